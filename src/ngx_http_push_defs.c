@@ -6,24 +6,39 @@
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_ETAG = ngx_string("Etag");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_IF_NONE_MATCH = ngx_string("If-None-Match");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_VARY = ngx_string("Vary");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_CONTENT_ENCODING = ngx_string("Content-Encoding");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_ALLOW = ngx_string("Allow");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_CACHE_CONTROL = ngx_string("Cache-Control");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_PRAGMA = ngx_string("Pragma");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_HEADERS = ngx_string("Access-Control-Allow-Headers");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_METHODS = ngx_string("Access-Control-Allow-Methods");
 const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN = ngx_string("Access-Control-Allow-Origin");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_LAST_EVENT_ID = ngx_string("Last-Event-ID");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_CHANNEL_ID = ngx_string("X-Channel-Id");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_CHANNEL_POSITIONS = ngx_string("X-Channel-Positions");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_UPGRADE = ngx_string("Upgrade");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_KEY = ngx_string("Sec-WebSocket-Key");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_VERSION = ngx_string("Sec-WebSocket-Version");
+const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_ACCEPT = ngx_string("Sec-WebSocket-Accept");
 
 //header values
 const  ngx_str_t NGX_HTTP_PUSH_CACHE_CONTROL_VALUE = ngx_string("no-cache");
+const  ngx_str_t NGX_HTTP_PUSH_EVENTSOURCE_CONTENT_TYPE = ngx_string("text/event-stream");
+const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_UPGRADE_VALUE = ngx_string("websocket");
+const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_VERSION_VALUE = ngx_string("13");
+const  ngx_str_t NGX_HTTP_PUSH_GZIP_VALUE = ngx_string("gzip");
+const  ngx_str_t NGX_HTTP_PUSH_VARY_ACCEPT_ENCODING_VALUE = ngx_string("Accept-Encoding");
+const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_GUID = ngx_string("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
 
 //status strings
+const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_101 = ngx_string("101 Switching Protocols");
 const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_409 = ngx_string("409 Conflict");
 const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_410 = ngx_string("410 Gone");
 
 //other stuff
 const  ngx_str_t NGX_HTTP_PUSH_ANYSTRING= ngx_string("*");
 const  ngx_str_t NGX_HTTP_PUSH_ACCESS_CONTROL_ALLOWED_PUBLISHER_HEADERS = ngx_string("Content-Type, Origin");
-const  ngx_str_t NGX_HTTP_PUSH_ACCESS_CONTROL_ALLOWED_SUBSCRIBER_HEADERS = ngx_string("If-None-Match, If-Modified-Since, Origin");
+const  ngx_str_t NGX_HTTP_PUSH_ACCESS_CONTROL_ALLOWED_SUBSCRIBER_HEADERS = ngx_string("If-None-Match, If-Modified-Since, Last-Event-ID, X-Channel-Positions, Origin");
 const  ngx_str_t NGX_HTTP_PUSH_ALLOW_GET_POST_PUT_DELETE_OPTIONS= ngx_string("GET, POST, PUT, DELETE, OPTIONS");
 const  ngx_str_t NGX_HTTP_PUSH_ALLOW_GET_OPTIONS= ngx_string("GET, OPTIONS");
 const  ngx_str_t NGX_HTTP_PUSH_VARY_HEADER_VALUE = ngx_string("If-None-Match, If-Modified-Since");
@@ -57,3 +72,29 @@ const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_YAML = ngx_string(
   "subscribers: %ui" CRLF
   CRLF
   "\0");
+
+//one element of push_stats' partition array
+const ngx_str_t NGX_HTTP_PUSH_PARTITION_STATS_JSON = ngx_string(
+  "{\"partition\": %ui, "
+  "\"channels\": %ui, "
+  "\"messages\": %ui, "
+  "\"shm_pages\": %ui, "
+  "\"shm_free_pages\": %ui, "
+  "\"gc_active\": %s, "
+  "\"gc_runs\": %ui, "
+  "\"gc_collected_channels\": %ui, "
+  "\"expired_channels\": %ui, "
+  "\"evicted_channels\": %ui, "
+  "\"evicted_messages\": %ui, "
+  "\"arena_pages\": %ui, "
+  "\"arena_free_pages\": %ui, "
+  "\"arena_free_runs\": %ui, "
+  "\"arena_largest_free_run\": %ui, "
+  "\"arena_requested_bytes\": %uz, "
+  "\"arena_allocated_bytes\": %uz, "
+  "\"large_message_pages\": %ui, "
+  "\"large_message_free_pages\": %ui, "
+  "\"gc_pause_last_usec\": %uL, "
+  "\"gc_pause_max_usec\": %uL, "
+  "\"gc_pause_total_usec\": %uL }"
+  "\0");
@@ -1,5 +1,13 @@
 
 #define NGX_HTTP_PUSH_DEFAULT_SHM_SIZE 33554432 //32 megs
+#define NGX_HTTP_PUSH_DEFAULT_SHM_PARTITIONS 1
+#define NGX_HTTP_PUSH_MAX_SHM_PARTITIONS 64
+#define NGX_HTTP_PUSH_DEFAULT_GC_INTERVAL 100 //msec
+#define NGX_HTTP_PUSH_DEFAULT_GC_BATCH_SIZE 200 //channels
+#define NGX_HTTP_PUSH_DEFAULT_GC_HIGH_WATERMARK 80 //percent
+#define NGX_HTTP_PUSH_DEFAULT_GC_LOW_WATERMARK 60
+#define NGX_HTTP_PUSH_DEFAULT_EVICTION_MIN_IDLE 10 //seconds
+#define NGX_HTTP_PUSH_MAX_MESSAGE_ARENA 90 //percent. channels and such need the rest
 #define NGX_HTTP_PUSH_DEFAULT_BUFFER_TIMEOUT 3600
 #define NGX_HTTP_PUSH_DEFAULT_SUBSCRIBER_TIMEOUT 0  //default: never timeout
 //(liucougar: this is a bit confusing, but it is what's the default behavior before this option is introducecd)
@@ -14,6 +22,25 @@
 
 #define NGX_HTTP_PUSH_MECHANISM_LONGPOLL 0
 #define NGX_HTTP_PUSH_MECHANISM_INTERVALPOLL 1
+#define NGX_HTTP_PUSH_MECHANISM_EVENTSOURCE 2
+#define NGX_HTTP_PUSH_MECHANISM_WEBSOCKET 3
+
+#define NGX_HTTP_PUSH_DEFAULT_STREAM_PING_INTERVAL 15 //seconds
+#define NGX_HTTP_PUSH_STREAM_MAX_PENDING 256 //frames a stream may fall behind by before it's dropped
+#define NGX_HTTP_PUSH_WEBSOCKET_MAX_HEADER_LEN 10 //of a frame sent to a client, which is never masked
+
+#define NGX_HTTP_PUSH_CHANNEL_INDEX_RBTREE 0
+#define NGX_HTTP_PUSH_CHANNEL_INDEX_HASH 1
+
+#define NGX_HTTP_PUSH_EVICTION_OFF 0
+#define NGX_HTTP_PUSH_EVICTION_LRU 1
+
+#define NGX_HTTP_PUSH_BUFFER_MODE_QUEUE 0
+#define NGX_HTTP_PUSH_BUFFER_MODE_RING 1
+#define NGX_HTTP_PUSH_BUFFER_MODE_LATEST 2
+
+#define NGX_HTTP_PUSH_GZIP_MIN_LENGTH 256 //bytes. smaller message bodies aren't worth precompressing
+#define NGX_HTTP_PUSH_BULK_MAX_HEADER_LENGTH 4096 //longest bulk publisher record header line
 
 #define NGX_HTTP_PUSH_MIN_MESSAGE_RECIPIENTS 0
 
@@ -38,6 +65,7 @@
 
 #define NGX_HTTP_PUSH_MESSAGE_RECEIVED 9000
 #define NGX_HTTP_PUSH_MESSAGE_QUEUED   9001
+#define NGX_HTTP_PUSH_DELAYED_DELIVERY 9002 //status of a publish that catches subscribers up on everything they haven't seen
 
 #define NGX_HTTP_PUSH_MESSAGE_FOUND     1000
 #define NGX_HTTP_PUSH_MESSAGE_EXPECTED  1001
@@ -46,17 +74,32 @@
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_ETAG;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_IF_NONE_MATCH;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_VARY;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_CONTENT_ENCODING;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_ALLOW;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_CACHE_CONTROL;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_PRAGMA;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_METHODS;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_HEADERS;
 extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_LAST_EVENT_ID;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_CHANNEL_ID;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_CHANNEL_POSITIONS;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_UPGRADE;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_KEY;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_VERSION;
+extern const  ngx_str_t NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_ACCEPT;
 
 //header values
 extern const  ngx_str_t NGX_HTTP_PUSH_CACHE_CONTROL_VALUE;
+extern const  ngx_str_t NGX_HTTP_PUSH_EVENTSOURCE_CONTENT_TYPE;
+extern const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_UPGRADE_VALUE;
+extern const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_VERSION_VALUE;
+extern const  ngx_str_t NGX_HTTP_PUSH_GZIP_VALUE;
+extern const  ngx_str_t NGX_HTTP_PUSH_VARY_ACCEPT_ENCODING_VALUE;
+extern const  ngx_str_t NGX_HTTP_PUSH_WEBSOCKET_GUID;
 
 //status strings
+extern const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_101;
 extern const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_409;
 extern const  ngx_str_t NGX_HTTP_PUSH_HTTP_STATUS_410;
 
@@ -70,4 +113,5 @@ extern const ngx_str_t NGX_HTTP_PUSH_VARY_HEADER_VALUE;
 extern const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_PLAIN;
 extern const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_JSON;
 extern const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_XML;
-extern const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_YAML;
\ No newline at end of file
+extern const ngx_str_t NGX_HTTP_PUSH_CHANNEL_INFO_YAML;
+extern const ngx_str_t NGX_HTTP_PUSH_PARTITION_STATS_JSON;
\ No newline at end of file
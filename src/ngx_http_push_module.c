@@ -3,6 +3,7 @@
  */
 
 #include <ngx_http_push_module.h>
+#include <ngx_sha1.h>
 
 #include <store/memory/store.h>
 #include <ngx_http_push_module_setup.c>
@@ -91,16 +92,94 @@ ngx_chain_t * ngx_http_push_create_output_chain(ngx_buf_t *buf, ngx_pool_t *pool
   return out;
 }
 
+//describe a stored message body with a buffer. in-memory bodies are referenced right where they are in shared memory.
+static void ngx_http_push_message_body_buf(ngx_http_push_msg_t *msg, ngx_buf_t *buf, ngx_file_t *file) {
+  static ngx_str_t                large_message_name = ngx_string("push module large message memory");
+  ngx_memzero(buf, sizeof(*buf));
+  if(msg->body_in_memfd) {
+    //already open, in every worker
+    ngx_memzero(file, sizeof(*file));
+    file->fd=ngx_http_push_store->message_body_fd(msg);
+    file->name=large_message_name;
+    buf->file=file;
+    buf->in_file=1;
+    buf->file_pos=msg->body_file_pos;
+    buf->file_last=msg->body_file_last;
+  }
+  else if(msg->body_in_file) {
+    ngx_memzero(file, sizeof(*file));
+    file->fd=NGX_INVALID_FILE;
+    file->name=msg->body;
+    buf->file=file;
+    buf->in_file=1;
+    buf->file_pos=msg->body_file_pos;
+    buf->file_last=msg->body_file_last;
+  }
+  else {
+    buf->memory=1;
+    buf->start=msg->body.data;
+    buf->pos=buf->start;
+    buf->last=buf->pos + msg->body.len;
+    buf->end=buf->last;
+  }
+}
+
+//in-memory message bodies are _not_ copied. the caller must keep the message reserved until the output is sent.
+static ngx_chain_t * ngx_http_push_create_message_output_chain(ngx_http_push_msg_t *msg, ngx_pool_t *pool, ngx_log_t *log) {
+  ngx_chain_t                    *out;
+  ngx_buf_t                       body;
+  ngx_file_t                      body_file;
+  
+  ngx_http_push_message_body_buf(msg, &body, &body_file);
+  if(msg->body_in_file) {
+    //we need our own file descriptor for this one
+    return ngx_http_push_create_output_chain(&body, pool, log);
+  }
+  if((out = ngx_pcalloc(pool, sizeof(*out)))==NULL) {
+    return NULL;
+  }
+  //separate allocation: shared responses free the chain and the buffer at different times. the file goes with the buffer.
+  if((out->buf = ngx_palloc(pool, sizeof(*out->buf) + (msg->body_in_memfd ? sizeof(body_file) : 0)))==NULL) {
+    ngx_pfree(pool, out);
+    return NULL;
+  }
+  ngx_memcpy(out->buf, &body, sizeof(body));
+  if(msg->body_in_memfd) {
+    out->buf->file = (ngx_file_t *) (out->buf+1);
+    ngx_memcpy(out->buf->file, &body_file, sizeof(body_file));
+    out->buf->file->log = log;
+  }
+  out->buf->last_buf = 1;
+  out->next = NULL;
+  return out;
+}
+
+static void ngx_http_push_release_message_cleanup(void *data) {
+  ngx_http_push_store->release_message(NULL, (ngx_http_push_msg_t *) data);
+}
+
 #define NGX_HTTP_PUSH_NO_CHANNEL_ID_MESSAGE "No channel id provided."
-static ngx_str_t * ngx_http_push_get_channel_id(ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf) {
+//$push_channel_id, split on push_channel_id_split_delimiter if there is one. each id is prefixed with the channel group.
+static ngx_str_t * ngx_http_push_get_channel_ids(ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf, ngx_uint_t *n) {
   ngx_http_variable_value_t      *vv = ngx_http_get_indexed_variable(r, cf->index);
   ngx_str_t                      *group = &cf->channel_group;
+  ngx_str_t                      *delim = &cf->channel_id_delimiter;
   size_t                          group_len = group->len;
   size_t                          var_len;
-  size_t                          len;
-  ngx_str_t                      *id;
-    if (vv == NULL || vv->not_found || vv->len == 0) {
-        ngx_buf_t *buf = ngx_create_temp_buf(r->pool, sizeof(NGX_HTTP_PUSH_NO_CHANNEL_ID_MESSAGE));
+  ngx_str_t                      *ids;
+  u_char                         *cur, *last = NULL, *end, *p;
+  ngx_uint_t                      count = 0;
+  
+  if (vv != NULL && !vv->not_found && vv->len > 0) {
+    last = vv->data + vv->len;
+    for(cur = vv->data; cur < last; cur = end + delim->len) {
+      end = delim->len > 0 ? ngx_strnstr(cur, (char *) delim->data, last - cur) : NULL;
+      end = end != NULL ? end : last;
+      count += (end > cur); //empty ones don't count
+    }
+  }
+  if (count == 0) {
+    ngx_buf_t *buf = ngx_create_temp_buf(r->pool, sizeof(NGX_HTTP_PUSH_NO_CHANNEL_ID_MESSAGE));
     ngx_chain_t *chain;
     if(buf==NULL) {
       return NULL;
@@ -119,21 +198,36 @@ static ngx_str_t * ngx_http_push_get_channel_id(ngx_http_request_t *r, ngx_http_
     ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
             "push module: the $push_channel_id variable is required but is not set");
     return NULL;
-    }
-  //maximum length limiter for channel id
-  var_len = vv->len <= cf->max_channel_id_length ? vv->len : cf->max_channel_id_length; 
-  len = group_len + 1 + var_len;
-  if((id = ngx_palloc(r->pool, sizeof(*id) + len))==NULL) {
+  }
+  //the ids' data follows them. each is at most as long as the whole variable.
+  if((ids = ngx_palloc(r->pool, count * sizeof(*ids) + count * (group_len + 1) + vv->len))==NULL) {
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
             "push module: unable to allocate memory for $push_channel_id string");
     return NULL;
   }
-  id->len=len;
-  id->data=(u_char *)(id+1);
-  ngx_memcpy(id->data, group->data, group_len);
-  id->data[group_len]='/';
-  ngx_memcpy(id->data + group_len + 1, vv->data, var_len);
-  return id;
+  p = (u_char *) (ids + count);
+  *n = 0;
+  for(cur = vv->data; cur < last; cur = end + delim->len) {
+    end = delim->len > 0 ? ngx_strnstr(cur, (char *) delim->data, last - cur) : NULL;
+    end = end != NULL ? end : last;
+    if(end == cur) {
+      continue;
+    }
+    //maximum length limiter for channel id
+    var_len = (size_t) (end - cur) <= (size_t) cf->max_channel_id_length ? (size_t) (end - cur) : (size_t) cf->max_channel_id_length;
+    ids[*n].len = group_len + 1 + var_len;
+    ids[*n].data = p;
+    p = ngx_cpymem(p, group->data, group_len);
+    *p++ = '/';
+    p = ngx_cpymem(p, cur, var_len);
+    (*n)++;
+  }
+  return ids;
+}
+
+static ngx_str_t * ngx_http_push_get_channel_id(ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf) {
+  ngx_uint_t                      n;
+  return ngx_http_push_get_channel_ids(r, cf, &n);
 }
 
 ngx_table_elt_t * ngx_http_push_add_response_header(ngx_http_request_t *r, const ngx_str_t *header_name, const ngx_str_t *header_value) {
@@ -187,6 +281,25 @@ ngx_int_t ngx_http_push_allow_caching(ngx_http_request_t * r) {
   return 1;
 }
 
+//drop one use of a response shared by subscribers in this worker. the last one out releases the message its buffer points into.
+static void ngx_http_push_shared_response_release(ngx_http_push_shared_response_t *shared) {
+  if(--shared->use_count > 0) {
+    return;
+  }
+  if(shared->buf->file && !shared->msg->body_in_memfd) {
+    ngx_close_file(shared->buf->file->fd);
+  }
+  ngx_pfree(ngx_http_push_pool, shared->buf);
+  if(shared->header != NULL) {
+    ngx_pfree(ngx_http_push_pool, shared->header);
+  }
+  if(shared->gzip_header != NULL) {
+    ngx_pfree(ngx_http_push_pool, shared->gzip_header);
+  }
+  ngx_http_push_store->release_message(NULL, shared->msg);
+  ngx_pfree(ngx_http_push_pool, shared);
+}
+
 void ngx_http_push_subscriber_cleanup(ngx_http_push_subscriber_cleanup_t *data) {
   if(data->subscriber!=NULL) { //still queued up
     ngx_http_push_subscriber_t* sb = data->subscriber;
@@ -199,20 +312,12 @@ void ngx_http_push_subscriber_cleanup(ngx_http_push_subscriber_cleanup_t *data)
     ngx_pfree(data->rpool, data->rchain);
     data->rchain=NULL;
   }
-  if(data->buf_use_count != NULL && --(*data->buf_use_count) <= 0) {
-    ngx_buf_t                      *buf;
-    ngx_pfree(ngx_http_push_pool, data->buf_use_count);
-    buf=data->buf;
-    if(buf->file) {
-      ngx_close_file(buf->file->fd);
-    }
-    ngx_pfree(ngx_http_push_pool, buf);
+  if(data->shared != NULL) {
+    ngx_http_push_shared_response_release(data->shared);
   }
   
   if(data->channel!=NULL) { //we're expected to decrement the subscriber count
-    ngx_http_push_store->lock();
-    data->channel->subscribers--;
-    ngx_http_push_store->unlock();
+    ngx_atomic_fetch_add(&data->channel->subscribers, (ngx_atomic_int_t) -1);
   }
 }
 
@@ -250,8 +355,7 @@ ngx_int_t ngx_http_push_subscriber_get_msg_id(ngx_http_request_t *r, ngx_http_pu
 }
 
 //allocates nothing
-ngx_int_t ngx_http_push_prepare_response_to_subscriber_request(ngx_http_request_t *r, ngx_chain_t *chain, ngx_str_t *content_type, ngx_str_t *etag, time_t last_modified) {
-  ngx_int_t                      res;
+static ngx_int_t ngx_http_push_send_subscriber_response_header(ngx_http_request_t *r, ngx_str_t *content_type, ngx_str_t *etag, time_t last_modified, off_t content_length) {
   if (content_type!=NULL) {
     r->headers_out.content_type.len=content_type->len;
     r->headers_out.content_type.data = content_type->data;
@@ -271,17 +375,219 @@ ngx_int_t ngx_http_push_prepare_response_to_subscriber_request(ngx_http_request_
   ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_VARY, &NGX_HTTP_PUSH_VARY_HEADER_VALUE);
   
   r->headers_out.status=NGX_HTTP_OK;
-  //we know the entity length, and we're using just one buffer. so no chunking please.
-  r->headers_out.content_length_n=ngx_buf_size(chain->buf);
-  if((res = ngx_http_send_header(r)) >= NGX_HTTP_SPECIAL_RESPONSE) {
+  //we know the entity length, so no chunking please.
+  r->headers_out.content_length_n=content_length;
+  return ngx_http_send_header(r);
+}
+
+//allocates nothing
+ngx_int_t ngx_http_push_prepare_response_to_subscriber_request(ngx_http_request_t *r, ngx_chain_t *chain, ngx_str_t *content_type, ngx_str_t *etag, time_t last_modified) {
+  ngx_int_t                      res;
+  //we're using just one buffer
+  if((res = ngx_http_push_send_subscriber_response_header(r, content_type, etag, last_modified, ngx_buf_size(chain->buf))) >= NGX_HTTP_SPECIAL_RESPONSE) {
     return res;
   }
   
   return ngx_http_output_filter(r, chain);
 }
 
+//swap a message's body for its precompressed one (gzip, the variant the message came with), if the subscriber takes gzip.
+//buf describes the body in memory. NGX_DECLINED if it's sent as it is.
+ngx_int_t ngx_http_push_gzip_variant(ngx_http_request_t *r, ngx_str_t *gzip, ngx_buf_t *buf) {
+#if (NGX_HTTP_GZIP)
+  ngx_table_elt_t                *h;
+#endif
+  if(gzip->len == 0) {
+    return NGX_DECLINED;
+  }
+  //caches need to know the body depends on it
+  if(ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_VARY, &NGX_HTTP_PUSH_VARY_ACCEPT_ENCODING_VALUE)==NULL) {
+    return NGX_ERROR;
+  }
+#if (NGX_HTTP_GZIP)
+  //same rules as the gzip filter. the filter leaves responses with a Content-Encoding alone.
+  if(ngx_http_gzip_ok(r) != NGX_OK) {
+    return NGX_DECLINED;
+  }
+  if((h = ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_CONTENT_ENCODING, &NGX_HTTP_PUSH_GZIP_VALUE))==NULL) {
+    return NGX_ERROR;
+  }
+  r->headers_out.content_encoding = h;
+  buf->start = gzip->data;
+  buf->pos = buf->start;
+  buf->last = buf->pos + gzip->len;
+  buf->end = buf->last;
+  return NGX_OK;
+#else
+  return NGX_DECLINED;
+#endif
+}
+
+#define NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN 16
+
+//several messages as the parts of one multipart/mixed response, tagged with the last one's Etag and Last-Modified.
+//the caller's reservations on the messages may be released as soon as this returns.
+//names, if not NULL, are the channels the messages are from, for a subscriber waiting on several
+ngx_int_t ngx_http_push_prepare_batch_response_to_subscriber_request(ngx_http_request_t *r, ngx_http_push_msg_t **msgs, ngx_str_t **names, ngx_uint_t n) {
+  ngx_chain_t                    *out = NULL, **last = &out, *body, *cl;
+  ngx_str_t                      *content_type, *etag = NULL, multipart;
+  time_t                          last_modified = 0;
+  ngx_buf_t                      *b;
+  off_t                           len = 0;
+  u_char                          boundary[NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN];
+  ngx_uint_t                      i;
+  ngx_int_t                       rc;
+  
+  ngx_sprintf(boundary, "%08xD%08xD", (uint32_t) ngx_random(), (uint32_t) ngx_random());
+  for(i = 0; i < n; i++) {
+    if(ngx_http_push_alloc_for_subscriber_response(r->pool, 0, msgs[i], &body, &content_type, &etag, &last_modified) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    b = ngx_create_temp_buf(r->pool, sizeof(CRLF "--" CRLF "Content-Type: " CRLF "Last-Modified: Mon, 28 Sep 1970 06:00:00 GMT" CRLF "Etag: " CRLF CRLF) - 1 + NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN + content_type->len + etag->len
+                            + (names != NULL ? NGX_HTTP_PUSH_HEADER_CHANNEL_ID.len + sizeof(": " CRLF) - 1 + names[i]->len : 0));
+    if(b == NULL || (cl = ngx_alloc_chain_link(r->pool))==NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    //the CRLF before a boundary belongs to the boundary
+    b->last = ngx_sprintf(b->last, "%s--%*s" CRLF, i == 0 ? "" : CRLF, (size_t) NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN, boundary);
+    if(names != NULL) {
+      b->last = ngx_sprintf(b->last, "%V: %V" CRLF, &NGX_HTTP_PUSH_HEADER_CHANNEL_ID, names[i]);
+    }
+    if(content_type->len > 0) {
+      b->last = ngx_sprintf(b->last, "Content-Type: %V" CRLF, content_type);
+    }
+    b->last = ngx_cpymem(b->last, "Last-Modified: ", sizeof("Last-Modified: ") - 1);
+    b->last = ngx_http_time(b->last, last_modified);
+    b->last = ngx_sprintf(b->last, CRLF "Etag: %V" CRLF CRLF, etag);
+    body->buf->last_buf = 0;
+    cl->buf = b;
+    cl->next = body;
+    *last = cl;
+    last = &body->next;
+    len += ngx_buf_size(b) + ngx_buf_size(body->buf);
+  }
+  if((b = ngx_create_temp_buf(r->pool, sizeof(CRLF "--" "--" CRLF) - 1 + NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN))==NULL || (cl = ngx_alloc_chain_link(r->pool))==NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->last = ngx_sprintf(b->last, CRLF "--%*s--" CRLF, (size_t) NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN, boundary);
+  b->last_buf = 1;
+  cl->buf = b;
+  cl->next = NULL;
+  *last = cl;
+  len += ngx_buf_size(b);
+  
+  multipart.len = sizeof("multipart/mixed; boundary=") - 1 + NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN;
+  if((multipart.data = ngx_pnalloc(r->pool, multipart.len))==NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ngx_sprintf(multipart.data, "multipart/mixed; boundary=%*s", (size_t) NGX_HTTP_PUSH_BATCH_BOUNDARY_LEN, boundary);
+  if((rc = ngx_http_push_send_subscriber_response_header(r, &multipart, etag, last_modified, len)) >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+  return ngx_http_output_filter(r, out);
+}
+
+//prerendered headers go straight to the connection, so only plain HTTP/1.x main requests qualify
+static ngx_int_t ngx_http_push_can_send_prerendered(ngx_http_request_t *r) {
+  return r == r->main && !r->header_only && r->http_version >= NGX_HTTP_VERSION_10 && r->http_version <= NGX_HTTP_VERSION_11;
+}
+
+//status line and headers for a message, everything up to the Connection header. rendered once, written to every subscriber.
+//vary_encoding for messages with a precompressed body, gzipped if that's what's being sent.
+static ngx_str_t * ngx_http_push_render_response_header(ngx_pool_t *pool, ngx_str_t *content_type, ngx_str_t *etag, time_t last_modified, off_t content_length, ngx_flag_t vary_encoding, ngx_flag_t gzipped) {
+  ngx_str_t                      *header;
+  size_t                          len;
+  u_char                         *p;
+  
+  len = sizeof("HTTP/1.1 200 OK" CRLF) - 1
+      + sizeof("Date: " CRLF) - 1 + ngx_cached_http_time.len
+      + sizeof("Content-Length: " CRLF) - 1 + NGX_OFF_T_LEN
+      + NGX_HTTP_PUSH_HEADER_VARY.len + sizeof(": " CRLF) - 1 + NGX_HTTP_PUSH_VARY_HEADER_VALUE.len;
+  if(content_type != NULL && content_type->len > 0) {
+    len += sizeof("Content-Type: " CRLF) - 1 + content_type->len;
+  }
+  if(last_modified) {
+    len += sizeof("Last-Modified: Mon, 28 Sep 1970 06:00:00 GMT" CRLF) - 1;
+  }
+  if(etag != NULL) {
+    len += NGX_HTTP_PUSH_HEADER_ETAG.len + sizeof(": " CRLF) - 1 + etag->len;
+  }
+  if(vary_encoding) {
+    len += NGX_HTTP_PUSH_HEADER_VARY.len + sizeof(": " CRLF) - 1 + NGX_HTTP_PUSH_VARY_ACCEPT_ENCODING_VALUE.len;
+  }
+  if(gzipped) {
+    len += NGX_HTTP_PUSH_HEADER_CONTENT_ENCODING.len + sizeof(": " CRLF) - 1 + NGX_HTTP_PUSH_GZIP_VALUE.len;
+  }
+  
+  if((header = ngx_palloc(pool, sizeof(*header) + len))==NULL) {
+    return NULL;
+  }
+  header->data = (u_char *) (header+1);
+  p = ngx_copy(header->data, "HTTP/1.1 200 OK" CRLF, sizeof("HTTP/1.1 200 OK" CRLF) - 1);
+  p = ngx_sprintf(p, "Date: %V" CRLF, &ngx_cached_http_time);
+  if(content_type != NULL && content_type->len > 0) {
+    p = ngx_sprintf(p, "Content-Type: %V" CRLF, content_type);
+  }
+  p = ngx_sprintf(p, "Content-Length: %O" CRLF, content_length);
+  if(last_modified) {
+    p = ngx_copy(p, "Last-Modified: ", sizeof("Last-Modified: ") - 1);
+    p = ngx_http_time(p, last_modified);
+    *p++ = CR; *p++ = LF;
+  }
+  if(etag != NULL) {
+    p = ngx_sprintf(p, "%V: %V" CRLF, &NGX_HTTP_PUSH_HEADER_ETAG, etag);
+  }
+  p = ngx_sprintf(p, "%V: %V" CRLF, &NGX_HTTP_PUSH_HEADER_VARY, &NGX_HTTP_PUSH_VARY_HEADER_VALUE);
+  if(vary_encoding) {
+    p = ngx_sprintf(p, "%V: %V" CRLF, &NGX_HTTP_PUSH_HEADER_VARY, &NGX_HTTP_PUSH_VARY_ACCEPT_ENCODING_VALUE);
+  }
+  if(gzipped) {
+    p = ngx_sprintf(p, "%V: %V" CRLF, &NGX_HTTP_PUSH_HEADER_CONTENT_ENCODING, &NGX_HTTP_PUSH_GZIP_VALUE);
+  }
+  header->len = p - header->data;
+  return header;
+}
+
+//write [prerendered header][Connection header][body] to the subscriber, bypassing the header and body filters.
+static ngx_int_t ngx_http_push_send_prerendered_response(ngx_http_request_t *r, ngx_str_t *header, ngx_chain_t *body) {
+  static ngx_str_t                connection_keepalive = ngx_string("Connection: keep-alive" CRLF CRLF);
+  static ngx_str_t                connection_close = ngx_string("Connection: close" CRLF CRLF);
+  ngx_http_core_loc_conf_t       *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  ngx_str_t                      *connection;
+  ngx_chain_t                    *out;
+  ngx_buf_t                      *b;
+  
+  if(clcf->keepalive_timeout == 0) {
+    r->keepalive = 0;
+  }
+  connection = r->keepalive ? &connection_keepalive : &connection_close;
+  
+  //two links and two buffers: the header's, and the Connection header's. the write filter moves buffer positions, so these can't be shared.
+  if((out = ngx_pcalloc(r->pool, 2 * (sizeof(*out) + sizeof(*b))))==NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b = (ngx_buf_t *) (out + 2);
+  b[0].memory = 1;
+  b[0].pos = header->data;
+  b[0].last = header->data + header->len;
+  b[1].memory = 1;
+  b[1].pos = connection->data;
+  b[1].last = connection->data + connection->len;
+  out[0].buf = &b[0];
+  out[0].next = &out[1];
+  out[1].buf = &b[1];
+  out[1].next = body;
+  
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = ngx_buf_size(body->buf);
+  r->header_size = header->len + connection->len;
+  r->header_sent = 1;
+  return ngx_http_write_filter(r, out);
+}
+
 //allocates message and responds to subscriber
 ngx_int_t ngx_http_push_alloc_for_subscriber_response(ngx_pool_t *pool, ngx_int_t shared, ngx_http_push_msg_t *msg, ngx_chain_t **chain, ngx_str_t **content_type, ngx_str_t **etag, time_t *last_modified) {
+  ngx_pool_cleanup_t             *cln;
   if(etag != NULL && (*etag = ngx_http_push_store->message_etag(msg, pool))==NULL) {
     //oh, nevermind...
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate memory for Etag header");
@@ -300,7 +606,7 @@ ngx_int_t ngx_http_push_alloc_for_subscriber_response(ngx_pool_t *pool, ngx_int_
   }
   
   //preallocate output chain. yes, same one for every waiting subscriber
-  if(chain != NULL && (*chain = ngx_http_push_create_output_chain(msg->buf, pool, ngx_cycle->log))==NULL) {
+  if(chain != NULL && (*chain = ngx_http_push_create_message_output_chain(msg, pool, ngx_cycle->log))==NULL) {
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate buffer chain while responding to subscriber request");
     if(pool == NULL) {
       ngx_free(*etag);
@@ -316,12 +622,30 @@ ngx_int_t ngx_http_push_alloc_for_subscriber_response(ngx_pool_t *pool, ngx_int_
   if(last_modified != NULL) {
     *last_modified = msg->message_time;
   }
-  ngx_http_push_store->unlock();
   
   
-  if(pool!=NULL && shared == 0 && ((*chain)->buf->file!=NULL)) {
+  if(chain == NULL) {
+    return NGX_OK;
+  }
+  
+  //the output chain points into the message. keep it around until the response is done with it.
+  //shared responses are released by the last subscriber to finish, a single request's when its pool is destroyed.
+  ngx_http_push_store->reserve_message(NULL, msg);
+  if(pool!=NULL && shared == 0) {
+    if((cln = ngx_pool_cleanup_add(pool, 0))==NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate message pool cleanup while responding to subscriber request");
+      ngx_http_push_store->release_message(NULL, msg);
+      ngx_pfree(pool, *etag);
+      ngx_pfree(pool, *content_type);
+      ngx_pfree(pool, *chain);
+      return NGX_ERROR;
+    }
+    cln->handler = ngx_http_push_release_message_cleanup;
+    cln->data = msg;
+  }
+  
+  if(pool!=NULL && shared == 0 && ((*chain)->buf->file!=NULL) && !msg->body_in_memfd) {
     //close file when we're done with it
-    ngx_pool_cleanup_t *cln;
     ngx_pool_cleanup_file_t *clnf;
     
     if((cln = ngx_pool_cleanup_add(pool, sizeof(ngx_pool_cleanup_file_t)))==NULL) {
@@ -443,8 +767,7 @@ ngx_int_t ngx_push_longpoll_subscriber_enqueue(ngx_http_push_channel_t *channel,
   clndata = (ngx_http_push_subscriber_cleanup_t *) cln->data;
   clndata->channel=channel;
   clndata->subscriber=subscriber;
-  clndata->buf_use_count=0;
-  clndata->buf=NULL;
+  clndata->shared=NULL;
   clndata->rchain=NULL;
   clndata->rpool=NULL;
   subscriber->clndata=clndata;
@@ -465,6 +788,126 @@ ngx_int_t ngx_push_longpoll_subscriber_enqueue(ngx_http_push_channel_t *channel,
   return NGX_OK;
 }
 
+/* multi-channel long-polling: one request waits on all its channels, and whichever has news first wakes it up.
+ * it answers with everything the client hasn't seen from any of them, as a batch response naming each part's channel. */
+
+//take a multi-channel subscriber off all its channels' queues. this is the request's cleanup, too.
+void ngx_http_push_multi_subscriber_detach(ngx_http_push_multi_subscriber_t *m) {
+  ngx_http_push_subscriber_t     *sb;
+  ngx_uint_t                      i;
+  for(i = 0; i < m->n; i++) {
+    if((sb = m->subscribers[i]) != NULL) {
+      ngx_queue_remove(&sb->queue);
+      ngx_pfree(ngx_http_push_pool, sb);
+      m->subscribers[i] = NULL;
+      ngx_atomic_fetch_add(&m->channels[i]->subscribers, (ngx_atomic_int_t) -1);
+    }
+  }
+  if(m->timeout.timer_set) {
+    ngx_del_timer(&m->timeout);
+  }
+}
+
+static void ngx_http_push_multi_subscriber_timeout(ngx_event_t *ev) {
+  ngx_http_push_multi_subscriber_t *m = ev->data;
+  ngx_http_request_t             *r = m->request;
+  ngx_http_push_multi_subscriber_detach(m);
+  ngx_http_finalize_request(r, ngx_http_push_respond_status_only(r, NGX_HTTP_NOT_MODIFIED, NULL));
+}
+
+//respond with everything the subscriber hasn't seen yet, from all its channels. msg, if not NULL, was just published
+//to channel, and may not have been queued. NGX_DECLINED if there's nothing to respond with yet.
+static ngx_int_t ngx_http_push_multi_subscriber_respond(ngx_http_push_multi_subscriber_t *m, ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg) {
+  ngx_http_request_t             *r = m->request;
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_uint_t                      i, j, got, count = 0;
+  ngx_int_t                       msg_search_outcome, rc;
+  ngx_flag_t                      expired = 0;
+  
+  for(i = 0; i < m->n; i++) {
+    got = ngx_http_push_store->get_channel_messages(m->channels[i], &m->msg_ids[i], &m->msgs[count], (ngx_uint_t) cf->subscriber_batch_max, &msg_search_outcome, cf);
+    for(j = 0; j < got; j++) {
+      m->msg_names[count + j] = &m->names[i];
+    }
+    count += got;
+    expired |= (msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_EXPIRED);
+    if(msg != NULL && m->channels[i] == channel && msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_EXPECTED) {
+      //an unbuffered channel's message is only for those already waiting
+      ngx_http_push_store->reserve_message(channel, msg);
+      m->msgs[count] = msg;
+      m->msg_names[count++] = &m->names[i];
+    }
+  }
+  if(count == 0 && !expired) {
+    return NGX_DECLINED;
+  }
+  ngx_http_push_multi_subscriber_detach(m);
+  if(count == 0) {
+    return NGX_HTTP_NO_CONTENT; //same as when subscribing to just the one channel
+  }
+  rc = ngx_http_push_prepare_batch_response_to_subscriber_request(r, m->msgs, m->msg_names, count);
+  for(i = 0; i < count; i++) {
+    ngx_http_push_store->release_message(NULL, m->msgs[i]);
+  }
+  return rc;
+}
+
+//a multi-channel subscriber has just been queued on all its channels. respond now if it's missed anything.
+ngx_int_t ngx_http_push_multi_subscriber_start(ngx_http_push_multi_subscriber_t *m) {
+  ngx_http_request_t             *r = m->request;
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_int_t                       rc = NGX_DECLINED;
+  
+  if(!cf->ignore_queue_on_no_cache || ngx_http_push_allow_caching(r)) {
+    rc = ngx_http_push_multi_subscriber_respond(m, NULL, NULL);
+  }
+  if(rc != NGX_DECLINED) {
+    return rc;
+  }
+  if(cf->subscriber_timeout > 0) {
+    m->timeout.handler = ngx_http_push_multi_subscriber_timeout;
+    m->timeout.data = m;
+    m->timeout.log = r->connection->log;
+    ngx_add_timer(&m->timeout, cf->subscriber_timeout * 1000);
+  }
+  r->read_event_handler = ngx_http_test_reading;
+  r->write_event_handler = ngx_http_request_empty_handler;
+  r->main->count++;
+  return NGX_DONE;
+}
+
+//news on one of a multi-channel subscriber's channels. cur, its subscriber there, has just been taken off the
+//channel's queue by the caller, which counts it off the channel. it's either put back or freed.
+static void ngx_http_push_multi_subscriber_wake(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *cur, ngx_http_push_msg_t *msg, ngx_int_t status_code, const ngx_str_t *status_line) {
+  ngx_http_push_multi_subscriber_t *m = cur->multi;
+  ngx_http_request_t             *r = m->request;
+  ngx_uint_t                      i;
+  ngx_int_t                       rc;
+  
+  for(i = 0; i < m->n && m->subscribers[i] != cur; i++) { /* void */ }
+  if(i < m->n) {
+    m->subscribers[i] = NULL;
+  }
+  if(status_code != 0) {
+    //the channel's gone, or some such. that's the response.
+    ngx_http_push_multi_subscriber_detach(m);
+    ngx_pfree(ngx_http_push_pool, cur);
+    ngx_http_finalize_request(r, ngx_http_push_respond_status_only(r, status_code, status_line));
+    return;
+  }
+  if((rc = ngx_http_push_multi_subscriber_respond(m, channel, msg)) == NGX_DECLINED) {
+    //nothing it hasn't already seen. keep waiting, timeout and all.
+    if(i < m->n && ngx_http_push_store->requeue_subscriber(channel, cur) == NGX_OK) {
+      m->subscribers[i] = cur;
+      return;
+    }
+    ngx_http_push_multi_subscriber_detach(m);
+    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ngx_pfree(ngx_http_push_pool, cur);
+  ngx_http_finalize_request(r, rc);
+}
+
 /*
 ngx_int_t ngx_push_longpoll_subscriber_dequeue(ngx_http_push_subscriber_t *subscriber) {
   return NGX_OK;
@@ -476,11 +919,11 @@ static ngx_int_t ngx_http_push_response_channel_ptr_info(ngx_http_push_channel_t
   ngx_uint_t         subscribers = 0;
   ngx_uint_t         messages = 0;
   if(channel!=NULL) {
-    ngx_http_push_store->lock();
+    ngx_http_push_store->lock(channel);
     subscribers = channel->subscribers;
     last_seen = channel->last_seen;
     messages  = channel->messages;
-    ngx_http_push_store->unlock();
+    ngx_http_push_store->unlock(channel);
     r->headers_out.status = status_code == (ngx_int_t) NULL ? NGX_HTTP_OK : status_code;
     if (status_code == NGX_HTTP_CREATED) {
       r->headers_out.status_line.len =sizeof("201 Created")- 1;
@@ -534,6 +977,7 @@ static ngx_int_t subscribe_intervalpoll_callback(ngx_http_push_msg_t *msg, ngx_i
       
     case NGX_HTTP_PUSH_MESSAGE_FOUND:
       ngx_http_push_alloc_for_subscriber_response(r->pool, 0, msg, &chain, &content_type, &etag, &last_modified);
+      ngx_http_push_gzip_variant(r, &msg->gzip_body, chain->buf);
       ngx_http_push_prepare_response_to_subscriber_request(r, chain, content_type, etag, last_modified);
       ngx_http_push_store->release_message(NULL, msg);
       ngx_http_finalize_request(r, NGX_OK);
@@ -545,95 +989,1259 @@ static ngx_int_t subscribe_intervalpoll_callback(ngx_http_push_msg_t *msg, ngx_i
   }
 }
 
-ngx_int_t ngx_http_push_subscriber_handler(ngx_http_request_t *r) {
-  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
-  ngx_str_t                      *channel_id;
-  ngx_http_push_msg_id_t          msg_id;
-  
-  if((channel_id=ngx_http_push_get_channel_id(r, cf)) == NULL) {
-    return r->headers_out.status ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+//pass on what's given, and keep whatever doesn't fit flowing from the request's write handler
+static ngx_int_t ngx_http_push_stream_send(ngx_http_request_t *r, ngx_chain_t *out) {
+  ngx_http_core_loc_conf_t       *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  ngx_event_t                    *wev = r->connection->write;
+  if(ngx_http_output_filter(r, out) == NGX_ERROR) {
+    return NGX_ERROR;
   }
-  
-  switch(r->method) {
-    case NGX_HTTP_GET:
-      ngx_http_push_subscriber_get_msg_id(r, &msg_id);
+  if(r->buffered || r->connection->buffered || r->postponed) {
+    if(!wev->delayed) {
+      ngx_add_timer(wev, clcf->send_timeout);
+    }
+    return ngx_handle_write_event(wev, clcf->send_lowat);
+  }
+  if(wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+  return NGX_OK;
+}
 
-      r->main->count++; //let it linger until callback
-      switch(cf->subscriber_poll_mechanism) {
-        ngx_int_t                       msg_search_outcome;
-        
-        //for NGX_HTTP_PUSH_MECHANISM_LONGPOLL
-        case NGX_HTTP_PUSH_MECHANISM_INTERVALPOLL:
-          ngx_http_push_store->get_message(channel_id, &msg_id, &msg_search_outcome, r, &subscribe_intervalpoll_callback);
-          break;
-          
-        case NGX_HTTP_PUSH_MECHANISM_LONGPOLL:
-          ngx_http_push_store->subscribe(channel_id, &msg_id, r, &subscribe_longpoll_callback);
-          break;
-      }
-      return NGX_DONE;
-    
-    case NGX_HTTP_OPTIONS:
-      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,  &NGX_HTTP_PUSH_ANYSTRING);
-      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_HEADERS, &NGX_HTTP_PUSH_ACCESS_CONTROL_ALLOWED_SUBSCRIBER_HEADERS);
-      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_METHODS, &NGX_HTTP_PUSH_ALLOW_GET_OPTIONS);
-      r->headers_out.content_length_n = 0;
-      r->header_only = 1;
-      r->headers_out.status=NGX_HTTP_OK;
-      ngx_http_send_header(r);
-      return NGX_OK;
-      
-    default:
-      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ALLOW, &NGX_HTTP_PUSH_ALLOW_GET_OPTIONS); //valid HTTP for the win
-      return NGX_HTTP_NOT_ALLOWED;
+/* Eventsource and websocket subscribers get a response that stays open. Each message is rendered as an event or a
+ * websocket frame once per worker and shared by every stream it goes to, and the subscriber goes right back on the
+ * channel's queue -- no new request, no channel lookup. The event id is the message id, so a client's Last-Event-ID
+ * resumes it. */
+
+#define ngx_http_push_msg_id_newer(a, b) ((a)->time > (b)->time || ((a)->time == (b)->time && (a)->tag > (b)->tag))
+
+static ngx_str_t                ngx_http_push_eventsource_ping_frame = ngx_string(":\n");
+static ngx_str_t                ngx_http_push_websocket_ping_frame = ngx_string("\x89\x00");
+static ngx_str_t                ngx_http_push_websocket_close_frame = ngx_string("\x88\x02\x03\xe8"); //1000, normal closure
+
+#define NGX_HTTP_PUSH_WEBSOCKET_TEXT   0x1
+#define NGX_HTTP_PUSH_WEBSOCKET_BINARY 0x2
+#define NGX_HTTP_PUSH_WEBSOCKET_CLOSE  0x8
+#define NGX_HTTP_PUSH_WEBSOCKET_PING   0x9
+#define NGX_HTTP_PUSH_WEBSOCKET_PONG   0xA
+
+static void ngx_http_push_stream_frame_release(ngx_http_push_stream_frame_t *frame) {
+  if(--frame->use_count == 0) {
+    ngx_free(frame);
   }
 }
 
-static ngx_int_t publish_callback(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r) {
-  switch(status) {
-    case NGX_HTTP_PUSH_MESSAGE_QUEUED:
-      //message was queued successfully, but there were no subscribers to receive it.
-      ngx_http_finalize_request(r, ngx_http_push_response_channel_ptr_info(ch, r, NGX_HTTP_ACCEPTED));
-      return NGX_OK;
-      
-    case NGX_HTTP_PUSH_MESSAGE_RECEIVED:
-      //message was queued successfully, and it was already sent to at least one subscriber
-      ngx_http_finalize_request(r, ngx_http_push_response_channel_ptr_info(ch, r, NGX_HTTP_CREATED));
-      return NGX_OK;
-      
-    case NGX_ERROR:
-      //WTF?
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: error broadcasting message to workers");
-      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-      return NGX_ERROR;
-      
-    default:
-      //for debugging, mostly. I don't expect this branch to behit during regular operation
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: TOTALLY UNEXPECTED error broadcasting message to workers");
-      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+//a copy of a message body that's in a file, or NULL
+static u_char * ngx_http_push_read_message_body(ngx_http_push_msg_t *msg, ngx_buf_t *body, ngx_file_t *file, ngx_log_t *log) {
+  size_t                          len = (size_t) (body->file_last - body->file_pos);
+  ssize_t                         n = NGX_ERROR;
+  u_char                         *data;
+  if((data = ngx_alloc(len + 1, log))==NULL) {
+    return NULL;
+  }
+  file->log = log;
+  if(msg->body_in_memfd) {
+    n = ngx_read_file(file, data, len, body->file_pos);
+  }
+  else if((file->fd = ngx_open_file(file->name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, NGX_FILE_OWNER_ACCESS)) != NGX_INVALID_FILE) {
+    n = ngx_read_file(file, data, len, body->file_pos);
+    ngx_close_file(file->fd);
+  }
+  if(n != (ssize_t) len) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "push module: unable to read message body");
+    ngx_free(data);
+    return NULL;
+  }
+  return data;
+}
+
+//where a message body's bytes are. *data is a copy to be freed afterwards, or NULL if the body's right there in memory.
+static ngx_int_t ngx_http_push_stream_message_body(ngx_http_push_msg_t *msg, u_char **start, u_char **end, u_char **data, ngx_log_t *log) {
+  ngx_buf_t                       body;
+  ngx_file_t                      file;
+  ngx_http_push_message_body_buf(msg, &body, &file);
+  *data = NULL;
+  if(body.in_file) {
+    if((*data = ngx_http_push_read_message_body(msg, &body, &file, log))==NULL) {
       return NGX_ERROR;
+    }
+    *start = *data;
+    *end = *data + (body.file_last - body.file_pos);
+  }
+  else {
+    *start = body.pos;
+    *end = body.last;
   }
+  return NGX_OK;
 }
 
-static void ngx_http_push_publisher_body_handler(ngx_http_request_t * r) {
-  ngx_str_t                      *channel_id;
-  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
-  ngx_uint_t                      method = r->method;
+//render a message as an event: its id, then every line of the body as a data field
+static ngx_http_push_stream_frame_t * ngx_http_push_eventsource_frame(ngx_http_push_msg_t *msg, ngx_log_t *log) {
+  ngx_http_push_stream_frame_t   *frame;
+  u_char                         *data, *start, *end, *line, *p, *q;
+  size_t                          len, breaks = 0;
   
-  if((channel_id = ngx_http_push_get_channel_id(r, cf))==NULL) {
-    ngx_http_finalize_request(r, r->headers_out.status ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR);
-    return;
+  if(ngx_http_push_stream_message_body(msg, &start, &end, &data, log) != NGX_OK) {
+    return NULL;
   }
-  
-  switch(method) {
-    case NGX_HTTP_POST:
-    case NGX_HTTP_PUT:
-      ngx_http_push_store->publish(channel_id, r, &publish_callback);
-      break;
+  //CR, LF and CRLF all end a line
+  for(p = start; p < end; p++) {
+    if(*p == LF || (*p == CR && (p + 1 == end || p[1] != LF))) {
+      breaks++;
+    }
+  }
+  len = sizeof("id: :" "\n") - 1 + NGX_TIME_T_LEN + NGX_INT_T_LEN + (breaks + 1) * (sizeof("data: " "\n") - 1) + (end - start) + 1;
+  if((frame = ngx_alloc(sizeof(*frame) + len, log)) != NULL) {
+    frame->use_count = 1;
+    frame->id.time = msg->message_time;
+    frame->id.tag = msg->message_tag;
+    p = ngx_sprintf((u_char *) (frame + 1), "id: %T:%i\n", frame->id.time, frame->id.tag);
+    for(line = start; /* void */ ; line = q + 1) {
+      for(q = line; q < end && *q != LF && *q != CR; q++) { /* void */ }
+      p = ngx_cpymem(p, "data: ", sizeof("data: ") - 1);
+      p = ngx_cpymem(p, line, q - line);
+      *p++ = LF;
+      if(q == end) {
+        break;
+      }
+      if(*q == CR && q + 1 < end && q[1] == LF) {
+        q++;
+      }
+    }
+    *p++ = LF;
+    frame->len = p - (u_char *) (frame + 1);
+  }
+  if(data != NULL) {
+    ngx_free(data);
+  }
+  return frame;
+}
+
+static u_char * ngx_http_push_websocket_header(u_char *p, u_char opcode, uint64_t len) {
+  ngx_int_t                       i;
+  *p++ = 0x80 | opcode; //FIN: messages are never fragmented
+  if(len < 126) {
+    *p++ = (u_char) len;
+  }
+  else if(len <= 0xffff) {
+    *p++ = 126;
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+  }
+  else {
+    *p++ = 127;
+    for(i = 7; i >= 0; i--) {
+      *p++ = (u_char) (len >> (i * 8));
+    }
+  }
+  return p;
+}
+
+//browsers drop the connection on a text frame that isn't UTF-8, so anything that isn't text goes out as binary
+static u_char ngx_http_push_websocket_opcode(ngx_http_push_msg_t *msg) {
+  ngx_str_t                      *type = &msg->content_type;
+  if(type->len == 0
+    || (type->len >= sizeof("text/") - 1 && ngx_strncasecmp(type->data, (u_char *) "text/", sizeof("text/") - 1) == 0)
+    || ngx_strlcasestrn(type->data, type->data + type->len, (u_char *) "json", sizeof("json") - 2) != NULL) {
+    return NGX_HTTP_PUSH_WEBSOCKET_TEXT;
+  }
+  return NGX_HTTP_PUSH_WEBSOCKET_BINARY;
+}
+
+//a websocket frame: the header, encoded once, then the body
+static ngx_http_push_stream_frame_t * ngx_http_push_websocket_frame(ngx_http_push_msg_t *msg, ngx_log_t *log) {
+  ngx_http_push_stream_frame_t   *frame;
+  u_char                         *data, *start, *end, *p;
+  
+  if(ngx_http_push_stream_message_body(msg, &start, &end, &data, log) != NGX_OK) {
+    return NULL;
+  }
+  if((frame = ngx_alloc(sizeof(*frame) + NGX_HTTP_PUSH_WEBSOCKET_MAX_HEADER_LEN + (end - start), log)) != NULL) {
+    frame->use_count = 1;
+    frame->id.time = msg->message_time;
+    frame->id.tag = msg->message_tag;
+    p = ngx_http_push_websocket_header((u_char *) (frame + 1), ngx_http_push_websocket_opcode(msg), end - start);
+    p = ngx_cpymem(p, start, end - start);
+    frame->len = p - (u_char *) (frame + 1);
+  }
+  if(data != NULL) {
+    ngx_free(data);
+  }
+  return frame;
+}
+
+static ngx_http_push_stream_frame_t * ngx_http_push_stream_frame(ngx_http_push_stream_t *stream, ngx_http_push_msg_t *msg, ngx_log_t *log) {
+  return stream->websocket != NULL ? ngx_http_push_websocket_frame(msg, log) : ngx_http_push_eventsource_frame(msg, log);
+}
+
+//let go of what's been sent
+static void ngx_http_push_stream_update(ngx_http_push_stream_t *stream) {
+  ngx_chain_t                    *cl;
+  while(stream->busy != NULL && ngx_buf_size(stream->busy->buf) == 0) {
+    cl = stream->busy;
+    stream->busy = cl->next;
+    if(cl->buf->start != NULL) {
+      ngx_http_push_stream_frame_release((ngx_http_push_stream_frame_t *) cl->buf->start);
+    }
+    cl->next = stream->free;
+    stream->free = cl;
+    stream->pending--;
+  }
+  if(stream->busy == NULL) {
+    stream->busy_end = &stream->busy;
+  }
+}
+
+//write a frame to the stream, or a constant one (a ping if NULL) if there's no frame
+static ngx_int_t ngx_http_push_stream_write(ngx_http_request_t *r, ngx_http_push_stream_t *stream, ngx_http_push_stream_frame_t *frame, ngx_str_t *constant) {
+  ngx_chain_t                    *cl;
+  ngx_buf_t                      *b;
+  ngx_int_t                       rc;
+  //control frames go out regardless
+  if(constant == NULL && stream->pending >= NGX_HTTP_PUSH_STREAM_MAX_PENDING) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "push module: stream subscriber fell too far behind");
+    return NGX_ERROR;
+  }
+  if((cl = stream->free) != NULL) {
+    stream->free = cl->next;
+    b = cl->buf;
+  }
+  else if((cl = ngx_alloc_chain_link(r->pool))==NULL || (b = ngx_calloc_buf(r->pool))==NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memzero(b, sizeof(*b));
+  b->memory = 1;
+  b->flush = 1;
+  if(frame != NULL) {
+    //start marks the frame the buffer points into, so it can be released once it's sent
+    frame->use_count++;
+    b->start = (u_char *) frame;
+    b->pos = (u_char *) (frame + 1);
+    b->last = b->pos + frame->len;
+  }
+  else {
+    if(constant == NULL) {
+      constant = stream->websocket != NULL ? &ngx_http_push_websocket_ping_frame : &ngx_http_push_eventsource_ping_frame;
+    }
+    b->pos = constant->data;
+    b->last = b->pos + constant->len;
+  }
+  b->end = b->last;
+  cl->buf = b;
+  cl->next = NULL;
+  *stream->busy_end = cl;
+  stream->busy_end = &cl->next;
+  stream->pending++;
+  rc = ngx_http_push_stream_send(r, cl);
+  ngx_http_push_stream_update(stream);
+  return rc;
+}
+
+//write a message's frame, unless the stream's already had it
+static ngx_int_t ngx_http_push_stream_send_frame(ngx_http_request_t *r, ngx_http_push_stream_t *stream, ngx_http_push_stream_frame_t *frame) {
+  if(!ngx_http_push_msg_id_newer(&frame->id, &stream->last)) {
+    return NGX_OK;
+  }
+  stream->last = frame->id;
+  return ngx_http_push_stream_write(r, stream, frame, NULL);
+}
+
+//end a stream. NGX_DONE ends it cleanly.
+static void ngx_http_push_stream_close(ngx_http_request_t *r, ngx_http_push_stream_t *stream, ngx_int_t rc) {
+  if(stream->ping.timer_set) {
+    ngx_del_timer(&stream->ping);
+  }
+  if(rc == NGX_DONE && stream->websocket != NULL) {
+    //not waiting around for the client's close frame. there's nothing more it could want.
+    if(ngx_http_push_stream_write(r, stream, NULL, &ngx_http_push_websocket_close_frame) != NGX_OK) {
+      rc = NGX_ERROR;
+    }
+  }
+  if(rc == NGX_DONE && ngx_http_send_special(r, NGX_HTTP_LAST) != NGX_ERROR) {
+    ngx_http_finalize_request(r, NGX_OK);
+    return;
+  }
+  ngx_http_finalize_request(r, NGX_ERROR);
+}
+
+static void ngx_http_push_stream_writer(ngx_http_request_t *r) {
+  ngx_http_push_stream_t         *stream = ngx_http_get_module_ctx(r, ngx_http_push_module);
+  if(r->connection->write->timedout) {
+    r->connection->timedout = 1;
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+    return;
+  }
+  if(ngx_http_push_stream_send(r, NULL) != NGX_OK) {
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+    return;
+  }
+  ngx_http_push_stream_update(stream);
+}
+
+static void ngx_http_push_stream_ping(ngx_event_t *ev) {
+  ngx_http_request_t             *r = ev->data;
+  ngx_http_push_stream_t         *stream = ngx_http_get_module_ctx(r, ngx_http_push_module);
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  if(ngx_exiting) {
+    //don't hold up a graceful shutdown. the client will reconnect elsewhere.
+    ngx_http_push_stream_close(r, stream, NGX_DONE);
+    return;
+  }
+  if(ngx_http_push_stream_write(r, stream, NULL, NULL) != NGX_OK) {
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+    return;
+  }
+  ngx_add_timer(ev, cf->subscriber_ping_interval * 1000);
+}
+
+static void ngx_http_push_stream_cleanup(void *data) {
+  ngx_http_push_stream_t         *stream = data;
+  ngx_chain_t                    *cl;
+  if(stream->ping.timer_set) {
+    ngx_del_timer(&stream->ping);
+  }
+  for(cl = stream->busy; cl != NULL; cl = cl->next) {
+    if(cl->buf->start != NULL) {
+      ngx_http_push_stream_frame_release((ngx_http_push_stream_frame_t *) cl->buf->start);
+    }
+  }
+  stream->busy = NULL;
+}
+
+//send whatever's been published since the last message the stream got
+static ngx_int_t ngx_http_push_stream_catch_up(ngx_http_request_t *r, ngx_http_push_stream_t *stream) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_stream_frame_t   *frame;
+  ngx_http_push_msg_t            *msg;
+  ngx_int_t                       msg_search_outcome, rc;
+  for(;;) {
+    msg = ngx_http_push_store->get_channel_message(stream->channel, &stream->last, &msg_search_outcome, cf);
+    if(msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_EXPIRED && (stream->last.time != 0 || stream->last.tag != 0)) {
+      //it's been too long. start over from the oldest message there is.
+      stream->last.time = 0;
+      stream->last.tag = 0;
+      continue;
+    }
+    if(msg_search_outcome != NGX_HTTP_PUSH_MESSAGE_FOUND) {
+      return NGX_OK;
+    }
+    frame = ngx_http_push_stream_frame(stream, msg, r->connection->log);
+    ngx_http_push_store->release_message(stream->channel, msg);
+    if(frame == NULL) {
+      return NGX_ERROR;
+    }
+    stream->last = frame->id;
+    rc = ngx_http_push_stream_write(r, stream, frame, NULL);
+    ngx_http_push_stream_frame_release(frame);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+  }
+}
+
+//put a stream that's been taken off the channel's queue back on it. seq is the channel's last_seq when it was taken.
+static void ngx_http_push_stream_resubscribe(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber, ngx_http_push_stream_t *stream, uint64_t seq) {
+  ngx_http_request_t             *r = subscriber->request;
+  if(ngx_http_push_store->requeue_subscriber(channel, subscriber) != NGX_OK) {
+    ngx_pfree(ngx_http_push_pool, subscriber);
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+    return;
+  }
+  subscriber->clndata->subscriber = subscriber;
+  subscriber->clndata->channel = channel;
+  //whatever was published while it was off the queue went to everyone else
+  if(channel->last_seq != seq && ngx_http_push_stream_catch_up(r, stream) != NGX_OK) {
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+  }
+}
+
+//Last-Event-ID, if there is one, is where a reconnecting stream left off
+static void ngx_http_push_eventsource_get_msg_id(ngx_http_request_t *r, ngx_http_push_msg_id_t *id) {
+  ngx_str_t                      *last_id = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_LAST_EVENT_ID);
+  u_char                         *sep;
+  time_t                          time;
+  ngx_int_t                       tag;
+  if(last_id == NULL || (sep = ngx_strlchr(last_id->data, last_id->data + last_id->len, ':'))==NULL) {
+    return;
+  }
+  if((time = ngx_atotm(last_id->data, sep - last_id->data)) == NGX_ERROR || (tag = ngx_atoi(sep + 1, last_id->data + last_id->len - sep - 1)) == NGX_ERROR) {
+    return;
+  }
+  id->time = time;
+  id->tag = tag;
+}
+
+//does this look like a websocket handshake we can go along with?
+static ngx_int_t ngx_http_push_websocket_request(ngx_http_request_t *r) {
+  ngx_str_t                      *upgrade = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_UPGRADE);
+  ngx_str_t                      *key = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_KEY);
+  ngx_str_t                      *version = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_VERSION);
+  return r == r->main && r->http_version >= NGX_HTTP_VERSION_11
+    && upgrade != NULL && upgrade->len == NGX_HTTP_PUSH_WEBSOCKET_UPGRADE_VALUE.len
+    && ngx_strncasecmp(upgrade->data, NGX_HTTP_PUSH_WEBSOCKET_UPGRADE_VALUE.data, upgrade->len) == 0
+    && key != NULL && key->len > 0
+    && version != NULL && version->len == NGX_HTTP_PUSH_WEBSOCKET_VERSION_VALUE.len
+    && ngx_strncmp(version->data, NGX_HTTP_PUSH_WEBSOCKET_VERSION_VALUE.data, version->len) == 0;
+}
+
+//Sec-WebSocket-Accept: base64(SHA-1(key + GUID))
+static ngx_int_t ngx_http_push_websocket_accept(ngx_http_request_t *r, ngx_str_t *accept) {
+  ngx_str_t                      *key = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_KEY);
+  ngx_sha1_t                      sha1;
+  u_char                          hash[20];
+  ngx_str_t                       digest = { sizeof(hash), hash };
+  ngx_sha1_init(&sha1);
+  ngx_sha1_update(&sha1, key->data, key->len);
+  ngx_sha1_update(&sha1, NGX_HTTP_PUSH_WEBSOCKET_GUID.data, NGX_HTTP_PUSH_WEBSOCKET_GUID.len);
+  ngx_sha1_final(hash, &sha1);
+  if((accept->data = ngx_pnalloc(r->pool, ngx_base64_encoded_length(sizeof(hash))))==NULL) {
+    return NGX_ERROR;
+  }
+  ngx_encode_base64(accept, &digest);
+  return NGX_OK;
+}
+
+#define ngx_http_push_websocket_header_len(h) ((((h)[1] & 0x7f) == 126 ? 4 : ((h)[1] & 0x7f) == 127 ? 10 : 2) + ((h)[1] & 0x80 ? 4 : 0))
+#define ngx_http_push_websocket_header_complete(ws) ((ws)->header_len >= 2 && (ws)->header_len == ngx_http_push_websocket_header_len((ws)->header))
+
+//a whole frame's come in from the client
+static ngx_int_t ngx_http_push_websocket_frame_received(ngx_http_request_t *r, ngx_http_push_stream_t *stream) {
+  ngx_http_push_websocket_t      *ws = stream->websocket;
+  ngx_http_push_stream_frame_t   *pong;
+  u_char                         *p;
+  ngx_int_t                       rc;
+  switch(ws->header[0] & 0x0f) {
+    case NGX_HTTP_PUSH_WEBSOCKET_CLOSE:
+      return NGX_DONE;
+    
+    case NGX_HTTP_PUSH_WEBSOCKET_PING:
+      if((pong = ngx_alloc(sizeof(*pong) + NGX_HTTP_PUSH_WEBSOCKET_MAX_HEADER_LEN + ws->payload_read, r->connection->log))==NULL) {
+        return NGX_ERROR;
+      }
+      ngx_memzero(pong, sizeof(*pong));
+      pong->use_count = 1;
+      p = ngx_http_push_websocket_header((u_char *) (pong + 1), NGX_HTTP_PUSH_WEBSOCKET_PONG, ws->payload_read);
+      p = ngx_cpymem(p, ws->control, ws->payload_read);
+      pong->len = p - (u_char *) (pong + 1);
+      rc = ngx_http_push_stream_write(r, stream, pong, NULL);
+      ngx_http_push_stream_frame_release(pong);
+      return rc;
+    
+    default:
+      //pongs, and anything the client has to say, are of no interest
+      return NGX_OK;
+  }
+}
+
+//make sense of what the client's sent. only control frames' payloads are kept.
+static ngx_int_t ngx_http_push_websocket_parse(ngx_http_request_t *r, ngx_http_push_stream_t *stream, u_char *p, u_char *last) {
+  ngx_http_push_websocket_t      *ws = stream->websocket;
+  u_char                         *h = ws->header, *mask;
+  uint64_t                        len, i, n;
+  ngx_int_t                       rc;
+  while(p < last) {
+    if(!ngx_http_push_websocket_header_complete(ws)) {
+      h[ws->header_len++] = *p++;
+      if(!ngx_http_push_websocket_header_complete(ws)) {
+        continue;
+      }
+      if(!(h[1] & 0x80)) {
+        //clients must mask what they send
+        return NGX_ERROR;
+      }
+      len = h[1] & 0x7f;
+      if(len == 126) {
+        len = (h[2] << 8) | h[3];
+      }
+      else if(len == 127) {
+        for(len = 0, i = 2; i < 10; i++) {
+          len = (len << 8) | h[i];
+        }
+      }
+      if((h[0] & 0x08) && len > sizeof(ws->control)) {
+        return NGX_ERROR;
+      }
+      ws->payload_left = len;
+      ws->payload_read = 0;
+    }
+    else {
+      n = ngx_min((uint64_t) (last - p), ws->payload_left);
+      if(h[0] & 0x08) {
+        mask = &h[ws->header_len - 4];
+        for(i = 0; i < n; i++) {
+          ws->control[ws->payload_read + i] = p[i] ^ mask[(ws->payload_read + i) % 4];
+        }
+      }
+      p += n;
+      ws->payload_read += n;
+      ws->payload_left -= n;
+    }
+    if(ws->payload_left > 0) {
+      continue;
+    }
+    ws->header_len = 0;
+    if((rc = ngx_http_push_websocket_frame_received(r, stream)) != NGX_OK) {
+      return rc;
+    }
+  }
+  return NGX_OK;
+}
+
+static void ngx_http_push_websocket_reader(ngx_http_request_t *r) {
+  ngx_http_push_stream_t         *stream = ngx_http_get_module_ctx(r, ngx_http_push_module);
+  ngx_connection_t               *c = r->connection;
+  u_char                          buf[512]; //clients have little to say
+  ssize_t                         n;
+  ngx_int_t                       rc;
+  for(;;) {
+    n = c->recv(c, buf, sizeof(buf));
+    if(n == NGX_AGAIN) {
+      break;
+    }
+    if(n == 0 || n == NGX_ERROR) {
+      c->error = 1;
+      ngx_http_push_stream_close(r, stream, NGX_ERROR);
+      return;
+    }
+    if((rc = ngx_http_push_websocket_parse(r, stream, buf, buf + n)) != NGX_OK) {
+      ngx_http_push_stream_close(r, stream, rc);
+      return;
+    }
+  }
+  if(ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_http_push_stream_close(r, stream, NGX_ERROR);
+  }
+}
+
+//called by the store once the subscriber's on the channel's queue
+ngx_int_t ngx_http_push_stream_subscriber_start(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber, ngx_http_push_msg_id_t *msg_id) {
+  ngx_http_request_t             *r = subscriber->request;
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_stream_t         *stream;
+  ngx_http_cleanup_t             *cln;
+  ngx_str_t                       accept;
+  ngx_int_t                       rc;
+  
+  //streams don't time out
+  if(ngx_push_longpoll_subscriber_enqueue(channel, subscriber, 0) != NGX_OK) {
+    ngx_queue_remove(&subscriber->queue);
+    ngx_pfree(ngx_http_push_pool, subscriber);
+    ngx_atomic_fetch_add(&channel->subscribers, (ngx_atomic_int_t) -1);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  //from here on, the subscriber cleanup takes it off the queue
+  if((stream = ngx_pcalloc(r->pool, sizeof(*stream)))==NULL || (cln = ngx_http_cleanup_add(r, 0))==NULL) {
+    return NGX_ERROR;
+  }
+  stream->channel = channel;
+  stream->last = *msg_id;
+  stream->busy_end = &stream->busy;
+  stream->ping.handler = ngx_http_push_stream_ping;
+  stream->ping.data = r;
+  stream->ping.log = r->connection->log;
+  cln->handler = ngx_http_push_stream_cleanup;
+  cln->data = stream;
+  ngx_http_set_ctx(r, stream, ngx_http_push_module);
+  
+  if(cf->subscriber_poll_mechanism == NGX_HTTP_PUSH_MECHANISM_WEBSOCKET) {
+    if((stream->websocket = ngx_pcalloc(r->pool, sizeof(*stream->websocket)))==NULL || ngx_http_push_websocket_accept(r, &accept) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    //the header filter adds the Connection: upgrade
+    r->headers_out.status = NGX_HTTP_SWITCHING_PROTOCOLS;
+    r->headers_out.status_line.len = NGX_HTTP_PUSH_HTTP_STATUS_101.len;
+    r->headers_out.status_line.data = NGX_HTTP_PUSH_HTTP_STATUS_101.data;
+    ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_UPGRADE, &NGX_HTTP_PUSH_WEBSOCKET_UPGRADE_VALUE);
+    ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_SEC_WEBSOCKET_ACCEPT, &accept);
+    r->keepalive = 0;
+  }
+  else {
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type.len = NGX_HTTP_PUSH_EVENTSOURCE_CONTENT_TYPE.len;
+    r->headers_out.content_type.data = NGX_HTTP_PUSH_EVENTSOURCE_CONTENT_TYPE.data;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_CACHE_CONTROL, &NGX_HTTP_PUSH_CACHE_CONTROL_VALUE);
+  }
+  r->headers_out.content_length_n = -1;
+  rc = ngx_http_send_header(r);
+  if(rc == NGX_ERROR || rc > NGX_OK) {
+    return NGX_ERROR;
+  }
+  if(r->header_only) {
+    ngx_http_push_stream_close(r, stream, NGX_DONE);
+    return NGX_DONE;
+  }
+  r->write_event_handler = ngx_http_push_stream_writer;
+  if(stream->websocket != NULL) {
+    //clients may not send anything before the handshake's answered, so there's nothing in r->header_in to look at
+    r->read_event_handler = ngx_http_push_websocket_reader;
+    if(ngx_handle_read_event(r->connection->read, 0) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  
+  //a ping first, to get the headers out
+  if(ngx_http_push_stream_write(r, stream, NULL, NULL) != NGX_OK || ngx_http_push_stream_catch_up(r, stream) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  if(cf->subscriber_ping_interval > 0) {
+    ngx_add_timer(&stream->ping, cf->subscriber_ping_interval * 1000);
+  }
+  return NGX_DONE;
+}
+
+/* long-poll on several channels at once. X-Channel-Positions says where the client is in each, in the same order
+ * as the channel ids, as "<time>:<tag>" -- a part's Last-Modified time in seconds, and its Etag. channels it
+ * leaves out start from msg_id, like any other subscriber. */
+static void ngx_http_push_subscribe_multi(ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf, ngx_str_t *ids, ngx_uint_t n, ngx_http_push_msg_id_t *msg_id) {
+  ngx_str_t                      *positions = ngx_http_push_find_in_header_value(r, NGX_HTTP_PUSH_HEADER_CHANNEL_POSITIONS);
+  ngx_http_push_multi_subscriber_t *m;
+  ngx_http_cleanup_t             *cln;
+  ngx_uint_t                      i, j, k, max = (ngx_uint_t) cf->subscriber_batch_max;
+  u_char                         *cur, *last, *end, *sep;
+  time_t                          time;
+  ngx_int_t                       tag;
+  
+  if((m = ngx_pcalloc(r->pool, sizeof(*m)))==NULL
+     || (m->names = ngx_palloc(r->pool, sizeof(*m->names) * n))==NULL
+     || (m->msg_ids = ngx_palloc(r->pool, sizeof(*m->msg_ids) * n))==NULL
+     || (m->channels = ngx_pcalloc(r->pool, sizeof(*m->channels) * n))==NULL
+     || (m->subscribers = ngx_pcalloc(r->pool, sizeof(*m->subscribers) * n))==NULL
+     || (m->msgs = ngx_palloc(r->pool, sizeof(*m->msgs) * n * max))==NULL
+     || (m->msg_names = ngx_palloc(r->pool, sizeof(*m->msg_names) * n * max))==NULL
+     || (cln = ngx_http_cleanup_add(r, 0))==NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate multi-channel subscriber");
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  cln->handler = (ngx_http_cleanup_pt) ngx_http_push_multi_subscriber_detach;
+  cln->data = m;
+  m->request = r;
+  m->channel_ids = ids;
+  
+  cur = positions != NULL ? positions->data : NULL;
+  last = positions != NULL ? positions->data + positions->len : NULL;
+  for(i = 0; i < n; i++) {
+    m->msg_ids[i] = *msg_id;
+    if(cur == NULL || cur >= last) {
+      continue;
+    }
+    if((end = ngx_strlchr(cur, last, ',')) == NULL) {
+      end = last;
+    }
+    while(cur < end && *cur == ' ') {
+      cur++;
+    }
+    if((sep = ngx_strlchr(cur, end, ':')) != NULL && (time = ngx_atotm(cur, sep - cur)) != NGX_ERROR && (tag = ngx_atoi(sep + 1, end - sep - 1)) != NGX_ERROR) {
+      m->msg_ids[i].time = time;
+      m->msg_ids[i].tag = tag;
+    }
+    cur = end + 1;
+  }
+  
+  //the same channel twice would put two of its subscribers in one queue
+  for(i = 0, j = 0; i < n; i++) {
+    for(k = 0; k < j && (ids[k].len != ids[i].len || ngx_strncmp(ids[k].data, ids[i].data, ids[i].len) != 0); k++) { /* void */ }
+    if(k < j) {
+      continue;
+    }
+    ids[j] = ids[i];
+    m->msg_ids[j] = m->msg_ids[i];
+    m->names[j].data = ids[j].data + cf->channel_group.len + 1;
+    m->names[j].len = ids[j].len - cf->channel_group.len - 1;
+    j++;
+  }
+  m->n = j;
+  ngx_http_push_store->subscribe_multi(m, r, &subscribe_longpoll_callback);
+}
+
+ngx_int_t ngx_http_push_subscriber_handler(ngx_http_request_t *r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_str_t                      *channel_id;
+  ngx_http_push_msg_id_t          msg_id;
+  ngx_uint_t                      n = 1;
+  
+  if((channel_id=ngx_http_push_get_channel_ids(r, cf, &n)) == NULL) {
+    return r->headers_out.status ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  
+  switch(r->method) {
+    case NGX_HTTP_GET:
+      ngx_http_push_subscriber_get_msg_id(r, &msg_id);
+
+      r->main->count++; //let it linger until callback
+      switch(cf->subscriber_poll_mechanism) {
+        ngx_int_t                       msg_search_outcome;
+        
+        //for NGX_HTTP_PUSH_MECHANISM_LONGPOLL
+        case NGX_HTTP_PUSH_MECHANISM_INTERVALPOLL:
+          ngx_http_push_store->get_message(channel_id, &msg_id, &msg_search_outcome, r, &subscribe_intervalpoll_callback);
+          break;
+          
+        case NGX_HTTP_PUSH_MECHANISM_LONGPOLL:
+          if(n > 1) {
+            ngx_http_push_subscribe_multi(r, cf, channel_id, n, &msg_id);
+            break;
+          }
+          ngx_http_push_store->subscribe(channel_id, &msg_id, r, &subscribe_longpoll_callback);
+          break;
+          
+        case NGX_HTTP_PUSH_MECHANISM_EVENTSOURCE:
+          ngx_http_push_eventsource_get_msg_id(r, &msg_id);
+          ngx_http_push_store->subscribe(channel_id, &msg_id, r, &subscribe_longpoll_callback);
+          break;
+        
+        case NGX_HTTP_PUSH_MECHANISM_WEBSOCKET:
+          if(!ngx_http_push_websocket_request(r)) {
+            ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+            break;
+          }
+          ngx_http_push_store->subscribe(channel_id, &msg_id, r, &subscribe_longpoll_callback);
+          break;
+      }
+      return NGX_DONE;
+    
+    case NGX_HTTP_OPTIONS:
+      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_ORIGIN,  &NGX_HTTP_PUSH_ANYSTRING);
+      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_HEADERS, &NGX_HTTP_PUSH_ACCESS_CONTROL_ALLOWED_SUBSCRIBER_HEADERS);
+      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ACCESS_CONTROL_ALLOW_METHODS, &NGX_HTTP_PUSH_ALLOW_GET_OPTIONS);
+      r->headers_out.content_length_n = 0;
+      r->header_only = 1;
+      r->headers_out.status=NGX_HTTP_OK;
+      ngx_http_send_header(r);
+      return NGX_OK;
+      
+    default:
+      ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ALLOW, &NGX_HTTP_PUSH_ALLOW_GET_OPTIONS); //valid HTTP for the win
+      return NGX_HTTP_NOT_ALLOWED;
+  }
+}
+
+//no channel info for a multi-channel publish. 201 if any of the channels had subscribers, 202 if none did.
+static ngx_int_t publish_multi_callback(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r) {
+  switch(status) {
+    case NGX_HTTP_PUSH_MESSAGE_QUEUED:
+      ngx_http_finalize_request(r, ngx_http_push_respond_status_only(r, NGX_HTTP_ACCEPTED, NULL));
+      return NGX_OK;
+      
+    case NGX_HTTP_PUSH_MESSAGE_RECEIVED:
+      ngx_http_finalize_request(r, ngx_http_push_respond_status_only(r, NGX_HTTP_CREATED, NULL));
+      return NGX_OK;
+      
+    default:
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: error publishing message to several channels");
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return NGX_ERROR;
+  }
+}
+
+static ngx_int_t publish_callback(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r) {
+  switch(status) {
+    case NGX_HTTP_PUSH_MESSAGE_QUEUED:
+      //message was queued successfully, but there were no subscribers to receive it.
+      ngx_http_finalize_request(r, ngx_http_push_response_channel_ptr_info(ch, r, NGX_HTTP_ACCEPTED));
+      return NGX_OK;
+      
+    case NGX_HTTP_PUSH_MESSAGE_RECEIVED:
+      //message was queued successfully, and it was already sent to at least one subscriber
+      ngx_http_finalize_request(r, ngx_http_push_response_channel_ptr_info(ch, r, NGX_HTTP_CREATED));
+      return NGX_OK;
+      
+    case NGX_ERROR:
+      //WTF?
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: error broadcasting message to workers");
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return NGX_ERROR;
+      
+    default:
+      //for debugging, mostly. I don't expect this branch to behit during regular operation
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: TOTALLY UNEXPECTED error broadcasting message to workers");
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return NGX_ERROR;
+  }
+}
+
+/* Cut-through publishing. A large publish is relayed to the subscribers waiting in this worker while its body is
+ * still uploading: the message is created up front with room for the whole body, and nginx is told to spool the
+ * body to its temp file. Each time it's written some more, that part is copied into the message and passed on.
+ * Everyone else gets the message the usual way, once it's all in. The relayed responses go out with the tags the
+ * message was created with, but something else published in the meantime gets ahead of it, and then publishing
+ * gives it new ones. So the last byte is held back until the message is published: if its tags stayed put the
+ * responses are completed, and if not they're cut off, and their subscribers get it again with the right tags. */
+
+static void ngx_http_push_cut_through_writer(ngx_http_request_t *r) {
+  if(r->connection->write->timedout) {
+    r->connection->timedout = 1;
+    ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+    return;
+  }
+  if(ngx_http_push_stream_send(r, NULL) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_ERROR);
+  }
+}
+
+static void ngx_http_push_cut_through_subscriber_gone(void *data) {
+  ((ngx_http_push_cut_through_subscriber_t *) data)->request = NULL;
+}
+
+//send bytes [from, to) of the message body to a subscriber
+static ngx_int_t ngx_http_push_cut_through_relay_to(ngx_http_push_cut_through_subscriber_t *sub, off_t from, off_t to, ngx_flag_t last) {
+  ngx_http_request_t             *r = sub->request;
+  ngx_chain_t                    *out;
+  ngx_buf_t                      *b;
+  if((out = ngx_alloc_chain_link(r->pool))==NULL || (b = ngx_calloc_buf(r->pool))==NULL) {
+    return NGX_ERROR;
+  }
+  if(from < to && sub->body->in_file) {
+    b->in_file = 1;
+    b->file = sub->body->file;
+    b->file_pos = sub->body->file_pos + from;
+    b->file_last = sub->body->file_pos + to;
+  }
+  else if(from < to) {
+    b->memory = 1;
+    b->start = sub->body->pos + from;
+    b->pos = b->start;
+    b->last = sub->body->pos + to;
+    b->end = b->last;
+  }
+  b->flush = 1;
+  b->last_buf = last;
+  out->buf = b;
+  out->next = NULL;
+  return ngx_http_push_stream_send(r, out);
+}
+
+//done relaying, one way or another. on NGX_OK the subscribers' responses are complete; otherwise they're cut off.
+//on NGX_ERROR the message is thrown away too, and the caller gets any other use of it out of the way first.
+static void ngx_http_push_cut_through_finish(ngx_http_push_cut_through_t *ct, ngx_int_t rc) {
+  ngx_http_push_cut_through_subscriber_t *sub;
+  ngx_http_request_t             *r;
+  ngx_uint_t                      i;
+  for(i=0; i < ct->subscriber_count; i++) {
+    sub = &ct->subscribers[i];
+    if((r = sub->request) == NULL) {
+      continue;
+    }
+    sub->cln->handler = NULL;
+    sub->request = NULL;
+    if(rc == NGX_OK && ngx_http_push_cut_through_relay_to(sub, ct->size - 1, ct->size, 1) == NGX_OK) {
+      ngx_http_finalize_request(r, NGX_OK);
+    }
+    else {
+      ngx_http_finalize_request(r, NGX_ERROR);
+    }
+  }
+  ct->subscriber_count = 0;
+  if(ct->cln != NULL) {
+    ct->cln->handler = NULL;
+    ct->cln = NULL;
+  }
+  if(rc == NGX_ERROR) {
+    ngx_http_push_store->release_message(NULL, ct->msg);
+  }
+  ct->done = 1;
+  if(!ct->reading) {
+    ngx_pfree(ngx_http_push_pool, ct);
+  }
+}
+
+//copy whatever nginx has spooled since last time into the message, and pass it on
+static ngx_int_t ngx_http_push_cut_through_relay(ngx_http_push_cut_through_t *ct) {
+  ngx_http_request_t             *r = ct->publisher;
+  ngx_temp_file_t                *tf = r->request_body != NULL ? r->request_body->temp_file : NULL;
+  ngx_http_push_cut_through_subscriber_t *sub;
+  off_t                           available, offset, from, to;
+  ngx_buf_t                       part;
+  ngx_int_t                       rc;
+  ngx_uint_t                      i;
+  if(tf == NULL || (available = ngx_min(tf->offset, ct->size)) <= ct->relayed) {
+    return NGX_OK;
+  }
+  ngx_memzero(&part, sizeof(part));
+  part.in_file = 1;
+  part.file = &tf->file;
+  part.file_pos = ct->relayed;
+  part.file_last = available;
+  //reading moves the file's offset, and nginx appends the rest of the body there
+  offset = tf->file.offset;
+  rc = ngx_http_push_store->write_message_body(ct->msg, &part, ct->relayed, r);
+  tf->file.offset = offset;
+  if(rc != NGX_OK) {
+    return NGX_ERROR;
+  }
+  //the last byte waits until the message is published, and its tags are final
+  from = ngx_min(ct->relayed, ct->size - 1);
+  to = ngx_min(available, ct->size - 1);
+  for(i=0; from < to && i < ct->subscriber_count; i++) {
+    sub = &ct->subscribers[i];
+    if(sub->request != NULL && ngx_http_push_cut_through_relay_to(sub, from, to, 0) != NGX_OK) {
+      ngx_http_finalize_request(sub->request, NGX_ERROR); //its cleanup lets go of it
+    }
+  }
+  ct->relayed = available;
+  return NGX_OK;
+}
+
+//stop relaying. the rest of the body still comes in, and gets published the usual way.
+static void ngx_http_push_cut_through_abandon(ngx_http_push_cut_through_t *ct) {
+  ngx_http_request_t             *r = ct->publisher;
+  r->read_event_handler = ct->read_body;
+  ngx_http_set_ctx(r, NULL, ngx_http_push_module);
+  ngx_http_push_cut_through_finish(ct, NGX_ERROR);
+}
+
+static void ngx_http_push_cut_through_publisher_gone(void *data) {
+  ngx_http_push_cut_through_t    *ct = data;
+  ct->publisher = NULL;
+  ct->cln = NULL;
+  if(!ct->reading) {
+    ngx_http_push_cut_through_finish(ct, NGX_ERROR);
+  }
+}
+
+//wraps nginx's request body reader
+static void ngx_http_push_cut_through_read_handler(ngx_http_request_t *r) {
+  ngx_http_push_cut_through_t    *ct = ngx_http_get_module_ctx(r, ngx_http_push_module);
+  ct->reading = 1;
+  ct->read_body(r);
+  ct->reading = 0;
+  if(ct->done) {
+    //the body's all in, or nginx gave up on it. either way, r may be gone by now.
+    ngx_pfree(ngx_http_push_pool, ct);
+  }
+  else if(ct->publisher == NULL) {
+    ngx_http_push_cut_through_finish(ct, NGX_ERROR);
+  }
+  else if(ngx_http_push_cut_through_relay(ct) != NGX_OK) {
+    ngx_http_push_cut_through_abandon(ct);
+  }
+}
+
+//start relaying a publish that's still uploading, if there's anyone here to relay it to
+static void ngx_http_push_cut_through_start(ngx_http_request_t *r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_variable_value_t      *vv = ngx_http_get_indexed_variable(r, cf->index);
+  ngx_str_t                      *channel_id, *content_type, *etag;
+  ngx_http_push_channel_t        *channel;
+  ngx_http_push_msg_t            *msg;
+  ngx_http_push_subscriber_t     *sentinel, *cur, *next;
+  ngx_http_push_cut_through_t    *ct = NULL;
+  ngx_http_push_cut_through_subscriber_t *sub;
+  ngx_http_push_stream_t         *stream;
+  ngx_http_cleanup_t             *cln = NULL;
+  ngx_http_request_t             *sr;
+  ngx_chain_t                    *chain;
+  time_t                          last_modified;
+  ngx_int_t                       count, rc;
+  uint64_t                        seq;
+  
+  //no channel id? that's for the body handler to deal with
+  if(vv == NULL || vv->not_found || vv->len == 0 || (channel_id = ngx_http_push_get_channel_id(r, cf))==NULL) {
+    return;
+  }
+  if((channel = ngx_http_push_store->find_channel(channel_id, cf->channel_timeout, NULL))==NULL) {
+    return;
+  }
+  if((msg = ngx_http_push_store->create_partial_message(channel, r, r->headers_in.content_length_n))==NULL) {
+    return;
+  }
+  seq = channel->last_seq;
+  if((sentinel = ngx_http_push_store->take_worker_subscribers(channel))==NULL) {
+    ngx_http_push_store->release_message(NULL, msg);
+    return;
+  }
+  if((count = ngx_http_push_store->channel_worker_subscribers(sentinel)) == 0) {
+    ngx_http_push_store->release_subscriber_sentinel(channel, sentinel);
+    ngx_http_push_store->release_message(NULL, msg);
+    return;
+  }
+  if((ct = ngx_pcalloc(ngx_http_push_pool, sizeof(*ct) + sizeof(*ct->subscribers) * count))==NULL || (cln = ngx_http_cleanup_add(r, 0))==NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate memory for cut-through publishing");
+    if(ct != NULL) {
+      ngx_pfree(ngx_http_push_pool, ct);
+    }
+    ngx_http_push_respond_to_subscribers(channel, sentinel, NULL, NGX_HTTP_INTERNAL_SERVER_ERROR, NULL);
+    ngx_http_push_store->release_message(NULL, msg);
+    return;
+  }
+  ct->publisher = r;
+  ct->cln = cln;
+  ct->msg = msg;
+  ct->message_time = msg->message_time;
+  ct->message_tag = msg->message_tag;
+  ct->size = r->headers_in.content_length_n;
+  ct->subscribers = (ngx_http_push_cut_through_subscriber_t *) (ct+1);
+  cln->handler = ngx_http_push_cut_through_publisher_gone;
+  cln->data = ct;
+  ngx_http_set_ctx(r, ct, ngx_http_push_module);
+  
+  for(cur=ngx_http_push_store->next_subscriber(channel, sentinel, NULL, 0); cur!=NULL; cur=next) {
+    sr = cur->request;
+    next = ngx_http_push_store->next_subscriber(channel, sentinel, cur, 0);
+    if(cur->multi != NULL) {
+      //it'll hear about the message once it's all in
+      ngx_http_push_multi_subscriber_wake(channel, cur, NULL, 0, NULL);
+      continue;
+    }
+    //they're ours now. cleanup oughtn't dequeue anything, or decrement the subscriber count.
+    ngx_http_push_subscriber_clear_ctx(cur);
+    if((stream = ngx_http_get_module_ctx(sr, ngx_http_push_module)) != NULL) {
+      //streams get the message once it's published, like everyone else
+      ngx_http_push_stream_resubscribe(channel, cur, stream, seq);
+      continue;
+    }
+    ngx_pfree(ngx_http_push_pool, cur);
+    sub = &ct->subscribers[ct->subscriber_count++];
+    sub->request = NULL;
+    if((sub->cln = ngx_http_cleanup_add(sr, 0))==NULL || ngx_http_push_alloc_for_subscriber_response(sr->pool, 0, msg, &chain, &content_type, &etag, &last_modified)!=NGX_OK) {
+      ngx_http_finalize_request(sr, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      continue;
+    }
+    rc = ngx_http_push_send_subscriber_response_header(sr, content_type, etag, last_modified, ct->size);
+    if(rc == NGX_ERROR || rc > NGX_OK || sr->header_only) {
+      ngx_http_finalize_request(sr, rc);
+      continue;
+    }
+    sub->cln->handler = ngx_http_push_cut_through_subscriber_gone;
+    sub->cln->data = sub;
+    sub->request = sr;
+    sub->body = chain->buf;
+    sr->write_event_handler = ngx_http_push_cut_through_writer;
+  }
+  ngx_atomic_fetch_add(&channel->subscribers, (ngx_atomic_int_t) -count);
+  ngx_http_push_store->release_subscriber_sentinel(channel, sentinel);
+  
+  ct->read_body = r->read_event_handler;
+  r->read_event_handler = ngx_http_push_cut_through_read_handler;
+  if(ngx_http_push_cut_through_relay(ct) != NGX_OK) {
+    ngx_http_push_cut_through_abandon(ct);
+  }
+}
+
+//the message is out. finish the relayed responses if they went out with the tags it ended up with.
+static ngx_int_t ngx_http_push_cut_through_published(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r) {
+  ngx_http_push_cut_through_t    *ct = ngx_http_get_module_ctx(r, ngx_http_push_module);
+  ngx_http_push_msg_t            *msg = ct->msg;
+  ngx_flag_t                      restamped = msg->message_time != ct->message_time || msg->message_tag != ct->message_tag;
+  ngx_http_set_ctx(r, NULL, ngx_http_push_module);
+  ngx_http_push_cut_through_finish(ct, status == NGX_ERROR || restamped ? NGX_DECLINED : NGX_OK);
+  ngx_http_push_store->release_message(NULL, msg);
+  return publish_callback(status, ch, r);
+}
+
+//the whole body's in. publish it, and finish the relayed responses.
+static void ngx_http_push_cut_through_complete(ngx_http_push_cut_through_t *ct, ngx_str_t *channel_id) {
+  ngx_http_request_t             *r = ct->publisher;
+  if(ngx_http_push_cut_through_relay(ct) != NGX_OK || ct->relayed != ct->size) {
+    //publish it the usual way after all
+    ngx_http_set_ctx(r, NULL, ngx_http_push_module);
+    ngx_http_push_cut_through_finish(ct, NGX_ERROR);
+    ngx_http_push_store->publish(channel_id, r, &publish_callback);
+    return;
+  }
+  //publishing lets go of the message, and its tags are still needed after
+  ngx_http_push_store->reserve_message(NULL, ct->msg);
+  ngx_http_push_store->publish_created_message(channel_id, ct->msg, r, &ngx_http_push_cut_through_published);
+}
+
+//copy len bytes of the request body, from offset at on, to dst. spooled parts are read from the temp file.
+ngx_int_t ngx_http_push_read_request_body(ngx_http_request_t *r, off_t at, u_char *dst, size_t len) {
+  ngx_chain_t                    *cl;
+  ngx_buf_t                      *buf;
+  off_t                           start = 0, size, from, to, pos;
+  ssize_t                         n;
+  for(cl = r->request_body != NULL ? r->request_body->bufs : NULL; cl != NULL && len > 0; cl = cl->next, start += size) {
+    buf = cl->buf;
+    size = ngx_buf_in_memory(buf) ? buf->last - buf->pos : (buf->in_file && buf->file != NULL ? buf->file_last - buf->file_pos : 0);
+    if(at >= start + size) {
+      continue;
+    }
+    from = at - start;
+    to = ngx_min(size, from + (off_t) len);
+    if(ngx_buf_in_memory(buf)) {
+      dst = ngx_cpymem(dst, buf->pos + from, to - from);
+    }
+    else {
+      for(pos = from; pos < to; pos += n, dst += n) {
+        if((n = ngx_read_file(buf->file, dst, (size_t) (to - pos), buf->file_pos + pos)) <= 0) {
+          ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "push module: unable to read request body");
+          return NGX_ERROR;
+        }
+      }
+    }
+    len -= (size_t) (to - from);
+    at += to - from;
+  }
+  return len == 0 ? NGX_OK : NGX_ERROR;
+}
+
+//len bytes of the request body at offset at: right where they are if they're all in one buffer in memory, read into buf if not
+static u_char * ngx_http_push_peek_request_body(ngx_http_request_t *r, off_t at, size_t len, u_char *buf) {
+  ngx_chain_t                    *cl;
+  off_t                           start = 0, size;
+  for(cl = r->request_body != NULL ? r->request_body->bufs : NULL; cl != NULL; cl = cl->next, start += size) {
+    size = ngx_buf_size(cl->buf);
+    if(at < start + size) {
+      if(ngx_buf_in_memory(cl->buf) && at + (off_t) len <= start + size) {
+        return cl->buf->pos + (at - start);
+      }
+      break;
+    }
+  }
+  return ngx_http_push_read_request_body(r, at, buf, len) == NGX_OK ? buf : NULL;
+}
+
+/* the bulk record at *pos in a request body of size bytes: "<channel id> <content type, or -> <length>\n<body>\n".
+ * the records are read where nginx left them, buffers and temp file both, and the body is just located: the store
+ * copies it to where the message keeps it. the header line is in scratch, or the request body's own buffer.
+ * NGX_DONE at the end of the body. */
+static ngx_int_t ngx_http_push_parse_bulk_record(ngx_http_request_t *r, off_t *pos, off_t size, u_char *scratch, ngx_str_t *id, ngx_str_t *content_type, off_t *body_pos, size_t *body_len) {
+  u_char                         *p, *last, *eol, *end, *sp1, *sp2, lf;
+  ngx_int_t                       len;
+  if(*pos == size) {
+    return NGX_DONE;
+  }
+  if((p = ngx_http_push_peek_request_body(r, *pos, (size_t) ngx_min(size - *pos, NGX_HTTP_PUSH_BULK_MAX_HEADER_LENGTH), scratch)) == NULL) {
+    return NGX_ERROR;
+  }
+  last = p + ngx_min(size - *pos, NGX_HTTP_PUSH_BULK_MAX_HEADER_LENGTH);
+  if((eol = ngx_strlchr(p, last, LF)) == NULL) {
+    return NGX_ERROR;
+  }
+  end = (eol > p && *(eol - 1) == CR) ? eol - 1 : eol;
+  if((sp1 = ngx_strlchr(p, end, ' ')) == NULL || sp1 == p || (sp2 = ngx_strlchr(sp1 + 1, end, ' ')) == NULL || sp2 == sp1 + 1) {
+    return NGX_ERROR;
+  }
+  *body_pos = *pos + (eol + 1 - p);
+  if((len = ngx_atoi(sp2 + 1, end - sp2 - 1)) == NGX_ERROR || size - *body_pos < len + 1 || ngx_http_push_read_request_body(r, *body_pos + len, &lf, 1) != NGX_OK || lf != LF) {
+    return NGX_ERROR;
+  }
+  id->data = p;
+  id->len = sp1 - p;
+  content_type->data = sp1 + 1;
+  content_type->len = (sp2 - sp1 - 1 == 1 && sp1[1] == '-') ? 0 : (size_t) (sp2 - sp1 - 1);
+  *body_len = (size_t) len;
+  *pos = *body_pos + len + 1;
+  return NGX_OK;
+}
+
+/* publish every record in the body, and respond with a JSON array of each one's status code, in order: 201 or
+ * 202 as for a single publish, 500 if it couldn't be published. a malformed record gets a 400 and ends the batch. */
+static void ngx_http_push_publish_bulk(ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf) {
+  static ngx_str_t                content_type = ngx_string("application/json");
+  ngx_str_t                      *group = &cf->channel_group;
+  ngx_array_t                    *records;
+  ngx_http_push_bulk_record_t    *rec;
+  ngx_chain_t                    *cl;
+  ngx_str_t                       id, type;
+  u_char                         *scratch, *p;
+  off_t                           pos, size = 0, body_pos;
+  size_t                          body_len, id_len;
+  ngx_int_t                       rc, code;
+  ngx_uint_t                      i;
+  ngx_buf_t                      *b;
+  
+  for(cl = r->request_body != NULL ? r->request_body->bufs : NULL; cl != NULL; cl = cl->next) {
+    size += ngx_buf_size(cl->buf);
+  }
+  if((scratch = ngx_palloc(r->pool, NGX_HTTP_PUSH_BULK_MAX_HEADER_LENGTH))==NULL || (records = ngx_array_create(r->pool, 16, sizeof(*rec)))==NULL) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  for(pos = 0; (rc = ngx_http_push_parse_bulk_record(r, &pos, size, scratch, &id, &type, &body_pos, &body_len)) == NGX_OK; /* void */) {
+    //same channel id rules as $push_channel_id. the header line may be in scratch, so it's all copied.
+    id_len = ngx_min(id.len, (size_t) cf->max_channel_id_length);
+    if((rec = ngx_array_push(records))==NULL || (p = ngx_palloc(r->pool, group->len + 1 + id_len + type.len))==NULL) {
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return;
+    }
+    rec->channel_id.data = p;
+    p = ngx_cpymem(p, group->data, group->len);
+    *p++ = '/';
+    p = ngx_cpymem(p, id.data, id_len);
+    rec->channel_id.len = group->len + 1 + id_len;
+    rec->content_type.data = p;
+    rec->content_type.len = type.len;
+    ngx_memcpy(p, type.data, type.len);
+    rec->body_pos = body_pos;
+    rec->body_len = body_len;
+    rec->status = NGX_ERROR;
+  }
+  if(records->nelts > 0 && ngx_http_push_store->publish_bulk(records->elts, records->nelts, r) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  if(rc == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "push module: malformed bulk publisher record after %ui good ones", records->nelts);
+  }
+  
+  if((b = ngx_create_temp_buf(r->pool, (records->nelts + 1) * sizeof("500,") + sizeof("[]" CRLF)))==NULL) {
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  *b->last++ = '[';
+  for(i = 0, rec = records->elts; i < records->nelts; i++) {
+    code = rec[i].status == NGX_HTTP_PUSH_MESSAGE_RECEIVED ? NGX_HTTP_CREATED : (rec[i].status == NGX_HTTP_PUSH_MESSAGE_QUEUED ? NGX_HTTP_ACCEPTED : NGX_HTTP_INTERNAL_SERVER_ERROR);
+    b->last = ngx_sprintf(b->last, i > 0 ? ",%i" : "%i", code);
+  }
+  if(rc == NGX_ERROR) {
+    code = NGX_HTTP_BAD_REQUEST;
+    b->last = ngx_sprintf(b->last, i > 0 ? ",%i" : "%i", code);
+  }
+  b->last = ngx_cpymem(b->last, "]" CRLF, sizeof("]" CRLF) - 1);
+  b->last_buf = 1;
+  
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_type = content_type;
+  r->headers_out.content_type_len = content_type.len;
+  r->headers_out.content_length_n = ngx_buf_size(b);
+  rc = ngx_http_send_header(r);
+  if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    ngx_http_finalize_request(r, rc);
+    return;
+  }
+  ngx_http_finalize_request(r, ngx_http_output_filter(r, ngx_http_push_create_output_chain(b, r->pool, r->connection->log)));
+}
+
+static void ngx_http_push_publisher_body_handler(ngx_http_request_t * r) {
+  ngx_str_t                      *channel_id;
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_cut_through_t    *ct;
+  ngx_uint_t                      method = r->method;
+  ngx_uint_t                      i, n = 1;
+  
+  if(cf->publisher_bulk && (method & (NGX_HTTP_POST|NGX_HTTP_PUT))) {
+    //the records say which channels
+    ngx_http_push_publish_bulk(r, cf);
+    return;
+  }
+  
+  if((channel_id = ngx_http_push_get_channel_ids(r, cf, &n))==NULL) {
+    ngx_http_finalize_request(r, r->headers_out.status ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+  
+  switch(method) {
+    case NGX_HTTP_POST:
+    case NGX_HTTP_PUT:
+      if((ct = ngx_http_get_module_ctx(r, ngx_http_push_module)) != NULL) {
+        ngx_http_push_cut_through_complete(ct, channel_id);
+      }
+      else if(n > 1) {
+        ngx_http_push_store->publish_multi(channel_id, n, r, &publish_multi_callback);
+      }
+      else {
+        ngx_http_push_store->publish(channel_id, r, &publish_callback);
+      }
+      break;
       
     case NGX_HTTP_DELETE:
+      //reports on the first channel
       ngx_http_finalize_request(r, ngx_http_push_response_channel_info(channel_id, r, NGX_HTTP_OK));
-      ngx_http_push_store->delete_channel(channel_id);
+      for(i = 0; i < n; i++) {
+        ngx_http_push_store->delete_channel(&channel_id[i]);
+      }
       break;
       
     case NGX_HTTP_GET:
@@ -659,6 +2267,96 @@ static void ngx_http_push_publisher_body_handler(ngx_http_request_t * r) {
   }
 }
 
+static void ngx_http_push_release_messages(ngx_http_push_channel_t *channel, ngx_http_push_msg_t **msgs, ngx_uint_t count) {
+  ngx_uint_t                      i;
+  for(i = 0; i < count; i++) {
+    ngx_http_push_store->release_message(channel, msgs[i]);
+  }
+}
+
+//a delayed delivery: everyone gets what they haven't seen yet, all at once. msg is the latest message, for the reservation.
+static ngx_int_t ngx_http_push_respond_to_subscribers_delayed(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *sentinel, ngx_http_push_msg_t *msg) {
+  ngx_http_push_subscriber_t     *cur, *next;
+  ngx_http_push_stream_t         *stream;
+  ngx_http_push_loc_conf_t       *cf;
+  ngx_http_request_t             *r;
+  ngx_http_push_msg_id_t          id, found_id;
+  ngx_http_push_msg_t           **msgs = NULL;
+  ngx_uint_t                      count = 0, max = 0;
+  ngx_int_t                       msg_search_outcome = NGX_HTTP_PUSH_MESSAGE_EXPECTED, rc, responded_subscribers = 0;
+  ngx_chain_t                    *chain;
+  ngx_str_t                      *content_type, *etag;
+  time_t                          last_modified;
+  
+  for(cur=ngx_http_push_store->next_subscriber(channel, sentinel, NULL, 0); cur!=NULL; cur=next) {
+    r = cur->request;
+    next = ngx_http_push_store->next_subscriber(channel, sentinel, cur, 0);
+    responded_subscribers++;
+    
+    if(cur->multi != NULL) {
+      ngx_http_push_multi_subscriber_wake(channel, cur, NULL, 0, NULL);
+      continue;
+    }
+    if((stream = ngx_http_get_module_ctx(r, ngx_http_push_module)) != NULL) {
+      //streams catch up from wherever they left off
+      ngx_http_push_subscriber_clear_ctx(cur);
+      ngx_http_push_stream_resubscribe(channel, cur, stream, 0);
+      continue;
+    }
+    
+    cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+    ngx_http_push_subscriber_get_msg_id(r, &id);
+    //subscribers that waited together mostly waited for the same thing
+    if(msgs == NULL || id.time != found_id.time || id.tag != found_id.tag || (ngx_uint_t) cf->subscriber_batch_max != max) {
+      if(msgs != NULL) {
+        ngx_http_push_release_messages(channel, msgs, count);
+        ngx_free(msgs);
+      }
+      count = 0;
+      max = cf->subscriber_batch_max;
+      found_id = id;
+      if((msgs = ngx_alloc(sizeof(*msgs) * max, ngx_cycle->log)) != NULL) {
+        count = ngx_http_push_store->get_channel_messages(channel, &id, msgs, max, &msg_search_outcome, cf);
+      }
+    }
+    
+    if(msgs != NULL && msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_EXPECTED) {
+      //it came in after everything that's been published. keep waiting, timeout and all.
+      if(ngx_http_push_store->requeue_subscriber(channel, cur) == NGX_OK) {
+        continue;
+      }
+    }
+    
+    ngx_http_push_subscriber_clear_ctx(cur);
+    ngx_pfree(ngx_http_push_pool, cur);
+    if(msgs == NULL || msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_EXPECTED) {
+      rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if(count == 0) {
+      rc = NGX_HTTP_NO_CONTENT; //expired, same as when subscribing
+    }
+    else if(count > 1) {
+      rc = ngx_http_push_prepare_batch_response_to_subscriber_request(r, msgs, NULL, count);
+    }
+    else if(ngx_http_push_alloc_for_subscriber_response(r->pool, 0, msgs[0], &chain, &content_type, &etag, &last_modified) == NGX_OK) {
+      ngx_http_push_gzip_variant(r, &msgs[0]->gzip_body, chain->buf);
+      rc = ngx_http_push_prepare_response_to_subscriber_request(r, chain, content_type, etag, last_modified);
+    }
+    else {
+      rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_http_finalize_request(r, rc);
+  }
+  if(msgs != NULL) {
+    ngx_http_push_release_messages(channel, msgs, count);
+    ngx_free(msgs);
+  }
+  ngx_http_push_store->release_message(channel, msg);
+  ngx_atomic_fetch_add(&channel->subscribers, (ngx_atomic_int_t) -responded_subscribers);
+  ngx_http_push_store->release_subscriber_sentinel(channel, sentinel);
+  return NGX_OK;
+}
+
 ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *sentinel, ngx_http_push_msg_t *msg, ngx_int_t status_code, const ngx_str_t *status_line) {
 
   //copy everything we need first
@@ -670,15 +2368,25 @@ ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel,
   ngx_buf_t                  *buffer = NULL;
   ngx_chain_t                *rchain;
   ngx_buf_t                  *rbuffer;
-  ngx_int_t                  *buf_use_count = NULL;
+  ngx_http_push_shared_response_t *shared = NULL;
+  ngx_http_push_loc_conf_t   *cf;
+  ngx_int_t                   rc;
   ngx_http_push_subscriber_cleanup_t *clndata;
-  ngx_http_push_subscriber_t *cur=NULL;
+  ngx_http_push_subscriber_t *cur, *next;
+  ngx_http_push_stream_t     *stream;
+  ngx_http_push_stream_frame_t *frame = NULL, *ws_frame = NULL, **stream_frame;
+  uint64_t                    seq = 0;
+  ngx_str_t                   gzip = ngx_null_string, **header;
+  ngx_flag_t                  gzipped;
   ngx_int_t                   responded_subscribers=0;
 
   if(sentinel==NULL) {
     //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "respond_to_subscribers with sentinel==NULL");
     return NGX_OK;
   }
+  if(msg != NULL && status_code == NGX_HTTP_PUSH_DELAYED_DELIVERY) {
+    return ngx_http_push_respond_to_subscribers_delayed(channel, sentinel, msg);
+  }
   
   if(msg!=NULL) {
     if(ngx_http_push_alloc_for_subscriber_response(ngx_http_push_pool, 1, msg, &chain, &content_type, &etag, &last_modified)==NGX_ERROR) {
@@ -689,13 +2397,52 @@ ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel,
     buffer = chain->buf;
     buffer->recycled = 1;
 
-    buf_use_count = ngx_pcalloc(ngx_http_push_pool, sizeof(*buf_use_count));
-    *buf_use_count = ngx_http_push_store->channel_worker_subscribers(sentinel);
+    if((shared = ngx_pcalloc(ngx_http_push_pool, sizeof(*shared)))==NULL) {
+      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate shared response while responding to subscribers");
+      ngx_http_push_store->release_message(NULL, msg); //the output chain's reservation
+      ngx_http_push_store->release_message(channel, msg);
+      return NGX_ERROR;
+    }
+    //counts our own use until we're done here, so subscribers that finish right away can't free the buffer out from under us.
+    shared->use_count = 1;
+    shared->buf = buffer;
+    shared->msg = msg;
+    shared->header = NULL; //rendered once the first subscriber wants it
+    shared->gzip_header = NULL;
+    seq = msg->seq;
+    gzip = msg->gzip_body; //it's in the same block the shared response keeps reserved
   }
     
-  while((cur=ngx_http_push_store->next_subscriber(channel, sentinel, cur, 1))!=NULL) {
-    //in this block, nothing in shared memory should be dereferenced.
+  for(cur=ngx_http_push_store->next_subscriber(channel, sentinel, NULL, 0); cur!=NULL; cur=next) {
+    //in this block, nothing in shared memory should be dereferenced. (the message is, however, when it's first rendered as an event.)
     r=cur->request;
+    next=ngx_http_push_store->next_subscriber(channel, sentinel, cur, 0);
+    responded_subscribers++;
+
+    if(cur->multi != NULL) {
+      ngx_http_push_multi_subscriber_wake(channel, cur, msg, msg == NULL ? status_code : 0, status_line);
+      continue;
+    }
+    if((stream = ngx_http_get_module_ctx(r, ngx_http_push_module)) != NULL) {
+      //streams stay subscribed
+      ngx_http_push_subscriber_clear_ctx(cur);
+      if(msg == NULL) {
+        ngx_pfree(ngx_http_push_pool, cur);
+        ngx_http_push_stream_close(r, stream, NGX_DONE);
+        continue;
+      }
+      stream_frame = stream->websocket != NULL ? &ws_frame : &frame;
+      if(*stream_frame == NULL) {
+        *stream_frame = ngx_http_push_stream_frame(stream, msg, r->connection->log);
+      }
+      if(*stream_frame == NULL || ngx_http_push_stream_send_frame(r, stream, *stream_frame) != NGX_OK) {
+        ngx_pfree(ngx_http_push_pool, cur);
+        ngx_http_push_stream_close(r, stream, NGX_ERROR);
+        continue;
+      }
+      ngx_http_push_stream_resubscribe(channel, cur, stream, seq);
+      continue;
+    }
 
     if(msg!=NULL) {
       //chain and buffer for this request
@@ -707,8 +2454,8 @@ ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel,
 
       //request buffer cleanup
       clndata = cur->clndata;
-      clndata->buf = buffer;
-      clndata->buf_use_count = buf_use_count;
+      clndata->shared = shared;
+      shared->use_count++;
       clndata->rchain = rchain;
       clndata->rpool = r->pool;
 
@@ -717,15 +2464,35 @@ ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel,
       }
       //cleanup oughtn't dequeue anything. or decrement the subscriber count, for that matter
       ngx_http_push_subscriber_clear_ctx(cur);
-      ngx_http_finalize_request(r, ngx_http_push_prepare_response_to_subscriber_request(r, rchain, content_type, etag, last_modified)); //BAM!
+      
+      gzipped = (ngx_http_push_gzip_variant(r, &gzip, rbuffer) == NGX_OK);
+      cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+      if(cf->prerendered_headers && ngx_http_push_can_send_prerendered(r)) {
+        header = gzipped ? &shared->gzip_header : &shared->header;
+        if(*header == NULL) {
+          *header = ngx_http_push_render_response_header(ngx_http_push_pool, content_type, etag, last_modified, ngx_buf_size(rbuffer), gzip.len > 0, gzipped);
+        }
+        rc = (*header != NULL) ? ngx_http_push_send_prerendered_response(r, *header, rchain) : NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      else {
+        rc = ngx_http_push_prepare_response_to_subscriber_request(r, rchain, content_type, etag, last_modified);
+      }
+      ngx_http_finalize_request(r, rc); //BAM!
     }
     else {
       ngx_http_push_subscriber_clear_ctx(cur);
       ngx_http_finalize_request(r, ngx_http_push_respond_status_only(r, status_code, status_line));
     }
-    responded_subscribers++;
+    ngx_pfree(ngx_http_push_pool, cur);
+  }
+  if(frame != NULL) {
+    ngx_http_push_stream_frame_release(frame);
+  }
+  if(ws_frame != NULL) {
+    ngx_http_push_stream_frame_release(ws_frame);
   }
   if(msg!=NULL) {
+    ngx_http_push_shared_response_release(shared);
     ngx_http_push_store->release_message(channel, msg);
     ngx_pfree(ngx_http_push_pool, etag);
     ngx_pfree(ngx_http_push_pool, content_type);
@@ -733,31 +2500,85 @@ ngx_int_t ngx_http_push_respond_to_subscribers(ngx_http_push_channel_t *channel,
   }
   
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "respond_to_subscribers with msg %p finished", msg);
-  ngx_http_push_store->lock();
-  channel->subscribers-=responded_subscribers;
-  //is the message still needed?
-  ngx_http_push_store->unlock();
+  ngx_atomic_fetch_add(&channel->subscribers, (ngx_atomic_int_t) -responded_subscribers);
   ngx_http_push_store->release_subscriber_sentinel(channel, sentinel);
   return NGX_OK;
 }
 
 ngx_int_t ngx_http_push_publisher_handler(ngx_http_request_t * r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_core_loc_conf_t       *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  ngx_flag_t                      cut_through;
   ngx_int_t                       rc;
   
-  /* Instruct ngx_http_read_subscriber_request_body to store the request
-     body entirely in a memory buffer or in a file */
-  r->request_body_in_single_buf = 1;
+  /* The body is copied straight from whatever buffers it's read into, so it
+     needn't be coalesced into one. Keep the temp file, though: a body that
+     has nowhere better to go is published right out of it. */
   r->request_body_in_persistent_file = 1;
   r->request_body_in_clean_file = 0;
   r->request_body_file_log_level = 0;
+  
+  //cut-through bodies go out as nginx spools them, so make sure it does.
+  cut_through = cf->cut_through && cf->delivery_delay == 0 && cf->channel_id_delimiter.len == 0 && !cf->publisher_bulk && (r->method & (NGX_HTTP_POST|NGX_HTTP_PUT)) && r->headers_in.content_length_n > (off_t) clcf->client_body_buffer_size;
+  if(cut_through) {
+    r->request_body_in_file_only = 1;
+  }
 
   rc = ngx_http_read_client_request_body(r, ngx_http_push_publisher_body_handler);
   if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
     return rc;
   }
+  if(cut_through && rc == NGX_AGAIN && r->request_body != NULL && r->request_body->rest > 0) {
+    ngx_http_push_cut_through_start(r);
+  }
   return NGX_DONE;
 }
 
+ngx_int_t ngx_http_push_stats_handler(ngx_http_request_t *r) {
+  static ngx_str_t                content_type = ngx_string("application/json");
+  static ngx_str_t                head = ngx_string("{\"partitions\": [");
+  static ngx_str_t                tail = ngx_string("]}" CRLF);
+  const ngx_str_t                *format = &NGX_HTTP_PUSH_PARTITION_STATS_JSON;
+  ngx_http_push_partition_stats_t stats;
+  ngx_buf_t                      *b;
+  ngx_uint_t                      i;
+  ngx_int_t                       rc;
+  
+  if(r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+    ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_ALLOW, &NGX_HTTP_PUSH_ALLOW_GET_OPTIONS);
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+  if((rc = ngx_http_discard_request_body(r)) != NGX_OK) {
+    return rc;
+  }
+  
+  //one template's worth of numbers per partition, plus separators
+  if ((b = ngx_create_temp_buf(r->pool, head.len + tail.len + NGX_HTTP_PUSH_MAX_SHM_PARTITIONS * (format->len + 2 + 22*NGX_INT64_LEN))) == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->last = ngx_cpymem(b->last, head.data, head.len);
+  for(i=0; ngx_http_push_store->partition_stats(i, &stats) == NGX_OK; i++) {
+    if(i > 0) {
+      b->last = ngx_cpymem(b->last, ", ", 2);
+    }
+    b->last = ngx_sprintf(b->last, (char *)format->data, i, stats.channels, stats.messages, stats.pages, stats.free_pages, stats.gc_active ? "true" : "false", stats.gc_runs, stats.gc_collected, stats.expired, stats.evicted_channels, stats.evicted_messages, stats.arena_pages, stats.arena_free_pages, stats.arena_free_runs, stats.arena_largest_free_run, stats.arena_requested, stats.arena_allocated, stats.large_message_pages, stats.large_message_free_pages, stats.gc_pause_last, stats.gc_pause_max, stats.gc_pause_total);
+  }
+  b->last = ngx_cpymem(b->last, tail.data, tail.len);
+  b->last_buf = 1;
+  
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_type = content_type;
+  r->headers_out.content_type_len = content_type.len;
+  r->headers_out.content_length_n = ngx_buf_size(b);
+  ngx_http_push_add_response_header(r, &NGX_HTTP_PUSH_HEADER_CACHE_CONTROL, &NGX_HTTP_PUSH_CACHE_CONTROL_VALUE);
+  
+  rc = ngx_http_send_header(r);
+  if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+  return ngx_http_output_filter(r, ngx_http_push_create_output_chain(b, r->pool, r->connection->log));
+}
+
 void ngx_http_push_copy_preallocated_buffer(ngx_buf_t *buf, ngx_buf_t *cbuf) {
   if (cbuf!=NULL) {
     ngx_memcpy(cbuf, buf, sizeof(*buf)); //overkill?
@@ -50,15 +50,25 @@ static void *ngx_http_push_create_loc_conf(ngx_conf_t *cf) {
   lcf->buffer_timeout=NGX_CONF_UNSET;
   lcf->max_messages=NGX_CONF_UNSET;
   lcf->min_messages=NGX_CONF_UNSET;
+  lcf->message_buffer_mode=NGX_CONF_UNSET;
   lcf->subscriber_concurrency=NGX_CONF_UNSET;
   lcf->subscriber_poll_mechanism=NGX_CONF_UNSET;
   lcf->subscriber_timeout=NGX_CONF_UNSET;
+  lcf->subscriber_ping_interval=NGX_CONF_UNSET;
+  lcf->subscriber_batch_max=NGX_CONF_UNSET;
   lcf->authorize_channel=NGX_CONF_UNSET;
   lcf->delete_oldest_received_message=NGX_CONF_UNSET;
   lcf->max_channel_id_length=NGX_CONF_UNSET;
   lcf->max_channel_subscribers=NGX_CONF_UNSET;
   lcf->ignore_queue_on_no_cache=NGX_CONF_UNSET;
   lcf->channel_timeout=NGX_CONF_UNSET;
+  lcf->prerendered_headers=NGX_CONF_UNSET;
+  lcf->cut_through=NGX_CONF_UNSET;
+  lcf->delivery_delay=NGX_CONF_UNSET_MSEC;
+  lcf->message_gzip=NGX_CONF_UNSET;
+  lcf->channel_id_delimiter.data=NULL;
+  lcf->publisher_bulk=NGX_CONF_UNSET;
+  lcf->prefix_wildcard=NGX_CONF_UNSET;
   lcf->channel_group.data=NULL;
   return lcf;
 }
@@ -68,9 +78,12 @@ static char *  ngx_http_push_merge_loc_conf(ngx_conf_t *cf, void *parent, void *
   ngx_conf_merge_sec_value(conf->buffer_timeout, prev->buffer_timeout, NGX_HTTP_PUSH_DEFAULT_BUFFER_TIMEOUT);
   ngx_conf_merge_value(conf->max_messages, prev->max_messages, NGX_HTTP_PUSH_DEFAULT_MAX_MESSAGES);
   ngx_conf_merge_value(conf->min_messages, prev->min_messages, NGX_HTTP_PUSH_DEFAULT_MIN_MESSAGES);
+  ngx_conf_merge_value(conf->message_buffer_mode, prev->message_buffer_mode, NGX_HTTP_PUSH_BUFFER_MODE_QUEUE);
   ngx_conf_merge_value(conf->subscriber_concurrency, prev->subscriber_concurrency, NGX_HTTP_PUSH_SUBSCRIBER_CONCURRENCY_BROADCAST);
   ngx_conf_merge_value(conf->subscriber_poll_mechanism, prev->subscriber_poll_mechanism, NGX_HTTP_PUSH_MECHANISM_LONGPOLL);
   ngx_conf_merge_sec_value(conf->subscriber_timeout, prev->subscriber_timeout, NGX_HTTP_PUSH_DEFAULT_SUBSCRIBER_TIMEOUT);
+  ngx_conf_merge_sec_value(conf->subscriber_ping_interval, prev->subscriber_ping_interval, NGX_HTTP_PUSH_DEFAULT_STREAM_PING_INTERVAL);
+  ngx_conf_merge_value(conf->subscriber_batch_max, prev->subscriber_batch_max, 1);
   ngx_conf_merge_value(conf->authorize_channel, prev->authorize_channel, 0);
   ngx_conf_merge_value(conf->delete_oldest_received_message, prev->delete_oldest_received_message, 0);
   ngx_conf_merge_value(conf->max_channel_id_length, prev->max_channel_id_length, NGX_HTTP_PUSH_MAX_CHANNEL_ID_LENGTH);
@@ -78,8 +91,19 @@ static char *  ngx_http_push_merge_loc_conf(ngx_conf_t *cf, void *parent, void *
   ngx_conf_merge_value(conf->ignore_queue_on_no_cache, prev->ignore_queue_on_no_cache, 0);
   ngx_conf_merge_value(conf->channel_timeout, prev->channel_timeout, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT);
   ngx_conf_merge_str_value(conf->channel_group, prev->channel_group, "");
+  ngx_conf_merge_value(conf->prerendered_headers, prev->prerendered_headers, 0);
+  ngx_conf_merge_value(conf->cut_through, prev->cut_through, 0);
+  ngx_conf_merge_msec_value(conf->delivery_delay, prev->delivery_delay, 0);
+  ngx_conf_merge_value(conf->message_gzip, prev->message_gzip, 0);
+  ngx_conf_merge_str_value(conf->channel_id_delimiter, prev->channel_id_delimiter, "");
+  ngx_conf_merge_value(conf->publisher_bulk, prev->publisher_bulk, 0);
+  ngx_conf_merge_value(conf->prefix_wildcard, prev->prefix_wildcard, 0);
   
   //sanity checks
+  if(conf->subscriber_batch_max < 1) {
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "push_subscriber_batch_max must be at least 1.");
+    return NGX_CONF_ERROR;
+  }
   if(conf->max_messages < conf->min_messages) {
     //min/max buffer size makes sense?
     ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "push_max_message_buffer_length cannot be smaller than push_min_message_buffer_length.");
@@ -140,6 +164,67 @@ static char *ngx_http_push_set_subscriber_concurrency(ngx_conf_t *cf, ngx_comman
   return NGX_CONF_OK;
 }
 
+static char *ngx_http_push_set_message_buffer_mode(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  static ngx_http_push_strval_t  mode[] = {
+    { "queue", NGX_HTTP_PUSH_BUFFER_MODE_QUEUE },
+    { "ring" , NGX_HTTP_PUSH_BUFFER_MODE_RING  },
+    { "latest", NGX_HTTP_PUSH_BUFFER_MODE_LATEST }
+  };
+  ngx_int_t                      *field = (ngx_int_t *) ((char *) conf + cmd->offset);
+  
+  if (*field != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  
+  ngx_str_t                   value = (((ngx_str_t *) cf->args->elts)[1]);
+  if(ngx_http_push_strval(value, mode, 3, field)!=NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "invalid push_message_buffer_mode value: %V", &value);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+static char *ngx_http_push_set_channel_index(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  static ngx_http_push_strval_t  index[] = {
+    { "rbtree", NGX_HTTP_PUSH_CHANNEL_INDEX_RBTREE },
+    { "hash"  , NGX_HTTP_PUSH_CHANNEL_INDEX_HASH   }
+  };
+  ngx_int_t                      *field = (ngx_int_t *) ((char *) conf + cmd->offset);
+  
+  if (*field != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  
+  ngx_str_t                   value = (((ngx_str_t *) cf->args->elts)[1]);
+  if(ngx_http_push_strval(value, index, 2, field)!=NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "invalid push_channel_index value: %V", &value);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
+static char *ngx_http_push_set_eviction_policy(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  static ngx_http_push_strval_t  policy[] = {
+    { "off", NGX_HTTP_PUSH_EVICTION_OFF },
+    { "lru", NGX_HTTP_PUSH_EVICTION_LRU }
+  };
+  ngx_int_t                      *field = (ngx_int_t *) ((char *) conf + cmd->offset);
+  
+  if (*field != NGX_CONF_UNSET) {
+    return "is duplicate";
+  }
+  
+  ngx_str_t                   value = (((ngx_str_t *) cf->args->elts)[1]);
+  if(ngx_http_push_strval(value, policy, 2, field)!=NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "invalid push_eviction_policy value: %V", &value);
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+}
+
 static char *ngx_http_push_publisher(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
   return ngx_http_push_setup_handler(cf, conf, &ngx_http_push_publisher_handler);
 }
@@ -147,7 +232,9 @@ static char *ngx_http_push_publisher(ngx_conf_t *cf, ngx_command_t *cmd, void *c
 static char *ngx_http_push_subscriber(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
   static ngx_http_push_strval_t  mech[] = {
     { "interval-poll", NGX_HTTP_PUSH_MECHANISM_INTERVALPOLL },
-    { "long-poll"    , NGX_HTTP_PUSH_MECHANISM_LONGPOLL     }  
+    { "long-poll"    , NGX_HTTP_PUSH_MECHANISM_LONGPOLL     },
+    { "eventsource"  , NGX_HTTP_PUSH_MECHANISM_EVENTSOURCE  },
+    { "websocket"    , NGX_HTTP_PUSH_MECHANISM_WEBSOCKET    }
   };
   ngx_int_t                      *field = (ngx_int_t *) ((char *) conf + cmd->offset);
   if (*field != NGX_CONF_UNSET) {
@@ -159,7 +246,7 @@ static char *ngx_http_push_subscriber(ngx_conf_t *cf, ngx_command_t *cmd, void *
   }
   else {
     ngx_str_t                   value = (((ngx_str_t *) cf->args->elts)[1]);
-    if(ngx_http_push_strval(value, mech, 2, field)!=NGX_OK) {
+    if(ngx_http_push_strval(value, mech, 4, field)!=NGX_OK) {
       ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "invalid push_subscriber value: %V", &value);
       return NGX_CONF_ERROR;
     }
@@ -168,6 +255,12 @@ static char *ngx_http_push_subscriber(ngx_conf_t *cf, ngx_command_t *cmd, void *
   return ngx_http_push_setup_handler(cf, conf, &ngx_http_push_subscriber_handler);
 }
 
+static char *ngx_http_push_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf) {
+  ngx_http_core_loc_conf_t       *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = &ngx_http_push_stats_handler;
+  return NGX_CONF_OK;
+}
+
 static void ngx_http_push_exit_worker(ngx_cycle_t *cycle) {
   ngx_http_push_store->exit_worker(cycle);
 }
@@ -226,6 +319,76 @@ static ngx_command_t  ngx_http_push_commands[] = {
       NGX_HTTP_MAIN_CONF_OFFSET,
       offsetof(ngx_http_push_main_conf_t, shm_size),
       NULL },
+
+    { ngx_string("push_shm_partitions"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, shm_partitions),
+      NULL },
+
+    { ngx_string("push_channel_index"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_push_set_channel_index,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, channel_index),
+      NULL },
+    
+    { ngx_string("push_gc_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, gc_interval),
+      NULL },
+    
+    { ngx_string("push_gc_batch_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, gc_batch_size),
+      NULL },
+    
+    { ngx_string("push_gc_high_watermark"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, gc_high_watermark),
+      NULL },
+    
+    { ngx_string("push_gc_low_watermark"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, gc_low_watermark),
+      NULL },
+    
+    { ngx_string("push_message_arena"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, message_arena),
+      NULL },
+    
+    { ngx_string("push_large_message_memory"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, large_message_memory),
+      NULL },
+    
+    { ngx_string("push_eviction_policy"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_push_set_eviction_policy,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, eviction_policy),
+      NULL },
+    
+    { ngx_string("push_eviction_min_idle"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_push_main_conf_t, eviction_min_idle),
+      NULL },
     
   { ngx_string("push_min_message_buffer_length"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -262,6 +425,48 @@ static ngx_command_t  ngx_http_push_commands[] = {
       0,
       NULL },
   
+  { ngx_string("push_delivery_delay"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, delivery_delay),
+      NULL },
+  
+  { ngx_string("push_message_gzip"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, message_gzip),
+      NULL },
+  
+  { ngx_string("push_subscriber_prefix_wildcard"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, prefix_wildcard),
+      NULL },
+  
+  { ngx_string("push_publisher_bulk"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, publisher_bulk),
+      NULL },
+  
+  { ngx_string("push_publisher_cut_through"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, cut_through),
+      NULL },
+  
+  { ngx_string("push_stats"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_push_stats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+  
   { ngx_string("push_subscriber"),
       NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
       ngx_http_push_subscriber,
@@ -283,6 +488,27 @@ static ngx_command_t  ngx_http_push_commands[] = {
       offsetof(ngx_http_push_loc_conf_t, subscriber_timeout),
       NULL },
     
+    { ngx_string("push_subscriber_ping_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, subscriber_ping_interval),
+      NULL },
+    
+    { ngx_string("push_subscriber_batch_max"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, subscriber_batch_max),
+      NULL },
+    
+    { ngx_string("push_subscriber_prerendered_headers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, prerendered_headers),
+      NULL },
+    
   { ngx_string("push_authorized_channels_only"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -290,6 +516,13 @@ static ngx_command_t  ngx_http_push_commands[] = {
       offsetof(ngx_http_push_loc_conf_t, authorize_channel),
       NULL },
     
+  { ngx_string("push_message_buffer_mode"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_push_set_message_buffer_mode,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, message_buffer_mode),
+      NULL },
+    
   { ngx_string("push_store_messages"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_http_push_store_messages_directive,
@@ -304,6 +537,13 @@ static ngx_command_t  ngx_http_push_commands[] = {
       offsetof(ngx_http_push_loc_conf_t, channel_group),
       NULL },
     
+  { ngx_string("push_channel_id_split_delimiter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_push_loc_conf_t, channel_id_delimiter),
+      NULL },
+    
   { ngx_string("push_max_channel_id_length"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_num_slot,
@@ -1,6 +1,16 @@
 //on with the declarations
 typedef struct {
   size_t                          shm_size;
+  ngx_int_t                       shm_partitions;
+  ngx_int_t                       channel_index;
+  ngx_msec_t                      gc_interval;
+  ngx_int_t                       gc_batch_size;
+  ngx_int_t                       gc_high_watermark; //percent of a partition in use
+  ngx_int_t                       gc_low_watermark;
+  ngx_int_t                       eviction_policy;
+  time_t                          eviction_min_idle;
+  ngx_int_t                       message_arena; //percent of each partition set aside for messages
+  size_t                          large_message_memory; //for bodies too big for client_body_buffer_size. all partitions together
 } ngx_http_push_main_conf_t;
 
 typedef struct {
@@ -15,20 +25,50 @@ typedef struct {
   ngx_int_t                       tag;  //used in conjunction with message_time if more than one message have the same time.
 } ngx_http_push_msg_id_t;
 
+//a message body shared by the messages of a multi-channel publish in one partition. the body follows, then its gzipped variant.
+typedef struct {
+  ngx_uint_t                      refcount; //one per message, and the publisher's while it's publishing. changed with the partition locked
+  size_t                          block_size;
+  size_t                          len; //0 if it's in large message memory instead
+  size_t                          gzip_len; //0 if there's no gzipped variant
+  off_t                           file_pos; //in the partition's large message memory
+  off_t                           file_last;
+  unsigned                        in_memfd:1;
+} ngx_http_push_msg_body_t;
+
 //message queue
 typedef struct {
   ngx_queue_t                     queue; //this MUST be first.
   ngx_str_t                       content_type;
   //  ngx_str_t                       charset;
-  ngx_buf_t                      *buf;
+  ngx_str_t                       body; //the body, or the name of the temp file holding it. both live in the message's own block.
+  ngx_str_t                       gzip_body; //the body precompressed, right after it in the block (or in a block of its own). empty if there's none
+  ngx_http_push_msg_body_t       *shared_body; //where the body is instead, if it's shared with other messages. NULL otherwise
+  off_t                           body_file_pos; //in the temp file, or the partition's large message memory
+  off_t                           body_file_last;
+  unsigned                        body_in_file:1;
+  unsigned                        body_in_memfd:1; //in the partition's large message memory. body is empty
+  unsigned                        gzip_separate:1; //gzip_body is a block of its own, added once the body was all in
+  size_t                          block_size; //bytes allocated for the message, content type and body together
   time_t                          expires;
   ngx_uint_t                      delete_oldest_received_min_messages; //NGX_MAX_UINT32_VALUE for 'never'
   time_t                          message_time; //tag message by time
   ngx_int_t                       message_tag;  //used in conjunction with message_time if more than one message have the same time.
-  ngx_int_t                       refcount;
+  uint64_t                        seq; //per-channel sequence number. in ring channels, also the message_tag
+  ngx_atomic_t                    refcount; //being in the channel's queue counts as a reference. changed atomically, without the zone lock.
 } ngx_http_push_msg_t;
 
+//one message of a bulk publish
+typedef struct {
+  ngx_str_t                       channel_id;
+  ngx_str_t                       content_type;
+  off_t                           body_pos; //where the body starts in the request body. it's copied from there into place
+  size_t                          body_len;
+  ngx_int_t                       status; //NGX_HTTP_PUSH_MESSAGE_RECEIVED or _QUEUED once it's published, NGX_ERROR if it couldn't be
+} ngx_http_push_bulk_record_t;
+
 typedef struct ngx_http_push_subscriber_cleanup_s ngx_http_push_subscriber_cleanup_t;
+typedef struct ngx_http_push_multi_subscriber_s ngx_http_push_multi_subscriber_t;
 
 //subscriber request queue
 typedef struct {
@@ -36,6 +76,7 @@ typedef struct {
   ngx_http_request_t             *request;
   ngx_http_push_subscriber_cleanup_t *clndata; 
   ngx_event_t                     event;
+  ngx_http_push_multi_subscriber_t *multi; //NULL unless the request is waiting on several channels
 } ngx_http_push_subscriber_t;
 
 typedef struct {
@@ -51,22 +92,114 @@ typedef struct {
   ngx_str_t                       id;
   ngx_http_push_msg_t            *message_queue;
   ngx_uint_t                      messages;
+  uint64_t                        last_seq; //sequence number of the last message created
+  ngx_http_push_msg_t           **ring; //queued messages indexed by seq % ring_size, or NULL
+  ngx_uint_t                      ring_size;
   ngx_http_push_pid_queue_t      *workers_with_subscribers;
-  ngx_uint_t                      subscribers;
+  ngx_atomic_t                    subscribers; //changed atomically, without the zone lock.
   time_t                          last_seen;
   time_t                          expires;
+  ngx_queue_t                     gc_queue; //all of the partition's channels, in the order the garbage collector visits them
+  time_t                          expiry_due; //when the expiry index next looks at this channel
+  ngx_uint_t                      expiry_index; //position in the expiry index
+  ngx_queue_t                     lru_queue; //least recently used first
+  time_t                          last_used; //last time a publisher or subscriber looked this channel up
+  ngx_msec_t                      delivery_due; //when a worker's timer tells subscribers what's been published. 0 if nothing's waiting
+  ngx_queue_t                     delivery_queue; //in the partition's delayed_channels while delivery_due is set
 } ngx_http_push_channel_t; 
 
+//a channel's delayed delivery, waiting on its timer in the worker that published first
+typedef struct {
+  ngx_event_t                     timer;
+  ngx_str_t                       channel_id; //the channel may be gone by the time it goes off
+  ngx_msec_t                      due; //the channel's delivery_due when it was set
+} ngx_http_push_delayed_delivery_t;
+
+//one worker's response to all of a channel's waiting subscribers. lives in ngx_http_push_pool until the last of them is done.
+typedef struct {
+  ngx_int_t                      use_count;
+  ngx_buf_t                     *buf;
+  ngx_http_push_msg_t           *msg; //what buf points into
+  ngx_str_t                     *header; //prerendered status line and headers, or NULL
+  ngx_str_t                     *gzip_header; //the same, for the precompressed body
+} ngx_http_push_shared_response_t;
+
+//a subscriber getting a publish relayed to it while the body's still coming in
+typedef struct {
+  ngx_http_request_t            *request; //NULL once it's gone
+  ngx_http_cleanup_t            *cln;
+  ngx_buf_t                     *body; //the whole message body. each relayed part is a slice of it
+} ngx_http_push_cut_through_subscriber_t;
+
+//a cut-through publish. lives in ngx_http_push_pool, since the publisher and its subscribers may go away in any order.
+typedef struct {
+  ngx_http_request_t            *publisher; //NULL once it's gone
+  ngx_http_cleanup_t            *cln;
+  ngx_http_event_handler_pt      read_body; //nginx's own request body reader
+  ngx_http_push_msg_t           *msg;
+  off_t                          size;
+  off_t                          relayed; //bytes written to the message so far. all but the last one are passed on as they come
+  time_t                         message_time; //the tags the relayed responses went out with
+  ngx_int_t                      message_tag;
+  ngx_http_push_cut_through_subscriber_t *subscribers; //in the publisher's pool
+  ngx_uint_t                     subscriber_count;
+  unsigned                       reading:1; //inside read_body, which may finish or free the publisher
+  unsigned                       done:1;
+} ngx_http_push_cut_through_t;
+
+//a message rendered as an eventsource event or a websocket frame, shared by the streams in this worker it's sent to.
+//the frame itself follows.
+typedef struct {
+  ngx_int_t                      use_count;
+  ngx_http_push_msg_id_t         id;
+  size_t                         len;
+} ngx_http_push_stream_frame_t;
+
+//what's been read of the frame a websocket client is sending
+typedef struct {
+  u_char                         header[14];
+  size_t                         header_len;
+  uint64_t                       payload_left;
+  uint64_t                       payload_read;
+  u_char                         control[125]; //ping and close payloads, to be echoed back
+} ngx_http_push_websocket_t;
+
+//an eventsource or websocket subscriber's stream. lives in its request's pool.
+typedef struct {
+  ngx_http_push_channel_t       *channel;
+  ngx_http_push_websocket_t     *websocket; //NULL for eventsource
+  ngx_http_push_msg_id_t         last; //of the last message sent
+  ngx_chain_t                   *busy; //frames and pings on their way out, oldest first
+  ngx_chain_t                  **busy_end;
+  ngx_chain_t                   *free;
+  ngx_uint_t                     pending;
+  ngx_event_t                    ping;
+} ngx_http_push_stream_t;
+
 //cleaning supplies
 struct ngx_http_push_subscriber_cleanup_s {
   ngx_http_push_subscriber_t    *subscriber;
   ngx_http_push_channel_t       *channel;
-  ngx_int_t                     *buf_use_count;
-  ngx_buf_t                     *buf;
+  ngx_http_push_shared_response_t *shared;
   ngx_chain_t                   *rchain;
   ngx_pool_t                    *rpool;
 };
 
+//a long-poll request waiting on several channels at once. it has one cleanup and one timer, and a subscriber
+//queued on each channel. lives in the request's pool.
+struct ngx_http_push_multi_subscriber_s {
+  ngx_http_request_t            *request;
+  ngx_uint_t                     n;
+  ngx_str_t                     *channel_ids; //with the channel group
+  ngx_str_t                     *names; //as the client knows them
+  ngx_http_push_msg_id_t        *msg_ids; //where the client is in each channel
+  ngx_http_push_channel_t      **channels;
+  ngx_http_push_subscriber_t   **subscribers; //NULL once it's off the channel's queue
+  ngx_http_push_msg_t          **msgs; //room for a response's worth of messages,
+  ngx_str_t                    **msg_names; //and which channel each is from
+  ngx_event_t                    timeout;
+};
+
 //garbage collecting goodness
 typedef struct {
   ngx_queue_t                     queue;
@@ -75,7 +208,8 @@ typedef struct {
 
 //messages to worker processes
 typedef struct {
-  ngx_queue_t                     queue;
+  ngx_atomic_t                    seq; //mailbox slot sequence. tells producers and the consumer whose turn it is
+  ngx_pid_t                       claimant; //the producer that claimed the slot, until it's read
   ngx_http_push_msg_t            *msg; //->shared memory
   ngx_int_t                       status_code;
   ngx_pid_t                       pid; 
@@ -83,27 +217,154 @@ typedef struct {
   ngx_http_push_subscriber_t     *subscriber_sentinel; //->a worker's local pool
 } ngx_http_push_worker_msg_t;
 
+#define NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE 256 //must be a power of 2
+
+//a worker's incoming messages. bounded lock-free ring, many producers and one consumer: the worker itself.
+typedef struct {
+  ngx_atomic_t                    tail; //next slot to claim. producers race for it
+  ngx_atomic_t                    head; //next slot to read. consumer only
+  ngx_atomic_t                    alerted; //someone already woke the worker up, and it hasn't started reading yet
+  ngx_atomic_t                    overflowed; //messages in overflow. senders go straight there while there are any, to keep them in order
+  ngx_queue_t                     overflow; //what didn't fit in the ring, in the IPC partition's slab pool. locked with it
+  ngx_http_push_worker_msg_t      slots[NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE];
+} ngx_http_push_worker_mailbox_t;
+
+//a worker message that didn't fit in its mailbox's ring
+typedef struct {
+  ngx_queue_t                     queue;
+  ngx_http_push_worker_msg_t      wmsg;
+} ngx_http_push_worker_msg_overflow_t;
+
+//open-addressing channel index
+typedef struct {
+  uint32_t                        hash;
+  uint32_t                        dist; //1 + distance from the home slot. 0 means empty
+  ngx_http_push_channel_t        *channel;
+} ngx_http_push_hashtable_slot_t;
+
 typedef struct {
-  ngx_queue_t                    queue;
-  ngx_rwlock_t                   lock;
-} ngx_http_push_worker_msg_sentinel_t;
+  ngx_http_push_hashtable_slot_t *slots;
+  ngx_uint_t                      size; //always a power of 2
+  ngx_http_push_hashtable_slot_t *old_slots; //the table before it last grew, while its channels are moved over. or NULL
+  ngx_uint_t                      old_size;
+  ngx_uint_t                      migrated; //old slots moved over so far
+  ngx_uint_t                      count; //in both tables
+  ngx_uint_t                      gc_cursor;
+  uint64_t                        key[2]; //hash key, random per zone
+} ngx_http_push_hashtable_t;
 
-//shared memory
+//channels by when they next need cleaning up. a binary min-heap.
+typedef struct {
+  ngx_http_push_channel_t       **channels;
+  ngx_uint_t                      size;
+  ngx_uint_t                      count;
+} ngx_http_push_expiry_heap_t;
+
+//channel id prefixes with prefix channels. a radix tree.
+typedef struct ngx_http_push_prefix_node_s ngx_http_push_prefix_node_t;
+struct ngx_http_push_prefix_node_s {
+  ngx_http_push_prefix_node_t    *children;
+  ngx_http_push_prefix_node_t    *next; //sibling
+  ngx_flag_t                      subscribed; //there's a prefix channel for everything up to and including this node
+  size_t                          len;
+  u_char                         *label; //follows the node
+};
+
+//message arena, in pages. one entry per page
+#define NGX_HTTP_PUSH_ARENA_CLASSES 64
+
+typedef struct {
+  uint32_t                        run; //length of the run, on its first and last page
+  uint32_t                        head; //first page of the run. on the last page, and on every page of small-object runs
+  uint32_t                        next; //first pages of neighbouring runs on the free list or a size class's partial list
+  uint32_t                        prev;
+  uint32_t                        free_chunk; //small-object runs: offset of the first free chunk, plus 1. 0 when full
+  uint16_t                        size_class;
+  uint16_t                        used; //small-object runs: chunks handed out
+} ngx_http_push_arena_page_t;
+
+typedef struct {
+  u_char                         *start;
+  ngx_uint_t                      pages;
+  ngx_http_push_arena_page_t     *page;
+  uint32_t                        free_runs;
+  uint32_t                        partial[NGX_HTTP_PUSH_ARENA_CLASSES]; //runs with free chunks, by size class
+  uint32_t                        class_size[NGX_HTTP_PUSH_ARENA_CLASSES];
+  uint16_t                        class_pages[NGX_HTTP_PUSH_ARENA_CLASSES];
+  ngx_uint_t                      classes;
+  ngx_uint_t                      free_pages;
+  ngx_uint_t                      free_run_count;
+  size_t                          requested; //bytes asked for by everything allocated
+  size_t                          allocated; //bytes actually taken up by it
+} ngx_http_push_arena_t;
+
+//shared memory. one of these per partition, each in its own zone with its own slab pool and lock.
 typedef struct {
   ngx_rbtree_t                          tree;
   ngx_uint_t                            channels; //# of channels being used
-  ngx_uint_t                            messages; //# of channels being used
-  ngx_http_push_worker_msg_sentinel_t  *ipc; //interprocess stuff
+  ngx_uint_t                            messages; //# of messages being used
+  ngx_uint_t                            partition; //index of this partition
+  ngx_http_push_hashtable_t            *hashtable; //channel index, when not using the rbtree
+  ngx_http_push_expiry_heap_t          *expiry; //channels by expiration time
+  ngx_http_push_arena_t                *arena; //where messages go, if set aside
+  ngx_http_push_arena_t                *large_messages; //page map of the partition's large message memory, if any
+  ngx_uint_t                            expired; //channels deleted by the expiry index
+  ngx_queue_t                           lru_channels;
+  ngx_uint_t                            evicted_channels; //channels whose messages were evicted to make room
+  ngx_uint_t                            evicted_messages;
+  ngx_http_push_worker_mailbox_t      **ipc; //worker mailboxes by process slot. only used in partition 0
+  ngx_http_push_prefix_node_t          *prefixes; //prefix channel index. only used in partition 0
+  ngx_rwlock_t                          prefix_lock; //the index's own. it's taken before any partition's lock, never after
+  ngx_atomic_t                          prefix_count; //prefixes in the index. publishers don't look any further when it's 0
+  ngx_atomic_t                          prefix_generation; //changes with the index. workers walk their own copies of it, made when it changes
+  ngx_uint_t                            prefix_channels_deleted; //from this partition, since the gc timer last took their prefixes out of the index
+  ngx_queue_t                           gc_channels;
+  ngx_queue_t                           delayed_channels; //channels with a delayed delivery coming up. the gc timer delivers the overdue ones
+  ngx_queue_t                          *gc_cursor; //where the garbage collector's next batch starts
+  ngx_flag_t                            gc_active; //between the high and low watermarks
+  ngx_uint_t                            gc_runs;
+  ngx_uint_t                            gc_collected; //channels deleted by the garbage collector
+  uint64_t                              gc_pause_last; //microseconds the partition was locked for a batch
+  uint64_t                              gc_pause_max;
+  uint64_t                              gc_pause_total;
 } ngx_http_push_shm_data_t;
 
+//a snapshot of one partition, for push_stats
+typedef struct {
+  ngx_uint_t                      channels;
+  ngx_uint_t                      messages;
+  ngx_uint_t                      pages;
+  ngx_uint_t                      free_pages;
+  ngx_flag_t                      gc_active;
+  ngx_uint_t                      gc_runs;
+  ngx_uint_t                      gc_collected;
+  ngx_uint_t                      expired;
+  ngx_uint_t                      evicted_channels;
+  ngx_uint_t                      evicted_messages;
+  ngx_uint_t                      arena_pages;
+  ngx_uint_t                      arena_free_pages;
+  ngx_uint_t                      arena_free_runs;
+  ngx_uint_t                      arena_largest_free_run;
+  size_t                          arena_requested;
+  size_t                          arena_allocated;
+  ngx_uint_t                      large_message_pages;
+  ngx_uint_t                      large_message_free_pages;
+  uint64_t                        gc_pause_last;
+  uint64_t                        gc_pause_max;
+  uint64_t                        gc_pause_total;
+} ngx_http_push_partition_stats_t;
+
 typedef struct {
   ngx_int_t                       index;
   time_t                          buffer_timeout;
   ngx_int_t                       min_messages;
   ngx_int_t                       max_messages;
+  ngx_int_t                       message_buffer_mode;
   ngx_int_t                       subscriber_concurrency;
   ngx_int_t                       subscriber_poll_mechanism;
   time_t                          subscriber_timeout;
+  time_t                          subscriber_ping_interval;
+  ngx_int_t                       subscriber_batch_max;
   ngx_int_t                       authorize_channel;
   ngx_int_t                       delete_oldest_received_message;
   ngx_str_t                       channel_group;
@@ -111,6 +372,13 @@ typedef struct {
   ngx_int_t                       max_channel_subscribers;
   ngx_int_t                       ignore_queue_on_no_cache;
   time_t                          channel_timeout;
+  ngx_int_t                       prerendered_headers;
+  ngx_int_t                       cut_through;
+  ngx_msec_t                      delivery_delay;
+  ngx_int_t                       message_gzip;
+  ngx_str_t                       channel_id_delimiter;
+  ngx_int_t                       publisher_bulk;
+  ngx_int_t                       prefix_wildcard;
 } ngx_http_push_loc_conf_t;
 
 typedef struct {
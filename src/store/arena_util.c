@@ -0,0 +1,272 @@
+#include <ngx_http_push_module.h>
+#include "arena_util.h"
+
+/* Message arena: a region of a partition set aside for messages, so big bodies and small channel
+ * bookkeeping don't fragment each other.
+ * Pages are handed out in runs. Free runs are kept on one list, and coalesce with their neighbours
+ * when freed; a run's length and state are recorded on its first and last page. Objects above
+ * NGX_HTTP_PUSH_ARENA_MAX_SMALL_SIZE get a run to themselves. Smaller ones are rounded up to one
+ * of four size classes per power of 2 (at most 25% waste, usually much less, versus up to 50% for
+ * the slab allocator's power-of-2 classes), and packed into runs of same-size chunks.
+ * All functions assume the zone is locked. */
+
+#define ngx_http_push_arena_page_addr(arena, i) ((arena)->start + ((size_t) (i) << ngx_pagesize_shift))
+
+static void ngx_http_push_arena_link(ngx_http_push_arena_t *arena, uint32_t *list, uint32_t i) {
+  arena->page[i].prev = NGX_HTTP_PUSH_ARENA_NONE;
+  arena->page[i].next = *list;
+  if(*list != NGX_HTTP_PUSH_ARENA_NONE) {
+    arena->page[*list].prev = i;
+  }
+  *list = i;
+}
+
+static void ngx_http_push_arena_unlink(ngx_http_push_arena_t *arena, uint32_t *list, uint32_t i) {
+  ngx_http_push_arena_page_t     *page = &arena->page[i];
+  if(page->prev != NGX_HTTP_PUSH_ARENA_NONE) {
+    arena->page[page->prev].next = page->next;
+  }
+  else {
+    *list = page->next;
+  }
+  if(page->next != NGX_HTTP_PUSH_ARENA_NONE) {
+    arena->page[page->next].prev = page->prev;
+  }
+}
+
+//mark a run, and note its length on both ends
+static void ngx_http_push_arena_mark_run(ngx_http_push_arena_t *arena, uint32_t i, uint32_t run, uint16_t size_class) {
+  ngx_http_push_arena_page_t     *first = &arena->page[i], *last = &arena->page[i + run - 1];
+  first->run = run;
+  first->head = i;
+  first->size_class = size_class;
+  last->run = run;
+  last->head = i;
+  last->size_class = size_class;
+}
+
+static void ngx_http_push_arena_add_free_run(ngx_http_push_arena_t *arena, uint32_t i, uint32_t run) {
+  ngx_http_push_arena_mark_run(arena, i, run, NGX_HTTP_PUSH_ARENA_FREE);
+  ngx_http_push_arena_link(arena, &arena->free_runs, i);
+  arena->free_pages += run;
+  arena->free_run_count++;
+}
+
+static void ngx_http_push_arena_remove_free_run(ngx_http_push_arena_t *arena, uint32_t i) {
+  ngx_http_push_arena_unlink(arena, &arena->free_runs, i);
+  arena->free_pages -= arena->page[i].run;
+  arena->free_run_count--;
+}
+
+//best fit. returns the first page, or NGX_HTTP_PUSH_ARENA_NONE
+static uint32_t ngx_http_push_arena_alloc_run(ngx_http_push_arena_t *arena, uint32_t run, uint16_t size_class) {
+  uint32_t                        i, best = NGX_HTTP_PUSH_ARENA_NONE;
+  for(i = arena->free_runs; i != NGX_HTTP_PUSH_ARENA_NONE; i = arena->page[i].next) {
+    if(arena->page[i].run >= run && (best == NGX_HTTP_PUSH_ARENA_NONE || arena->page[i].run < arena->page[best].run)) {
+      best = i;
+      if(arena->page[i].run == run) {
+        break;
+      }
+    }
+  }
+  if(best == NGX_HTTP_PUSH_ARENA_NONE) {
+    return best;
+  }
+  ngx_http_push_arena_remove_free_run(arena, best);
+  if(arena->page[best].run > run) {
+    ngx_http_push_arena_add_free_run(arena, best + run, arena->page[best].run - run);
+  }
+  ngx_http_push_arena_mark_run(arena, best, run, size_class);
+  return best;
+}
+
+static void ngx_http_push_arena_free_run(ngx_http_push_arena_t *arena, uint32_t i, uint32_t run) {
+  uint32_t                        prev;
+  if(i > 0 && arena->page[i - 1].size_class == NGX_HTTP_PUSH_ARENA_FREE) {
+    prev = arena->page[i - 1].head;
+    ngx_http_push_arena_remove_free_run(arena, prev);
+    run += arena->page[prev].run;
+    i = prev;
+  }
+  if(i + run < arena->pages && arena->page[i + run].size_class == NGX_HTTP_PUSH_ARENA_FREE) {
+    ngx_http_push_arena_remove_free_run(arena, i + run);
+    run += arena->page[i + run].run;
+  }
+  ngx_http_push_arena_add_free_run(arena, i, run);
+}
+
+static void ngx_http_push_arena_init_classes(ngx_http_push_arena_t *arena) {
+  size_t                          size, step, run_bytes;
+  ngx_uint_t                      c, pages;
+  for(c = 0, size = NGX_HTTP_PUSH_ARENA_MIN_SIZE; size <= NGX_HTTP_PUSH_ARENA_MAX_SMALL_SIZE && c < NGX_HTTP_PUSH_ARENA_CLASSES; c++, size += step) {
+    arena->class_size[c] = (uint32_t) size;
+    arena->partial[c] = NGX_HTTP_PUSH_ARENA_NONE;
+    //fewest pages that waste no more than an eighth of the run
+    for(pages = 1; pages < NGX_HTTP_PUSH_ARENA_MAX_RUN_PAGES; pages++) {
+      run_bytes = pages << ngx_pagesize_shift;
+      if(run_bytes >= size && (run_bytes % size) * 8 <= run_bytes) {
+        break;
+      }
+    }
+    arena->class_pages[c] = (uint16_t) pages;
+    //four classes per power of 2
+    for(step = 1; step * 8 <= size; step <<= 1) { /* void */ }
+  }
+  arena->classes = c;
+}
+
+//with map_only, the pages are somewhere else -- this just keeps track of them, by index.
+ngx_http_push_arena_t *ngx_http_push_arena_create_locked(ngx_shm_zone_t *shm_zone, size_t size, ngx_int_t map_only) {
+  ngx_http_push_arena_t          *arena;
+  ngx_uint_t                      pages = size >> ngx_pagesize_shift;
+  if(pages < NGX_HTTP_PUSH_ARENA_MAX_RUN_PAGES) {
+    return NULL;
+  }
+  if((arena = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*arena), "message arena"))==NULL) {
+    return NULL;
+  }
+  if((arena->page = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*arena->page) * pages, "message arena page map"))==NULL) {
+    ngx_http_push_store->free_locked(arena);
+    return NULL;
+  }
+  //big enough to always come back page-aligned
+  if(map_only) {
+    arena->start = NULL;
+  }
+  else if((arena->start = ngx_http_push_store->alloc_locked(shm_zone, pages << ngx_pagesize_shift, "message arena pages"))==NULL) {
+    ngx_http_push_store->free_locked(arena->page);
+    ngx_http_push_store->free_locked(arena);
+    return NULL;
+  }
+  arena->pages = pages;
+  arena->free_runs = NGX_HTTP_PUSH_ARENA_NONE;
+  arena->free_pages = 0;
+  arena->free_run_count = 0;
+  arena->requested = 0;
+  arena->allocated = 0;
+  ngx_http_push_arena_init_classes(arena);
+  ngx_http_push_arena_add_free_run(arena, 0, (uint32_t) pages);
+  return arena;
+}
+
+static ngx_int_t ngx_http_push_arena_size_class(ngx_http_push_arena_t *arena, size_t size) {
+  ngx_uint_t                      lo = 0, hi = arena->classes, mid;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(arena->class_size[mid] < size) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo < arena->classes ? (ngx_int_t) lo : NGX_ERROR;
+}
+
+void *ngx_http_push_arena_alloc_locked(ngx_http_push_arena_t *arena, size_t size) {
+  ngx_int_t                       c = ngx_http_push_arena_size_class(arena, size);
+  ngx_http_push_arena_page_t     *head;
+  uint32_t                        i, j, chunks, off;
+  u_char                         *p;
+
+  if(c == NGX_ERROR) {
+    //large object
+    uint32_t                      run = (uint32_t) ((size + ngx_pagesize - 1) >> ngx_pagesize_shift);
+    if((i = ngx_http_push_arena_alloc_run(arena, run, NGX_HTTP_PUSH_ARENA_LARGE)) == NGX_HTTP_PUSH_ARENA_NONE) {
+      return NULL;
+    }
+    arena->requested += size;
+    arena->allocated += (size_t) run << ngx_pagesize_shift;
+    return ngx_http_push_arena_page_addr(arena, i);
+  }
+
+  if((i = arena->partial[c]) == NGX_HTTP_PUSH_ARENA_NONE) {
+    //new run, every chunk on its free list
+    if((i = ngx_http_push_arena_alloc_run(arena, arena->class_pages[c], (uint16_t) c)) == NGX_HTTP_PUSH_ARENA_NONE) {
+      return NULL;
+    }
+    for(j = 1; j < arena->class_pages[c]; j++) {
+      arena->page[i + j].head = i;
+      arena->page[i + j].size_class = (uint16_t) c;
+    }
+    chunks = (uint32_t) (((size_t) arena->class_pages[c] << ngx_pagesize_shift) / arena->class_size[c]);
+    p = ngx_http_push_arena_page_addr(arena, i);
+    for(j = 0; j < chunks; j++) {
+      *(uint32_t *) (p + j * arena->class_size[c]) = (j + 1 < chunks) ? (j + 1) * arena->class_size[c] + 1 : 0;
+    }
+    arena->page[i].free_chunk = 1;
+    arena->page[i].used = 0;
+    ngx_http_push_arena_link(arena, &arena->partial[c], i);
+  }
+
+  head = &arena->page[i];
+  off = head->free_chunk - 1;
+  p = ngx_http_push_arena_page_addr(arena, i) + off;
+  head->free_chunk = *(uint32_t *) p;
+  head->used++;
+  if(head->free_chunk == 0) {
+    //full
+    ngx_http_push_arena_unlink(arena, &arena->partial[c], i);
+  }
+  arena->requested += size;
+  arena->allocated += arena->class_size[c];
+  return p;
+}
+
+//a run of whole pages, by index. NGX_HTTP_PUSH_ARENA_NONE if there's no room.
+uint32_t ngx_http_push_arena_alloc_pages_locked(ngx_http_push_arena_t *arena, size_t size) {
+  uint32_t                        run = (uint32_t) ((size + ngx_pagesize - 1) >> ngx_pagesize_shift), i;
+  if(run == 0 || (i = ngx_http_push_arena_alloc_run(arena, run, NGX_HTTP_PUSH_ARENA_LARGE)) == NGX_HTTP_PUSH_ARENA_NONE) {
+    return NGX_HTTP_PUSH_ARENA_NONE;
+  }
+  arena->requested += size;
+  arena->allocated += (size_t) run << ngx_pagesize_shift;
+  return i;
+}
+
+void ngx_http_push_arena_free_pages_locked(ngx_http_push_arena_t *arena, uint32_t i, size_t size) {
+  arena->requested -= size;
+  arena->allocated -= (size_t) arena->page[i].run << ngx_pagesize_shift;
+  ngx_http_push_arena_free_run(arena, i, arena->page[i].run);
+}
+
+void ngx_http_push_arena_free_locked(ngx_http_push_arena_t *arena, void *ptr, size_t size) {
+  uint32_t                        i = arena->page[((u_char *) ptr - arena->start) >> ngx_pagesize_shift].head;
+  ngx_http_push_arena_page_t     *head = &arena->page[i];
+  uint16_t                        c = head->size_class;
+  u_char                         *p = ptr;
+
+  arena->requested -= size;
+  if(c == NGX_HTTP_PUSH_ARENA_LARGE) {
+    arena->allocated -= (size_t) head->run << ngx_pagesize_shift;
+    ngx_http_push_arena_free_run(arena, i, head->run);
+    return;
+  }
+
+  arena->allocated -= arena->class_size[c];
+  if(head->free_chunk == 0) {
+    //was full, so it's not on the partial list
+    ngx_http_push_arena_link(arena, &arena->partial[c], i);
+  }
+  *(uint32_t *) p = head->free_chunk;
+  head->free_chunk = (uint32_t) (p - ngx_http_push_arena_page_addr(arena, i)) + 1;
+  if(--head->used == 0) {
+    ngx_http_push_arena_unlink(arena, &arena->partial[c], i);
+    ngx_http_push_arena_free_run(arena, i, arena->class_pages[c]);
+  }
+}
+
+void ngx_http_push_arena_stats_locked(ngx_http_push_arena_t *arena, ngx_http_push_partition_stats_t *stats) {
+  uint32_t                        i;
+  stats->arena_pages = arena->pages;
+  stats->arena_free_pages = arena->free_pages;
+  stats->arena_free_runs = arena->free_run_count;
+  stats->arena_largest_free_run = 0;
+  for(i = arena->free_runs; i != NGX_HTTP_PUSH_ARENA_NONE; i = arena->page[i].next) {
+    if(arena->page[i].run > stats->arena_largest_free_run) {
+      stats->arena_largest_free_run = arena->page[i].run;
+    }
+  }
+  stats->arena_requested = arena->requested;
+  stats->arena_allocated = arena->allocated;
+}
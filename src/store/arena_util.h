@@ -0,0 +1,13 @@
+ngx_http_push_arena_t *ngx_http_push_arena_create_locked(ngx_shm_zone_t *shm_zone, size_t size, ngx_int_t map_only);
+uint32_t ngx_http_push_arena_alloc_pages_locked(ngx_http_push_arena_t *arena, size_t size);
+void ngx_http_push_arena_free_pages_locked(ngx_http_push_arena_t *arena, uint32_t page, size_t size);
+void *ngx_http_push_arena_alloc_locked(ngx_http_push_arena_t *arena, size_t size);
+void ngx_http_push_arena_free_locked(ngx_http_push_arena_t *arena, void *p, size_t size);
+void ngx_http_push_arena_stats_locked(ngx_http_push_arena_t *arena, ngx_http_push_partition_stats_t *stats);
+#define ngx_http_push_arena_owns(arena, p) ((u_char *) (p) >= (arena)->start && (u_char *) (p) < (arena)->start + ((arena)->pages << ngx_pagesize_shift))
+#define NGX_HTTP_PUSH_ARENA_MIN_SIZE 64
+#define NGX_HTTP_PUSH_ARENA_MAX_SMALL_SIZE 16384 //bigger objects get their own run of pages
+#define NGX_HTTP_PUSH_ARENA_MAX_RUN_PAGES 8 //most pages a small-object run spans
+#define NGX_HTTP_PUSH_ARENA_NONE NGX_MAX_UINT32_VALUE
+#define NGX_HTTP_PUSH_ARENA_FREE 0xffff //size class of pages in a free run
+#define NGX_HTTP_PUSH_ARENA_LARGE 0xfffe //size class of pages holding one large object
@@ -0,0 +1,154 @@
+#include <ngx_http_push_module.h>
+#include "rbtree_util.h"
+#include "expiry_util.h"
+
+/* Expiry index: a binary min-heap of channels in shared memory, keyed by the
+ * earliest time something in the channel may expire -- its oldest message,
+ * or the channel itself. Each channel remembers its heap position, so it can
+ * be moved or removed without a search. A key may be early (the channel is
+ * just rescheduled when it comes due), but should never be late.
+ * All functions assume the zone is locked. */
+
+#define ngx_http_push_expiry_parent(i) (((i) - 1) / 2)
+
+static void ngx_http_push_expiry_set(ngx_http_push_expiry_heap_t *heap, ngx_uint_t i, ngx_http_push_channel_t *channel) {
+  heap->channels[i] = channel;
+  channel->expiry_index = i;
+}
+
+static void ngx_http_push_expiry_sift_up(ngx_http_push_expiry_heap_t *heap, ngx_uint_t i) {
+  ngx_http_push_channel_t        *channel = heap->channels[i];
+  ngx_uint_t                      parent;
+  while(i > 0) {
+    parent = ngx_http_push_expiry_parent(i);
+    if(heap->channels[parent]->expiry_due <= channel->expiry_due) {
+      break;
+    }
+    ngx_http_push_expiry_set(heap, i, heap->channels[parent]);
+    i = parent;
+  }
+  ngx_http_push_expiry_set(heap, i, channel);
+}
+
+static void ngx_http_push_expiry_sift_down(ngx_http_push_expiry_heap_t *heap, ngx_uint_t i) {
+  ngx_http_push_channel_t        *channel = heap->channels[i];
+  ngx_uint_t                      child;
+  for(;;) {
+    child = 2 * i + 1;
+    if(child >= heap->count) {
+      break;
+    }
+    if(child + 1 < heap->count && heap->channels[child + 1]->expiry_due < heap->channels[child]->expiry_due) {
+      child++;
+    }
+    if(channel->expiry_due <= heap->channels[child]->expiry_due) {
+      break;
+    }
+    ngx_http_push_expiry_set(heap, i, heap->channels[child]);
+    i = child;
+  }
+  ngx_http_push_expiry_set(heap, i, channel);
+}
+
+ngx_http_push_expiry_heap_t *ngx_http_push_expiry_create_locked(ngx_shm_zone_t *shm_zone, ngx_uint_t size) {
+  ngx_http_push_expiry_heap_t    *heap;
+  if((heap = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*heap), "channel expiry heap"))==NULL) {
+    return NULL;
+  }
+  if((heap->channels = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*heap->channels) * size, "channel expiry heap entries"))==NULL) {
+    ngx_http_push_store->free_locked(heap);
+    return NULL;
+  }
+  heap->size = size;
+  heap->count = 0;
+  return heap;
+}
+
+static ngx_int_t ngx_http_push_expiry_grow_locked(ngx_http_push_expiry_heap_t *heap, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_channel_t       **channels;
+  //allocating may garbage-collect channels out of this heap, so copy it only after.
+  if((channels = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*channels) * heap->size * 2, "channel expiry heap entries"))==NULL) {
+    return NGX_ERROR;
+  }
+  ngx_memcpy(channels, heap->channels, sizeof(*channels) * heap->count);
+  ngx_http_push_store->free_locked(heap->channels);
+  heap->channels = channels;
+  heap->size *= 2;
+  return NGX_OK;
+}
+
+//when the channel next needs looking at, or 0 for never
+time_t ngx_http_push_expiry_due(ngx_http_push_channel_t *channel) {
+  ngx_queue_t                    *sentinel = &channel->message_queue->queue;
+  ngx_http_push_msg_t            *msg;
+  if(ngx_queue_empty(sentinel)) {
+    return channel->expires;
+  }
+  msg = ngx_queue_data(ngx_queue_head(sentinel), ngx_http_push_msg_t, queue);
+  //a message that never expires keeps the whole channel around
+  return msg->expires == 0 ? 0 : msg->expires + 1;
+}
+
+//(re)schedule a channel for no later than when. an earlier schedule is kept.
+void ngx_http_push_expiry_schedule_locked(ngx_http_push_expiry_heap_t *heap, ngx_http_push_channel_t *channel, time_t when, ngx_shm_zone_t *shm_zone) {
+  if(heap == NULL || when == 0) {
+    return;
+  }
+  if(channel->expiry_index != NGX_HTTP_PUSH_EXPIRY_UNSCHEDULED) {
+    if(when < channel->expiry_due) {
+      channel->expiry_due = when;
+      ngx_http_push_expiry_sift_up(heap, channel->expiry_index);
+    }
+    return;
+  }
+  if(heap->count == heap->size && ngx_http_push_expiry_grow_locked(heap, shm_zone) != NGX_OK) {
+    //the garbage collector's sweep will still get to it, just not right on time.
+    return;
+  }
+  channel->expiry_due = when;
+  ngx_http_push_expiry_set(heap, heap->count++, channel);
+  ngx_http_push_expiry_sift_up(heap, channel->expiry_index);
+}
+
+void ngx_http_push_expiry_remove_locked(ngx_http_push_expiry_heap_t *heap, ngx_http_push_channel_t *channel) {
+  ngx_uint_t                      i = channel->expiry_index;
+  ngx_http_push_channel_t        *last;
+  if(heap == NULL || i == NGX_HTTP_PUSH_EXPIRY_UNSCHEDULED) {
+    return;
+  }
+  channel->expiry_index = NGX_HTTP_PUSH_EXPIRY_UNSCHEDULED;
+  last = heap->channels[--heap->count];
+  if(last == channel) {
+    return;
+  }
+  ngx_http_push_expiry_set(heap, i, last);
+  if(i > 0 && last->expiry_due < heap->channels[ngx_http_push_expiry_parent(i)]->expiry_due) {
+    ngx_http_push_expiry_sift_up(heap, i);
+  }
+  else {
+    ngx_http_push_expiry_sift_down(heap, i);
+  }
+}
+
+//clean up to max channels that are due. returns the number of channels deleted.
+ngx_uint_t ngx_http_push_expire_due_locked(ngx_http_push_expiry_heap_t *heap, ngx_shm_zone_t *shm_zone, time_t now, ngx_uint_t max) {
+  ngx_http_push_channel_t        *channel;
+  ngx_uint_t                      i, deleted = 0;
+  time_t                          due;
+  if(heap == NULL) {
+    return 0;
+  }
+  for(i=0; i < max && heap->count > 0 && heap->channels[0]->expiry_due <= now; i++) {
+    channel = heap->channels[0];
+    ngx_http_push_expiry_remove_locked(heap, channel);
+    if(ngx_http_push_clean_channel_locked(channel) != NULL && ngx_http_push_delete_channel_locked(channel, shm_zone) == NGX_OK) {
+      deleted++;
+      continue;
+    }
+    //still in use. it just got a free slot, so this won't allocate.
+    if((due = ngx_http_push_expiry_due(channel)) != 0) {
+      ngx_http_push_expiry_schedule_locked(heap, channel, due > now ? due : now + NGX_HTTP_PUSH_EXPIRY_RECHECK, shm_zone);
+    }
+  }
+  return deleted;
+}
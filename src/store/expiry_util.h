@@ -0,0 +1,8 @@
+ngx_http_push_expiry_heap_t *ngx_http_push_expiry_create_locked(ngx_shm_zone_t *shm_zone, ngx_uint_t size);
+time_t ngx_http_push_expiry_due(ngx_http_push_channel_t *channel);
+void ngx_http_push_expiry_schedule_locked(ngx_http_push_expiry_heap_t *heap, ngx_http_push_channel_t *channel, time_t when, ngx_shm_zone_t *shm_zone);
+void ngx_http_push_expiry_remove_locked(ngx_http_push_expiry_heap_t *heap, ngx_http_push_channel_t *channel);
+ngx_uint_t ngx_http_push_expire_due_locked(ngx_http_push_expiry_heap_t *heap, ngx_shm_zone_t *shm_zone, time_t now, ngx_uint_t max);
+#define NGX_HTTP_PUSH_EXPIRY_INITIAL_SIZE 1024
+#define NGX_HTTP_PUSH_EXPIRY_UNSCHEDULED NGX_MAX_UINT32_VALUE
+#define NGX_HTTP_PUSH_EXPIRY_RECHECK 1 //seconds. for channels that are due, but still have subscribers
@@ -0,0 +1,287 @@
+#include <ngx_http_push_module.h>
+#include "hashtable_util.h"
+
+/* Robin Hood open-addressing channel index, in shared memory.
+ * Slots are kept in one flat array and carry the channel's hash, so a probe
+ * only dereferences a channel when the hashes match. Keys are hashed with
+ * SipHash-2-4 under a random per-zone key, so channel ids can't be picked to
+ * collide. Growing doesn't rehash everything at once: the old table stays
+ * around, read-only, and its channels are moved over a few slots at a time by
+ * every insert and gc step (so every lookup) until it's empty and freed. Channels moved
+ * or removed from it leave their slot's probe distance behind, so it's never
+ * shifted. All functions assume the zone is locked. */
+
+#define ngx_http_push_rotl64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define ngx_http_push_sipround(v0, v1, v2, v3)                                \
+  v0 += v1; v1 = ngx_http_push_rotl64(v1, 13); v1 ^= v0; v0 = ngx_http_push_rotl64(v0, 32); \
+  v2 += v3; v3 = ngx_http_push_rotl64(v3, 16); v3 ^= v2;                      \
+  v0 += v3; v3 = ngx_http_push_rotl64(v3, 21); v3 ^= v0;                      \
+  v2 += v1; v1 = ngx_http_push_rotl64(v1, 17); v1 ^= v2; v2 = ngx_http_push_rotl64(v2, 32)
+
+static uint64_t ngx_http_push_siphash(const u_char *in, size_t len, uint64_t k0, uint64_t k1) {
+  uint64_t                        v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t                        v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t                        v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t                        v3 = 0x7465646279746573ULL ^ k1;
+  uint64_t                        m, b = ((uint64_t) len) << 56;
+  const u_char                   *end = in + len - (len % 8);
+  ngx_uint_t                      i;
+
+  for( ; in != end; in += 8) {
+    m = 0;
+    for(i=0; i<8; i++) {
+      m |= ((uint64_t) in[i]) << (8 * i);
+    }
+    v3 ^= m;
+    ngx_http_push_sipround(v0, v1, v2, v3);
+    ngx_http_push_sipround(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  for(i=0; i < (len % 8); i++) {
+    b |= ((uint64_t) in[i]) << (8 * i);
+  }
+  v3 ^= b;
+  ngx_http_push_sipround(v0, v1, v2, v3);
+  ngx_http_push_sipround(v0, v1, v2, v3);
+  v0 ^= b;
+  v2 ^= 0xff;
+  for(i=0; i<4; i++) {
+    ngx_http_push_sipround(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint32_t ngx_http_push_hashtable_hash(ngx_http_push_hashtable_t *ht, ngx_str_t *id) {
+  return (uint32_t) ngx_http_push_siphash(id->data, id->len, ht->key[0], ht->key[1]);
+}
+
+//the hash key comes from the kernel. ngx_random() is seeded from the pid and the time, both easy enough to guess.
+static ngx_int_t ngx_http_push_hashtable_key(uint64_t key[2]) {
+  ngx_fd_t                        fd;
+  ssize_t                         n;
+  if((fd = ngx_open_file("/dev/urandom", NGX_FILE_RDONLY, NGX_FILE_OPEN, 0)) == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "push module: unable to open /dev/urandom for the channel hashtable key");
+    return NGX_ERROR;
+  }
+  n = read(fd, key, 2 * sizeof(uint64_t));
+  ngx_close_file(fd);
+  if(n != 2 * sizeof(uint64_t)) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno, "push module: unable to read the channel hashtable key from /dev/urandom");
+    return NGX_ERROR;
+  }
+  return NGX_OK;
+}
+
+static ngx_http_push_hashtable_slot_t *ngx_http_push_hashtable_alloc_slots(ngx_shm_zone_t *shm_zone, ngx_uint_t size) {
+  ngx_http_push_hashtable_slot_t *slots;
+  if((slots = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*slots) * size, "channel hashtable slots"))==NULL) {
+    return NULL;
+  }
+  ngx_memzero(slots, sizeof(*slots) * size);
+  return slots;
+}
+
+ngx_http_push_hashtable_t *ngx_http_push_hashtable_create_locked(ngx_shm_zone_t *shm_zone, ngx_uint_t size) {
+  ngx_http_push_hashtable_t      *ht;
+  if((ht = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*ht), "channel hashtable"))==NULL) {
+    return NULL;
+  }
+  if((ht->slots = ngx_http_push_hashtable_alloc_slots(shm_zone, size))==NULL) {
+    ngx_http_push_store->free_locked(ht);
+    return NULL;
+  }
+  ht->size = size;
+  ht->old_slots = NULL;
+  ht->old_size = 0;
+  ht->migrated = 0;
+  ht->count = 0;
+  ht->gc_cursor = 0;
+  if(ngx_http_push_hashtable_key(ht->key) != NGX_OK) {
+    ngx_http_push_store->free_locked(ht->slots);
+    ngx_http_push_store->free_locked(ht);
+    return NULL;
+  }
+  return ht;
+}
+
+//returns the slot index or NGX_ERROR. slots with no channel were moved out of the old table; they're only passed over.
+static ngx_int_t ngx_http_push_hashtable_lookup_slot(ngx_http_push_hashtable_slot_t *slots, ngx_uint_t size, ngx_str_t *id, uint32_t hash) {
+  ngx_uint_t                      mask = size - 1;
+  ngx_uint_t                      i = hash & mask;
+  uint32_t                        dist = 1;
+  ngx_http_push_hashtable_slot_t *slot;
+  ngx_http_push_channel_t        *channel;
+
+  for(;;) {
+    slot = &slots[i];
+    if(slot->dist < dist) {
+      //empty, or we'd have displaced this entry on insert. either way, it's not here.
+      return NGX_ERROR;
+    }
+    if(slot->hash == hash && (channel = slot->channel) != NULL) {
+      if(ngx_memn2cmp(id->data, channel->id.data, id->len, channel->id.len) == 0) {
+        return (ngx_int_t) i;
+      }
+    }
+    i = (i + 1) & mask;
+    dist++;
+  }
+}
+
+ngx_http_push_channel_t *ngx_http_push_hashtable_find(ngx_http_push_hashtable_t *ht, ngx_str_t *id) {
+  uint32_t                        hash = ngx_http_push_hashtable_hash(ht, id);
+  ngx_int_t                       i = ngx_http_push_hashtable_lookup_slot(ht->slots, ht->size, id, hash);
+  if(i != NGX_ERROR) {
+    return ht->slots[i].channel;
+  }
+  if(ht->old_slots != NULL && (i = ngx_http_push_hashtable_lookup_slot(ht->old_slots, ht->old_size, id, hash)) != NGX_ERROR) {
+    return ht->old_slots[i].channel;
+  }
+  return NULL;
+}
+
+static void ngx_http_push_hashtable_place(ngx_http_push_hashtable_slot_t *slots, ngx_uint_t size, ngx_http_push_hashtable_slot_t entry) {
+  ngx_uint_t                      mask = size - 1;
+  ngx_uint_t                      i = entry.hash & mask;
+  ngx_http_push_hashtable_slot_t  tmp;
+
+  entry.dist = 1;
+  for(;;) {
+    if(slots[i].dist == 0) {
+      slots[i] = entry;
+      return;
+    }
+    if(slots[i].dist < entry.dist) {
+      //robin hood: take from the rich
+      tmp = slots[i];
+      slots[i] = entry;
+      entry = tmp;
+    }
+    i = (i + 1) & mask;
+    entry.dist++;
+  }
+}
+
+//move up to n of the old table's slots over. the old table is freed once they've all been moved.
+static void ngx_http_push_hashtable_migrate_locked(ngx_http_push_hashtable_t *ht, ngx_uint_t n) {
+  ngx_http_push_hashtable_slot_t *slot;
+  for(/* void */; ht->old_slots != NULL && n > 0 && ht->migrated < ht->old_size; n--, ht->migrated++) {
+    slot = &ht->old_slots[ht->migrated];
+    if(slot->channel != NULL) {
+      ngx_http_push_hashtable_place(ht->slots, ht->size, *slot);
+      slot->channel = NULL;
+    }
+  }
+  if(ht->old_slots != NULL && ht->migrated == ht->old_size) {
+    ngx_http_push_store->free_locked(ht->old_slots);
+    ht->old_slots = NULL;
+    ht->old_size = 0;
+    ht->migrated = 0;
+  }
+}
+
+//double the table. its channels stay where they are until they're migrated.
+static ngx_int_t ngx_http_push_hashtable_grow_locked(ngx_http_push_hashtable_t *ht, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_hashtable_slot_t *slots;
+  ngx_uint_t                      size = ht->size * 2;
+  if(ht->old_slots != NULL) {
+    //still moving over from last time. that finishes long before the new table fills up, so it can wait.
+    return NGX_DECLINED;
+  }
+  //allocating may garbage-collect channels out of this table, so swap it only after.
+  if((slots = ngx_http_push_hashtable_alloc_slots(shm_zone, size))==NULL) {
+    return NGX_ERROR;
+  }
+  ht->old_slots = ht->slots;
+  ht->old_size = ht->size;
+  ht->migrated = 0;
+  ht->slots = slots;
+  ht->size = size;
+  ht->gc_cursor = 0;
+  return NGX_OK;
+}
+
+ngx_int_t ngx_http_push_hashtable_insert_locked(ngx_http_push_hashtable_t *ht, ngx_http_push_channel_t *channel, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_hashtable_slot_t  entry;
+  ngx_http_push_hashtable_migrate_locked(ht, NGX_HTTP_PUSH_HASHTABLE_MIGRATE_SLOTS);
+  if((ht->count + 1) * 100 > ht->size * NGX_HTTP_PUSH_HASHTABLE_MAX_LOAD) {
+    if(ngx_http_push_hashtable_grow_locked(ht, shm_zone) == NGX_ERROR) {
+      if(ht->count + 1 >= ht->size) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: channel hashtable is full and can't grow");
+        return NGX_ERROR;
+      }
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: unable to grow channel hashtable. lookups will be slower.");
+    }
+  }
+  entry.hash = ngx_http_push_hashtable_hash(ht, &channel->id);
+  entry.dist = 1;
+  entry.channel = channel;
+  ngx_http_push_hashtable_place(ht->slots, ht->size, entry);
+  ht->count++;
+  return NGX_OK;
+}
+
+ngx_int_t ngx_http_push_hashtable_remove(ngx_http_push_hashtable_t *ht, ngx_http_push_channel_t *channel) {
+  ngx_uint_t                      mask = ht->size - 1;
+  uint32_t                        hash = ngx_http_push_hashtable_hash(ht, &channel->id);
+  ngx_int_t                       found = ngx_http_push_hashtable_lookup_slot(ht->slots, ht->size, &channel->id, hash);
+  ngx_uint_t                      i, next;
+  if(found == NGX_ERROR && ht->old_slots != NULL && (found = ngx_http_push_hashtable_lookup_slot(ht->old_slots, ht->old_size, &channel->id, hash)) != NGX_ERROR) {
+    //not moved over yet. its slot keeps its distance so the probes past it still work.
+    if(ht->old_slots[found].channel != channel) {
+      return NGX_DECLINED;
+    }
+    ht->old_slots[found].channel = NULL;
+    ht->count--;
+    return NGX_OK;
+  }
+  if(found == NGX_ERROR || ht->slots[found].channel != channel) {
+    return NGX_DECLINED;
+  }
+  //backward-shift deletion. no tombstones.
+  i = (ngx_uint_t) found;
+  for(;;) {
+    next = (i + 1) & mask;
+    if(ht->slots[next].dist <= 1) {
+      ngx_memzero(&ht->slots[i], sizeof(ht->slots[i]));
+      break;
+    }
+    ht->slots[i] = ht->slots[next];
+    ht->slots[i].dist--;
+    i = next;
+  }
+  ht->count--;
+  return NGX_OK;
+}
+
+//next occupied slot for incremental garbage collection, or NULL if the table is empty.
+//channels still in the old table get their turn once they've been moved over.
+ngx_http_push_channel_t *ngx_http_push_hashtable_gc_next(ngx_http_push_hashtable_t *ht) {
+  ngx_uint_t                      i;
+  ngx_http_push_hashtable_migrate_locked(ht, NGX_HTTP_PUSH_HASHTABLE_MIGRATE_SLOTS);
+  if(ht->count == 0) {
+    return NULL;
+  }
+  for(i=0; i < ht->size; i++) {
+    ht->gc_cursor = (ht->gc_cursor + 1) & (ht->size - 1);
+    if(ht->slots[ht->gc_cursor].dist != 0) {
+      return ht->slots[ht->gc_cursor].channel;
+    }
+  }
+  return NULL;
+}
+
+void ngx_http_push_hashtable_walker(ngx_http_push_hashtable_t *ht, ngx_int_t(*apply)(ngx_http_push_channel_t *channel)) {
+  ngx_uint_t                      i;
+  for(i=0; i < ht->size; i++) {
+    if(ht->slots[i].dist != 0) {
+      apply(ht->slots[i].channel);
+    }
+  }
+  for(i=0; ht->old_slots != NULL && i < ht->old_size; i++) {
+    if(ht->old_slots[i].channel != NULL) {
+      apply(ht->old_slots[i].channel);
+    }
+  }
+}
@@ -0,0 +1,10 @@
+ngx_http_push_hashtable_t *ngx_http_push_hashtable_create_locked(ngx_shm_zone_t *shm_zone, ngx_uint_t size);
+uint32_t ngx_http_push_hashtable_hash(ngx_http_push_hashtable_t *ht, ngx_str_t *id);
+ngx_http_push_channel_t *ngx_http_push_hashtable_find(ngx_http_push_hashtable_t *ht, ngx_str_t *id);
+ngx_int_t ngx_http_push_hashtable_insert_locked(ngx_http_push_hashtable_t *ht, ngx_http_push_channel_t *channel, ngx_shm_zone_t *shm_zone);
+ngx_int_t ngx_http_push_hashtable_remove(ngx_http_push_hashtable_t *ht, ngx_http_push_channel_t *channel);
+ngx_http_push_channel_t *ngx_http_push_hashtable_gc_next(ngx_http_push_hashtable_t *ht);
+void ngx_http_push_hashtable_walker(ngx_http_push_hashtable_t *ht, ngx_int_t(*apply)(ngx_http_push_channel_t *channel));
+#define NGX_HTTP_PUSH_HASHTABLE_INITIAL_SIZE 1024
+#define NGX_HTTP_PUSH_HASHTABLE_MAX_LOAD 85 //percent
+#define NGX_HTTP_PUSH_HASHTABLE_MIGRATE_SLOTS 64 //old slots moved to the grown table per insert or gc step
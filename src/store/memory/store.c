@@ -2,8 +2,21 @@
 
 #include "store.h"
 #include <store/rbtree_util.h>
+#include <store/hashtable_util.h>
+#include <store/expiry_util.h>
+#include <store/arena_util.h>
+#include <store/prefix_util.h>
 #include <store/ngx_rwlock.h>
 #include <store/ngx_http_push_module_ipc.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#if (NGX_LINUX) && defined(MFD_CLOEXEC)
+#define NGX_HTTP_PUSH_HAVE_MEMFD 1
+#endif
+#define NGX_HTTP_PUSH_LARGE_MESSAGE_COPY_SIZE 65536
+#define NGX_HTTP_PUSH_DELIVERY_OVERDUE 1000 //msec past due before a delayed delivery's timer is given up for lost with its worker
+#define NGX_HTTP_PUSH_DELIVERY_OVERDUE_BATCH 16 //overdue deliveries per partition per gc tick
 
 #define NGX_HTTP_PUSH_BROADCAST_CHECK(val, fail, r, errormessage)             \
     if (val == fail) {                                                        \
@@ -20,11 +33,6 @@
         return NULL;                                                          \
     }
 
-#define NGX_HTTP_BUF_ALLOC_SIZE(buf)                                          \
-    (sizeof(*buf) +                                                           \
-   (((buf)->temporary || (buf)->memory) ? ngx_buf_size(buf) : 0) +          \
-   (((buf)->file!=NULL) ? (sizeof(*(buf)->file) + (buf)->file->name.len + 1) : 0))
-
 #define ENQUEUED_DBG "msg %p enqueued.  ref:%i, p:%p n:%p"
 #define CREATED_DBG  "msg %p created    ref:%i, p:%p n:%p"
 #define FREED_DBG    "msg %p freed.     ref:%i, p:%p n:%p"
@@ -33,56 +41,273 @@
 
 //#define DEBUG_SHM_ALLOC 1
 
-static ngx_http_push_channel_queue_t channel_gc_sentinel;
-static ngx_slab_pool_t    *ngx_http_push_shpool = NULL;
-static ngx_shm_zone_t     *ngx_http_push_shm_zone = NULL;
+static ngx_shm_zone_t     *ngx_http_push_shm_zones[NGX_HTTP_PUSH_MAX_SHM_PARTITIONS];
+static ngx_uint_t          ngx_http_push_shm_partitions = 0;
+static ngx_int_t           ngx_http_push_channel_index = NGX_HTTP_PUSH_CHANNEL_INDEX_RBTREE;
+static ngx_http_push_main_conf_t *ngx_http_push_store_mcf = NULL;
+static ngx_event_t         ngx_http_push_gc_timer;
+static ngx_event_t         ngx_http_push_mailbox_timer; //looks at a stalled mailbox slot again
+//large message memory: one anonymous file per partition, made by the master and inherited by the workers,
+//so the descriptor is the same everywhere.
+static ngx_fd_t            ngx_http_push_large_message_fds[NGX_HTTP_PUSH_MAX_SHM_PARTITIONS];
+static ngx_flag_t          ngx_http_push_large_message_fds_init = 0;
+
+#define ngx_http_push_zone_shpool(shm_zone) ((ngx_slab_pool_t *) (shm_zone)->shm.addr)
+#define ngx_http_push_zone_data(shm_zone) ((ngx_http_push_shm_data_t *) (shm_zone)->data)
+//IPC and other process-wide bookkeeping lives in the first partition
+#define ngx_http_push_ipc_zone (ngx_http_push_shm_zones[0])
 
 static ngx_int_t ngx_http_push_store_send_worker_message(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber_sentinel, ngx_pid_t pid, ngx_int_t worker_slot, ngx_http_push_msg_t *msg, ngx_int_t status_code);
+static void ngx_http_push_store_defer_worker_alerts(void);
+static void ngx_http_push_store_deliver_overdue(ngx_shm_zone_t *shm_zone);
+static void ngx_http_push_store_sweep_prefixes(ngx_shm_zone_t *shm_zone);
+static void ngx_http_push_store_send_deferred_worker_alerts(void);
+static void ngx_http_push_store_receive_worker_message(void);
+static void ngx_http_push_mailbox_timer_handler(ngx_event_t *ev) {
+  ngx_http_push_store_receive_worker_message();
+}
+static ngx_int_t ngx_http_push_delete_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_int_t force);
 
-static ngx_int_t ngx_http_push_channel_collector(ngx_http_push_channel_t * channel) {
-  if((ngx_http_push_clean_channel_locked(channel))!=NULL) { //we're up for deletion
-    ngx_http_push_channel_queue_t *trashy;
-    if((trashy = ngx_alloc(sizeof(*trashy), ngx_cycle->log))!=NULL) {
-      //yeah, i'm allocating memory during garbage collection. sue me.
-      trashy->channel=channel;
-      ngx_queue_insert_tail(&channel_gc_sentinel.queue, &trashy->queue);
-      return NGX_OK;
+//channels are routed to a partition by the same hash that keys them in the partition's rbtree
+static ngx_inline ngx_shm_zone_t *ngx_http_push_partition_for_id(ngx_str_t *id) {
+  return ngx_http_push_shm_zones[ngx_crc32_short(id->data, id->len) % ngx_http_push_shm_partitions];
+}
+
+static ngx_inline ngx_shm_zone_t *ngx_http_push_channel_partition(ngx_http_push_channel_t *channel) {
+  return ngx_http_push_shm_zones[channel->node.key % ngx_http_push_shm_partitions];
+}
+
+//find the partition a chunk of shared memory was allocated from
+static ngx_shm_zone_t *ngx_http_push_partition_for_ptr(void *ptr) {
+  ngx_uint_t                      i;
+  ngx_shm_zone_t                 *shm_zone;
+  for(i=0; i < ngx_http_push_shm_partitions; i++) {
+    shm_zone = ngx_http_push_shm_zones[i];
+    if((u_char *) ptr >= shm_zone->shm.addr && (u_char *) ptr < shm_zone->shm.addr + shm_zone->shm.size) {
+      return shm_zone;
     }
-    return NGX_ERROR;
   }
-  return NGX_OK;
+  ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "push module: pointer %p is not in any shared memory partition", ptr);
+  return NULL;
 }
 
-static void ngx_http_push_store_lock_shmem(void){
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+static void ngx_http_push_partition_lock(ngx_shm_zone_t *shm_zone) {
+  ngx_shmtx_lock(&ngx_http_push_zone_shpool(shm_zone)->mutex);
 }
-static void ngx_http_push_store_unlock_shmem(void){
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+static void ngx_http_push_partition_unlock(ngx_shm_zone_t *shm_zone) {
+  ngx_shmtx_unlock(&ngx_http_push_zone_shpool(shm_zone)->mutex);
 }
 
-//garbage-collecting slab allocator
-static void * ngx_http_push_slab_alloc_locked(size_t size, char *label) {
-  void  *p;
-  if((p = ngx_slab_alloc_locked(ngx_http_push_shpool, size))==NULL) {
-    ngx_http_push_channel_queue_t *ccur, *cnext;
-    ngx_uint_t                  collected = 0;
-    //failed. emergency garbage sweep, then.
-    
-    //collect channels
-    ngx_queue_init(&channel_gc_sentinel.queue);
-    ngx_http_push_walk_rbtree(ngx_http_push_channel_collector, ngx_http_push_shm_zone);
-    for(ccur=(ngx_http_push_channel_queue_t *)ngx_queue_next(&channel_gc_sentinel.queue); ccur != &channel_gc_sentinel; ccur=cnext) {
-      cnext = (ngx_http_push_channel_queue_t *)ngx_queue_next(&ccur->queue);
-      ngx_http_push_delete_channel_locked(ccur->channel, ngx_http_push_shm_zone);
-      ngx_free(ccur);
+/* Every push_gc_interval, each worker first cleans up whatever the expiry index says is due in each
+ * partition. On top of that, garbage collection walks a partition's channels in bounded batches,
+ * picking up where the last batch left off, while the partition is above its high watermark and
+ * until it's back under the low one. Running out of memory gets one extra batch on the spot --
+ * never a whole sweep. */
+static ngx_uint_t ngx_http_push_gc_batch_locked(ngx_shm_zone_t *shm_zone, ngx_uint_t max) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_queue_t                    *sentinel = &d->gc_channels;
+  ngx_http_push_channel_t        *channel;
+  ngx_uint_t                      i, visits = ngx_min(max, d->channels), collected = 0;
+  
+  for(i=0; i < visits; i++) {
+    if(d->gc_cursor == sentinel) {
+      d->gc_cursor = ngx_queue_next(sentinel);
+      if(d->gc_cursor == sentinel) {
+        break; //no channels at all
+      }
+    }
+    channel = ngx_queue_data(d->gc_cursor, ngx_http_push_channel_t, gc_queue);
+    d->gc_cursor = ngx_queue_next(d->gc_cursor);
+    if(ngx_http_push_clean_channel_locked(channel) != NULL && ngx_http_push_delete_channel_locked(channel, shm_zone) == NGX_OK) {
       collected++;
     }
+  }
+  d->gc_collected += collected;
+  return collected;
+}
+
+//messages go in the partition's message arena, if it has one. everything else in the slab pool.
+static void *ngx_http_push_partition_alloc_locked(ngx_shm_zone_t *shm_zone, size_t size, ngx_int_t message) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  if(message && d != NULL && d->arena != NULL) {
+    return ngx_http_push_arena_alloc_locked(d->arena, size);
+  }
+  return ngx_slab_alloc_locked(ngx_http_push_zone_shpool(shm_zone), size);
+}
+
+/* Last resort when a partition is full of channels that are still alive: drop the buffered messages of
+ * the least recently used channels nobody's subscribed to, until size bytes can be allocated. The
+ * emptied channels stay, and expire like any other. Returns the allocation, or NULL. */
+static void *ngx_http_push_evict_lru_locked(ngx_shm_zone_t *shm_zone, size_t size, ngx_int_t message, ngx_uint_t max) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_queue_t                    *sentinel = &d->lru_channels, *cur, *last = ngx_queue_last(sentinel);
+  ngx_http_push_channel_t        *channel;
+  ngx_queue_t                    *msgs;
+  time_t                          idle_since = ngx_time() - ngx_http_push_store_mcf->eviction_min_idle;
+  ngx_uint_t                      visits = 0;
+  void                           *p = NULL;
+  
+  if(ngx_queue_empty(sentinel)) {
+    return NULL;
+  }
+  for(cur = ngx_queue_head(sentinel); visits < max; cur = ngx_queue_head(sentinel), visits++) {
+    channel = ngx_queue_data(cur, ngx_http_push_channel_t, lru_queue);
+    if(channel->last_used > idle_since) {
+      break; //everything after this was used even more recently
+    }
+    if(channel->subscribers == 0 && channel->messages > 0) {
+      msgs = &channel->message_queue->queue;
+      while(!ngx_queue_empty(msgs)) {
+        ngx_http_push_delete_message_locked(channel, ngx_queue_data(ngx_queue_head(msgs), ngx_http_push_msg_t, queue), 0);
+        d->evicted_messages++;
+      }
+      d->evicted_channels++;
+      ngx_http_push_expiry_schedule_locked(d->expiry, channel, channel->expires, shm_zone);
+    }
+    //nothing more to take from this one. out of the way.
+    ngx_queue_remove(cur);
+    ngx_queue_insert_tail(sentinel, cur);
+    if((p = ngx_http_push_partition_alloc_locked(shm_zone, size, message)) != NULL || cur == last) {
+      break;
+    }
+  }
+  return p;
+}
+
+//pages of a partition that aren't handed out at all. the partition must be locked.
+static ngx_uint_t ngx_http_push_partition_free_pages_locked(ngx_shm_zone_t *shm_zone) {
+  ngx_slab_pool_t                *shpool = ngx_http_push_zone_shpool(shm_zone);
+  ngx_slab_page_t                *page;
+  ngx_uint_t                      free = 0;
+  for(page = shpool->free.next; page != &shpool->free; page = page->next) {
+    free += page->slab; //length of this run of free pages
+  }
+  return free;
+}
+
+static ngx_uint_t ngx_http_push_partition_pages(ngx_shm_zone_t *shm_zone) {
+  ngx_slab_pool_t                *shpool = ngx_http_push_zone_shpool(shm_zone);
+  return (ngx_uint_t) (shpool->end - shpool->start) >> ngx_pagesize_shift;
+}
+
+static ngx_uint_t ngx_http_push_partition_usage_locked(ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_arena_t          *arena = ngx_http_push_zone_data(shm_zone)->arena;
+  ngx_uint_t                      pages = ngx_http_push_partition_pages(shm_zone);
+  ngx_uint_t                      free = ngx_http_push_partition_free_pages_locked(shm_zone) + (arena != NULL ? arena->free_pages : 0);
+  return pages == 0 ? 0 : 100 - (free * 100 / pages);
+}
+
+static void ngx_http_push_gc_timer_handler(ngx_event_t *ev) {
+  ngx_uint_t                      i;
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_http_push_shm_data_t       *d;
+  struct timeval                  start, end;
+  uint64_t                        pause;
+  
+  for(i=0; i < ngx_http_push_shm_partitions; i++) {
+    shm_zone = ngx_http_push_shm_zones[i];
+    d = ngx_http_push_zone_data(shm_zone);
+    if(!ngx_shmtx_trylock(&ngx_http_push_zone_shpool(shm_zone)->mutex)) {
+      continue; //busy. someone's probably collecting it already
+    }
+    ngx_gettimeofday(&start);
+    d->expired += ngx_http_push_expire_due_locked(d->expiry, shm_zone, ngx_time(), (ngx_uint_t) ngx_http_push_store_mcf->gc_batch_size);
+    if(!d->gc_active && ngx_http_push_partition_usage_locked(shm_zone) >= (ngx_uint_t) ngx_http_push_store_mcf->gc_high_watermark) {
+      d->gc_active = 1;
+    }
+    if(d->gc_active) {
+      ngx_http_push_gc_batch_locked(shm_zone, (ngx_uint_t) ngx_http_push_store_mcf->gc_batch_size);
+      d->gc_runs++;
+    }
+    ngx_gettimeofday(&end);
+    //the pause includes expiring whatever was due
+    pause = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+    d->gc_pause_last = pause;
+    d->gc_pause_total += pause;
+    if(pause > d->gc_pause_max) {
+      d->gc_pause_max = pause;
+    }
+    if(d->gc_active && ngx_http_push_partition_usage_locked(shm_zone) <= (ngx_uint_t) ngx_http_push_store_mcf->gc_low_watermark) {
+      d->gc_active = 0;
+    }
+    ngx_http_push_partition_unlock(shm_zone);
+    if(!ngx_queue_empty(&d->delayed_channels)) {
+      ngx_http_push_store_deliver_overdue(shm_zone);
+    }
+    if(d->prefix_channels_deleted > 0) {
+      ngx_http_push_store_sweep_prefixes(shm_zone);
+    }
+  }
+  
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, ngx_http_push_store_mcf->gc_interval);
+  }
+}
+
+static ngx_int_t ngx_http_push_store_partition_stats(ngx_uint_t partition, ngx_http_push_partition_stats_t *stats) {
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_http_push_shm_data_t       *d;
+  if(partition >= ngx_http_push_shm_partitions) {
+    return NGX_DECLINED;
+  }
+  shm_zone = ngx_http_push_shm_zones[partition];
+  d = ngx_http_push_zone_data(shm_zone);
+  ngx_http_push_partition_lock(shm_zone);
+  stats->channels = d->channels;
+  stats->messages = d->messages;
+  stats->pages = ngx_http_push_partition_pages(shm_zone);
+  stats->free_pages = ngx_http_push_partition_free_pages_locked(shm_zone);
+  stats->gc_active = d->gc_active;
+  stats->gc_runs = d->gc_runs;
+  stats->gc_collected = d->gc_collected;
+  stats->expired = d->expired;
+  stats->evicted_channels = d->evicted_channels;
+  stats->evicted_messages = d->evicted_messages;
+  if(d->arena != NULL) {
+    ngx_http_push_arena_stats_locked(d->arena, stats);
+  }
+  else {
+    stats->arena_pages = 0;
+    stats->arena_free_pages = 0;
+    stats->arena_free_runs = 0;
+    stats->arena_largest_free_run = 0;
+    stats->arena_requested = 0;
+    stats->arena_allocated = 0;
+  }
+  stats->large_message_pages = d->large_messages != NULL ? d->large_messages->pages : 0;
+  stats->large_message_free_pages = d->large_messages != NULL ? d->large_messages->free_pages : 0;
+  stats->gc_pause_last = d->gc_pause_last;
+  stats->gc_pause_max = d->gc_pause_max;
+  stats->gc_pause_total = d->gc_pause_total;
+  ngx_http_push_partition_unlock(shm_zone);
+  return NGX_OK;
+}
+
+static void ngx_http_push_store_lock_shmem(ngx_http_push_channel_t *channel){
+  ngx_http_push_partition_lock(ngx_http_push_channel_partition(channel));
+}
+static void ngx_http_push_store_unlock_shmem(ngx_http_push_channel_t *channel){
+  ngx_http_push_partition_unlock(ngx_http_push_channel_partition(channel));
+}
+
+//garbage-collecting allocator. the partition must be locked.
+static void * ngx_http_push_gc_alloc_locked(ngx_shm_zone_t *shm_zone, size_t size, ngx_int_t message, char *label) {
+  void  *p;
+  if((p = ngx_http_push_partition_alloc_locked(shm_zone, size, message))==NULL && ngx_http_push_zone_data(shm_zone) != NULL) {
+    ngx_uint_t                  collected;
+    //failed. one garbage collection batch on the spot, then. the background collector takes it from here.
+    collected = ngx_http_push_gc_batch_locked(shm_zone, ngx_http_push_store_mcf != NULL ? (ngx_uint_t) ngx_http_push_store_mcf->gc_batch_size : NGX_HTTP_PUSH_DEFAULT_GC_BATCH_SIZE);
+    ngx_http_push_zone_data(shm_zone)->gc_active = 1;
     
-    //todo: collect worker messages maybe
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: out of shared memory in partition %ui. emergency garbage collection deleted %ui unused channels.", ngx_http_push_zone_data(shm_zone)->partition, collected);
     
-    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: out of shared memory. emergency garbage collection deleted %ui unused channels.", collected);
+    p = ngx_http_push_partition_alloc_locked(shm_zone, size, message);
     
-    p = ngx_slab_alloc_locked(ngx_http_push_shpool, size);
+    if(p == NULL && ngx_http_push_store_mcf != NULL && ngx_http_push_store_mcf->eviction_policy == NGX_HTTP_PUSH_EVICTION_LRU) {
+      ngx_uint_t                evicted = ngx_http_push_zone_data(shm_zone)->evicted_channels;
+      p = ngx_http_push_evict_lru_locked(shm_zone, size, message, (ngx_uint_t) ngx_http_push_store_mcf->gc_batch_size);
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: still out of shared memory in partition %ui. evicted messages from %ui idle channels.", ngx_http_push_zone_data(shm_zone)->partition, ngx_http_push_zone_data(shm_zone)->evicted_channels - evicted);
+    }
   }
 #if (DEBUG_SHM_ALLOC == 1)
   if (p != NULL) {
@@ -94,26 +319,29 @@ static void * ngx_http_push_slab_alloc_locked(size_t size, char *label) {
   return p;
 }
 
-static void * ngx_http_push_slab_alloc(size_t size, char *label) {
+static void * ngx_http_push_slab_alloc_locked(ngx_shm_zone_t *shm_zone, size_t size, char *label) {
+  return ngx_http_push_gc_alloc_locked(shm_zone, size, 0, label);
+}
+
+static void * ngx_http_push_slab_alloc(ngx_shm_zone_t *shm_zone, size_t size, char *label) {
   void * p;
-  ngx_http_push_store_lock_shmem();
-  p= ngx_http_push_slab_alloc_locked(size, label);
-  ngx_http_push_store_unlock_shmem();
+  ngx_http_push_partition_lock(shm_zone);
+  p= ngx_http_push_slab_alloc_locked(shm_zone, size, label);
+  ngx_http_push_partition_unlock(shm_zone);
   return p;
 }
 
+//the partition ptr belongs to must be locked.
 static void ngx_http_push_slab_free_locked(void *ptr) {
-  ngx_slab_free_locked(ngx_http_push_shpool, ptr);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_ptr(ptr);
+  if(shm_zone == NULL) {
+    return;
+  }
+  ngx_slab_free_locked(ngx_http_push_zone_shpool(shm_zone), ptr);
   #if (DEBUG_SHM_ALLOC == 1)
   ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "shpool free addr %p", ptr);
   #endif
 }
-/*
-static void ngx_http_push_slab_free(void *ptr) {
-  ngx_http_push_store_lock_shmem();
-  ngx_http_push_slab_free_locked(ptr);
-  ngx_http_push_store_unlock_shmem();
-}*/
 
 //shpool is assumed to be locked.
 static ngx_http_push_msg_t *ngx_http_push_get_latest_message_locked(ngx_http_push_channel_t * channel) {
@@ -135,64 +363,175 @@ static ngx_http_push_msg_t *ngx_http_push_get_oldest_message_locked(ngx_http_pus
   return ngx_queue_data(qmsg, ngx_http_push_msg_t, queue);
 }
 
-static void ngx_http_push_store_reserve_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg) {
+/* message refcounts are atomic. A message holds one reference for being in its channel's queue,
+ * one for its creator until publishing is done, and one for each worker it's being delivered to.
+ * New references must only be taken by someone who already holds one (or has the zone locked while
+ * the message is still queued), so nobody can revive a message whose count already hit zero.
+ * Whoever drops the last reference frees the message, and only that needs the zone lock. */
+static void ngx_http_push_store_reserve_message_num_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_int_t reservations) {
   if(msg == NULL) {
     return;
   }
-  msg->refcount++;
+  ngx_atomic_fetch_add(&msg->refcount, reservations);
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, RESERVED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
   //we need a refcount because channel messages MAY be dequed before they are used up. It thus falls on the IPC stuff to free it.
 }
 
-static void ngx_http_push_store_reserve_message_num_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_int_t reservations) {
-  if(msg == NULL) {
-    return;
-  }
-  msg->refcount+=reservations;
-  //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, RESERVED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
-  //we need a refcount because channel messages MAY be dequed before they are used up. It thus falls on the IPC stuff to free it.
+static void ngx_http_push_store_reserve_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg) {
+  ngx_http_push_store_reserve_message_num_locked(channel, msg, 1);
 }
 
 static void ngx_http_push_store_reserve_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg) {
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  ngx_http_push_store_reserve_message_locked(channel, msg);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
-  //we need a refcount because channel messages MAY be dequed before they are used up. It thus falls on the IPC stuff to free it.
+  //no lock needed. the caller already holds a reference.
+  ngx_http_push_store_reserve_message_num_locked(channel, msg, 1);
+}
+
+//drop a reference. returns 1 if that was the last one, and the message must now be freed.
+static ngx_inline ngx_int_t ngx_http_push_message_unref(ngx_http_push_msg_t *msg) {
+  ngx_atomic_uint_t               prev = ngx_atomic_fetch_add(&msg->refcount, (ngx_atomic_int_t) -1);
+  if(prev == 0) { //something worth exploring went wrong
+    ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "push module: message %p released more times than it was reserved", msg);
+    raise(SIGSEGV);
+  }
+  return prev == 1;
+}
+
+
+
+/* Large message memory: bodies too big for client_body_buffer_size, which nginx would otherwise leave
+ * in a temp file for every subscriber's worker to open, read and eventually unlink. Instead they're
+ * copied once into an anonymous file in shared memory (memfd, or an unlinked POSIX shm object where
+ * there's no memfd), and sent from there with sendfile. Space in the file is handed out in whole
+ * pages by a map-only arena in the partition. */
+static ngx_fd_t ngx_http_push_large_message_file(ngx_uint_t partition, size_t size, ngx_log_t *log) {
+  u_char                          name[sizeof("/push_module_large_messages__") + 2*NGX_INT_T_LEN];
+  ngx_fd_t                        fd;
+  ngx_sprintf(name, "/push_module_large_messages_%P_%ui%Z", ngx_pid, partition);
+#if (NGX_HTTP_PUSH_HAVE_MEMFD)
+  fd = memfd_create((char *) name + 1, MFD_CLOEXEC);
+#else
+  if((fd = shm_open((char *) name, O_RDWR | O_CREAT | O_EXCL, 0600)) != NGX_INVALID_FILE) {
+    shm_unlink((char *) name);
+  }
+#endif
+  if(fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "push module: unable to create large message memory for partition %ui", partition);
+    return NGX_INVALID_FILE;
+  }
+  if(ftruncate(fd, (off_t) size) == -1) {
+    ngx_log_error(NGX_LOG_WARN, log, ngx_errno, "push module: unable to size large message memory for partition %ui", partition);
+    ngx_close_file(fd);
+    return NGX_INVALID_FILE;
+  }
+  return fd;
+}
+
+static void ngx_http_push_large_message_free_locked(ngx_shm_zone_t *shm_zone, off_t pos, off_t len) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_http_push_arena_free_pages_locked(d->large_messages, (uint32_t) (pos >> ngx_pagesize_shift), (size_t) len);
+#if (NGX_HTTP_PUSH_HAVE_MEMFD) && defined(FALLOC_FL_PUNCH_HOLE)
+  //give the memory back now, rather than holding on to it until the pages get reused.
+  //still locked, so nobody can have been handed these pages again yet.
+  (void) fallocate(ngx_http_push_large_message_fds[d->partition], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, ngx_align(len, ngx_pagesize));
+#endif
+}
+
+//room in the partition's large message memory. returns where, or -1.
+static off_t ngx_http_push_large_message_reserve(ngx_shm_zone_t *shm_zone, off_t len) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  uint32_t                        page;
+  if(len <= 0 || ngx_http_push_large_message_fds[d->partition] == NGX_INVALID_FILE) {
+    return -1;
+  }
+  ngx_http_push_partition_lock(shm_zone);
+  if((page = ngx_http_push_arena_alloc_pages_locked(d->large_messages, (size_t) len)) == NGX_HTTP_PUSH_ARENA_NONE) {
+    //full. collect some garbage, same as for any other allocation
+    ngx_http_push_gc_batch_locked(shm_zone, (ngx_uint_t) ngx_http_push_store_mcf->gc_batch_size);
+    d->gc_active = 1;
+    page = ngx_http_push_arena_alloc_pages_locked(d->large_messages, (size_t) len);
+  }
+  ngx_http_push_partition_unlock(shm_zone);
+  return page == NGX_HTTP_PUSH_ARENA_NONE ? -1 : (off_t) page << ngx_pagesize_shift;
+}
+
+static ngx_fd_t ngx_http_push_store_message_body_fd(ngx_http_push_msg_t *msg) {
+  ngx_shm_zone_t                 *shm_zone;
+  if(!msg->body_in_memfd || (shm_zone = ngx_http_push_partition_for_ptr(msg)) == NULL) {
+    return NGX_INVALID_FILE;
+  }
+  return ngx_http_push_large_message_fds[ngx_http_push_zone_data(shm_zone)->partition];
 }
 
+//free a block allocated with message=1, from the arena or the slab pool. the partition must be locked.
+static void ngx_http_push_free_block_locked(ngx_shm_zone_t *shm_zone, void *p, size_t size) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  if(d->arena != NULL && ngx_http_push_arena_owns(d->arena, p)) {
+    ngx_http_push_arena_free_locked(d->arena, p, size);
+  }
+  else {
+    ngx_http_push_slab_free_locked(p);
+  }
+}
 
+//free a shared message body once no message needs it. the partition must be locked.
+static void ngx_http_push_free_shared_body_locked(ngx_shm_zone_t *shm_zone, ngx_http_push_msg_body_t *body) {
+  if(body->in_memfd) {
+    ngx_http_push_large_message_free_locked(shm_zone, body->file_pos, body->file_last - body->file_pos);
+  }
+  ngx_http_push_free_block_locked(shm_zone, body, body->block_size);
+}
 
 //free memory for a message. 
-static ngx_inline void ngx_http_push_free_message_locked(ngx_http_push_msg_t *msg, ngx_slab_pool_t *shpool) {
-  if(msg->buf->file!=NULL) {
+static ngx_inline void ngx_http_push_free_message_locked(ngx_http_push_msg_t *msg) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_ptr(msg);
+  if(msg->body_in_memfd && msg->shared_body == NULL) {
+    if(shm_zone != NULL) {
+      ngx_http_push_large_message_free_locked(shm_zone, msg->body_file_pos, msg->body_file_last - msg->body_file_pos);
+    }
+  }
+  else if(msg->body_in_file) {
     // i'd like to release the shpool lock here while i do stuff to this file, but that 
     // might unlock during channel rbtree traversal, which is Bad News.
-    if(msg->buf->file->fd!=NGX_INVALID_FILE) {
-      ngx_close_file(msg->buf->file->fd);
-    }
-    ngx_delete_file(msg->buf->file->name.data); //should I care about deletion errors? doubt it.
+    ngx_delete_file(msg->body.data); //should I care about deletion errors? doubt it.
+  }
+  if(msg->shared_body != NULL && --msg->shared_body->refcount == 0 && shm_zone != NULL) {
+    //last one out. it's in the same partition.
+    ngx_http_push_free_shared_body_locked(shm_zone, msg->shared_body);
+  }
+  if(msg->gzip_separate && shm_zone != NULL) {
+    ngx_http_push_free_block_locked(shm_zone, msg->gzip_body.data, msg->gzip_body.len);
+  }
+  //content type and body are in the same block
+  if(shm_zone != NULL && ngx_http_push_zone_data(shm_zone)->arena != NULL && ngx_http_push_arena_owns(ngx_http_push_zone_data(shm_zone)->arena, msg)) {
+    ngx_http_push_arena_free_locked(ngx_http_push_zone_data(shm_zone)->arena, msg, msg->block_size);
+  }
+  else {
+    ngx_http_push_slab_free_locked(msg);
   }
-  ngx_http_push_slab_free_locked(msg->buf); //separate block, remember?
-  ngx_http_push_slab_free_locked(msg);
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, FREED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
-  if(msg->refcount < 0) { //something worth exploring went wrong
-    raise(SIGSEGV);
+  if(shm_zone != NULL) {
+    ngx_http_push_zone_data(shm_zone)->messages--;
   }
-  ((ngx_http_push_shm_data_t *) ngx_http_push_shm_zone->data)->messages--;
 }
 
-// remove a message from queue and free all associated memory. assumes shpool is already locked.
+// remove a message from the channel's queue and drop the queue's reference. assumes shpool is already locked.
+// force frees the message even if someone else still holds a reference -- only do that when nobody else can be running.
 static ngx_int_t ngx_http_push_delete_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_int_t force) {
   if (msg==NULL) {
     return NGX_OK;
   }
   if(channel!=NULL) {
     ngx_queue_remove(&msg->queue);
+    msg->queue.prev=NULL;
+    msg->queue.next=NULL;
     channel->messages--;
+    if(channel->ring != NULL && channel->ring[msg->seq % channel->ring_size] == msg) {
+      channel->ring[msg->seq % channel->ring_size] = NULL;
+    }
   }
-  if(msg->refcount<=0 || force) {
+  if(force || ngx_http_push_message_unref(msg)) {
     //nobody needs this message, or we were forced at integer-point to delete
-    ngx_http_push_free_message_locked(msg, ngx_http_push_shpool);
+    ngx_http_push_free_message_locked(msg);
   }
   return NGX_OK;
 }
@@ -201,32 +540,75 @@ static void ngx_http_push_store_release_message_locked(ngx_http_push_channel_t *
   if(msg == NULL) {
     return;
   }
-  msg->refcount--;
-  //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, RELEASED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
-  if(msg->queue.next==NULL && msg->refcount<=0) { 
-    //message had been dequeued and nobody needs it anymore
-    ngx_http_push_free_message_locked(msg, ngx_http_push_shpool);
-  }
+  //still holding our reference, so msg can't go away under us here.
   if(channel != NULL && channel->messages > msg->delete_oldest_received_min_messages && ngx_http_push_get_oldest_message_locked(channel) == msg) {
     ngx_http_push_delete_message_locked(channel, msg, 0);
   }
+  //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, RELEASED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
+  if(ngx_http_push_message_unref(msg)) { 
+    //message had been dequeued and nobody needs it anymore
+    ngx_http_push_free_message_locked(msg);
+  }
 }
 
 static void ngx_http_push_store_release_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg) {
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  ngx_http_push_store_release_message_locked(channel, msg);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t                 *shm_zone;
+  if(msg == NULL || (shm_zone = ngx_http_push_partition_for_ptr(msg)) == NULL) {
+    return;
+  }
+  if(channel != NULL && msg->delete_oldest_received_min_messages != NGX_MAX_UINT32_VALUE) {
+    //push_delete_oldest_received_message may need to dequeue this message. that's a structural change.
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_store_release_message_locked(channel, msg);
+    ngx_http_push_partition_unlock(shm_zone);
+  }
+  else if(ngx_http_push_message_unref(msg)) {
+    //last one out. only freeing needs the lock.
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_free_message_locked(msg);
+    ngx_http_push_partition_unlock(shm_zone);
+  }
 }
 
 static ngx_int_t ngx_http_push_delete_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_int_t force) {
-  ngx_int_t ret;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_int_t                       ret;
+  ngx_shm_zone_t                 *shm_zone;
+  if(msg == NULL || (shm_zone = ngx_http_push_partition_for_ptr(msg)) == NULL) {
+    return NGX_OK;
+  }
+  ngx_http_push_partition_lock(shm_zone);
   ret = ngx_http_push_delete_message_locked(channel, msg, force);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_partition_unlock(shm_zone);
   return ret;
 }
 
 
+//ring channels' message tags are sequence numbers, so the message after msgid is one index away.
+//returns NGX_DECLINED when msgid can't be placed in the ring, and the queue has to be searched instead.
+static ngx_int_t ngx_http_push_find_ring_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_id_t *msgid, ngx_http_push_msg_t **found) {
+  ngx_http_push_msg_t            *prev, *next;
+  uint64_t                        seq;
+  if(msgid->tag <= 0 || (uint64_t) msgid->tag > channel->last_seq) {
+    return NGX_DECLINED;
+  }
+  seq = (uint64_t) msgid->tag;
+  //make sure the subscriber really did get this message from this channel
+  prev = channel->ring[seq % channel->ring_size];
+  if(prev == NULL || prev->seq != seq || prev->message_time != msgid->time) {
+    return NGX_DECLINED;
+  }
+  if(seq == channel->last_seq) {
+    *found = NULL;
+    return NGX_OK;
+  }
+  next = channel->ring[(seq + 1) % channel->ring_size];
+  if(next == NULL || next->seq != seq + 1) {
+    return NGX_DECLINED;
+  }
+  *found = next;
+  return NGX_OK;
+}
+
 /** find message with entity tags matching those of the request r.
   * @param r subscriber request
   */
@@ -245,6 +627,11 @@ static ngx_http_push_msg_t * ngx_http_push_find_message_locked(ngx_http_push_cha
     return NULL;
   }
   
+  if(channel->ring != NULL && ngx_http_push_find_ring_message_locked(channel, msgid, &msg) == NGX_OK) {
+    *status = msg == NULL ? NGX_HTTP_PUSH_MESSAGE_EXPECTED : NGX_HTTP_PUSH_MESSAGE_FOUND;
+    return msg;
+  }
+  
   // do we want a future message?
   msg = ngx_queue_data(sentinel->prev, ngx_http_push_msg_t, queue); 
   if(time <= msg->message_time) { //that's an empty check (Sentinel's values are zero)
@@ -286,9 +673,10 @@ static ngx_http_push_msg_t * ngx_http_push_find_message_locked(ngx_http_push_cha
 static ngx_http_push_channel_t * ngx_http_push_store_find_channel(ngx_str_t *id, time_t channel_timeout, ngx_int_t (*callback)(ngx_http_push_channel_t *channel)) {
   //get the channel and check channel authorization while we're at it.
   ngx_http_push_channel_t        *channel;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  channel = ngx_http_push_find_channel(id, channel_timeout, ngx_http_push_shm_zone);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_id(id);
+  ngx_http_push_partition_lock(shm_zone);
+  channel = ngx_http_push_find_channel(id, channel_timeout, shm_zone);
+  ngx_http_push_partition_unlock(shm_zone);
   if(callback!=NULL) {
     callback(channel);
   }
@@ -300,7 +688,8 @@ static ngx_int_t ngx_http_push_store_publish_raw(ngx_http_push_channel_t *channe
   
   //subscribers are queued up in a local pool. Queue heads, however, are located
   //in shared memory, identified by pid.
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t                *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_http_push_partition_lock(shm_zone);
   ngx_http_push_pid_queue_t     *sentinel = channel->workers_with_subscribers;
   ngx_http_push_subscriber_t    *subscriber_sentinels[NGX_MAX_PROCESSES];
   ngx_http_push_pid_queue_t     *pid_queues[NGX_MAX_PROCESSES];
@@ -331,15 +720,15 @@ static ngx_int_t ngx_http_push_store_publish_raw(ngx_http_push_channel_t *channe
   if(sub_sentinel_count > 0) {
     ngx_http_push_store_reserve_message_num_locked(channel, msg, sub_sentinel_count);
   }
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_partition_unlock(shm_zone);
   
   ngx_http_push_subscriber_t *subscriber_sentinel=NULL;
   for(i=0; i < sub_sentinel_count; i++) {
-    ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+    ngx_http_push_partition_lock(shm_zone);
     subscriber_sentinel = subscriber_sentinels[i];
     pid_t           worker_pid  = pid_queues[i]->pid;
     ngx_int_t       worker_slot = pid_queues[i]->slot;
-    ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+    ngx_http_push_partition_unlock(shm_zone);
     //if(msg != NULL)
     //  ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "publish msg %p (ref: %i) for worker %i (slot %i)", msg, msg->refcount, worker_pid, worker_slot);
     
@@ -352,11 +741,19 @@ static ngx_int_t ngx_http_push_store_publish_raw(ngx_http_push_channel_t *channe
       else {
         //some other worker's subscribers
         //interprocess communication breakdown
-        if(ngx_http_push_store_send_worker_message(channel, subscriber_sentinel, worker_pid, worker_slot, msg, status_code) != NGX_ERROR) {
-          ngx_http_push_alert_worker(worker_pid, worker_slot);
-        }
-        else {
+        if(ngx_http_push_store_send_worker_message(channel, subscriber_sentinel, worker_pid, worker_slot, msg, status_code) == NGX_ERROR) {
           ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: error communicating with some other worker process");
+          ngx_http_push_store_release_message(NULL, msg); //the reservation made for that worker
+          //its subscribers wait for the next message instead. unless some came along since: those are in a new
+          //sentinel, in that worker's memory, and the old one can't be merged into it from here.
+          ngx_http_push_partition_lock(shm_zone);
+          if(pid_queues[i]->subscriber_sentinel == NULL) {
+            pid_queues[i]->subscriber_sentinel = subscriber_sentinel;
+          }
+          else {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: subscribers of worker %i lost a message and will time out", worker_pid);
+          }
+          ngx_http_push_partition_unlock(shm_zone);
         }
       }
     } else {
@@ -371,38 +768,40 @@ static ngx_int_t ngx_http_push_store_publish_raw(ngx_http_push_channel_t *channe
 static ngx_int_t ngx_http_push_store_delete_channel(ngx_str_t *channel_id) {
   ngx_http_push_channel_t        *channel;
   ngx_http_push_msg_t            *msg, *sentinel;
-  ngx_http_push_store_lock_shmem();
-  channel = ngx_http_push_find_channel(channel_id, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT, ngx_http_push_shm_zone);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_id(channel_id);
+  ngx_http_push_partition_lock(shm_zone);
+  channel = ngx_http_push_find_channel(channel_id, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT, shm_zone);
   if (channel == NULL) {
-    ngx_http_push_store_unlock_shmem();
+    ngx_http_push_partition_unlock(shm_zone);
     return NGX_OK;
   }
   sentinel = channel->message_queue; 
-  msg = sentinel;
         
-  while((msg=(ngx_http_push_msg_t *)ngx_queue_next(&msg->queue))!=sentinel) {
-    //force-delete all the messages
-    ngx_http_push_delete_message_locked(NULL, msg, 1);
+  while(!ngx_queue_empty(&sentinel->queue)) {
+    //dequeue all the messages. ones still being delivered get freed when their last reference is released.
+    msg = ngx_queue_data(ngx_queue_head(&sentinel->queue), ngx_http_push_msg_t, queue);
+    ngx_http_push_delete_message_locked(channel, msg, 0);
   }
   channel->messages=0;
   
   //410 gone
-  ngx_http_push_store_unlock_shmem();
+  ngx_http_push_partition_unlock(shm_zone);
   
   ngx_http_push_store_publish_raw(channel, NULL, NGX_HTTP_GONE, &NGX_HTTP_PUSH_HTTP_STATUS_410);
   
-  ngx_http_push_store_lock_shmem();
-  ngx_http_push_delete_channel_locked(channel, ngx_http_push_shm_zone);
-  ngx_http_push_store_unlock_shmem();
+  ngx_http_push_partition_lock(shm_zone);
+  ngx_http_push_delete_channel_locked(channel, shm_zone);
+  ngx_http_push_partition_unlock(shm_zone);
   return NGX_OK;
 }
 
 static ngx_http_push_channel_t * ngx_http_push_store_get_channel(ngx_str_t *id, time_t channel_timeout, ngx_int_t (*callback)(ngx_http_push_channel_t *channel)) {
   //get the channel and check channel authorization while we're at it.
   ngx_http_push_channel_t        *channel;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  channel = ngx_http_push_get_channel(id, channel_timeout, ngx_http_push_shm_zone);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_id(id);
+  ngx_http_push_partition_lock(shm_zone);
+  channel = ngx_http_push_get_channel(id, channel_timeout, shm_zone);
+  ngx_http_push_partition_unlock(shm_zone);
   if(channel==NULL) {
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate memory for new channel");
   }
@@ -412,19 +811,205 @@ static ngx_http_push_channel_t * ngx_http_push_store_get_channel(ngx_str_t *id,
   return channel;
 }
 
+//this worker's copy of the prefix index. publishers walk it without taking any locks, and it's made again when the index changes.
+static ngx_http_push_prefix_node_t *ngx_http_push_prefix_snapshot = NULL;
+static ngx_pool_t              *ngx_http_push_prefix_snapshot_pool = NULL;
+static ngx_atomic_uint_t        ngx_http_push_prefix_snapshot_generation = 0;
+
+static ngx_http_push_prefix_node_t * ngx_http_push_store_prefix_snapshot(void) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(ngx_http_push_ipc_zone);
+  ngx_http_push_prefix_node_t    *copy = NULL;
+  ngx_atomic_uint_t               generation;
+  ngx_pool_t                     *pool;
+  if(ngx_http_push_prefix_snapshot_generation == d->prefix_generation) {
+    return ngx_http_push_prefix_snapshot;
+  }
+  if((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log))==NULL) {
+    return ngx_http_push_prefix_snapshot; //a stale copy beats none. try again next time
+  }
+  ngx_rwlock_reserve_read(&d->prefix_lock);
+  generation = d->prefix_generation;
+  if(d->prefixes != NULL && (copy = ngx_http_push_prefix_copy_locked(d->prefixes, pool)) == NULL) {
+    ngx_rwlock_release_read(&d->prefix_lock);
+    ngx_destroy_pool(pool);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate memory for a copy of the channel prefix index");
+    return ngx_http_push_prefix_snapshot;
+  }
+  ngx_rwlock_release_read(&d->prefix_lock);
+  if(ngx_http_push_prefix_snapshot_pool != NULL) {
+    ngx_destroy_pool(ngx_http_push_prefix_snapshot_pool);
+  }
+  ngx_http_push_prefix_snapshot_pool = pool;
+  ngx_http_push_prefix_snapshot = copy;
+  ngx_http_push_prefix_snapshot_generation = generation;
+  return copy;
+}
+
+static ngx_int_t ngx_http_push_store_add_prefix_locked(ngx_http_push_shm_data_t *d, ngx_str_t *prefix) {
+  ngx_int_t                       rc;
+  ngx_http_push_partition_lock(ngx_http_push_ipc_zone);
+  if(d->prefixes == NULL) {
+    d->prefixes = ngx_http_push_prefix_create_locked(ngx_http_push_ipc_zone);
+  }
+  rc = d->prefixes != NULL ? ngx_http_push_prefix_add_locked(d->prefixes, prefix, ngx_http_push_ipc_zone) : NGX_ERROR;
+  ngx_http_push_partition_unlock(ngx_http_push_ipc_zone);
+  if(rc == NGX_OK) {
+    ngx_atomic_fetch_add(&d->prefix_count, 1);
+    ngx_atomic_fetch_add(&d->prefix_generation, 1);
+  }
+  return rc;
+}
+
+/* put a prefix channel in the prefix index, once it's been created and is being subscribed to. if this worker's
+ * copy already has it, it's in there: a prefix only leaves the index when its channel's gone, and that's checked
+ * again after it's taken out. */
+static void ngx_http_push_store_index_prefix_channel(ngx_str_t *id, ngx_http_push_loc_conf_t *cf) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(ngx_http_push_ipc_zone);
+  ngx_http_push_prefix_node_t    *snapshot;
+  ngx_str_t                       prefix;
+  ngx_int_t                       rc;
+  if(!cf->prefix_wildcard || !ngx_http_push_prefix_channel_id(id)) {
+    return;
+  }
+  prefix.data = id->data;
+  prefix.len = id->len - 1;
+  if((snapshot = ngx_http_push_store_prefix_snapshot()) != NULL && ngx_http_push_prefix_find_locked(snapshot, &prefix)) {
+    return;
+  }
+  ngx_rwlock_reserve_write(&d->prefix_lock);
+  rc = ngx_http_push_store_add_prefix_locked(d, &prefix);
+  ngx_rwlock_release_write(&d->prefix_lock);
+  if(rc == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate memory for channel prefix index");
+  }
+}
+
+/* take the prefixes whose channels were deleted from a partition out of the prefix index. deleting a channel only
+ * counts them: the partition's locked then, and the index's lock has to come first. so the gc timer checks all of
+ * the partition's prefixes for channels that are gone, under one lock. */
+static void ngx_http_push_store_sweep_prefixes(ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(ngx_http_push_ipc_zone);
+  ngx_http_push_shm_data_t       *pd = ngx_http_push_zone_data(shm_zone);
+  ngx_http_push_channel_t        *channel;
+  ngx_array_t                    *ids = NULL;
+  ngx_str_t                      *id, prefix;
+  ngx_uint_t                      i, deleted, gone = 0;
+  ngx_pool_t                     *pool;
+  if((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log))==NULL) {
+    return; //next time
+  }
+  ngx_rwlock_reserve_write(&d->prefix_lock);
+  if(d->prefixes != NULL && (ids = ngx_http_push_prefix_channel_ids_locked(d->prefixes, pool)) == NULL) {
+    ngx_rwlock_release_write(&d->prefix_lock);
+    ngx_destroy_pool(pool);
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate memory to sweep the channel prefix index");
+    return;
+  }
+  id = ids != NULL ? ids->elts : NULL;
+  ngx_http_push_partition_lock(shm_zone);
+  deleted = pd->prefix_channels_deleted;
+  for(i = 0; ids != NULL && i < ids->nelts; i++) {
+    if(ngx_http_push_partition_for_id(&id[i]) == shm_zone && ngx_http_push_peek_channel_locked(&id[i], shm_zone) == NULL) {
+      id[gone++] = id[i];
+    }
+  }
+  pd->prefix_channels_deleted -= deleted;
+  ngx_http_push_partition_unlock(shm_zone);
+  if(gone > 0) {
+    ngx_http_push_partition_lock(ngx_http_push_ipc_zone);
+    for(i = 0; i < gone; i++) {
+      prefix.data = id[i].data;
+      prefix.len = id[i].len - 1;
+      ngx_http_push_prefix_remove_locked(d->prefixes, &prefix);
+    }
+    ngx_http_push_partition_unlock(ngx_http_push_ipc_zone);
+    ngx_atomic_fetch_add(&d->prefix_count, -(ngx_atomic_int_t) gone);
+    ngx_atomic_fetch_add(&d->prefix_generation, 1);
+    //a subscriber that made the channel again before the generation changed saw it in its old copy, and didn't add it back
+    for(i = 0; i < gone; i++) {
+      ngx_http_push_partition_lock(shm_zone);
+      channel = ngx_http_push_peek_channel_locked(&id[i], shm_zone);
+      ngx_http_push_partition_unlock(shm_zone);
+      if(channel != NULL) {
+        prefix.data = id[i].data;
+        prefix.len = id[i].len - 1;
+        ngx_http_push_store_add_prefix_locked(d, &prefix);
+      }
+    }
+  }
+  ngx_rwlock_release_write(&d->prefix_lock);
+  ngx_destroy_pool(pool);
+}
+
+/* ids of the prefix channels whose subscribers get what's published to a channel, allocated from r's pool. NULL if
+ * there are none. they come straight from this worker's copy of the index: the channels aren't looked up. */
+static ngx_str_t * ngx_http_push_store_prefix_channels(ngx_str_t *id, ngx_uint_t *n, ngx_http_request_t *r) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(ngx_http_push_ipc_zone);
+  ngx_http_push_prefix_node_t    *snapshot;
+  ngx_str_t                      *ids;
+  size_t                         *lens, size = 0;
+  ngx_uint_t                      i, matched;
+  u_char                         *p;
+  *n = 0;
+  if(d->prefix_count == 0 || ngx_http_push_prefix_channel_id(id)) {
+    return NULL; //nobody's subscribed to a prefix, or this is a prefix channel itself. those don't pass messages on.
+  }
+  if((snapshot = ngx_http_push_store_prefix_snapshot()) == NULL || (lens = ngx_palloc(r->pool, sizeof(*lens) * (id->len + 1)))==NULL) {
+    return NULL;
+  }
+  matched = ngx_http_push_prefix_match_locked(snapshot, id, lens);
+  if(matched == 0) {
+    return NULL;
+  }
+  for(i = 0; i < matched; i++) {
+    size += lens[i] + 1;
+  }
+  if((ids = ngx_palloc(r->pool, sizeof(*ids) * matched + size))==NULL) {
+    return NULL;
+  }
+  p = (u_char *) (ids + matched);
+  for(i = 0; i < matched; i++) {
+    ids[i].data = p;
+    ids[i].len = lens[i] + 1;
+    p = ngx_cpymem(p, id->data, lens[i]);
+    *p++ = NGX_HTTP_PUSH_PREFIX_WILDCARD;
+  }
+  *n = matched;
+  return ids;
+}
+
 static ngx_http_push_msg_t * ngx_http_push_store_get_channel_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_id_t *msgid, ngx_int_t *msg_search_outcome, ngx_http_push_loc_conf_t *cf) {
   ngx_http_push_msg_t *msg;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_store_lock_shmem(channel);
   msg = ngx_http_push_find_message_locked(channel, msgid, msg_search_outcome);
   if(*msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_FOUND) {
     ngx_http_push_store_reserve_message_locked(channel, msg);
   }
   channel->last_seen = ngx_time();
   channel->expires = ngx_time() + cf->channel_timeout;
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_store_unlock_shmem(channel);
   return msg;
 }
 
+//the message after msgid and up to max-1 more after it, oldest first, all under one lock. returns how many there are.
+static ngx_uint_t ngx_http_push_store_get_channel_messages(ngx_http_push_channel_t *channel, ngx_http_push_msg_id_t *msgid, ngx_http_push_msg_t **msgs, ngx_uint_t max, ngx_int_t *msg_search_outcome, ngx_http_push_loc_conf_t *cf) {
+  ngx_queue_t                    *sentinel = &channel->message_queue->queue, *cur;
+  ngx_http_push_msg_t            *msg;
+  ngx_uint_t                      n = 0;
+  ngx_http_push_store_lock_shmem(channel);
+  msg = ngx_http_push_find_message_locked(channel, msgid, msg_search_outcome);
+  if(*msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_FOUND) {
+    for(cur = &msg->queue; cur != sentinel && n < max; cur = ngx_queue_next(cur)) {
+      msgs[n] = ngx_queue_data(cur, ngx_http_push_msg_t, queue);
+      ngx_http_push_store_reserve_message_locked(channel, msgs[n++]);
+    }
+  }
+  channel->last_seen = ngx_time();
+  channel->expires = ngx_time() + cf->channel_timeout;
+  ngx_http_push_store_unlock_shmem(channel);
+  return n;
+}
+
 static ngx_int_t default_get_message_callback(ngx_http_push_msg_t *msg, ngx_int_t msg_search_outcome, ngx_http_request_t *r) {
   return NGX_OK;
 }
@@ -435,12 +1020,11 @@ static ngx_http_push_msg_t * ngx_http_push_store_get_message(ngx_str_t *channel_
   if(callback==NULL) {
     callback=&default_get_message_callback;
   }
-  ngx_http_push_store_lock_shmem();
-  channel = ngx_http_push_get_channel(channel_id, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT, ngx_http_push_shm_zone);
-  ngx_http_push_store_unlock_shmem();
+  channel = ngx_http_push_store_get_channel(channel_id, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT, NULL);
   if (channel == NULL) {
     return NULL;
   }
+  ngx_http_push_store_index_prefix_channel(channel_id, ngx_http_get_module_loc_conf(r, ngx_http_push_module));
   msg = ngx_http_push_store_get_channel_message(channel, msg_id, msg_search_outcome, ngx_http_get_module_loc_conf(r, ngx_http_push_module));
   callback(msg, *msg_search_outcome, r);
   return msg;
@@ -450,42 +1034,134 @@ static ngx_http_push_msg_t * ngx_http_push_store_get_message(ngx_str_t *channel_
 static ngx_int_t  ngx_http_push_init_shm_zone(ngx_shm_zone_t * shm_zone, void *data) {
   if(data) { /* zone already initialized */
     shm_zone->data = data;
+    if((((ngx_http_push_shm_data_t *) data)->hashtable != NULL) != (ngx_http_push_channel_index == NGX_HTTP_PUSH_CHANNEL_INDEX_HASH)) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: cannot change push_channel_index without restart, ignoring change");
+    }
+    if((((ngx_http_push_shm_data_t *) data)->arena != NULL) != (ngx_http_push_store_mcf->message_arena > 0)) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: cannot change push_message_arena without restart, ignoring change");
+    }
+    if((((ngx_http_push_shm_data_t *) data)->large_messages != NULL) != (ngx_http_push_store_mcf->large_message_memory > 0)) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: cannot change push_large_message_memory without restart, ignoring change");
+    }
     return NGX_OK;
   }
 
-  ngx_slab_pool_t                *shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
   ngx_rbtree_node_t              *sentinel;
   ngx_http_push_shm_data_t       *d;
-  
-  ngx_http_push_shpool = shpool; //we'll be using this a bit.
+  ngx_uint_t                      i;
   #if (DEBUG_SHM_ALLOC == 1)
+  ngx_slab_pool_t                *shpool = ngx_http_push_zone_shpool(shm_zone);
   ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "ngx_http_push_shpool start %p size %i", shpool->start, (u_char *)shpool->end - (u_char *)shpool->start);
   #endif
   
-  if ((d = (ngx_http_push_shm_data_t *)ngx_http_push_slab_alloc(sizeof(*d), "shm data")) == NULL) { //shm_data
+  shm_zone->data = NULL; //nothing to garbage-collect yet
+  if ((d = (ngx_http_push_shm_data_t *)ngx_http_push_slab_alloc(shm_zone, sizeof(*d), "shm data")) == NULL) { //shm_data
     return NGX_ERROR;
   }
   d->channels=0;
   d->messages=0;
-  shm_zone->data = d;
+  d->partition=0;
+  for(i=0; i < ngx_http_push_shm_partitions; i++) {
+    if(ngx_http_push_shm_zones[i] == shm_zone) {
+      d->partition=i;
+      break;
+    }
+  }
   d->ipc=NULL;
-  //initialize rbtree
-  if ((sentinel = ngx_http_push_slab_alloc(sizeof(*sentinel), "channel rbtree sentinel"))==NULL) {
+  d->prefixes=NULL;
+  ngx_rwlock_init(&d->prefix_lock);
+  d->prefix_count=0;
+  d->prefix_generation=0;
+  d->prefix_channels_deleted=0;
+  d->hashtable=NULL;
+  d->expiry=NULL;
+  d->arena=NULL;
+  d->large_messages=NULL;
+  d->expired=0;
+  ngx_queue_init(&d->lru_channels);
+  d->evicted_channels=0;
+  d->evicted_messages=0;
+  ngx_queue_init(&d->gc_channels);
+  ngx_queue_init(&d->delayed_channels);
+  d->gc_cursor=&d->gc_channels;
+  d->gc_active=0;
+  d->gc_runs=0;
+  d->gc_collected=0;
+  d->gc_pause_last=0;
+  d->gc_pause_max=0;
+  d->gc_pause_total=0;
+  shm_zone->data = d;
+  //initialize rbtree. it stays empty when channels are indexed in the hashtable.
+  if ((sentinel = ngx_http_push_slab_alloc(shm_zone, sizeof(*sentinel), "channel rbtree sentinel"))==NULL) {
     return NGX_ERROR;
   }
   ngx_rbtree_init(&d->tree, sentinel, ngx_http_push_rbtree_insert);
+  ngx_http_push_partition_lock(shm_zone);
+  d->expiry = ngx_http_push_expiry_create_locked(shm_zone, NGX_HTTP_PUSH_EXPIRY_INITIAL_SIZE);
+  ngx_http_push_partition_unlock(shm_zone);
+  if(d->expiry == NULL) {
+    return NGX_ERROR;
+  }
+  if(ngx_http_push_store_mcf->message_arena > 0) {
+    ngx_http_push_partition_lock(shm_zone);
+    d->arena = ngx_http_push_arena_create_locked(shm_zone, ngx_http_push_partition_pages(shm_zone) * ngx_http_push_store_mcf->message_arena / 100 << ngx_pagesize_shift, 0);
+    ngx_http_push_partition_unlock(shm_zone);
+    if(d->arena == NULL) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: unable to set aside a message arena in partition %ui. messages will share the slab pool.", d->partition);
+    }
+  }
+  if(ngx_http_push_store_mcf->large_message_memory > 0) {
+    size_t                        size = ngx_align(ngx_http_push_store_mcf->large_message_memory / ngx_http_push_shm_partitions, ngx_pagesize);
+    //a new zone means none of the old messages are coming along. workers still using them have their own descriptor.
+    if(ngx_http_push_large_message_fds[d->partition] != NGX_INVALID_FILE) {
+      ngx_close_file(ngx_http_push_large_message_fds[d->partition]);
+    }
+    ngx_http_push_large_message_fds[d->partition] = ngx_http_push_large_message_file(d->partition, size, ngx_cycle->log);
+    if(ngx_http_push_large_message_fds[d->partition] != NGX_INVALID_FILE) {
+      ngx_http_push_partition_lock(shm_zone);
+      d->large_messages = ngx_http_push_arena_create_locked(shm_zone, size, 1);
+      ngx_http_push_partition_unlock(shm_zone);
+    }
+    if(d->large_messages == NULL) {
+      ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: no large message memory in partition %ui. large messages will stay in temp files.", d->partition);
+    }
+  }
+  if(ngx_http_push_channel_index == NGX_HTTP_PUSH_CHANNEL_INDEX_HASH) {
+    ngx_http_push_partition_lock(shm_zone);
+    d->hashtable = ngx_http_push_hashtable_create_locked(shm_zone, NGX_HTTP_PUSH_HASHTABLE_INITIAL_SIZE);
+    ngx_http_push_partition_unlock(shm_zone);
+    if(d->hashtable == NULL) {
+      return NGX_ERROR;
+    }
+  }
   return NGX_OK;
 }
 
 //shared memory
 static ngx_str_t  ngx_push_shm_name = ngx_string("push_module"); //shared memory segment name
-static ngx_int_t  ngx_http_push_set_up_shm(ngx_conf_t *cf, size_t shm_size) {
-  ngx_http_push_shm_zone = ngx_shared_memory_add(cf, &ngx_push_shm_name, shm_size, &ngx_http_push_module);
-  if (ngx_http_push_shm_zone == NULL) {
-    return NGX_ERROR;
+static ngx_int_t  ngx_http_push_set_up_shm(ngx_conf_t *cf, size_t shm_size, ngx_uint_t partitions) {
+  ngx_uint_t                      i;
+  ngx_str_t                      *name;
+  ngx_shm_zone_t                 *shm_zone;
+  for(i=0; i < partitions; i++) {
+    if(i == 0) {
+      name = &ngx_push_shm_name; //the first partition keeps the old name
+    }
+    else {
+      if((name = ngx_palloc(cf->pool, sizeof(*name) + ngx_push_shm_name.len + 1 + NGX_INT_T_LEN))==NULL) {
+        return NGX_ERROR;
+      }
+      name->data = (u_char *)(name+1);
+      name->len = ngx_sprintf(name->data, "%V_%ui", &ngx_push_shm_name, i) - name->data;
+    }
+    if((shm_zone = ngx_shared_memory_add(cf, name, shm_size, &ngx_http_push_module)) == NULL) {
+      return NGX_ERROR;
+    }
+    shm_zone->init = ngx_http_push_init_shm_zone;
+    shm_zone->data = (void *) 1; 
+    ngx_http_push_shm_zones[i] = shm_zone;
   }
-  ngx_http_push_shm_zone->init = ngx_http_push_init_shm_zone;
-  ngx_http_push_shm_zone->data = (void *) 1; 
+  ngx_http_push_shm_partitions = partitions;
   return NGX_OK;
 }
 
@@ -499,32 +1175,54 @@ static ngx_int_t ngx_http_push_store_init_module(ngx_cycle_t *cycle) {
 
 //will be called once per worker
 static ngx_int_t ngx_http_push_store_init_ipc_shm(ngx_int_t workers) {
-  ngx_slab_pool_t                *shpool = (ngx_slab_pool_t *) ngx_http_push_shm_zone->shm.addr;
-  ngx_http_push_shm_data_t       *d = (ngx_http_push_shm_data_t *) ngx_http_push_shm_zone->data;
-  ngx_http_push_worker_msg_sentinel_t     *worker_messages=NULL;
-  ngx_shmtx_lock(&shpool->mutex);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_ipc_zone;
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_http_push_worker_mailbox_t *mailbox;
+  ngx_uint_t                      i;
+  ngx_http_push_partition_lock(shm_zone);
   if(d->ipc==NULL) {
     //ipc uninitialized. get it done!
-    if((worker_messages = ngx_http_push_slab_alloc_locked(sizeof(*worker_messages)*NGX_MAX_PROCESSES, "IPC worker message sentinel array"))==NULL) {
-      ngx_shmtx_unlock(&shpool->mutex);
+    if((d->ipc = ngx_http_push_slab_alloc_locked(shm_zone, sizeof(*d->ipc)*NGX_MAX_PROCESSES, "IPC worker mailbox array"))==NULL) {
+      ngx_http_push_partition_unlock(shm_zone);
       return NGX_ERROR;
     }
-    d->ipc=worker_messages;
-  }
-  else {
-    worker_messages=d->ipc;
+    ngx_memzero(d->ipc, sizeof(*d->ipc)*NGX_MAX_PROCESSES);
   }
   
-  ngx_queue_init(&worker_messages[ngx_process_slot].queue);
-  ngx_rwlock_init(&worker_messages[ngx_process_slot].lock);
+  if((mailbox = d->ipc[ngx_process_slot]) == NULL) {
+    //first worker in this process slot
+    if((mailbox = ngx_http_push_slab_alloc_locked(shm_zone, sizeof(*mailbox), "IPC worker mailbox"))==NULL) {
+      ngx_http_push_partition_unlock(shm_zone);
+      return NGX_ERROR;
+    }
+    mailbox->head = 0;
+    mailbox->tail = 0;
+    for(i=0; i < NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE; i++) {
+      mailbox->slots[i].seq = i;
+      mailbox->slots[i].claimant = 0;
+    }
+    mailbox->overflowed = 0;
+    ngx_queue_init(&mailbox->overflow);
+    d->ipc[ngx_process_slot] = mailbox;
+  }
+  //else a previous worker in this slot died. whatever it left behind gets cleaned up on our first read.
+  mailbox->alerted = 0;
   
-  ngx_shmtx_unlock(&shpool->mutex);
+  ngx_http_push_partition_unlock(shm_zone);
   return NGX_OK;
 }
 
 static ngx_int_t ngx_http_push_store_init_worker(ngx_cycle_t *cycle) {
   ngx_core_conf_t                *ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
   if(ngx_http_push_store_init_ipc_shm(ccf->worker_processes) == NGX_OK) {
+    ngx_http_push_mailbox_timer.handler = ngx_http_push_mailbox_timer_handler;
+    ngx_http_push_mailbox_timer.data = NULL;
+    ngx_http_push_mailbox_timer.log = cycle->log;
+    ngx_http_push_store_receive_worker_message(); //anything a dead predecessor never got to
+    ngx_http_push_gc_timer.handler = ngx_http_push_gc_timer_handler;
+    ngx_http_push_gc_timer.data = NULL;
+    ngx_http_push_gc_timer.log = cycle->log;
+    ngx_add_timer(&ngx_http_push_gc_timer, ngx_http_push_store_mcf->gc_interval);
     return ngx_http_push_ipc_init_worker(cycle);
   }
   else {
@@ -540,21 +1238,78 @@ static ngx_int_t ngx_http_push_store_init_postconfig(ngx_conf_t *cf) {
   if(conf->shm_size==NGX_CONF_UNSET_SIZE) {
     conf->shm_size=NGX_HTTP_PUSH_DEFAULT_SHM_SIZE;
   }
-  shm_size = ngx_align(conf->shm_size, ngx_pagesize);
+  if(conf->shm_partitions==NGX_CONF_UNSET) {
+    conf->shm_partitions=NGX_HTTP_PUSH_DEFAULT_SHM_PARTITIONS;
+  }
+  if(conf->channel_index==NGX_CONF_UNSET) {
+    conf->channel_index=NGX_HTTP_PUSH_CHANNEL_INDEX_RBTREE;
+  }
+  ngx_http_push_channel_index = conf->channel_index;
+  ngx_conf_init_msec_value(conf->gc_interval, NGX_HTTP_PUSH_DEFAULT_GC_INTERVAL);
+  ngx_conf_init_value(conf->gc_batch_size, NGX_HTTP_PUSH_DEFAULT_GC_BATCH_SIZE);
+  ngx_conf_init_value(conf->gc_high_watermark, NGX_HTTP_PUSH_DEFAULT_GC_HIGH_WATERMARK);
+  ngx_conf_init_value(conf->gc_low_watermark, NGX_HTTP_PUSH_DEFAULT_GC_LOW_WATERMARK);
+  if(conf->gc_interval == 0 || conf->gc_batch_size < 1) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "push_gc_interval and push_gc_batch_size must be positive");
+    return NGX_ERROR;
+  }
+  if(conf->gc_high_watermark > 100 || conf->gc_low_watermark > conf->gc_high_watermark) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "push_gc_low_watermark must not exceed push_gc_high_watermark, which must not exceed 100");
+    return NGX_ERROR;
+  }
+  ngx_conf_init_value(conf->message_arena, 0);
+  if(conf->message_arena < 0 || conf->message_arena > NGX_HTTP_PUSH_MAX_MESSAGE_ARENA) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "push_message_arena must be between 0 and %i percent", (ngx_int_t) NGX_HTTP_PUSH_MAX_MESSAGE_ARENA);
+    return NGX_ERROR;
+  }
+  ngx_conf_init_size_value(conf->large_message_memory, 0);
+  if(!ngx_http_push_large_message_fds_init) {
+    ngx_uint_t                  i;
+    for(i=0; i < NGX_HTTP_PUSH_MAX_SHM_PARTITIONS; i++) {
+      ngx_http_push_large_message_fds[i] = NGX_INVALID_FILE;
+    }
+    ngx_http_push_large_message_fds_init = 1;
+  }
+  ngx_conf_init_value(conf->eviction_policy, NGX_HTTP_PUSH_EVICTION_OFF);
+  if(conf->eviction_min_idle == NGX_CONF_UNSET) {
+    conf->eviction_min_idle = NGX_HTTP_PUSH_DEFAULT_EVICTION_MIN_IDLE;
+  }
+  ngx_http_push_store_mcf = conf;
+  if(conf->shm_partitions < 1 || conf->shm_partitions > NGX_HTTP_PUSH_MAX_SHM_PARTITIONS) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "push_shm_partitions must be between 1 and %i, using %i", (ngx_int_t )NGX_HTTP_PUSH_MAX_SHM_PARTITIONS, conf->shm_partitions < 1 ? 1 : (ngx_int_t )NGX_HTTP_PUSH_MAX_SHM_PARTITIONS);
+    conf->shm_partitions = conf->shm_partitions < 1 ? 1 : NGX_HTTP_PUSH_MAX_SHM_PARTITIONS;
+  }
+  if(ngx_http_push_shm_partitions > 0 && ngx_http_push_shm_partitions != (ngx_uint_t )conf->shm_partitions) {
+    //channels are routed by partition count, so it can't change under existing channels
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "Cannot change push_shm_partitions without restart, ignoring change");
+    conf->shm_partitions = (ngx_int_t )ngx_http_push_shm_partitions;
+  }
+  //the memory limit is for all partitions together
+  shm_size = ngx_align(conf->shm_size / conf->shm_partitions, ngx_pagesize);
   if (shm_size < 8 * ngx_pagesize) {
-        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "The push_max_reserved_memory value must be at least %udKiB", (8 * ngx_pagesize) >> 10);
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "The push_max_reserved_memory value must be at least %udKiB per partition", (8 * ngx_pagesize) >> 10);
         shm_size = 8 * ngx_pagesize;
     }
-  if(ngx_http_push_shm_zone && ngx_http_push_shm_zone->shm.size != shm_size) {
+  if(ngx_http_push_shm_partitions > 0 && ngx_http_push_shm_zones[0] && ngx_http_push_shm_zones[0]->shm.size != shm_size) {
     ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "Cannot change memory area size without restart, ignoring change");
   }
-  ngx_conf_log_error(NGX_LOG_INFO, cf, 0, "Using %udKiB of shared memory for push module", shm_size >> 10);
+  ngx_conf_log_error(NGX_LOG_INFO, cf, 0, "Using %i partitions of %udKiB of shared memory for push module", conf->shm_partitions, shm_size >> 10);
   
-  return ngx_http_push_set_up_shm(cf, shm_size);
+  return ngx_http_push_set_up_shm(cf, shm_size, (ngx_uint_t )conf->shm_partitions);
 }
 
 static void ngx_http_push_store_create_main_conf(ngx_conf_t *cf, ngx_http_push_main_conf_t *mcf) {
   mcf->shm_size=NGX_CONF_UNSET_SIZE;
+  mcf->shm_partitions=NGX_CONF_UNSET;
+  mcf->channel_index=NGX_CONF_UNSET;
+  mcf->gc_interval=NGX_CONF_UNSET_MSEC;
+  mcf->gc_batch_size=NGX_CONF_UNSET;
+  mcf->gc_high_watermark=NGX_CONF_UNSET;
+  mcf->gc_low_watermark=NGX_CONF_UNSET;
+  mcf->eviction_policy=NGX_CONF_UNSET;
+  mcf->message_arena=NGX_CONF_UNSET;
+  mcf->large_message_memory=NGX_CONF_UNSET_SIZE;
+  mcf->eviction_min_idle=NGX_CONF_UNSET;
 }
 
 //great justice appears to be at hand
@@ -568,11 +1323,7 @@ static ngx_int_t ngx_http_push_movezig_channel_locked(ngx_http_push_channel_t *
   return NGX_OK;
 }
 static ngx_int_t ngx_http_push_store_channel_subscribers(ngx_http_push_channel_t * channel) {
-  ngx_int_t subs;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  subs = channel->subscribers;
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
-  return subs;
+  return (ngx_int_t) channel->subscribers;
 }
 
 static ngx_int_t ngx_http_push_store_channel_worker_subscribers(ngx_http_push_subscriber_t * worker_sentinel) {
@@ -608,24 +1359,40 @@ static ngx_int_t ngx_http_push_store_channel_release_subscriber_sentinel(ngx_htt
 }
 
 static void ngx_http_push_store_exit_worker(ngx_cycle_t *cycle) {
+  if(ngx_http_push_gc_timer.timer_set) {
+    ngx_del_timer(&ngx_http_push_gc_timer);
+  }
+  if(ngx_http_push_mailbox_timer.timer_set) {
+    ngx_del_timer(&ngx_http_push_mailbox_timer);
+  }
   ngx_http_push_ipc_exit_worker(cycle);
 }
 
 static void ngx_http_push_store_exit_master(ngx_cycle_t *cycle) {
-  //destroy channel tree in shared memory
-  ngx_http_push_walk_rbtree(ngx_http_push_movezig_channel_locked, ngx_http_push_shm_zone);
+  ngx_uint_t                      i;
+  //destroy channel trees in shared memory
+  for(i=0; i < ngx_http_push_shm_partitions; i++) {
+    ngx_http_push_walk_channels(ngx_http_push_movezig_channel_locked, ngx_http_push_shm_zones[i]);
+  }
+  for(i=0; i < NGX_HTTP_PUSH_MAX_SHM_PARTITIONS && ngx_http_push_large_message_fds_init; i++) {
+    if(ngx_http_push_large_message_fds[i] != NGX_INVALID_FILE) {
+      ngx_close_file(ngx_http_push_large_message_fds[i]);
+      ngx_http_push_large_message_fds[i] = NGX_INVALID_FILE;
+    }
+  }
   //deinitialize IPC
   ngx_http_push_shutdown_ipc(cycle);
 }
 
-static ngx_http_push_subscriber_t * ngx_http_push_store_subscribe_raw(ngx_http_push_channel_t *channel, ngx_http_request_t *r) {
+//put a subscriber on this worker's queue for the channel. it may be one that's just been taken off it.
+static ngx_int_t ngx_http_push_store_queue_subscriber(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber) {
   ngx_http_push_pid_queue_t  *sentinel, *cur, *found;
-  ngx_http_push_subscriber_t *subscriber;
   ngx_http_push_subscriber_t *subscriber_sentinel;
-  //ngx_http_push_loc_conf_t   *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_shm_zone_t             *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_log_t                  *log = subscriber->request->connection->log;
   
   //subscribers are queued up in a local pool. Queue sentinels are separate and also local, but not in the pool.
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_partition_lock(shm_zone);
   sentinel = channel->workers_with_subscribers;
   cur = (ngx_http_push_pid_queue_t *)ngx_queue_head(&sentinel->queue);
   found = NULL;
@@ -638,10 +1405,10 @@ static ngx_http_push_subscriber_t * ngx_http_push_store_subscribe_raw(ngx_http_p
     cur = (ngx_http_push_pid_queue_t *)ngx_queue_next(&cur->queue);
   }
   if(found == NULL) { //found nothing
-    if((found=ngx_http_push_slab_alloc_locked(sizeof(*found), "worker subscriber sentinel"))==NULL) {
-      ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate worker subscriber queue marker in shared memory");
-      return NULL;
+    if((found=ngx_http_push_slab_alloc_locked(shm_zone, sizeof(*found), "worker subscriber sentinel"))==NULL) {
+      ngx_http_push_partition_unlock(shm_zone);
+      ngx_log_error(NGX_LOG_ERR, log, 0, "push module: unable to allocate worker subscriber queue marker in shared memory");
+      return NGX_ERROR;
     }
     //initialize
     ngx_queue_insert_tail(&sentinel->queue, &found->queue);
@@ -649,12 +1416,6 @@ static ngx_http_push_subscriber_t * ngx_http_push_store_subscribe_raw(ngx_http_p
     found->slot=ngx_process_slot;
     found->subscriber_sentinel=NULL;
   }
-  if((subscriber = ngx_palloc(ngx_http_push_pool, sizeof(*subscriber)))==NULL) { //unable to allocate request queue element
-    ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate subscriber worker's memory pool");
-    return NULL;
-  }
-  channel->subscribers++; // do this only when we know everything went okay.
   
   //figure out the subscriber sentinel
   subscriber_sentinel = ((ngx_http_push_pid_queue_t *)found)->subscriber_sentinel;
@@ -663,18 +1424,33 @@ static ngx_http_push_subscriber_t * ngx_http_push_store_subscribe_raw(ngx_http_p
   if(subscriber_sentinel==NULL) {
     //it's perfectly normal for the sentinel to be NULL.
     if((subscriber_sentinel=ngx_palloc(ngx_http_push_pool, sizeof(*subscriber_sentinel)))==NULL) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate channel subscriber sentinel");
-      return NULL;
+      ngx_http_push_partition_unlock(shm_zone);
+      ngx_log_error(NGX_LOG_ERR, log, 0, "push module: unable to allocate channel subscriber sentinel");
+      return NGX_ERROR;
     }
     ngx_queue_init(&subscriber_sentinel->queue);
     ((ngx_http_push_pid_queue_t *)found)->subscriber_sentinel=subscriber_sentinel;
   }
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "add to subscriber sentinel at %p", subscriber_sentinel);
   ngx_queue_insert_tail(&subscriber_sentinel->queue, &subscriber->queue);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
-  
-  subscriber->request = r;
-  return subscriber;
+  ngx_atomic_fetch_add(&channel->subscribers, 1); // do this only when we know everything went okay.
+  ngx_http_push_partition_unlock(shm_zone);
+  return NGX_OK;
+}
+
+static ngx_http_push_subscriber_t * ngx_http_push_store_subscribe_raw(ngx_http_push_channel_t *channel, ngx_http_request_t *r) {
+  ngx_http_push_subscriber_t *subscriber;
+  if((subscriber = ngx_palloc(ngx_http_push_pool, sizeof(*subscriber)))==NULL) { //unable to allocate request queue element
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate subscriber worker's memory pool");
+    return NULL;
+  }
+  subscriber->request = r;
+  subscriber->multi = NULL;
+  if(ngx_http_push_store_queue_subscriber(channel, subscriber) != NGX_OK) {
+    ngx_pfree(ngx_http_push_pool, subscriber);
+    return NULL;
+  }
+  return subscriber;
 }
 
 static ngx_int_t ngx_http_push_handle_subscriber_concurrency(ngx_http_push_channel_t *channel, ngx_http_request_t *r, ngx_http_push_loc_conf_t *cf) {
@@ -722,8 +1498,10 @@ static ngx_int_t default_subscribe_callback(ngx_int_t status, ngx_http_request_t
 
 static ngx_int_t ngx_http_push_store_subscribe(ngx_str_t *channel_id, ngx_http_push_msg_id_t *msg_id, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_request_t *r)) {
   ngx_http_push_channel_t        *channel;
-  ngx_http_push_msg_t            *msg;
+  ngx_http_push_msg_t            *msg, **msgs;
   ngx_int_t                       msg_search_outcome;
+  ngx_uint_t                      i, count;
+  ngx_http_push_subscriber_t     *stream_subscriber;
   ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
 
   
@@ -746,6 +1524,7 @@ static ngx_int_t ngx_http_push_store_subscribe(ngx_str_t *channel_id, ngx_http_p
       return callback(NGX_HTTP_INTERNAL_SERVER_ERROR, r);
     }
   }
+  ngx_http_push_store_index_prefix_channel(channel_id, cf);
   
   switch(ngx_http_push_handle_subscriber_concurrency(channel, r, cf)) {
     case NGX_DECLINED: //this request was declined for some reason.
@@ -757,9 +1536,29 @@ static ngx_int_t ngx_http_push_store_subscribe(ngx_str_t *channel_id, ngx_http_p
   }
   
   
-  msg = ngx_http_push_store->get_channel_message(channel, msg_id, &msg_search_outcome, cf);
+  if(cf->subscriber_poll_mechanism == NGX_HTTP_PUSH_MECHANISM_EVENTSOURCE || cf->subscriber_poll_mechanism == NGX_HTTP_PUSH_MECHANISM_WEBSOCKET) {
+    //streams are subscribed right away, and catch up on whatever came after msg_id from there.
+    if ((stream_subscriber = ngx_http_push_store_subscribe_raw(channel, r))==NULL) {
+      return callback(NGX_HTTP_INTERNAL_SERVER_ERROR, r);
+    }
+    return callback(ngx_http_push_stream_subscriber_start(channel, stream_subscriber, msg_id), r);
+  }
+  
+  if(cf->subscriber_batch_max > 1 && (msgs = ngx_palloc(r->pool, sizeof(*msgs) * cf->subscriber_batch_max)) != NULL) {
+    //catch up on everything at once
+    count = ngx_http_push_store->get_channel_messages(channel, msg_id, msgs, cf->subscriber_batch_max, &msg_search_outcome, cf);
+    msg = count > 0 ? msgs[0] : NULL;
+  }
+  else {
+    msgs = &msg;
+    msg = ngx_http_push_store->get_channel_message(channel, msg_id, &msg_search_outcome, cf);
+    count = msg_search_outcome == NGX_HTTP_PUSH_MESSAGE_FOUND ? 1 : 0;
+  }
   
   if (cf->ignore_queue_on_no_cache && !ngx_http_push_allow_caching(r)) {
+    for(i = 0; i < count; i++) {
+      ngx_http_push_store->release_message(channel, msgs[i]);
+    }
     msg_search_outcome = NGX_HTTP_PUSH_MESSAGE_EXPECTED; 
     msg = NULL;
   }
@@ -790,7 +1589,15 @@ static ngx_int_t ngx_http_push_store_subscribe(ngx_str_t *channel_id, ngx_http_p
       return callback(NGX_HTTP_NO_CONTENT, r);
       
     case NGX_HTTP_PUSH_MESSAGE_FOUND:
+      if(count > 1) {
+        ngx_int_t ret=ngx_http_push_prepare_batch_response_to_subscriber_request(r, msgs, NULL, count);
+        for(i = 0; i < count; i++) {
+          ngx_http_push_store->release_message(channel, msgs[i]);
+        }
+        return callback(ret, r);
+      }
       ngx_http_push_alloc_for_subscriber_response(r->pool, 0, msg, &chain, &content_type, &etag, &last_modified);
+      ngx_http_push_gzip_variant(r, &msg->gzip_body, chain->buf);
       ngx_int_t ret=ngx_http_push_prepare_response_to_subscriber_request(r, chain, content_type, etag, last_modified);
       ngx_http_push_store->release_message(channel, msg);
       return callback(ret, r);
@@ -800,139 +1607,214 @@ static ngx_int_t ngx_http_push_store_subscribe(ngx_str_t *channel_id, ngx_http_p
   }
 }
 
+/* queue a long-poll subscriber on all of m's channels, then have it catch up on whatever it missed. it's queued
+ * first, so nothing published in between gets past it. channel concurrency settings don't apply: it's always
+ * one more broadcast subscriber. */
+static ngx_int_t ngx_http_push_store_subscribe_multi(ngx_http_push_multi_subscriber_t *m, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_request_t *r)) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_channel_t        *channel;
+  ngx_http_push_subscriber_t     *subscriber;
+  ngx_uint_t                      i;
+  
+  if(callback == NULL) {
+    callback=&default_subscribe_callback;
+  }
+  for(i = 0; i < m->n; i++) {
+    if(cf->authorize_channel) {
+      channel = ngx_http_push_store_find_channel(&m->channel_ids[i], cf->channel_timeout, NULL);
+    }
+    else {
+      channel = ngx_http_push_store_get_channel(&m->channel_ids[i], cf->channel_timeout, NULL);
+    }
+    if(channel == NULL) {
+      ngx_http_push_multi_subscriber_detach(m);
+      return callback(cf->authorize_channel ? NGX_HTTP_FORBIDDEN : NGX_HTTP_INTERNAL_SERVER_ERROR, r);
+    }
+    ngx_http_push_store_index_prefix_channel(&m->channel_ids[i], cf);
+    if((subscriber = ngx_http_push_store_subscribe_raw(channel, r))==NULL) {
+      ngx_http_push_multi_subscriber_detach(m);
+      return callback(NGX_HTTP_INTERNAL_SERVER_ERROR, r);
+    }
+    subscriber->multi = m;
+    m->channels[i] = channel;
+    m->subscribers[i] = subscriber;
+  }
+  return callback(ngx_http_push_multi_subscriber_start(m), r);
+}
+
 static ngx_str_t * ngx_http_push_store_etag_from_message(ngx_http_push_msg_t *msg, ngx_pool_t *pool){
   ngx_str_t *etag = NULL;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t *shm_zone = ngx_http_push_partition_for_ptr(msg);
   if(pool!=NULL && (etag = ngx_palloc(pool, sizeof(*etag) + NGX_INT_T_LEN))==NULL) {
     return NULL;
   }
   else if(pool==NULL && (etag = ngx_alloc(sizeof(*etag) + NGX_INT_T_LEN, ngx_cycle->log))==NULL) {
     return NULL;
   }
+  ngx_http_push_partition_lock(shm_zone);
   etag->data = (u_char *)(etag+1);
   etag->len = ngx_sprintf(etag->data,"%ui", msg->message_tag)- etag->data;
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_partition_unlock(shm_zone);
   return etag;
 }
 
 static ngx_str_t * ngx_http_push_store_content_type_from_message(ngx_http_push_msg_t *msg, ngx_pool_t *pool){
   ngx_str_t *content_type = NULL;
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+  ngx_shm_zone_t *shm_zone = ngx_http_push_partition_for_ptr(msg);
+  //content_type.len never changes after the message is created, so it's safe to size this outside the lock.
   if(pool != NULL && (content_type = ngx_palloc(pool, sizeof(*content_type) + msg->content_type.len))==NULL) {
     return NULL;
   }
   else if(pool == NULL && (content_type = ngx_alloc(sizeof(*content_type) + msg->content_type.len, ngx_cycle->log))==NULL) {
     return NULL;
   }
+  ngx_http_push_partition_lock(shm_zone);
   content_type->data = (u_char *)(content_type+1);
   content_type->len = msg->content_type.len;
   ngx_memcpy(content_type->data, msg->content_type.data, content_type->len);
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_partition_unlock(shm_zone);
   return content_type;
 }
 
-// this function adapted from push stream module. thanks Wandenberg Peixoto <wandenberg@gmail.com> and Rogério Carvalho Schneider <stockrt@gmail.com>
-static ngx_buf_t * ngx_http_push_request_body_to_single_buffer(ngx_http_request_t *r) {
-  ngx_buf_t *buf = NULL;
-  ngx_chain_t *chain;
-  ssize_t n;
-  off_t len;
-
-  chain = r->request_body->bufs;
-  if (chain->next == NULL) {
-    return chain->buf;
-  }
-  if (chain->buf->in_file) {
-    if (ngx_buf_in_memory(chain->buf)) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: can't handle a buffer in a temp file and in memory ");
-    }
-    if (chain->next != NULL) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: error reading request body with multiple ");
-    }
-    return chain->buf;
-  }
-  buf = ngx_create_temp_buf(r->pool, r->headers_in.content_length_n + 1);
-  if (buf != NULL) {
-    ngx_memset(buf->start, '\0', r->headers_in.content_length_n + 1);
-    while ((chain != NULL) && (chain->buf != NULL)) {
-      len = ngx_buf_size(chain->buf);
-      // if buffer is equal to content length all the content is in this buffer
-      if (len >= r->headers_in.content_length_n) {
-        buf->start = buf->pos;
-        buf->last = buf->pos;
-        len = r->headers_in.content_length_n;
-      }
-      if (chain->buf->in_file) {
-        n = ngx_read_file(chain->buf->file, buf->start, len, 0);
-        if (n == NGX_FILE_ERROR) {
-          ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: cannot read file with request body");
-          return NULL;
-        }
-        buf->last = buf->last + len;
-        ngx_delete_file(chain->buf->file->name.data);
-        chain->buf->file->fd = NGX_INVALID_FILE;
-      } else {
-        buf->last = ngx_copy(buf->start, chain->buf->pos, len);
-      }
+//one part of a request body, copied to dst, or written to fd at pos if there's no dst. returns its size, or NGX_ERROR.
+static ssize_t ngx_http_push_copy_body_part(ngx_buf_t *buf, u_char *dst, ngx_fd_t fd, off_t pos, u_char *bounce) {
+  off_t                           at, len;
+  ssize_t                         n;
+  if(ngx_buf_in_memory(buf)) {
+    len = buf->last - buf->pos;
+    if(dst != NULL) {
+      ngx_memcpy(dst, buf->pos, (size_t) len);
+    }
+    else if(len > 0 && pwrite(fd, buf->pos, (size_t) len, pos) != len) {
+      return NGX_ERROR;
+    }
+    return (ssize_t) len;
+  }
+  if(!buf->in_file || buf->file == NULL) {
+    return 0;
+  }
+  //spooled to the temp file. read it right into place, or through the bounce buffer into fd.
+  for(at = buf->file_pos; at < buf->file_last; at += n) {
+    len = buf->file_last - at;
+    if(dst != NULL) {
+      n = ngx_read_file(buf->file, dst + (at - buf->file_pos), (size_t) len, at);
+    }
+    else if((n = ngx_read_file(buf->file, bounce, (size_t) ngx_min(len, NGX_HTTP_PUSH_LARGE_MESSAGE_COPY_SIZE), at)) > 0 && pwrite(fd, bounce, (size_t) n, pos + (at - buf->file_pos)) != n) {
+      return NGX_ERROR;
+    }
+    if(n <= 0) {
+      return NGX_ERROR;
+    }
+  }
+  return (ssize_t) (buf->file_last - buf->file_pos);
+}
 
-      chain = chain->next;
-      buf->start = buf->last;
+//a request body goes straight from nginx's buffers (and temp file) to where the message keeps it: the message's
+//own block if dst is set, large message memory otherwise. no coalescing in between.
+static ngx_int_t ngx_http_push_copy_body_chain(ngx_chain_t *chain, u_char *dst, ngx_fd_t fd, off_t pos, ngx_http_request_t *r) {
+  u_char                         *bounce = NULL;
+  ssize_t                         n;
+  ngx_int_t                       rc = NGX_OK;
+  if(dst == NULL && (bounce = ngx_palloc(r->pool, NGX_HTTP_PUSH_LARGE_MESSAGE_COPY_SIZE))==NULL) {
+    return NGX_ERROR;
+  }
+  for(; chain != NULL && rc == NGX_OK; chain = chain->next) {
+    if((n = ngx_http_push_copy_body_part(chain->buf, dst, fd, pos, bounce)) == NGX_ERROR) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "push module: unable to copy publisher request body");
+      rc = NGX_ERROR;
     }
+    else {
+      pos += n;
+      dst = dst != NULL ? dst + n : NULL;
+    }
+  }
+  if(bounce != NULL) {
+    ngx_pfree(r->pool, bounce);
   }
-  return buf;
+  return rc;
 }
 
+//len bytes of the request body from offset at on into large message memory, through a bounce buffer
+static ngx_int_t ngx_http_push_copy_body_range(ngx_http_request_t *r, off_t at, size_t len, ngx_fd_t fd, off_t pos, u_char *bounce) {
+  size_t                          n;
+  for(/* void */; len > 0; at += n, pos += n, len -= n) {
+    n = ngx_min(len, NGX_HTTP_PUSH_LARGE_MESSAGE_COPY_SIZE);
+    if(ngx_http_push_read_request_body(r, at, bounce, n) != NGX_OK || pwrite(fd, bounce, n, pos) != (ssize_t) n) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno, "push module: unable to copy publisher request body");
+      return NGX_ERROR;
+    }
+  }
+  return NGX_OK;
+}
 
-static ngx_http_push_msg_t * ngx_http_push_store_create_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r) {
-  ngx_buf_t                      *buf = NULL, *buf_copy;
-  size_t                          content_type_len;
+
+//entity tags and sequence number. the message must be the channel's newest.
+static void ngx_http_push_stamp_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf) {
+  ngx_http_push_msg_t            *previous_msg = ngx_http_push_get_latest_message_locked(channel);
+  //the previous message may be this very one, being reused
+  time_t                          previous_time = previous_msg != NULL ? previous_msg->message_time : 0;
+  ngx_int_t                       previous_tag = previous_msg != NULL ? previous_msg->message_tag : 0;
+  msg->message_time=ngx_time(); //ESSENTIAL TODO: make sure this ends up producing GMT time
+  msg->seq=++channel->last_seq;
+  if(cf->message_buffer_mode == NGX_HTTP_PUSH_BUFFER_MODE_RING && cf->max_messages > 0) {
+    //still strictly increasing along with message_time, so the queue search works on these too.
+    msg->message_tag=(ngx_int_t) msg->seq;
+  }
+  else {
+    msg->message_tag=(previous_msg!=NULL && msg->message_time == previous_time) ? (previous_tag + 1) : 0;    
+  }
+}
+
+static ngx_inline ngx_str_t * ngx_http_push_request_content_type(ngx_http_request_t *r) {
+  return r->headers_in.content_type != NULL ? &r->headers_in.content_type->value : NULL;
+}
+
+//fill in a message's block. the body goes in one of three places: large message memory at large_pos,
+//the temp file file_buf is in, or body_len bytes of the message's own block (filled in by the caller).
+//gzip_len bytes after an in-block body are for its precompressed variant.
+static void ngx_http_push_store_init_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_request_t *r, ngx_str_t *content_type, size_t body_len, size_t gzip_len, off_t body_size, off_t large_pos, ngx_buf_t *file_buf) {
   ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
-  ngx_http_push_msg_t            *msg, *previous_msg;
-  
-  //first off, we'll want to extract the body buffer
+  size_t                          content_type_len = content_type != NULL ? content_type->len : 0;
   
-  //note: this works mostly because of r->request_body_in_single_buf = 1; 
-  //which, i suppose, makes this module a little slower than it could be.
-  //this block is a little hacky. might be a thorn for forward-compatibility.
-  if(r->headers_in.content_length_n == -1 || r->headers_in.content_length_n == 0) {
-    buf = ngx_create_temp_buf(r->pool, 0);
-    //this buffer will get copied to shared memory in a few lines, 
-    //so it does't matter what pool we make it in.
-  }
-  else if(r->request_body->bufs!=NULL) {
-    buf = ngx_http_push_request_body_to_single_buffer(r);
+  msg->body.data = (u_char *) (msg+1) + content_type_len;
+  msg->body_in_memfd = 0;
+  msg->gzip_separate = 0;
+  msg->gzip_body.len = 0;
+  msg->gzip_body.data = NULL;
+  msg->shared_body = NULL;
+  if(large_pos != -1) {
+    msg->body.len = 0;
+    msg->body_file_pos = large_pos;
+    msg->body_file_last = large_pos + body_size;
+    msg->body_in_file = 0;
+    msg->body_in_memfd = 1;
+  }
+  else if(file_buf != NULL) {
+    msg->body.len = file_buf->file->name.len;
+    ngx_memcpy(msg->body.data, file_buf->file->name.data, msg->body.len);
+    msg->body.data[msg->body.len]='\0';
+    msg->body_file_pos = file_buf->file_pos;
+    msg->body_file_last = file_buf->file_last;
+    msg->body_in_file = 1;
   }
   else {
-    ngx_log_error(NGX_LOG_ERR, (r)->connection->log, 0, "push module: unexpected publisher message request body buffer location. please report this to the push module developers.");
-    return NULL;
+    //copied in once we've unlocked
+    msg->body.len = body_len;
+    msg->body_in_file = 0;
+    if(gzip_len > 0) {
+      msg->gzip_body.len = gzip_len;
+      msg->gzip_body.data = msg->body.data + body_len;
+    }
   }
   
-  NGX_HTTP_PUSH_BROADCAST_CHECK(buf, NULL, r, "push module: can't find or allocate publisher request body buffer");
-      
-  content_type_len = (r->headers_in.content_type!=NULL ? r->headers_in.content_type->value.len : 0);
-  
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
-  
-  //create a buffer copy in shared mem
-  msg = ngx_http_push_slab_alloc_locked(sizeof(*msg) + content_type_len, "message + content_type");
-  NGX_HTTP_PUSH_BROADCAST_CHECK_LOCKED(msg, NULL, r, "push module: unable to allocate message in shared memory", ngx_http_push_shpool);
-  previous_msg=ngx_http_push_get_latest_message_locked(channel); //need this for entity-tags generation
-  
-  buf_copy = ngx_http_push_slab_alloc_locked(NGX_HTTP_BUF_ALLOC_SIZE(buf), "message buffer copy");
-  NGX_HTTP_PUSH_BROADCAST_CHECK_LOCKED(buf_copy, NULL, r, "push module: unable to allocate buffer in shared memory", ngx_http_push_shpool) //magic nullcheck
-  ngx_http_push_copy_preallocated_buffer(buf, buf_copy);
-  
-  msg->buf=buf_copy;
-  
   //Stamp the new message with entity tags
-  msg->message_time=ngx_time(); //ESSENTIAL TODO: make sure this ends up producing GMT time
-  msg->message_tag=(previous_msg!=NULL && msg->message_time == previous_msg->message_time) ? (previous_msg->message_tag + 1) : 0;    
+  ngx_http_push_stamp_message_locked(channel, msg, cf);
   
   //store the content-type
   if(content_type_len>0) {
-    msg->content_type.len=r->headers_in.content_type->value.len;
+    msg->content_type.len=content_type_len;
     msg->content_type.data=(u_char *) (msg+1); //we had reserved a contiguous chunk, myes?
-    ngx_memcpy(msg->content_type.data, r->headers_in.content_type->value.data, msg->content_type.len);
+    ngx_memcpy(msg->content_type.data, content_type->data, msg->content_type.len);
   }
   else {
     msg->content_type.len=0;
@@ -943,7 +1825,7 @@ static ngx_http_push_msg_t * ngx_http_push_store_create_message(ngx_http_push_ch
   msg->queue.prev=NULL;
   msg->queue.next=NULL;
   
-  msg->refcount=0;
+  msg->refcount=1; //the creator's reference, released once it's done publishing
   
   //set message expiration time
   time_t                  message_timeout = cf->buffer_timeout;
@@ -951,41 +1833,546 @@ static ngx_http_push_msg_t * ngx_http_push_store_create_message(ngx_http_push_ch
   
   msg->delete_oldest_received_min_messages = cf->delete_oldest_received_message ? (ngx_uint_t) cf->min_messages : NGX_MAX_UINT32_VALUE;
   //NGX_MAX_UINT32_VALUE to disable, otherwise = min_message_buffer_size of the publisher location from whence the message came
+}
+
+/* allocate and stamp a message whose body goes in one of three places: large message memory at large_pos,
+ * the temp file file_buf is in, or body_len bytes of the message's own block (filled in by the caller). */
+static ngx_http_push_msg_t * ngx_http_push_store_new_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r, size_t body_len, size_t gzip_len, off_t body_size, off_t large_pos, ngx_buf_t *file_buf) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  size_t                          content_type_len = (r->headers_in.content_type!=NULL ? r->headers_in.content_type->value.len : 0);
+  ngx_http_push_msg_t            *msg;
+  
+  ngx_http_push_partition_lock(shm_zone);
+  
+  //one block in the channel's partition: message, then content-type, then body (or body filename), then gzipped body
+  msg = ngx_http_push_gc_alloc_locked(shm_zone, sizeof(*msg) + content_type_len + body_len + gzip_len, 1, "message + content_type + body");
+  if(msg == NULL && large_pos != -1) {
+    ngx_http_push_large_message_free_locked(shm_zone, large_pos, body_size);
+  }
+  NGX_HTTP_PUSH_BROADCAST_CHECK_LOCKED(msg, NULL, r, "push module: unable to allocate message in shared memory", ngx_http_push_zone_shpool(shm_zone));
+  
+  msg->block_size = sizeof(*msg) + content_type_len + body_len + gzip_len;
+  ngx_http_push_store_init_message_locked(channel, msg, r, ngx_http_push_request_content_type(r), body_len, gzip_len, body_size, large_pos, file_buf);
   
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
+  ngx_http_push_zone_data(shm_zone)->messages++;
+  ngx_http_push_partition_unlock(shm_zone);
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, CREATED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
   return msg;
 }
 
-static ngx_int_t ngx_http_push_store_enqueue_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf) {
-  ngx_shmtx_lock(&ngx_http_push_shpool->mutex);
+//in latest mode, a publish takes over the block of the message it replaces if nobody else is using it and
+//the new one fits. the old message is dequeued and restamped, so nothing can see it until it's enqueued again.
+static ngx_http_push_msg_t * ngx_http_push_store_reuse_latest_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r, size_t body_len, size_t gzip_len) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  size_t                          content_type_len = (r->headers_in.content_type!=NULL ? r->headers_in.content_type->value.len : 0);
+  ngx_http_push_msg_t            *msg;
+  
+  if(cf->message_buffer_mode != NGX_HTTP_PUSH_BUFFER_MODE_LATEST || cf->max_messages == 0) {
+    return NULL;
+  }
+  ngx_http_push_partition_lock(shm_zone);
+  msg = ngx_http_push_get_latest_message_locked(channel);
+  //the queue's is the only reference. anyone else would need the lock to get one.
+  if(msg == NULL || msg->refcount != 1 || msg->body_in_file || msg->body_in_memfd || msg->shared_body != NULL || msg->gzip_separate || sizeof(*msg) + content_type_len + body_len + gzip_len > msg->block_size) {
+    ngx_http_push_partition_unlock(shm_zone);
+    return NULL;
+  }
+  if(channel->ring != NULL && channel->ring[msg->seq % channel->ring_size] == msg) {
+    channel->ring[msg->seq % channel->ring_size] = NULL;
+  }
+  //stamped while it's still the latest, so the new tags come after the old ones
+  ngx_http_push_store_init_message_locked(channel, msg, r, ngx_http_push_request_content_type(r), body_len, gzip_len, (off_t) body_len, -1, NULL);
+  ngx_queue_remove(&msg->queue);
+  msg->queue.prev=NULL;
+  msg->queue.next=NULL;
+  channel->messages--;
+  ngx_http_push_partition_unlock(shm_zone);
+  return msg;
+}
+
+//gzip a message body into the request's pool. NGX_DECLINED if that doesn't make it any smaller.
+static ngx_int_t ngx_http_push_store_gzip_body(ngx_str_t *body, ngx_str_t *gzip, ngx_http_request_t *r) {
+  z_stream                        zs;
+  size_t                          bound;
+  int                             rc;
+  ngx_memzero(&zs, sizeof(zs));
+  //+16 for a gzip wrapper instead of a zlib one
+  if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL - 1, Z_DEFAULT_STRATEGY) != Z_OK) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to initialize message compression");
+    return NGX_ERROR;
+  }
+  bound = deflateBound(&zs, body->len);
+  if((gzip->data = ngx_palloc(r->pool, bound))==NULL) {
+    deflateEnd(&zs);
+    return NGX_ERROR;
+  }
+  zs.next_in = body->data;
+  zs.avail_in = body->len;
+  zs.next_out = gzip->data;
+  zs.avail_out = bound;
+  rc = deflate(&zs, Z_FINISH);
+  gzip->len = zs.total_out;
+  deflateEnd(&zs);
+  if(rc != Z_STREAM_END || gzip->len >= body->len) {
+    ngx_pfree(r->pool, gzip->data);
+    gzip->len = 0;
+    return NGX_DECLINED;
+  }
+  return NGX_OK;
+}
+
+//a message stamped a while before it's enqueued gets stamped again if something newer got into its channel first,
+//or if the channel is a new one by now.
+static void ngx_http_push_store_restamp_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf) {
+  ngx_http_push_msg_t            *latest = ngx_http_push_get_latest_message_locked(channel);
+  if((latest != NULL && (latest->message_time > msg->message_time || (latest->message_time == msg->message_time && latest->message_tag >= msg->message_tag))) || channel->last_seq < msg->seq) {
+    ngx_http_push_stamp_message_locked(channel, msg, cf);
+  }
+}
+
+static ngx_http_push_msg_t * ngx_http_push_store_create_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_chain_t                    *body = (r->request_body != NULL) ? r->request_body->bufs : NULL, *cl;
+  ngx_buf_t                      *file_buf = NULL; //the whole body, still in its temp file
+  ngx_http_push_msg_t            *msg;
+  size_t                          body_len;
+  off_t                           body_size = 0, large_pos = -1;
+  ngx_flag_t                      spooled = 0;
+  ngx_str_t                       plain = ngx_null_string, gzip = ngx_null_string;
+  
+  //the body is however many buffers nginx read it into, some of them maybe spooled to a temp file.
+  for(cl = body; cl != NULL; cl = cl->next) {
+    body_size += ngx_buf_size(cl->buf);
+    if(!ngx_buf_in_memory(cl->buf) && cl->buf->in_file && cl->buf->file != NULL) {
+      spooled = 1;
+    }
+  }
+  if(spooled && d->large_messages != NULL && (large_pos = ngx_http_push_large_message_reserve(shm_zone, body_size)) != -1 && ngx_http_push_copy_body_chain(body, NULL, ngx_http_push_large_message_fds[d->partition], large_pos, r) != NGX_OK) {
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_large_message_free_locked(shm_zone, large_pos, body_size);
+    ngx_http_push_partition_unlock(shm_zone);
+    large_pos = -1;
+  }
+  if(large_pos == -1 && spooled && body->next == NULL) {
+    //nowhere better for it. it stays in the temp file.
+    file_buf = body->buf;
+  }
+  body_len = (large_pos != -1) ? 0 : (file_buf != NULL ? file_buf->file->name.len + 1 : (size_t) body_size);
+  
+  if(cf->message_gzip && large_pos == -1 && file_buf == NULL && body_len >= NGX_HTTP_PUSH_GZIP_MIN_LENGTH) {
+    //compressed once here for every subscriber, before allocating, so the block can be sized for both
+    if(body->next == NULL && ngx_buf_in_memory(body->buf)) {
+      plain.data = body->buf->pos;
+      plain.len = body_len;
+    }
+    else if((plain.data = ngx_palloc(r->pool, body_len))==NULL || ngx_http_push_copy_body_chain(body, plain.data, NGX_INVALID_FILE, 0, r) != NGX_OK) {
+      return NULL;
+    }
+    else {
+      plain.len = body_len;
+    }
+    if(ngx_http_push_store_gzip_body(&plain, &gzip, r) == NGX_ERROR) {
+      return NULL;
+    }
+  }
+  
+  msg = (large_pos == -1 && file_buf == NULL) ? ngx_http_push_store_reuse_latest_message(channel, r, body_len, gzip.len) : NULL;
+  if(msg == NULL && (msg = ngx_http_push_store_new_message(channel, r, body_len, gzip.len, body_size, large_pos, file_buf)) == NULL) {
+    return NULL;
+  }
+  
+  //nothing else can see the message until it's enqueued, so the copy can take its time.
+  if(plain.data != NULL) {
+    ngx_memcpy(msg->body.data, plain.data, plain.len);
+    if(gzip.len > 0) {
+      ngx_memcpy(msg->gzip_body.data, gzip.data, gzip.len);
+    }
+  }
+  else if(large_pos == -1 && file_buf == NULL && body_len > 0 && ngx_http_push_copy_body_chain(body, msg->body.data, NGX_INVALID_FILE, 0, r) != NGX_OK) {
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_free_message_locked(msg);
+    ngx_http_push_partition_unlock(shm_zone);
+    return NULL;
+  }
+  if(file_buf == NULL && r->request_body != NULL && r->request_body->temp_file != NULL) {
+    //nobody needs the temp file anymore
+    ngx_delete_file(r->request_body->temp_file->file.name.data);
+  }
+  return msg;
+}
+
+//a message with room for a body of size bytes that's still on its way. write_message_body fills it in,
+//publish_created_message publishes it, and releasing it before then throws it away.
+static ngx_http_push_msg_t * ngx_http_push_store_create_partial_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r, off_t size) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  off_t                           large_pos = -1;
+  if(ngx_http_push_zone_data(shm_zone)->large_messages != NULL) {
+    large_pos = ngx_http_push_large_message_reserve(shm_zone, size);
+  }
+  return ngx_http_push_store_new_message(channel, r, large_pos != -1 ? 0 : (size_t) size, 0, size, large_pos, NULL);
+}
+
+//copy part of a body to its place in a partial message, at offset at
+static ngx_int_t ngx_http_push_store_write_message_body(ngx_http_push_msg_t *msg, ngx_buf_t *part, off_t at, ngx_http_request_t *r) {
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_chain_t                     chain;
+  off_t                           size = msg->body_in_memfd ? msg->body_file_last - msg->body_file_pos : (off_t) msg->body.len;
+  if(at + ngx_buf_size(part) > size || (shm_zone = ngx_http_push_partition_for_ptr(msg)) == NULL) {
+    return NGX_ERROR;
+  }
+  chain.buf = part;
+  chain.next = NULL;
+  if(msg->body_in_memfd) {
+    return ngx_http_push_copy_body_chain(&chain, NULL, ngx_http_push_large_message_fds[ngx_http_push_zone_data(shm_zone)->partition], msg->body_file_pos + at, r);
+  }
+  return ngx_http_push_copy_body_chain(&chain, msg->body.data + at, NGX_INVALID_FILE, 0, r);
+}
+
+//(re)build a channel's ring index. on failure, the channel keeps whatever index it had -- lookups just fall back to the queue.
+static void ngx_http_push_channel_ring_resize_locked(ngx_http_push_channel_t *channel, ngx_shm_zone_t *shm_zone, ngx_uint_t size) {
+  ngx_http_push_msg_t           **ring;
+  ngx_queue_t                    *cur, *sentinel = &channel->message_queue->queue;
+  ngx_http_push_msg_t            *msg;
+  if((ring = ngx_http_push_slab_alloc_locked(shm_zone, sizeof(*ring) * size, "channel message ring"))==NULL) {
+    return;
+  }
+  ngx_memzero(ring, sizeof(*ring) * size);
+  for(cur = ngx_queue_head(sentinel); cur != sentinel; cur = ngx_queue_next(cur)) {
+    msg = ngx_queue_data(cur, ngx_http_push_msg_t, queue);
+    ring[msg->seq % size] = msg; //newer messages win
+  }
+  if(channel->ring != NULL) {
+    ngx_http_push_slab_free_locked(channel->ring);
+  }
+  channel->ring = ring;
+  channel->ring_size = size;
+}
+
+static void ngx_http_push_store_enqueue_message_locked(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf, ngx_shm_zone_t *shm_zone) {
+  if(cf->message_buffer_mode == NGX_HTTP_PUSH_BUFFER_MODE_RING && channel->ring_size < (ngx_uint_t) cf->max_messages) {
+    ngx_http_push_channel_ring_resize_locked(channel, shm_zone, (ngx_uint_t) cf->max_messages);
+  }
+  ngx_http_push_store_reserve_message_locked(channel, msg); //the queue's reference
   ngx_queue_insert_tail(&channel->message_queue->queue, &msg->queue);
   channel->messages++;
+  if(channel->ring != NULL) {
+    channel->ring[msg->seq % channel->ring_size] = msg;
+  }
   
-  //now see if the queue is too big
-  if(channel->messages > (ngx_uint_t) cf->max_messages) {
+  //now see if the queue is too big. in latest mode, nothing but the newest message stays.
+  while(channel->messages > (cf->message_buffer_mode == NGX_HTTP_PUSH_BUFFER_MODE_LATEST ? 1 : (ngx_uint_t) cf->max_messages)) {
     //exceeeds max queue size. don't force it, someone might still be using this message.
     ngx_http_push_delete_message_locked(channel, ngx_http_push_get_oldest_message_locked(channel), 0);
   }
+  ngx_http_push_expiry_schedule_locked(ngx_http_push_zone_data(shm_zone)->expiry, channel, ngx_http_push_expiry_due(channel), shm_zone);
   if(channel->messages > (ngx_uint_t) cf->min_messages) {
     //exceeeds min queue size. maybe delete the oldest message
     //no, don't do anything for now. This feature is badly implemented and I think I'll deprecate it.
   }
-
-  ngx_shmtx_unlock(&ngx_http_push_shpool->mutex);
   //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, ENQUEUED_DBG, msg, msg->refcount, msg->queue.prev, msg->queue.next);
+}
+
+static ngx_int_t ngx_http_push_store_enqueue_message(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_http_push_partition_lock(shm_zone);
+  ngx_http_push_store_enqueue_message_locked(channel, msg, cf, shm_zone);
+  ngx_http_push_partition_unlock(shm_zone);
   return NGX_OK;
 }
 
+static void ngx_http_push_store_delivery_timer_handler(ngx_event_t *ev) {
+  ngx_http_push_delayed_delivery_t *dd = ev->data;
+  ngx_http_push_channel_t        *channel;
+  ngx_http_push_msg_t            *msg = NULL;
+  ngx_shm_zone_t                 *shm_zone;
+  if((channel = ngx_http_push_store_find_channel(&dd->channel_id, NGX_HTTP_PUSH_DEFAULT_CHANNEL_TIMEOUT, NULL)) != NULL) {
+    shm_zone = ngx_http_push_channel_partition(channel);
+    ngx_http_push_partition_lock(shm_zone);
+    //from here on, publishing starts a new delay. unless someone else already gave up on this one, and
+    //delivered it or started a delay of their own.
+    if(channel->delivery_due == dd->due) {
+      channel->delivery_due = 0;
+      ngx_queue_remove(&channel->delivery_queue);
+      if((msg = ngx_http_push_get_latest_message_locked(channel)) != NULL) {
+        ngx_http_push_store_reserve_message_locked(channel, msg);
+      }
+    }
+    ngx_http_push_partition_unlock(shm_zone);
+    if(msg != NULL) {
+      //the message is just something for the workers to hold on to. subscribers get whatever they haven't seen yet.
+      ngx_http_push_store_publish_raw(channel, msg, NGX_HTTP_PUSH_DELAYED_DELIVERY, NULL);
+      ngx_http_push_store_release_message(NULL, msg);
+    }
+  }
+  ngx_free(dd);
+}
+
+/* hold off on telling subscribers about a message until the delay is up, and tell them about everything published by
+ * then all at once. the first publish in a while sets the timer, in its worker. the channel only knows when that
+ * timer's due, so if the worker died with it, whichever comes first delivers it: a publish long enough after, which
+ * sets a new timer, or some worker's gc timer going through the partition's delayed channels. */
+static ngx_int_t ngx_http_push_store_delay_delivery(ngx_http_push_channel_t *channel, ngx_msec_t delay) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_http_push_delayed_delivery_t *dd;
+  ngx_int_t                       received;
+  ngx_msec_t                      now = ngx_current_msec;
+  if((dd = ngx_calloc(sizeof(*dd) + channel->id.len, ngx_cycle->log))==NULL) {
+    return NGX_ERROR;
+  }
+  ngx_http_push_partition_lock(shm_zone);
+  received = channel->subscribers > 0 ? NGX_HTTP_PUSH_MESSAGE_RECEIVED : NGX_HTTP_PUSH_MESSAGE_QUEUED;
+  if(channel->delivery_due != 0 && (ngx_msec_int_t) (now - channel->delivery_due) < NGX_HTTP_PUSH_DELIVERY_OVERDUE) {
+    ngx_http_push_partition_unlock(shm_zone);
+    ngx_free(dd);
+    return received;
+  }
+  if(channel->delivery_due != 0) {
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: delayed delivery on channel %V is overdue. its worker must be gone; delivering from this one.", &channel->id);
+    ngx_queue_remove(&channel->delivery_queue);
+  }
+  dd->due = now + delay;
+  if(dd->due == 0) {
+    dd->due = 1; //0 is for nothing waiting
+  }
+  channel->delivery_due = dd->due;
+  ngx_queue_insert_tail(&ngx_http_push_zone_data(shm_zone)->delayed_channels, &channel->delivery_queue);
+  dd->channel_id.len = channel->id.len;
+  dd->channel_id.data = (u_char *) (dd + 1);
+  ngx_memcpy(dd->channel_id.data, channel->id.data, channel->id.len);
+  ngx_http_push_partition_unlock(shm_zone);
+  dd->timer.handler = ngx_http_push_store_delivery_timer_handler;
+  dd->timer.data = dd;
+  dd->timer.log = ngx_cycle->log;
+  ngx_add_timer(&dd->timer, delay);
+  return received;
+}
+
+//deliver the partition's delayed deliveries whose timers went missing with their workers. called from the gc timer,
+//so a channel nobody publishes to again still gets its subscribers what's already been published.
+static void ngx_http_push_store_deliver_overdue(ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_http_push_channel_t        *channels[NGX_HTTP_PUSH_DELIVERY_OVERDUE_BATCH], *channel;
+  ngx_http_push_msg_t            *msgs[NGX_HTTP_PUSH_DELIVERY_OVERDUE_BATCH], *msg;
+  ngx_queue_t                    *q, *next;
+  ngx_msec_t                      now = ngx_current_msec;
+  ngx_uint_t                      i, n = 0;
+  if(!ngx_shmtx_trylock(&ngx_http_push_zone_shpool(shm_zone)->mutex)) {
+    return;
+  }
+  for(q = ngx_queue_head(&d->delayed_channels); q != ngx_queue_sentinel(&d->delayed_channels) && n < NGX_HTTP_PUSH_DELIVERY_OVERDUE_BATCH; q = next) {
+    next = ngx_queue_next(q);
+    channel = ngx_queue_data(q, ngx_http_push_channel_t, delivery_queue);
+    if((ngx_msec_int_t) (now - channel->delivery_due) < NGX_HTTP_PUSH_DELIVERY_OVERDUE) {
+      continue;
+    }
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: delayed delivery on channel %V is overdue. its worker must be gone; delivering from this one.", &channel->id);
+    channel->delivery_due = 0;
+    ngx_queue_remove(&channel->delivery_queue);
+    if((msg = ngx_http_push_get_latest_message_locked(channel)) != NULL) {
+      ngx_http_push_store_reserve_message_locked(channel, msg);
+      channels[n] = channel;
+      msgs[n++] = msg;
+    }
+  }
+  ngx_http_push_partition_unlock(shm_zone);
+  ngx_http_push_store_defer_worker_alerts();
+  for(i = 0; i < n; i++) {
+    ngx_http_push_store_publish_raw(channels[i], msgs[i], NGX_HTTP_PUSH_DELAYED_DELIVERY, NULL);
+    ngx_http_push_store_release_message(NULL, msgs[i]);
+  }
+  ngx_http_push_store_send_deferred_worker_alerts();
+}
+
 static ngx_int_t default_publish_callback(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r) {
   return status;
 }
 
+static ngx_int_t ngx_http_push_store_publish_created(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r)) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_int_t                       result=0;
+  if(cf->max_messages > 0) { //channel buffers exist
+    ngx_http_push_store_enqueue_message(channel, msg, cf);
+    if(cf->delivery_delay > 0 && (result = ngx_http_push_store_delay_delivery(channel, cf->delivery_delay)) != NGX_ERROR) {
+      ngx_http_push_store_release_message(NULL, msg);
+      return callback(result, channel, r);
+    }
+  }
+  result= ngx_http_push_store_publish_raw(channel, msg, 0, NULL);
+  //done with it. unbuffered messages are freed here or when the last subscriber's worker releases them.
+  ngx_http_push_store_release_message(NULL, msg);
+  return callback(result, channel, r);
+}
+
+/* a copy of the request body, to be shared by the messages of a multi-channel publish in shm_zone. it goes where
+ * create_message would put it: large message memory if it was spooled, the message arena otherwise, with its
+ * precompressed variant. plain and gzip start out empty, and are filled in by the first partition that keeps the
+ * body in memory, for the rest to copy. */
+static ngx_http_push_msg_body_t * ngx_http_push_store_new_shared_body(ngx_shm_zone_t *shm_zone, ngx_http_request_t *r, off_t size, ngx_flag_t spooled, ngx_str_t *plain, ngx_str_t *gzip) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  ngx_chain_t                    *bufs = r->request_body != NULL ? r->request_body->bufs : NULL;
+  ngx_http_push_msg_body_t       *body;
+  off_t                           large_pos = -1;
+  size_t                          body_len, gzip_len = 0;
+  
+  if(spooled && d->large_messages != NULL && (large_pos = ngx_http_push_large_message_reserve(shm_zone, size)) != -1 && ngx_http_push_copy_body_chain(bufs, NULL, ngx_http_push_large_message_fds[d->partition], large_pos, r) != NGX_OK) {
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_large_message_free_locked(shm_zone, large_pos, size);
+    ngx_http_push_partition_unlock(shm_zone);
+    large_pos = -1;
+  }
+  body_len = large_pos != -1 ? 0 : (size_t) size;
+  if(cf->message_gzip && plain->data == NULL && body_len >= NGX_HTTP_PUSH_GZIP_MIN_LENGTH) {
+    //compressed once for all the partitions
+    if((plain->data = ngx_palloc(r->pool, body_len))==NULL || ngx_http_push_copy_body_chain(bufs, plain->data, NGX_INVALID_FILE, 0, r) != NGX_OK) {
+      plain->data = NULL;
+      return NULL;
+    }
+    plain->len = body_len;
+    if(ngx_http_push_store_gzip_body(plain, gzip, r) == NGX_ERROR) {
+      return NULL;
+    }
+  }
+  if(body_len > 0) {
+    gzip_len = gzip->len;
+  }
+  
+  ngx_http_push_partition_lock(shm_zone);
+  if((body = ngx_http_push_gc_alloc_locked(shm_zone, sizeof(*body) + body_len + gzip_len, 1, "shared message body"))==NULL && large_pos != -1) {
+    ngx_http_push_large_message_free_locked(shm_zone, large_pos, size);
+  }
+  ngx_http_push_partition_unlock(shm_zone);
+  if(body == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate shared message body in shared memory");
+    return NULL;
+  }
+  body->refcount = 1; //the publisher's
+  body->block_size = sizeof(*body) + body_len + gzip_len;
+  body->len = body_len;
+  body->gzip_len = gzip_len;
+  body->in_memfd = large_pos != -1;
+  body->file_pos = large_pos;
+  body->file_last = large_pos + size;
+  //nobody else can see it yet
+  if(plain->data != NULL) {
+    ngx_memcpy(body + 1, plain->data, body_len);
+  }
+  else if(body_len > 0 && ngx_http_push_copy_body_chain(bufs, (u_char *) (body + 1), NGX_INVALID_FILE, 0, r) != NGX_OK) {
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_free_shared_body_locked(shm_zone, body);
+    ngx_http_push_partition_unlock(shm_zone);
+    return NULL;
+  }
+  else if(body_len > 0) {
+    //the other partitions copy this one. the publisher's reference keeps it around until they're done.
+    plain->data = (u_char *) (body + 1);
+    plain->len = body_len;
+  }
+  if(gzip_len > 0) {
+    ngx_memcpy((u_char *) (body + 1) + body_len, gzip->data, gzip_len);
+  }
+  return body;
+}
+
+static void ngx_http_push_store_release_shared_body(ngx_http_push_msg_body_t *body) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_partition_for_ptr(body);
+  ngx_http_push_partition_lock(shm_zone);
+  if(--body->refcount == 0) {
+    ngx_http_push_free_shared_body_locked(shm_zone, body);
+  }
+  ngx_http_push_partition_unlock(shm_zone);
+}
+
+//a message that's just a header, for a body someone else allocated in the channel's partition
+static ngx_http_push_msg_t * ngx_http_push_store_new_shared_body_message(ngx_http_push_channel_t *channel, ngx_http_request_t *r, ngx_http_push_msg_body_t *body) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  size_t                          content_type_len = (r->headers_in.content_type!=NULL ? r->headers_in.content_type->value.len : 0);
+  ngx_http_push_msg_t            *msg;
+  
+  ngx_http_push_partition_lock(shm_zone);
+  if((msg = ngx_http_push_gc_alloc_locked(shm_zone, sizeof(*msg) + content_type_len, 1, "message + content_type"))==NULL) {
+    ngx_http_push_partition_unlock(shm_zone);
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate message in shared memory");
+    return NULL;
+  }
+  msg->block_size = sizeof(*msg) + content_type_len;
+  ngx_http_push_store_init_message_locked(channel, msg, r, ngx_http_push_request_content_type(r), 0, 0, 0, -1, NULL);
+  msg->body.data = (u_char *) (body + 1);
+  msg->body.len = body->len;
+  if(body->gzip_len > 0) {
+    msg->gzip_body.data = msg->body.data + body->len;
+    msg->gzip_body.len = body->gzip_len;
+  }
+  if(body->in_memfd) {
+    msg->body_file_pos = body->file_pos;
+    msg->body_file_last = body->file_last;
+    msg->body_in_memfd = 1;
+  }
+  msg->shared_body = body;
+  body->refcount++;
+  ngx_http_push_zone_data(shm_zone)->messages++;
+  ngx_http_push_partition_unlock(shm_zone);
+  return msg;
+}
+
+//is anyone waiting for the channel's next message? they'll need publish_raw to tell them.
+static ngx_flag_t ngx_http_push_channel_has_waiting_subscribers_locked(ngx_http_push_channel_t *channel) {
+  ngx_http_push_pid_queue_t      *sentinel = channel->workers_with_subscribers, *cur;
+  for(cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&sentinel->queue); cur != sentinel; cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&cur->queue)) {
+    if(cur->subscriber_sentinel != NULL) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* hand msg, just published to a channel, to whoever's waiting on that channel's prefix channels. prefix channels
+ * keep no messages of their own, so nothing's enqueued: each one's partition is locked once to find it and see if
+ * anyone's there. one that's gone isn't made again. the caller holds a reference to msg. woken, if not NULL, has
+ * the prefix channels this publish already woke up, which are skipped, and gets the new ones. */
+static void ngx_http_push_store_wake_prefix_channels(ngx_str_t *channel_id, ngx_http_push_msg_t *msg, ngx_array_t **woken, ngx_http_request_t *r) {
+  ngx_http_push_channel_t        *channel;
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_str_t                      *ids, *seen;
+  ngx_uint_t                      i, j, n;
+  ngx_flag_t                      waiting;
+  if((ids = ngx_http_push_store_prefix_channels(channel_id, &n, r)) == NULL) {
+    return;
+  }
+  for(i = 0; i < n; i++) {
+    if(woken != NULL) {
+      if(*woken == NULL && (*woken = ngx_array_create(r->pool, n, sizeof(*seen))) == NULL) {
+        return;
+      }
+      seen = (*woken)->elts;
+      for(j = 0; j < (*woken)->nelts && (seen[j].len != ids[i].len || ngx_memcmp(seen[j].data, ids[i].data, ids[i].len) != 0); j++) { /* void */ }
+      if(j < (*woken)->nelts) {
+        continue;
+      }
+      if((seen = ngx_array_push(*woken)) == NULL) {
+        return;
+      }
+      *seen = ids[i];
+    }
+    shm_zone = ngx_http_push_partition_for_id(&ids[i]);
+    ngx_http_push_partition_lock(shm_zone);
+    channel = ngx_http_push_peek_channel_locked(&ids[i], shm_zone);
+    waiting = channel != NULL && ngx_http_push_channel_has_waiting_subscribers_locked(channel);
+    ngx_http_push_partition_unlock(shm_zone);
+    if(waiting) {
+      ngx_http_push_store_publish_raw(channel, msg, 0, NULL);
+    }
+  }
+}
+
 static ngx_int_t ngx_http_push_store_publish_message(ngx_str_t *channel_id, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r)) {
   ngx_http_push_channel_t        *channel;
   ngx_http_push_msg_t            *msg;
   ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
-  ngx_int_t                       result=0;
+  ngx_int_t                       status;
   if(callback==NULL) {
     callback=&default_publish_callback;
   }
@@ -998,133 +2385,589 @@ static ngx_int_t ngx_http_push_store_publish_message(ngx_str_t *channel_id, ngx_
     return callback(NGX_ERROR, channel, r);
     //ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
   }
+  ngx_http_push_store_reserve_message(channel, msg); //kept for the prefix channels
+  ngx_http_push_store_defer_worker_alerts();
+  if((status = ngx_http_push_store_publish_created(channel, msg, r, &default_publish_callback)) != NGX_ERROR) {
+    ngx_http_push_store_wake_prefix_channels(channel_id, msg, NULL, r);
+  }
+  ngx_http_push_store_send_deferred_worker_alerts();
+  ngx_http_push_store_release_message(NULL, msg);
+  return callback(status, channel, r);
+}
+
+/* publish one body to several channels. it's stored once in each partition the channels are in, and each
+ * channel gets a message header pointing to it. other workers' subscribers are told about everything at once,
+ * after it's all been sent. a prefix channel is woken up once, by the first of the channels it matches. */
+static ngx_int_t ngx_http_push_store_publish_message_multi(ngx_str_t *channel_ids, ngx_uint_t n, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r)) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_push_msg_body_t       *bodies[NGX_HTTP_PUSH_MAX_SHM_PARTITIONS];
+  ngx_http_push_channel_t        *channel;
+  ngx_http_push_msg_t            *msg;
+  ngx_array_t                    *woken = NULL;
+  ngx_chain_t                    *cl;
+  ngx_uint_t                      i, partition;
+  ngx_int_t                       result, status = NGX_HTTP_PUSH_MESSAGE_QUEUED;
+  ngx_str_t                       plain = ngx_null_string, gzip = ngx_null_string;
+  ngx_flag_t                      spooled = 0;
+  off_t                           size = 0;
+  if(callback==NULL) {
+    callback=&default_publish_callback;
+  }
+  for(cl = (r->request_body != NULL) ? r->request_body->bufs : NULL; cl != NULL; cl = cl->next) {
+    size += ngx_buf_size(cl->buf);
+    if(!ngx_buf_in_memory(cl->buf) && cl->buf->in_file && cl->buf->file != NULL) {
+      spooled = 1;
+    }
+  }
+  ngx_memzero(bodies, sizeof(bodies));
   
-  if(cf->max_messages > 0) { //channel buffers exist
-    ngx_http_push_store_enqueue_message(channel, msg, cf);
+  ngx_http_push_store_defer_worker_alerts();
+  for(i = 0; i < n; i++) {
+    if((channel = ngx_http_push_store_get_channel(&channel_ids[i], cf->channel_timeout, NULL))==NULL) {
+      status = NGX_ERROR;
+      break;
+    }
+    partition = channel->node.key % ngx_http_push_shm_partitions;
+    if(bodies[partition] == NULL && (bodies[partition] = ngx_http_push_store_new_shared_body(ngx_http_push_channel_partition(channel), r, size, spooled, &plain, &gzip)) == NULL) {
+      status = NGX_ERROR;
+      break;
+    }
+    if((msg = ngx_http_push_store_new_shared_body_message(channel, r, bodies[partition])) == NULL) {
+      status = NGX_ERROR;
+      break;
+    }
+    ngx_http_push_store_reserve_message(channel, msg); //kept for the prefix channels
+    if((result = ngx_http_push_store_publish_created(channel, msg, r, &default_publish_callback)) == NGX_ERROR) {
+      ngx_http_push_store_release_message(NULL, msg);
+      status = NGX_ERROR;
+      break;
+    }
+    ngx_http_push_store_wake_prefix_channels(&channel_ids[i], msg, &woken, r);
+    ngx_http_push_store_release_message(NULL, msg);
+    if(result == NGX_HTTP_PUSH_MESSAGE_RECEIVED) {
+      status = result;
+    }
   }
-  else if(cf->max_messages == 0) {
-    ngx_http_push_store_reserve_message(NULL, msg);
+  ngx_http_push_store_send_deferred_worker_alerts();
+  
+  for(i = 0; i < ngx_http_push_shm_partitions; i++) {
+    if(bodies[i] != NULL) {
+      ngx_http_push_store_release_shared_body(bodies[i]);
+    }
   }
-  result= ngx_http_push_store_publish_raw(channel, msg, 0, NULL);
-  return callback(result, channel, r);
+  if(r->request_body != NULL && r->request_body->temp_file != NULL) {
+    //nobody needs the temp file anymore
+    ngx_delete_file(r->request_body->temp_file->file.name.data);
+  }
+  return callback(status, NULL, r);
 }
 
-static ngx_int_t ngx_http_push_store_send_worker_message(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber_sentinel, ngx_pid_t pid, ngx_int_t worker_slot, ngx_http_push_msg_t *msg, ngx_int_t status_code) {
-  ngx_http_push_worker_msg_sentinel_t   *worker_messages = ((ngx_http_push_shm_data_t *)ngx_http_push_shm_zone->data)->ipc;
-  ngx_http_push_worker_msg_sentinel_t   *sentinel = &worker_messages[worker_slot];
-  ngx_http_push_worker_msg_t            *newmessage;
-  if((newmessage=ngx_http_push_slab_alloc(sizeof(*newmessage), "IPC worker message"))==NULL) {
-    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate worker message");
+//where a bulk record's body goes: large message memory if it's too big for client_body_buffer_size and there's
+//room, or the message's own block, gzipped there as well if that's on. nothing's locked while this copies or compresses.
+static ngx_int_t ngx_http_push_store_place_bulk_body(ngx_http_push_bulk_record_t *record, ngx_uint_t partition, off_t *large_pos, ngx_str_t *plain, ngx_str_t *gzip, u_char **bounce, ngx_http_request_t *r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_http_core_loc_conf_t       *clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_shm_zones[partition];
+  ngx_http_push_shm_data_t       *d = ngx_http_push_zone_data(shm_zone);
+  *large_pos = -1;
+  if(record->body_len > clcf->client_body_buffer_size && d->large_messages != NULL && (*large_pos = ngx_http_push_large_message_reserve(shm_zone, (off_t) record->body_len)) != -1) {
+    if((*bounce != NULL || (*bounce = ngx_palloc(r->pool, NGX_HTTP_PUSH_LARGE_MESSAGE_COPY_SIZE)) != NULL) && ngx_http_push_copy_body_range(r, record->body_pos, record->body_len, ngx_http_push_large_message_fds[d->partition], *large_pos, *bounce) == NGX_OK) {
+      return NGX_OK;
+    }
+    ngx_http_push_partition_lock(shm_zone);
+    ngx_http_push_large_message_free_locked(shm_zone, *large_pos, (off_t) record->body_len);
+    ngx_http_push_partition_unlock(shm_zone);
+    *large_pos = -1;
+  }
+  if(!cf->message_gzip || record->body_len < NGX_HTTP_PUSH_GZIP_MIN_LENGTH) {
+    return NGX_OK; //copied from the request body once the message is allocated
+  }
+  plain->len = record->body_len;
+  if((plain->data = ngx_palloc(r->pool, plain->len)) == NULL || ngx_http_push_read_request_body(r, record->body_pos, plain->data, plain->len) != NGX_OK) {
     return NGX_ERROR;
   }
-  newmessage->msg = msg;
-  newmessage->status_code = status_code;
-  newmessage->pid = pid;
-  newmessage->subscriber_sentinel = subscriber_sentinel;
-  newmessage->channel = channel;
+  return ngx_http_push_store_gzip_body(plain, gzip, r) == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+/* publish a batch of messages, each to its own channel. bodies are read right out of the request body, wherever
+ * nginx left it, and placed the same way single publishes place theirs. each partition is locked twice: once to
+ * allocate and stamp its records' messages, and once to enqueue them after their bodies were copied in, unlocked.
+ * only channels with subscribers waiting go through publish_raw afterwards, and other workers are woken up once for
+ * the whole batch. each message then wakes up its channel's prefix channels. */
+static ngx_int_t ngx_http_push_store_publish_bulk(ngx_http_push_bulk_record_t *records, ngx_uint_t n, ngx_http_request_t *r) {
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_http_push_channel_t       **channels, *channel;
+  ngx_http_push_msg_t           **msgs, *msg;
+  ngx_uint_t                     *partitions, i, p;
+  ngx_str_t                      *plains, *gzips;
+  off_t                          *large;
+  u_char                         *waiting, *bounce = NULL;
+  ngx_int_t                       result;
+  size_t                          size, body_len, gzip_len;
+  
+  size = n * (sizeof(*channels) + sizeof(*msgs) + sizeof(*plains) + sizeof(*gzips) + sizeof(*large) + sizeof(*partitions) + sizeof(*waiting));
+  if((channels = ngx_pcalloc(r->pool, size))==NULL) {
+    return NGX_ERROR;
+  }
+  msgs = (ngx_http_push_msg_t **) (channels + n);
+  plains = (ngx_str_t *) (msgs + n);
+  gzips = plains + n;
+  large = (off_t *) (gzips + n);
+  partitions = (ngx_uint_t *) (large + n);
+  waiting = (u_char *) (partitions + n);
+  for(i = 0; i < n; i++) {
+    records[i].status = NGX_ERROR;
+    partitions[i] = ngx_crc32_short(records[i].channel_id.data, records[i].channel_id.len) % ngx_http_push_shm_partitions;
+  }
+  
+  for(i = 0; i < n; i++) {
+    if(ngx_http_push_store_place_bulk_body(&records[i], partitions[i], &large[i], &plains[i], &gzips[i], &bounce, r) != NGX_OK) {
+      partitions[i] = NGX_HTTP_PUSH_MAX_SHM_PARTITIONS;
+    }
+  }
+  
+  //allocate and stamp
+  for(p = 0; p < ngx_http_push_shm_partitions; p++) {
+    shm_zone = ngx_http_push_shm_zones[p];
+    for(i = 0; i < n && partitions[i] != p; i++) { /* void */ }
+    if(i == n) {
+      continue; //nothing for this one
+    }
+    ngx_http_push_partition_lock(shm_zone);
+    for(/* void */; i < n; i++) {
+      if(partitions[i] != p) {
+        continue;
+      }
+      body_len = large[i] != -1 ? 0 : records[i].body_len;
+      gzip_len = large[i] != -1 ? 0 : gzips[i].len;
+      size = sizeof(*msg) + records[i].content_type.len + body_len + gzip_len;
+      if((channel = ngx_http_push_get_channel(&records[i].channel_id, cf->channel_timeout, shm_zone))==NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate memory for new channel");
+      }
+      else if((msg = ngx_http_push_gc_alloc_locked(shm_zone, size, 1, "message + content_type + body"))==NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate message in shared memory");
+      }
+      else {
+        msg->block_size = size;
+        ngx_http_push_store_init_message_locked(channel, msg, r, &records[i].content_type, body_len, gzip_len, (off_t) records[i].body_len, large[i], NULL);
+        ngx_http_push_zone_data(shm_zone)->messages++;
+        msgs[i] = msg;
+        continue;
+      }
+      if(large[i] != -1) {
+        ngx_http_push_large_message_free_locked(shm_zone, large[i], (off_t) records[i].body_len);
+      }
+    }
+    ngx_http_push_partition_unlock(shm_zone);
+  }
+  
+  //nothing else can see the messages yet, so their bodies are copied in unlocked
+  for(i = 0; i < n; i++) {
+    if((msg = msgs[i]) == NULL || large[i] != -1) {
+      continue;
+    }
+    if(plains[i].data != NULL) {
+      ngx_memcpy(msg->body.data, plains[i].data, plains[i].len);
+      if(gzips[i].len > 0) {
+        ngx_memcpy(msg->gzip_body.data, gzips[i].data, gzips[i].len);
+      }
+    }
+    else if(ngx_http_push_read_request_body(r, records[i].body_pos, msg->body.data, records[i].body_len) != NGX_OK) {
+      shm_zone = ngx_http_push_shm_zones[partitions[i]];
+      ngx_http_push_partition_lock(shm_zone);
+      ngx_http_push_free_message_locked(msg);
+      ngx_http_push_partition_unlock(shm_zone);
+      msgs[i] = NULL;
+    }
+  }
   
-  ngx_http_push_store_lock_shmem();
-  ngx_queue_insert_tail(&sentinel->queue, &newmessage->queue);
-  ngx_http_push_store_unlock_shmem();
+  //enqueue. the channel's looked up again: it may have been collected while it was unlocked.
+  for(p = 0; p < ngx_http_push_shm_partitions; p++) {
+    shm_zone = ngx_http_push_shm_zones[p];
+    for(i = 0; i < n && (partitions[i] != p || msgs[i] == NULL); i++) { /* void */ }
+    if(i == n) {
+      continue;
+    }
+    ngx_http_push_partition_lock(shm_zone);
+    for(/* void */; i < n; i++) {
+      if(partitions[i] != p || (msg = msgs[i]) == NULL) {
+        continue;
+      }
+      if((channel = ngx_http_push_get_channel(&records[i].channel_id, cf->channel_timeout, shm_zone))==NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "push module: unable to allocate memory for new channel");
+        ngx_http_push_free_message_locked(msg);
+        msgs[i] = NULL;
+        continue;
+      }
+      ngx_http_push_store_restamp_message_locked(channel, msg, cf);
+      if(cf->max_messages > 0) {
+        ngx_http_push_store_enqueue_message_locked(channel, msg, cf, shm_zone);
+      }
+      waiting[i] = ngx_http_push_channel_has_waiting_subscribers_locked(channel);
+      channels[i] = channel;
+    }
+    ngx_http_push_partition_unlock(shm_zone);
+  }
+  if(r->request_body != NULL && r->request_body->temp_file != NULL) {
+    ngx_delete_file(r->request_body->temp_file->file.name.data);
+  }
+  
+  ngx_http_push_store_defer_worker_alerts();
+  for(i = 0; i < n; i++) {
+    if((msg = msgs[i]) == NULL) {
+      continue;
+    }
+    result = NGX_ERROR;
+    if(cf->max_messages > 0 && cf->delivery_delay > 0) {
+      result = ngx_http_push_store_delay_delivery(channels[i], cf->delivery_delay);
+    }
+    if(result == NGX_ERROR) {
+      //subscribers who show up from here on find it in the channel's queue
+      result = waiting[i] ? ngx_http_push_store_publish_raw(channels[i], msg, 0, NULL) : NGX_HTTP_PUSH_MESSAGE_QUEUED;
+    }
+    ngx_http_push_store_wake_prefix_channels(&records[i].channel_id, msg, NULL, r);
+    ngx_http_push_store_release_message(NULL, msg);
+    records[i].status = result;
+  }
+  ngx_http_push_store_send_deferred_worker_alerts();
+  return NGX_OK;
+}
+
+//publish a partial message once its whole body is in. the channel is looked up again: it may have gone away in the meantime.
+static ngx_int_t ngx_http_push_store_publish_created_message(ngx_str_t *channel_id, ngx_http_push_msg_t *msg, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r)) {
+  ngx_http_push_channel_t        *channel;
+  ngx_shm_zone_t                 *shm_zone;
+  ngx_http_push_loc_conf_t       *cf = ngx_http_get_module_loc_conf(r, ngx_http_push_module);
+  ngx_int_t                       status;
+  ngx_str_t                       gzip = ngx_null_string;
+  u_char                         *gzip_block = NULL;
+  if(callback==NULL) {
+    callback=&default_publish_callback;
+  }
+  if((channel=ngx_http_push_store_get_channel(channel_id, cf->channel_timeout, NULL))==NULL) {
+    ngx_http_push_store_release_message(NULL, msg);
+    return callback(NGX_ERROR, NULL, r);
+  }
+  shm_zone = ngx_http_push_channel_partition(channel);
+  if(cf->message_gzip && !msg->body_in_memfd && !msg->body_in_file && msg->gzip_body.len == 0 && msg->body.len >= NGX_HTTP_PUSH_GZIP_MIN_LENGTH) {
+    //its block was sized before there was a body to compress. the variant gets one of its own.
+    (void) ngx_http_push_store_gzip_body(&msg->body, &gzip, r);
+  }
+  ngx_http_push_partition_lock(shm_zone);
+  if(gzip.len > 0) {
+    gzip_block = ngx_http_push_gc_alloc_locked(shm_zone, gzip.len, 1, "gzipped message body");
+  }
+  //something else got published while the body was coming in. it goes after that, with new tags.
+  ngx_http_push_store_restamp_message_locked(channel, msg, cf);
+  ngx_http_push_partition_unlock(shm_zone);
+  if(gzip_block != NULL) {
+    //nobody can see the message until it's enqueued
+    ngx_memcpy(gzip_block, gzip.data, gzip.len);
+    msg->gzip_body.data = gzip_block;
+    msg->gzip_body.len = gzip.len;
+    msg->gzip_separate = 1;
+  }
+  if(r->request_body != NULL && r->request_body->temp_file != NULL) {
+    ngx_delete_file(r->request_body->temp_file->file.name.data);
+  }
+  ngx_http_push_store_reserve_message(channel, msg); //kept for the prefix channels
+  ngx_http_push_store_defer_worker_alerts();
+  if((status = ngx_http_push_store_publish_created(channel, msg, r, &default_publish_callback)) != NGX_ERROR) {
+    ngx_http_push_store_wake_prefix_channels(channel_id, msg, NULL, r);
+  }
+  ngx_http_push_store_send_deferred_worker_alerts();
+  ngx_http_push_store_release_message(NULL, msg);
+  return callback(status, channel, r);
+}
+
+//take this worker's waiting subscribers off the channel, to respond to them some other way. returns their sentinel, or NULL if there are none.
+static ngx_http_push_subscriber_t * ngx_http_push_store_take_worker_subscribers(ngx_http_push_channel_t *channel) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_channel_partition(channel);
+  ngx_http_push_pid_queue_t      *sentinel, *cur;
+  ngx_http_push_subscriber_t     *subscriber_sentinel = NULL;
+  ngx_http_push_partition_lock(shm_zone);
+  sentinel = channel->workers_with_subscribers;
+  for(cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&sentinel->queue); cur != sentinel; cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&cur->queue)) {
+    if(cur->pid == ngx_pid) {
+      subscriber_sentinel = cur->subscriber_sentinel;
+      cur->subscriber_sentinel = NULL; //same as publishing does
+      break;
+    }
+  }
+  ngx_http_push_partition_unlock(shm_zone);
+  return subscriber_sentinel;
+}
+
+/* Worker mailboxes are Vyukov-style bounded rings: each slot's seq says whether it's free for the producer
+ * claiming position seq, or full for the consumer reading position seq-1. Producers claim positions with a
+ * compare-and-swap on tail, so sending never takes a lock. Only the first sender since the worker last
+ * started reading writes to its socketpair; everyone else's message gets picked up by that same wakeup.
+ * When the ring is full, messages go to an overflow list in the IPC partition's slab pool instead, under
+ * its lock, and the worker reads that after the ring. A send only fails if there's no memory for that.
+ * A producer that dies between claiming a slot and filling it would hold up the ring for good, so once
+ * the slot at the head has been stuck for a while and whoever claimed it is gone, the worker skips it.
+ * Producers say who they are before they claim, so a claimed slot always names a producer; a timer
+ * checks on it again. A producer that was only very slow finds its slot taken back when it tries to
+ * hand it over, and sends through the overflow list instead. */
+#define NGX_HTTP_PUSH_WORKER_MAILBOX_STALL 5000 //msec the head slot can be claimed but unfilled before its producer is checked on
+
+//the consumer's head slot that's claimed but unfilled, and since when
+static ngx_atomic_uint_t        ngx_http_push_mailbox_stalled_pos = 0;
+static ngx_msec_t               ngx_http_push_mailbox_stalled_since = 0;
+
+//while a multi-channel publish is sending, wakeups wait until it's done: one per worker for the whole batch.
+//pid of each worker owed one by process slot, or 0.
+static ngx_flag_t               ngx_http_push_worker_alerts_deferred = 0;
+static ngx_pid_t                ngx_http_push_deferred_alerts[NGX_MAX_PROCESSES];
+
+static ngx_int_t ngx_http_push_worker_mailbox_push(ngx_http_push_worker_mailbox_t *mailbox, ngx_http_push_worker_msg_t *wmsg) {
+  ngx_http_push_worker_msg_t     *slot;
+  ngx_atomic_uint_t               pos = mailbox->tail;
+  ngx_atomic_int_t                dif;
+  for(;;) {
+    slot = &mailbox->slots[pos & (NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE - 1)];
+    dif = (ngx_atomic_int_t) (slot->seq - pos);
+    if(dif == 0) {
+      //before claiming it. losing the race leaves our pid there until the winner writes its own.
+      slot->claimant = ngx_pid;
+      ngx_memory_barrier();
+      if(ngx_atomic_cmp_set(&mailbox->tail, pos, pos + 1)) {
+        break;
+      }
+    }
+    else if(dif < 0) {
+      return NGX_AGAIN; //full
+    }
+    pos = mailbox->tail;
+  }
+  slot->claimant = ngx_pid;
+  slot->msg = wmsg->msg;
+  slot->status_code = wmsg->status_code;
+  slot->pid = wmsg->pid;
+  slot->channel = wmsg->channel;
+  slot->subscriber_sentinel = wmsg->subscriber_sentinel;
+  ngx_memory_barrier();
+  if(!ngx_atomic_cmp_set(&slot->seq, pos, pos + 1)) {
+    return NGX_DECLINED; //we took so long the consumer gave up on it
+  }
+  return NGX_OK; //it's the consumer's now
+}
+
+//is the head slot's producer never going to fill it? consumer only
+static ngx_flag_t ngx_http_push_worker_mailbox_abandoned(ngx_http_push_worker_mailbox_t *mailbox, ngx_atomic_uint_t pos, ngx_http_push_worker_msg_t *slot) {
+  ngx_pid_t                       claimant;
+  if(mailbox->tail == pos || slot->seq != pos) {
+    return 0; //empty. or the slot's filled after all
+  }
+  if(!ngx_http_push_mailbox_timer.timer_set && !ngx_exiting) {
+    //nobody's going to wake us up about this one
+    ngx_add_timer(&ngx_http_push_mailbox_timer, NGX_HTTP_PUSH_WORKER_MAILBOX_STALL);
+  }
+  if(ngx_http_push_mailbox_stalled_pos != pos || ngx_http_push_mailbox_stalled_since == 0) {
+    ngx_http_push_mailbox_stalled_pos = pos;
+    ngx_http_push_mailbox_stalled_since = ngx_current_msec;
+    return 0;
+  }
+  if(ngx_current_msec - ngx_http_push_mailbox_stalled_since < NGX_HTTP_PUSH_WORKER_MAILBOX_STALL) {
+    return 0;
+  }
+  claimant = slot->claimant;
+  if(claimant == 0 || kill(claimant, 0) == 0 || ngx_errno != NGX_ESRCH) {
+    return 0; //still around. it'll get there.
+  }
+  ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "push module: skipping a worker message whose sender (pid %P) died before writing it", claimant);
+  return 1;
+}
+
+//consumer only
+static ngx_int_t ngx_http_push_worker_mailbox_pop(ngx_http_push_worker_mailbox_t *mailbox, ngx_http_push_worker_msg_t *wmsg) {
+  ngx_atomic_uint_t               pos;
+  ngx_http_push_worker_msg_t     *slot;
+  for(;;) {
+    pos = mailbox->head;
+    slot = &mailbox->slots[pos & (NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE - 1)];
+    if(slot->seq == pos + 1) {
+      break;
+    }
+    if(!ngx_http_push_worker_mailbox_abandoned(mailbox, pos, slot)) {
+      return NGX_DONE; //empty, or the next message is still being written
+    }
+    //take it back. if its producer shows up after all, it'll find it's too late.
+    slot->claimant = 0;
+    ngx_memory_barrier();
+    if(ngx_atomic_cmp_set(&slot->seq, pos, pos + NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE)) {
+      ngx_http_push_mailbox_stalled_since = 0;
+      mailbox->head = pos + 1;
+    }
+  }
+  ngx_http_push_mailbox_stalled_since = 0;
+  ngx_memory_barrier();
+  *wmsg = *slot;
+  slot->claimant = 0;
+  ngx_memory_barrier();
+  slot->seq = pos + NGX_HTTP_PUSH_WORKER_MAILBOX_SIZE; //free for the producer that goes around the ring next
+  mailbox->head = pos + 1;
   return NGX_OK;
+}
+
+//the ring's full, or took back our slot. the message goes on the overflow list, after whatever's already there.
+static ngx_int_t ngx_http_push_worker_mailbox_overflow(ngx_http_push_worker_mailbox_t *mailbox, ngx_http_push_worker_msg_t *wmsg) {
+  ngx_shm_zone_t                 *shm_zone = ngx_http_push_ipc_zone;
+  ngx_http_push_worker_msg_overflow_t *overflow;
+  ngx_http_push_partition_lock(shm_zone);
+  if((overflow = ngx_http_push_slab_alloc_locked(shm_zone, sizeof(*overflow), "IPC worker message"))==NULL) {
+    ngx_http_push_partition_unlock(shm_zone);
+    return NGX_ERROR;
+  }
+  overflow->wmsg = *wmsg;
+  ngx_queue_insert_tail(&mailbox->overflow, &overflow->queue);
+  mailbox->overflowed++;
+  ngx_http_push_partition_unlock(shm_zone);
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_push_store_send_worker_message(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber_sentinel, ngx_pid_t pid, ngx_int_t worker_slot, ngx_http_push_msg_t *msg, ngx_int_t status_code) {
+  ngx_http_push_worker_mailbox_t *mailbox = ngx_http_push_zone_data(ngx_http_push_ipc_zone)->ipc[worker_slot];
+  ngx_http_push_worker_msg_t      wmsg;
+  if(mailbox == NULL) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: no mailbox for worker in process slot %i", worker_slot);
+    return NGX_ERROR;
+  }
+  wmsg.msg = msg;
+  wmsg.status_code = status_code;
+  wmsg.pid = pid;
+  wmsg.subscriber_sentinel = subscriber_sentinel;
+  wmsg.channel = channel;
   
+  if((mailbox->overflowed > 0 || ngx_http_push_worker_mailbox_push(mailbox, &wmsg) != NGX_OK) && ngx_http_push_worker_mailbox_overflow(mailbox, &wmsg) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: mailbox of worker %i is full, and there's no memory for more", pid);
+    return NGX_ERROR;
+  }
+  if(ngx_http_push_worker_alerts_deferred) {
+    ngx_http_push_deferred_alerts[worker_slot] = pid;
+    return NGX_OK;
+  }
+  if(ngx_atomic_cmp_set(&mailbox->alerted, 0, 1)) {
+    ngx_http_push_alert_worker(pid, worker_slot);
+  }
+  return NGX_OK;
 }
 
-static void ngx_http_push_store_receive_worker_message(void) {
-  ngx_http_push_worker_msg_t     *prev_worker_msg, *worker_msg;
-  ngx_http_push_worker_msg_sentinel_t    *sentinel;
+static void ngx_http_push_store_defer_worker_alerts(void) {
+  ngx_http_push_worker_alerts_deferred = 1;
+}
+
+static void ngx_http_push_store_send_deferred_worker_alerts(void) {
+  ngx_http_push_worker_mailbox_t *mailbox;
+  ngx_int_t                       slot;
+  ngx_http_push_worker_alerts_deferred = 0;
+  for(slot = 0; slot < NGX_MAX_PROCESSES; slot++) {
+    if(ngx_http_push_deferred_alerts[slot] == 0) {
+      continue;
+    }
+    mailbox = ngx_http_push_zone_data(ngx_http_push_ipc_zone)->ipc[slot];
+    if(mailbox != NULL && ngx_atomic_cmp_set(&mailbox->alerted, 0, 1)) {
+      ngx_http_push_alert_worker(ngx_http_push_deferred_alerts[slot], slot);
+    }
+    ngx_http_push_deferred_alerts[slot] = 0;
+  }
+}
+
+static void ngx_http_push_store_handle_worker_message(ngx_http_push_worker_msg_t *worker_msg) {
   const ngx_str_t                *status_line = NULL;
   ngx_http_push_channel_t        *channel;
-  ngx_http_push_subscriber_t     *subscriber_sentinel;
-  ngx_int_t                       worker_msg_pid;
-  
   ngx_int_t                       status_code;
-  ngx_http_push_msg_t            *msg;
-  
-  sentinel = &(((ngx_http_push_shm_data_t *)ngx_http_push_shm_zone->data)->ipc)[ngx_process_slot];
-  
-  ngx_http_push_store_lock_shmem();
-  worker_msg = (ngx_http_push_worker_msg_t *)ngx_queue_next(&sentinel->queue);
-  ngx_http_push_store_unlock_shmem();
-  while((void *)worker_msg != (void *)sentinel) {
-    
-    ngx_http_push_store_lock_shmem();
-    worker_msg_pid = worker_msg->pid;
-    ngx_http_push_store_unlock_shmem();
-    
-    if(worker_msg_pid == ngx_pid) {
-      //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "process_worker_message processing proper worker_msg ");
-      //everything is okay.
-      
-      ngx_http_push_store_lock_shmem();
-      status_code = worker_msg->status_code;
-      msg = worker_msg->msg;
-      channel = worker_msg->channel;
-      subscriber_sentinel = worker_msg->subscriber_sentinel;
-      ngx_http_push_store_unlock_shmem();
-      
-      if(msg==NULL) {
-        //just a status line, is all    
-        //status code only.
-        switch(status_code) {
-          case NGX_HTTP_CONFLICT:
-            status_line=&NGX_HTTP_PUSH_HTTP_STATUS_409;
-            break;
-            
-          case NGX_HTTP_GONE:
-            status_line=&NGX_HTTP_PUSH_HTTP_STATUS_410;
-            break;
-            
-          case 0:
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: worker message contains neither a channel message nor a status code");
-            //let's let the subscribers know that something went wrong and they might've missed a message
-            status_code = NGX_HTTP_INTERNAL_SERVER_ERROR; 
-            //intentional fall-through
-          default:
-            status_line=NULL;
-        }
+  if(worker_msg->pid == ngx_pid) {
+    //everything is okay.
+    status_code = worker_msg->status_code;
+    if(worker_msg->msg==NULL) {
+      //just a status line, is all    
+      //status code only.
+      switch(status_code) {
+        case NGX_HTTP_CONFLICT:
+          status_line=&NGX_HTTP_PUSH_HTTP_STATUS_409;
+          break;
+          
+        case NGX_HTTP_GONE:
+          status_line=&NGX_HTTP_PUSH_HTTP_STATUS_410;
+          break;
+          
+        case 0:
+          ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: worker message contains neither a channel message nor a status code");
+          //let's let the subscribers know that something went wrong and they might've missed a message
+          status_code = NGX_HTTP_INTERNAL_SERVER_ERROR; 
+          //intentional fall-through
+        default:
+          status_line=NULL;
       }
-      
-      ngx_http_push_respond_to_subscribers(channel, subscriber_sentinel, msg, status_code, status_line);
     }
-    else {
-      //that's quite bad you see. a previous worker died with an undelivered message.
-      //but all its subscribers' connections presumably got canned, too. so it's not so bad after all.
-      //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "process_worker_message processing INVALID worker_msg ");
-      
-      ngx_http_push_store_lock_shmem();
-      
-      ngx_http_push_pid_queue_t     *channel_worker_sentinel = worker_msg->channel->workers_with_subscribers;
-      
-      ngx_http_push_pid_queue_t     *channel_worker_cur = channel_worker_sentinel;
-      ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: worker %i intercepted a message intended for another worker process (%i) that probably died", ngx_pid, worker_msg->pid);
-      
-      //delete that invalid sucker.
-      while((channel_worker_cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&channel_worker_cur->queue))!=channel_worker_sentinel) {
-        if(channel_worker_cur->pid == worker_msg->pid) {
-          ngx_queue_remove(&channel_worker_cur->queue);
-          ngx_http_push_slab_free_locked(channel_worker_cur);
-          break;
-        }
+    
+    ngx_http_push_respond_to_subscribers(worker_msg->channel, worker_msg->subscriber_sentinel, worker_msg->msg, status_code, status_line);
+  }
+  else {
+    //that's quite bad you see. a previous worker died with an undelivered message.
+    //but all its subscribers' connections presumably got canned, too. so it's not so bad after all.
+    channel = worker_msg->channel;
+    ngx_http_push_store_lock_shmem(channel);
+    
+    ngx_http_push_pid_queue_t     *channel_worker_sentinel = channel->workers_with_subscribers;
+    
+    ngx_http_push_pid_queue_t     *channel_worker_cur = channel_worker_sentinel;
+    ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: worker %i intercepted a message intended for another worker process (%i) that probably died", ngx_pid, worker_msg->pid);
+    
+    //delete that invalid sucker.
+    while((channel_worker_cur=(ngx_http_push_pid_queue_t *)ngx_queue_next(&channel_worker_cur->queue))!=channel_worker_sentinel) {
+      if(channel_worker_cur->pid == worker_msg->pid) {
+        ngx_queue_remove(&channel_worker_cur->queue);
+        ngx_http_push_slab_free_locked(channel_worker_cur);
+        break;
       }
-      
-      ngx_http_push_store_unlock_shmem();
-      
     }
-    //It may be worth it to memzero worker_msg for debugging purposes.
-    prev_worker_msg = worker_msg;
     
-    ngx_http_push_store_lock_shmem();
-    worker_msg = (ngx_http_push_worker_msg_t *)ngx_queue_next(&worker_msg->queue);
-    ngx_http_push_slab_free_locked(prev_worker_msg);
-    ngx_http_push_store_unlock_shmem();
+    ngx_http_push_store_unlock_shmem(channel);
+    //the dead worker won't be releasing the message it was sent
+    ngx_http_push_store_release_message(NULL, worker_msg->msg);
+  }
+}
 
+static void ngx_http_push_store_receive_worker_message(void) {
+  ngx_http_push_worker_mailbox_t *mailbox = ngx_http_push_zone_data(ngx_http_push_ipc_zone)->ipc[ngx_process_slot];
+  ngx_http_push_worker_msg_t      worker_msg;
+  ngx_http_push_worker_msg_overflow_t *overflow;
+  ngx_queue_t                     overflowed, *q;
+  
+  //anyone sending after this point has to wake us up again
+  mailbox->alerted = 0;
+  ngx_memory_barrier();
+  
+  while(ngx_http_push_worker_mailbox_pop(mailbox, &worker_msg) == NGX_OK) {
+    ngx_http_push_store_handle_worker_message(&worker_msg);
+  }
+  if(mailbox->overflowed == 0) {
+    return;
   }
-  ngx_http_push_store_lock_shmem();
-  ngx_queue_init(&sentinel->queue); //reset the worker message sentinel
-  ngx_http_push_store_unlock_shmem();
-  //ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0, "process_worker_message finished");
-  return;
+  //everything that didn't fit in the ring, taken off the list all at once. it's all ours from there.
+  ngx_queue_init(&overflowed);
+  ngx_http_push_partition_lock(ngx_http_push_ipc_zone);
+  if(!ngx_queue_empty(&mailbox->overflow)) {
+    ngx_queue_add(&overflowed, &mailbox->overflow);
+    ngx_queue_init(&mailbox->overflow);
+  }
+  mailbox->overflowed = 0;
+  ngx_http_push_partition_unlock(ngx_http_push_ipc_zone);
+  for(q = ngx_queue_head(&overflowed); q != ngx_queue_sentinel(&overflowed); q = ngx_queue_next(q)) {
+    overflow = ngx_queue_data(q, ngx_http_push_worker_msg_overflow_t, queue);
+    ngx_http_push_store_handle_worker_message(&overflow->wmsg);
+  }
+  ngx_http_push_partition_lock(ngx_http_push_ipc_zone);
+  while(!ngx_queue_empty(&overflowed)) {
+    q = ngx_queue_head(&overflowed);
+    ngx_queue_remove(q);
+    overflow = ngx_queue_data(q, ngx_http_push_worker_msg_overflow_t, queue);
+    ngx_http_push_slab_free_locked(overflow);
+  }
+  ngx_http_push_partition_unlock(ngx_http_push_ipc_zone);
 }
 
 ngx_http_push_store_t  ngx_http_push_store_memory = {
@@ -1141,7 +2984,10 @@ ngx_http_push_store_t  ngx_http_push_store_memory = {
     //async-friendly functions with callbacks
     &ngx_http_push_store_get_message, //+callback
     &ngx_http_push_store_subscribe, //+callback
+    &ngx_http_push_store_subscribe_multi, //+callback
     &ngx_http_push_store_publish_message, //+callback
+    &ngx_http_push_store_publish_bulk,
+    &ngx_http_push_store_publish_message_multi, //+callback
     
     //channel stuff,
     &ngx_http_push_store_get_channel, //creates channel if not found, +callback
@@ -1149,6 +2995,7 @@ ngx_http_push_store_t  ngx_http_push_store_memory = {
     &ngx_http_push_store_delete_channel,
     
     &ngx_http_push_store_get_channel_message,
+    &ngx_http_push_store_get_channel_messages,
     &ngx_http_push_store_reserve_message,
     &ngx_http_push_store_release_message,
     
@@ -1157,6 +3004,8 @@ ngx_http_push_store_t  ngx_http_push_store_memory = {
     &ngx_http_push_store_channel_worker_subscribers,
     &ngx_http_push_store_channel_next_subscriber,
     &ngx_http_push_store_channel_release_subscriber_sentinel,
+    &ngx_http_push_store_take_worker_subscribers,
+    &ngx_http_push_store_queue_subscriber,
 
     //legacy shared-memory store helpers
     &ngx_http_push_store_lock_shmem,
@@ -1171,10 +3020,18 @@ ngx_http_push_store_t  ngx_http_push_store_memory = {
     &ngx_http_push_store_enqueue_message,
     &ngx_http_push_store_etag_from_message,
     &ngx_http_push_store_content_type_from_message,
+    &ngx_http_push_store_message_body_fd,
+    
+    &ngx_http_push_store_create_partial_message,
+    &ngx_http_push_store_write_message_body,
+    &ngx_http_push_store_publish_created_message,
     
     //interprocess communication
     &ngx_http_push_store_send_worker_message,
-    &ngx_http_push_store_receive_worker_message
+    &ngx_http_push_store_receive_worker_message,
+    
+    //stats
+    &ngx_http_push_store_partition_stats
     
 
 };
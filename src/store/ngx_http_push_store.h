@@ -13,7 +13,10 @@ typedef struct {
   //async-friendly functions with callbacks
   ngx_http_push_msg_t * (*get_message) (ngx_str_t *channel_id, ngx_http_push_msg_id_t *msg_id, ngx_int_t *msg_search_outcome, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_http_push_msg_t *msg, ngx_int_t msg_search_outcome, ngx_http_request_t *r));
   ngx_int_t             (*subscribe)   (ngx_str_t *channel_id, ngx_http_push_msg_id_t *msg_id, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_request_t *r));
+  ngx_int_t             (*subscribe_multi)(ngx_http_push_multi_subscriber_t *m, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_request_t *r)); //long-poll only
   ngx_int_t             (*publish)     (ngx_str_t *channel_id, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r));
+  ngx_int_t             (*publish_bulk)(ngx_http_push_bulk_record_t *records, ngx_uint_t n, ngx_http_request_t *r); //sets each record's status
+  ngx_int_t             (*publish_multi)(ngx_str_t *channel_ids, ngx_uint_t n, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r)); //one body for all the channels. ch is NULL
   
   //channel actions
   ngx_http_push_channel_t *(*get_channel)(ngx_str_t *id, time_t channel_timeout, ngx_int_t (*callback)(ngx_http_push_channel_t *channel));
@@ -21,6 +24,7 @@ typedef struct {
   
   ngx_int_t (*delete_channel)(ngx_str_t *channel_id);
   ngx_http_push_msg_t *(*get_channel_message)(ngx_http_push_channel_t *channel, ngx_http_push_msg_id_t *msgid, ngx_int_t *msg_search_outcome, ngx_http_push_loc_conf_t *cf);
+  ngx_uint_t (*get_channel_messages)(ngx_http_push_channel_t *channel, ngx_http_push_msg_id_t *msgid, ngx_http_push_msg_t **msgs, ngx_uint_t max, ngx_int_t *msg_search_outcome, ngx_http_push_loc_conf_t *cf);
   
   void (*reserve_message)(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg);
   void (*release_message)(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg);
@@ -30,10 +34,12 @@ typedef struct {
   ngx_int_t (*channel_worker_subscribers)(ngx_http_push_subscriber_t * worker_sentinel);
   ngx_http_push_subscriber_t *(*next_subscriber)(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *sentinel, ngx_http_push_subscriber_t *cur, int release_previous);
   ngx_int_t (*release_subscriber_sentinel)(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *sentinel);
+  ngx_http_push_subscriber_t *(*take_worker_subscribers)(ngx_http_push_channel_t *channel);
+  ngx_int_t (*requeue_subscriber)(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber); //put one that's been taken back on this worker's queue
   
-  void (*lock)(void); //legacy shared-memory store helpers
-  void (*unlock)(void);
-  void * (*alloc_locked)(size_t size, char * label);
+  void (*lock)(ngx_http_push_channel_t *channel); //legacy shared-memory store helpers. locks the channel's partition
+  void (*unlock)(ngx_http_push_channel_t *channel);
+  void * (*alloc_locked)(ngx_shm_zone_t *shm_zone, size_t size, char * label);
   void (*free_locked)(void *ptr);
   
   //message actions and properties
@@ -43,9 +49,18 @@ typedef struct {
   ngx_int_t (*enqueue_message)(ngx_http_push_channel_t *channel, ngx_http_push_msg_t *msg, ngx_http_push_loc_conf_t *cf);
   ngx_str_t * (*message_etag)(ngx_http_push_msg_t *msg, ngx_pool_t *pool);
   ngx_str_t * (*message_content_type)(ngx_http_push_msg_t *msg, ngx_pool_t *pool);
+  ngx_fd_t (*message_body_fd)(ngx_http_push_msg_t *msg); //for bodies in large message memory. shared by the whole process -- don't close it
+  
+  //messages published while their body is still coming in
+  ngx_http_push_msg_t * (*create_partial_message)(ngx_http_push_channel_t *channel, ngx_http_request_t *r, off_t size);
+  ngx_int_t (*write_message_body)(ngx_http_push_msg_t *msg, ngx_buf_t *part, off_t at, ngx_http_request_t *r);
+  ngx_int_t (*publish_created_message)(ngx_str_t *channel_id, ngx_http_push_msg_t *msg, ngx_http_request_t *r, ngx_int_t (*callback)(ngx_int_t status, ngx_http_push_channel_t *ch, ngx_http_request_t *r));
   
   //ipc
   ngx_int_t (*send_worker_message)(ngx_http_push_channel_t *channel, ngx_http_push_subscriber_t *subscriber_sentinel, ngx_pid_t pid, ngx_int_t worker_slot, ngx_http_push_msg_t *msg, ngx_int_t status_code);
   void (*receive_worker_message)(void);
+  
+  //stats. NGX_DECLINED past the last partition
+  ngx_int_t (*partition_stats)(ngx_uint_t partition, ngx_http_push_partition_stats_t *stats);
 } ngx_http_push_store_t;
 
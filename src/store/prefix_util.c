@@ -0,0 +1,184 @@
+#include <ngx_http_push_module.h>
+#include "prefix_util.h"
+
+/* Prefix index: a radix tree over the prefixes of the channel ids that have
+ * prefix channels. A prefix channel's id is the prefix and a trailing
+ * wildcard, and its waiting subscribers get everything published to a channel
+ * whose id starts with the prefix. All of a channel id's prefixes that are in the
+ * index are found in one walk down from the root. Each node's label continues
+ * its parent's, and siblings' labels start with different bytes.
+ * All functions assume the index is locked, or is a worker's own copy of it. */
+
+static ngx_http_push_prefix_node_t *ngx_http_push_prefix_node_create_locked(ngx_shm_zone_t *shm_zone, u_char *label, size_t len) {
+  ngx_http_push_prefix_node_t    *node;
+  if((node = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*node) + len, "channel prefix"))==NULL) {
+    return NULL;
+  }
+  node->children = NULL;
+  node->next = NULL;
+  node->subscribed = 0;
+  node->label = (u_char *) (node + 1);
+  node->len = len;
+  ngx_memcpy(node->label, label, len);
+  return node;
+}
+
+//the child whose label starts with c
+static ngx_http_push_prefix_node_t *ngx_http_push_prefix_child(ngx_http_push_prefix_node_t *node, u_char c) {
+  ngx_http_push_prefix_node_t    *child;
+  for(child = node->children; child != NULL && child->label[0] != c; child = child->next) { /* void */ }
+  return child;
+}
+
+ngx_http_push_prefix_node_t *ngx_http_push_prefix_create_locked(ngx_shm_zone_t *shm_zone) {
+  return ngx_http_push_prefix_node_create_locked(shm_zone, NULL, 0);
+}
+
+ngx_int_t ngx_http_push_prefix_add_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_prefix_node_t    *node = root, *child, *tail;
+  size_t                          pos = 0, common;
+  for(;;) {
+    if(pos == prefix->len) {
+      if(node->subscribed) {
+        return NGX_DECLINED; //already there
+      }
+      node->subscribed = 1;
+      return NGX_OK;
+    }
+    if((child = ngx_http_push_prefix_child(node, prefix->data[pos])) == NULL) {
+      if((child = ngx_http_push_prefix_node_create_locked(shm_zone, prefix->data + pos, prefix->len - pos)) == NULL) {
+        return NGX_ERROR;
+      }
+      child->subscribed = 1;
+      child->next = node->children;
+      node->children = child;
+      return NGX_OK;
+    }
+    for(common = 1; common < child->len && pos + common < prefix->len && child->label[common] == prefix->data[pos + common]; common++) { /* void */ }
+    if(common < child->len) {
+      //split it. the child keeps the part in common, and the rest of it moves down a level.
+      if((tail = ngx_http_push_prefix_node_create_locked(shm_zone, child->label + common, child->len - common)) == NULL) {
+        return NGX_ERROR;
+      }
+      tail->children = child->children;
+      tail->subscribed = child->subscribed;
+      child->children = tail;
+      child->subscribed = 0;
+      child->len = common;
+    }
+    node = child;
+    pos += common;
+  }
+}
+
+//take the rest of a prefix out from under node. returns whether node is no longer needed.
+static ngx_flag_t ngx_http_push_prefix_remove_below(ngx_http_push_prefix_node_t *node, u_char *rest, size_t len) {
+  ngx_http_push_prefix_node_t    *child, **link;
+  if(len == 0) {
+    node->subscribed = 0;
+    return node->children == NULL;
+  }
+  for(link = &node->children; *link != NULL && (*link)->label[0] != rest[0]; link = &(*link)->next) { /* void */ }
+  if((child = *link) == NULL || child->len > len || ngx_memcmp(child->label, rest, child->len) != 0) {
+    return 0;
+  }
+  if(ngx_http_push_prefix_remove_below(child, rest + child->len, len - child->len)) {
+    *link = child->next;
+    ngx_http_push_store->free_locked(child);
+    return !node->subscribed && node->children == NULL;
+  }
+  return 0;
+}
+
+//the root stays, even when it's all that's left. returns whether the prefix was there.
+ngx_flag_t ngx_http_push_prefix_remove_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix) {
+  if(!ngx_http_push_prefix_find_locked(root, prefix)) {
+    return 0;
+  }
+  ngx_http_push_prefix_remove_below(root, prefix->data, prefix->len);
+  return 1;
+}
+
+ngx_flag_t ngx_http_push_prefix_find_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix) {
+  ngx_http_push_prefix_node_t    *node = root;
+  size_t                          pos = 0;
+  while(pos < prefix->len) {
+    if((node = ngx_http_push_prefix_child(node, prefix->data[pos])) == NULL || node->len > prefix->len - pos || ngx_memcmp(node->label, prefix->data + pos, node->len) != 0) {
+      return 0;
+    }
+    pos += node->len;
+  }
+  return node->subscribed;
+}
+
+//the lengths of the channel id's prefixes that are in the index, shortest first. lens has room for id->len + 1 of them.
+ngx_uint_t ngx_http_push_prefix_match_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *id, size_t *lens) {
+  ngx_http_push_prefix_node_t    *node = root;
+  size_t                          pos = 0;
+  ngx_uint_t                      n = 0;
+  for(;;) {
+    if(node->subscribed) {
+      lens[n++] = pos;
+    }
+    if(pos == id->len || (node = ngx_http_push_prefix_child(node, id->data[pos])) == NULL || node->len > id->len - pos || ngx_memcmp(node->label, id->data + pos, node->len) != 0) {
+      return n;
+    }
+    pos += node->len;
+  }
+}
+
+//a copy of the index, or of the part below node, in a worker's own memory
+ngx_http_push_prefix_node_t *ngx_http_push_prefix_copy_locked(ngx_http_push_prefix_node_t *node, ngx_pool_t *pool) {
+  ngx_http_push_prefix_node_t    *copy, *child, **link;
+  if((copy = ngx_palloc(pool, sizeof(*copy) + node->len))==NULL) {
+    return NULL;
+  }
+  copy->children = NULL;
+  copy->next = NULL;
+  copy->subscribed = node->subscribed;
+  copy->label = (u_char *) (copy + 1);
+  copy->len = node->len;
+  ngx_memcpy(copy->label, node->label, node->len);
+  link = &copy->children;
+  for(child = node->children; child != NULL; child = child->next) {
+    if((*link = ngx_http_push_prefix_copy_locked(child, pool)) == NULL) {
+      return NULL;
+    }
+    link = &(*link)->next;
+  }
+  return copy;
+}
+
+static ngx_int_t ngx_http_push_prefix_ids_below(ngx_http_push_prefix_node_t *node, u_char *path, size_t len, ngx_array_t *ids) {
+  ngx_http_push_prefix_node_t    *child;
+  ngx_str_t                      *id;
+  if(len + node->len >= NGX_HTTP_PUSH_MAX_CHANNEL_ID_LENGTH) {
+    return NGX_ERROR; //can't be a channel's
+  }
+  ngx_memcpy(path + len, node->label, node->len);
+  len += node->len;
+  if(node->subscribed) {
+    if((id = ngx_array_push(ids)) == NULL || (id->data = ngx_pnalloc(ids->pool, len + 1)) == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_memcpy(id->data, path, len);
+    id->data[len] = NGX_HTTP_PUSH_PREFIX_WILDCARD;
+    id->len = len + 1;
+  }
+  for(child = node->children; child != NULL; child = child->next) {
+    if(ngx_http_push_prefix_ids_below(child, path, len, ids) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+  return NGX_OK;
+}
+
+//the ids of the prefix channels of every prefix in the index, allocated from pool
+ngx_array_t *ngx_http_push_prefix_channel_ids_locked(ngx_http_push_prefix_node_t *root, ngx_pool_t *pool) {
+  ngx_array_t                    *ids;
+  u_char                         *path;
+  if((ids = ngx_array_create(pool, 16, sizeof(ngx_str_t))) == NULL || (path = ngx_pnalloc(pool, NGX_HTTP_PUSH_MAX_CHANNEL_ID_LENGTH)) == NULL) {
+    return NULL;
+  }
+  return ngx_http_push_prefix_ids_below(root, path, 0, ids) == NGX_OK ? ids : NULL;
+}
@@ -0,0 +1,9 @@
+ngx_http_push_prefix_node_t *ngx_http_push_prefix_create_locked(ngx_shm_zone_t *shm_zone);
+ngx_int_t ngx_http_push_prefix_add_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix, ngx_shm_zone_t *shm_zone);
+ngx_flag_t ngx_http_push_prefix_remove_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix);
+ngx_flag_t ngx_http_push_prefix_find_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *prefix);
+ngx_uint_t ngx_http_push_prefix_match_locked(ngx_http_push_prefix_node_t *root, ngx_str_t *id, size_t *lens);
+ngx_http_push_prefix_node_t *ngx_http_push_prefix_copy_locked(ngx_http_push_prefix_node_t *node, ngx_pool_t *pool);
+ngx_array_t *ngx_http_push_prefix_channel_ids_locked(ngx_http_push_prefix_node_t *root, ngx_pool_t *pool);
+#define NGX_HTTP_PUSH_PREFIX_WILDCARD '*' //ends a prefix channel's id
+#define ngx_http_push_prefix_channel_id(id) ((id)->len > 0 && (id)->data[(id)->len - 1] == NGX_HTTP_PUSH_PREFIX_WILDCARD)
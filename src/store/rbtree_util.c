@@ -1,5 +1,8 @@
 #include <ngx_http_push_module.h>
 #include "rbtree_util.h"
+#include "hashtable_util.h"
+#include "expiry_util.h"
+#include "prefix_util.h"
 
 ngx_http_push_channel_t * ngx_http_push_clean_channel_locked(ngx_http_push_channel_t * channel) {
   ngx_queue_t                 *sentinel = &channel->message_queue->queue;
@@ -18,10 +21,34 @@ ngx_http_push_channel_t * ngx_http_push_clean_channel_locked(ngx_http_push_chann
   return (channel->subscribers==0 && (channel->expires <= now)) ? channel : NULL; //if no waiting requests and channel expired, return this channel to be deleted
 }
 
-static ngx_int_t ngx_http_push_delete_node_locked(ngx_rbtree_t *tree, ngx_rbtree_node_t *trash) {
+//most recently used goes last
+static void ngx_http_push_channel_touch_locked(ngx_shm_zone_t *shm_zone, ngx_http_push_channel_t *channel) {
+  channel->last_used = ngx_time();
+  ngx_queue_remove(&channel->lru_queue);
+  ngx_queue_insert_tail(&((ngx_http_push_shm_data_t *) shm_zone->data)->lru_channels, &channel->lru_queue);
+}
+
+static ngx_int_t ngx_http_push_delete_node_locked(ngx_http_push_shm_data_t *d, ngx_rbtree_node_t *trash) {
 //assume the shm zone is already locked
   if(trash != NULL){ //take out the trash
-    ngx_rbtree_delete(tree, trash);
+    if(d->hashtable != NULL) {
+      if(ngx_http_push_hashtable_remove(d->hashtable, (ngx_http_push_channel_t *)trash) != NGX_OK) {
+        return NGX_DECLINED;
+      }
+    }
+    else {
+      ngx_rbtree_delete(&d->tree, trash);
+    }
+    
+    if(d->gc_cursor == &((ngx_http_push_channel_t *)trash)->gc_queue) {
+      d->gc_cursor = ngx_queue_next(d->gc_cursor);
+    }
+    ngx_queue_remove(&((ngx_http_push_channel_t *)trash)->gc_queue);
+    ngx_queue_remove(&((ngx_http_push_channel_t *)trash)->lru_queue);
+    if(((ngx_http_push_channel_t *)trash)->delivery_due != 0) {
+      ngx_queue_remove(&((ngx_http_push_channel_t *)trash)->delivery_queue);
+    }
+    ngx_http_push_expiry_remove_locked(d->expiry, (ngx_http_push_channel_t *)trash);
     
     //delete the worker-subscriber queue
     ngx_queue_t                *sentinel = (ngx_queue_t *)((ngx_http_push_channel_t *)trash)->workers_with_subscribers;
@@ -33,6 +60,9 @@ static ngx_int_t ngx_http_push_delete_node_locked(ngx_rbtree_t *tree, ngx_rbtree
       cur = next;
     }
     
+    if(((ngx_http_push_channel_t *)trash)->ring != NULL) {
+      ngx_http_push_store->free_locked(((ngx_http_push_channel_t *)trash)->ring);
+    }
     ngx_http_push_store->free_locked(trash);
     ngx_http_push_store->free_locked(sentinel);
     return NGX_OK;
@@ -42,15 +72,42 @@ static ngx_int_t ngx_http_push_delete_node_locked(ngx_rbtree_t *tree, ngx_rbtree
 
 ngx_int_t ngx_http_push_delete_channel_locked(ngx_http_push_channel_t *trash, ngx_shm_zone_t *shm_zone) {
   ngx_int_t                      res;
-  res = ngx_http_push_delete_node_locked(&((ngx_http_push_shm_data_t *) shm_zone->data)->tree, (ngx_rbtree_node_t *)trash);
+  ngx_http_push_shm_data_t      *d = (ngx_http_push_shm_data_t *) shm_zone->data;
+  res = ngx_http_push_delete_node_locked(d, (ngx_rbtree_node_t *)trash);
   if(res==NGX_OK) {
     ((ngx_http_push_shm_data_t *) shm_zone->data)->channels--;
+    if(ngx_http_push_prefix_channel_id(&trash->id)) {
+      d->prefix_channels_deleted++; //its prefix is taken out of the index later, by the gc timer
+    }
     return NGX_OK;
   }
   return res;
   
 }
 
+static ngx_http_push_channel_t * ngx_http_push_hashtable_find_channel(ngx_str_t *id, time_t timeout, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_hashtable_t      *ht = ((ngx_http_push_shm_data_t *) shm_zone->data)->hashtable;
+  ngx_http_push_channel_t        *up, *trash;
+  ngx_uint_t                      i;
+  
+  //lookups don't pass by other channels like tree searches do, so every search sweeps a couple of slots instead
+  for(i=0; i<2; i++) {
+    if((up = ngx_http_push_hashtable_gc_next(ht))==NULL) {
+      break;
+    }
+    if((trash = ngx_http_push_clean_channel_locked(up))!=NULL && ngx_memn2cmp(id->data, trash->id.data, id->len, trash->id.len) != 0) {
+      ngx_http_push_delete_channel_locked(trash, shm_zone);
+    }
+  }
+  
+  if((up = ngx_http_push_hashtable_find(ht, id))!=NULL) {
+    up->expires = ngx_time() + timeout;
+    ngx_http_push_clean_channel_locked(up);
+    ngx_http_push_channel_touch_locked(shm_zone, up);
+  }
+  return up;
+}
+
 ngx_http_push_channel_t * ngx_http_push_find_channel(ngx_str_t *id, time_t timeout, ngx_shm_zone_t *shm_zone) {
   ngx_rbtree_t                   *tree = &((ngx_http_push_shm_data_t *) shm_zone->data)->tree;
   uint32_t                        hash;
@@ -63,6 +120,9 @@ ngx_http_push_channel_t * ngx_http_push_find_channel(ngx_str_t *id, time_t timeo
   if (tree==NULL) {
     return NULL;
   }
+  if (((ngx_http_push_shm_data_t *) shm_zone->data)->hashtable != NULL) {
+    return ngx_http_push_hashtable_find_channel(id, timeout, shm_zone);
+  }
   
   hash = ngx_crc32_short(id->data, id->len);
 
@@ -104,6 +164,7 @@ ngx_http_push_channel_t * ngx_http_push_find_channel(ngx_str_t *id, time_t timeo
         }
         up->expires = ngx_time() + timeout;
         ngx_http_push_clean_channel_locked(up);
+        ngx_http_push_channel_touch_locked(shm_zone, up);
         return up;
       }
 
@@ -120,6 +181,36 @@ ngx_http_push_channel_t * ngx_http_push_find_channel(ngx_str_t *id, time_t timeo
   return NULL;
 }
 
+//find a channel by id without touching it: it doesn't get any closer to expiring, and nothing's collected on the way
+ngx_http_push_channel_t * ngx_http_push_peek_channel_locked(ngx_str_t *id, ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_shm_data_t       *d = (ngx_http_push_shm_data_t *) shm_zone->data;
+  uint32_t                        hash;
+  ngx_rbtree_node_t              *node, *sentinel;
+  ngx_int_t                       rc;
+  ngx_http_push_channel_t        *up;
+  if(d->hashtable != NULL) {
+    return ngx_http_push_hashtable_find(d->hashtable, id);
+  }
+  hash = ngx_crc32_short(id->data, id->len);
+  node = d->tree.root;
+  sentinel = d->tree.sentinel;
+  while (node != sentinel) {
+    if (hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+    do {
+      up = (ngx_http_push_channel_t *) node;
+      if((rc = ngx_memn2cmp(id->data, up->id.data, id->len, up->id.len)) == 0) {
+        return up;
+      }
+      node = (rc < 0) ? node->left : node->right;
+    } while (node != sentinel && hash == node->key);
+    break;
+  }
+  return NULL;
+}
+
 //find a channel by id. if channel not found, make one, insert it, and return that.
 ngx_http_push_channel_t *ngx_http_push_get_channel(ngx_str_t *id, time_t timeout, ngx_shm_zone_t *shm_zone) {
   ngx_rbtree_t                   *tree;
@@ -130,10 +221,10 @@ ngx_http_push_channel_t *ngx_http_push_get_channel(ngx_str_t *id, time_t timeout
     return up;
   }
   tree = &((ngx_http_push_shm_data_t *) shm_zone->data)->tree;
-  if((up = ngx_http_push_store->alloc_locked(sizeof(*up) + id->len + sizeof(ngx_http_push_msg_t), "channel"))==NULL) {
+  if((up = ngx_http_push_store->alloc_locked(shm_zone, sizeof(*up) + id->len + sizeof(ngx_http_push_msg_t), "channel"))==NULL) {
     return NULL;
   }
-  if((worker_queue_sentinel=ngx_http_push_store->alloc_locked(sizeof(*worker_queue_sentinel), "channel worker queue sentinel"))==NULL) {
+  if((worker_queue_sentinel=ngx_http_push_store->alloc_locked(shm_zone, sizeof(*worker_queue_sentinel), "channel worker queue sentinel"))==NULL) {
     ngx_http_push_store->free_locked(up);
     ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "push module: unable to allocate worker queue sentinel");
     return NULL;
@@ -145,12 +236,25 @@ ngx_http_push_channel_t *ngx_http_push_get_channel(ngx_str_t *id, time_t timeout
   
   up->id.len = (u_char) id->len;
   ngx_memcpy(up->id.data, id->data, up->id.len);
-  up->node.key = ngx_crc32_short(id->data, id->len);
-  ngx_rbtree_insert(tree, (ngx_rbtree_node_t *) up);
+  up->node.key = ngx_crc32_short(id->data, id->len); //also picks the channel's shm partition, whatever the index
+  if(((ngx_http_push_shm_data_t *) shm_zone->data)->hashtable != NULL) {
+    if(ngx_http_push_hashtable_insert_locked(((ngx_http_push_shm_data_t *) shm_zone->data)->hashtable, up, shm_zone) != NGX_OK) {
+      ngx_http_push_store->free_locked(worker_queue_sentinel);
+      ngx_http_push_store->free_locked(up);
+      return NULL;
+    }
+  }
+  else {
+    ngx_rbtree_insert(tree, (ngx_rbtree_node_t *) up);
+  }
 
   //initialize queues
   ngx_queue_init(&up->message_queue->queue);
   up->messages=0;
+  up->last_seq=0;
+  up->ring=NULL;
+  up->ring_size=0;
+  up->delivery_due=0;
   
   up->workers_with_subscribers=worker_queue_sentinel;
   up->subscribers=0;
@@ -158,6 +262,11 @@ ngx_http_push_channel_t *ngx_http_push_get_channel(ngx_str_t *id, time_t timeout
   up->last_seen=ngx_time();
 
   up->expires = ngx_time() + timeout;
+  up->expiry_index = NGX_HTTP_PUSH_EXPIRY_UNSCHEDULED;
+  ngx_http_push_expiry_schedule_locked(((ngx_http_push_shm_data_t *) shm_zone->data)->expiry, up, up->expires, shm_zone);
+  ngx_queue_insert_tail(&((ngx_http_push_shm_data_t *) shm_zone->data)->gc_channels, &up->gc_queue);
+  up->last_used = ngx_time();
+  ngx_queue_insert_tail(&((ngx_http_push_shm_data_t *) shm_zone->data)->lru_channels, &up->lru_queue);
   
   ((ngx_http_push_shm_data_t *) shm_zone->data)->channels++;
   
@@ -233,6 +342,16 @@ void ngx_http_push_rbtree_walker(ngx_rbtree_t *tree, ngx_int_t (*apply)(ngx_http
 }
 
 
+void ngx_http_push_walk_channels(ngx_int_t (*apply)(ngx_http_push_channel_t * channel), ngx_shm_zone_t *shm_zone) {
+  ngx_http_push_shm_data_t       *d = (ngx_http_push_shm_data_t *) shm_zone->data;
+  if(d->hashtable != NULL) {
+    ngx_http_push_hashtable_walker(d->hashtable, apply);
+  }
+  else {
+    ngx_http_push_walk_rbtree(apply, shm_zone);
+  }
+}
+
 static int ngx_http_push_compare_rbtree_node(const ngx_rbtree_node_t *v_left, const ngx_rbtree_node_t *v_right)
 {
   ngx_http_push_channel_t *left = (ngx_http_push_channel_t *) v_left, *right = (ngx_http_push_channel_t *) v_right;
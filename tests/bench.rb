@@ -0,0 +1,116 @@
+#!/usr/bin/ruby
+require 'securerandom'
+require 'typhoeus'
+require "optparse"
+#rough throughput benchmarks. start the server first, e.g. ./nginx.sh parts=8 or ./nginx.sh hash
+#there are no reference numbers: compare configurations against each other, on the same machine.
+server= "localhost:8082"
+channels=100
+messages=2000
+concurrency=50
+msg_size=100
+lookups=20000
+shm_size="32M"
+subscribers=10000
+sub_location="sub/broadcast"
+mode="publish"
+
+opt=OptionParser.new do |opts|
+  opts.on("-s", "--server SERVER (#{server})", "server and port."){|v| server=v}
+  opts.on("-c", "--channels NUM (#{channels})", "number of distinct channels"){|v| channels=Integer(v)}
+  opts.on("-n", "--messages NUM (#{messages})", "total number of messages to publish"){|v| messages=Integer(v)}
+  opts.on("-p", "--parallel NUM (#{concurrency})", "concurrent requests in flight"){|v| concurrency=Integer(v)}
+  opts.on("-b", "--bytes NUM (#{msg_size})", "message body size"){|v| msg_size=Integer(v)}
+  opts.on("-l", "--lookups NUM (#{lookups})", "channel lookups to time in lookup mode"){|v| lookups=Integer(v)}
+  opts.on("-u", "--subscribers NUM (#{subscribers})", "waiting subscribers in broadcast mode"){|v| subscribers=Integer(v)}
+  opts.on("--sub-location PATH (#{sub_location})", "subscriber location in broadcast mode, e.g. sub/prerendered"){|v| sub_location=v}
+  opts.on("-z", "--shm-size SIZE (#{shm_size})", "push_max_reserved_memory the server was started with, for memory mode"){|v| shm_size=v}
+  opts.on("-m", "--mode MODE (#{mode})", "benchmark to run: publish, lookup, memory, broadcast"){|v| mode=v}
+end
+opt.banner="Usage: bench.rb [options]"
+opt.parse!
+
+Typhoeus::Config.memoize = false
+prefix=SecureRandom.hex(4)
+body="x" * msg_size
+
+def run(hydra, requests)
+  start=Time.now
+  requests.each { |req| hydra.queue req }
+  hydra.run
+  Time.now - start
+end
+
+case mode
+when "publish"
+  #many publishers hitting many channels at once. this is where shared memory lock contention shows up.
+  hydra = Typhoeus::Hydra.new(max_concurrency: concurrency)
+  failed=0
+  reqs=(0...messages).map do |i|
+    req=Typhoeus::Request.new("http://#{server}/pub/#{prefix}_#{i % channels}", method: :POST, body: body, headers: {'Content-Type' => 'text/plain'})
+    req.on_complete { |r| failed+=1 unless r.success? }
+    req
+  end
+  elapsed=run hydra, reqs
+  puts "published #{messages} messages to #{channels} channels in #{elapsed.round(3)}s: #{(messages/elapsed).round} msg/sec (#{failed} failed)"
+when "lookup"
+  #fill the channel index, then time channel info requests for random channels. compare push_channel_index rbtree and hash.
+  hydra = Typhoeus::Hydra.new(max_concurrency: concurrency)
+  reqs=(0...channels).map do |i|
+    Typhoeus::Request.new("http://#{server}/pub/#{prefix}_#{i}", method: :POST, body: body, headers: {'Content-Type' => 'text/plain'})
+  end
+  elapsed=run hydra, reqs
+  puts "created #{channels} channels in #{elapsed.round(3)}s"
+  failed=0
+  reqs=(0...lookups).map do
+    req=Typhoeus::Request.new("http://#{server}/pub/#{prefix}_#{rand(channels)}", method: :GET, headers: {'Accept' => 'text/json'})
+    req.on_complete { |r| failed+=1 unless r.success? }
+    req
+  end
+  elapsed=run hydra, reqs
+  puts "looked up #{lookups} of #{channels} channels in #{elapsed.round(3)}s: #{(lookups/elapsed).round} lookups/sec (#{failed} failed)"
+when "broadcast"
+  #time from publishing one message until every waiting subscriber has it. compare --sub-location sub/broadcast and sub/prerendered.
+  #raise ulimit -n first, for both the server and this script.
+  channel="#{prefix}_broadcast"
+  hydra = Typhoeus::Hydra.new(max_concurrency: subscribers)
+  received, failed = 0, 0
+  finished_at=nil
+  subscribers.times do
+    req=Typhoeus::Request.new("http://#{server}/#{sub_location}/#{channel}", timeout: 600)
+    req.on_complete do |r|
+      r.success? ? received+=1 : failed+=1
+      finished_at=Time.now
+    end
+    hydra.queue req
+  end
+  published_at=nil
+  publisher=Thread.new do
+    sleep 1 until Typhoeus.get("http://#{server}/pub/#{channel}", headers: {'Accept' => 'text/json'}).body.to_s.match(/"subscribers": *(\d+)/).to_a[1].to_i >= subscribers
+    published_at=Time.now
+    Typhoeus.post("http://#{server}/pub/#{channel}", body: body, headers: {'Content-Type' => 'text/plain'})
+  end
+  hydra.run
+  publisher.join
+  puts "broadcast a #{msg_size}-byte message to #{received} subscribers of #{sub_location} in #{(finished_at - published_at).round(3)}s (#{failed} failed)"
+when "memory"
+  #fill shared memory with messages until publishing fails. start the server with ./nginx.sh tiny and pass -z 1M for quick runs.
+  units={"k" => 1024, "m" => 1024**2, "g" => 1024**3}
+  shm_bytes=shm_size.to_i * (units[shm_size[-1].downcase] || 1)
+  count=0
+  start=Time.now
+  loop do
+    resp=Typhoeus.post("http://#{server}/pub/fill/#{prefix}", body: body, headers: {'Content-Type' => 'application/json'})
+    break unless resp.success?
+    count+=1
+  end
+  elapsed=Time.now - start
+  if count==0
+    puts "couldn't publish a single message"
+    exit 1
+  end
+  puts "stored #{count} #{msg_size}-byte messages in #{shm_size} of shared memory (#{elapsed.round(3)}s): about #{shm_bytes/count} bytes per message"
+else
+  puts "unknown mode #{mode}"
+  exit 1
+end
@@ -17,6 +17,8 @@ ERROR_LOG="stderr"
 ERRLOG_LEVEL="notice"
 TMPDIR=""
 MEM="32M"
+PARTITIONS=1
+INDEX="rbtree"
 
 
 _cacheconf="  proxy_cache_path _CACHEDIR_ levels=1:2 keys_zone=cache:1m; \\n  server {\\n       listen 8007;\\n       location / { \\n          proxy_cache cache; \\n      }\\n  }\\n"
@@ -58,6 +60,10 @@ for opt in $*; do
       MEM="256M";;
     verylowmem|tiny)
       MEM="1M";;
+    parts=*|partitions=*)
+      PARTITIONS=${opt#*=};;
+    hash|hashtable)
+      INDEX="hash";;
   esac
 done
 
@@ -80,6 +86,8 @@ conf_replace "worker_processes" $WORKERS
 conf_replace "daemon" $NGINX_DAEMON
 conf_replace "working_directory" "\"$(pwd)\""
 conf_replace "push_max_reserved_memory" "$MEM"
+conf_replace "push_shm_partitions" "$PARTITIONS"
+conf_replace "push_channel_index" "$INDEX"
 if [[ ! -z $CACHE ]]; then
   sed "s|^\s*#cachetag.*|${_cacheconf}|g" $NGINX_TEMP_CONFIG -i
   tmpdir=`pwd`"/.tmp"
@@ -203,6 +203,23 @@ class PubSubTest <  Minitest::Test
     end
   end
   
+  def test_ring_buffer
+    pub, sub = pubsub 5, pub: "pub/ring/"
+    pub.post %w( these are older than the buffer )
+    pub.post %w( only the last eight get buffered )
+    pub.messages.remove_old 4
+    sub.run
+    sleep 0.2
+    pub.post %w( and the rest arrive live )
+    pub.post "FIN"
+    sub.wait
+    verify pub, sub
+    #etags are consecutive sequence numbers
+    etags = sub.messages.to_a.map { |m| m.etag.to_i }
+    assert_equal (etags.first..etags.last).to_a, etags
+    sub.terminate
+  end
+  
   def test_channel_isolation
     rands= %w( foo bar baz bax qqqqqqqqqqqqqqqqqqq eleven andsoon andsoforth feh )
     pub=[]
@@ -241,6 +258,22 @@ class PubSubTest <  Minitest::Test
     sub.terminate
   end
   
+  def test_prerendered_headers
+    pub, sub = pubsub 50, sub: "sub/prerendered/"
+    sub.run
+    sleep 0.5
+    pub.post ["hello there", "what is this"], "text/x-whatever"
+    pub.post "FIN"
+    sub.wait
+    verify pub, sub
+    sub.messages.each do |msg|
+      assert_equal "text/x-whatever", msg.content_type unless msg.message == "FIN"
+      refute_nil msg.etag
+      refute_nil msg.last_modified
+    end
+    sub.terminate
+  end
+  
   #def test_broadcast_for_3000
   #  test_broadcast 3000
   #end
@@ -320,6 +353,39 @@ class PubSubTest <  Minitest::Test
     test_long_message 950
   end
   
+  def test_cut_through
+    pub, sub = pubsub 10, pub: "pub/cut_through/", timeout: 10
+    sub.run
+    sleep 0.5
+    pub.post ["q" * 700 * 1024, "small", "FIN"]
+    sub.wait
+    verify pub, sub
+    sub.terminate
+  end
+  
+  def test_cut_through_concurrent_publish
+    require 'socket'
+    chan = SecureRandom.hex
+    pub, sub = pubsub 10, channel: chan, timeout: 10
+    sub.run
+    sleep 0.5
+    big = "q" * 700 * 1024
+    upload = TCPSocket.new SERVER, PORT
+    upload.write "POST /pub/cut_through/#{chan} HTTP/1.0\r\nContent-Type: text/plain\r\nContent-Length: #{big.bytesize}\r\n\r\n"
+    upload.write big[0, big.bytesize / 2]
+    sleep 0.5
+    pub.post "small" #gets ahead of the upload, which is republished with new tags
+    upload.write big[big.bytesize / 2 .. -1]
+    assert_match /^HTTP\/1\.1 20[12] /, upload.read
+    upload.close
+    pub.messages << Message.new(big)
+    pub.post "FIN"
+    sub.wait
+    #responses relayed under the old tags are cut off and asked for again, so there are errors, but no duplicates
+    verify pub, sub, false
+    sub.terminate
+  end
+  
   def test_message_length_range
     pub, sub = pubsub 2, timeout: 6
     sub.run
@@ -361,6 +427,24 @@ class PubSubTest <  Minitest::Test
     assert sub.match_errors(/code 304/)
   end
   
+  def test_subscriber_count_after_disconnect
+    #subscriber counts are decremented without the shared memory lock. make sure they all come back down.
+    require 'json'
+    subs=40
+    chan=SecureRandom.hex
+    sub=Subscriber.new(url("sub/timeout/#{chan}"), subs, timeout: 10)
+    sub.on_failure { false }
+    pub=Publisher.new url("pub/#{chan}")
+    sub.run
+    sleep 0.5
+    pub.get "text/json"
+    assert_equal subs, JSON.parse(pub.response_body)["subscribers"]
+    sub.wait
+    pub.get "text/json"
+    assert_equal 0, JSON.parse(pub.response_body)["subscribers"]
+    sub.terminate
+  end
+  
   def assert_header_includes(response, header, str)
     assert response.headers[header].include?(str), "Response header '#{header}:#{response.headers[header]}' must include \"#{str}\", but does not."
   end
@@ -380,6 +464,291 @@ class PubSubTest <  Minitest::Test
     %w( Content-Type Origin ).each {|v| assert_header_includes resp, "Access-Control-Allow-Headers", v}
   end
   
+  def test_stats
+    require 'json'
+    pub, sub = pubsub
+    pub.post "hello"
+    resp = Typhoeus.get url("stats")
+    assert_equal 200, resp.code
+    assert_match /application\/json/, resp.headers["Content-Type"]
+    stats = JSON.parse resp.body
+    assert stats["partitions"].length >= 1
+    part = stats["partitions"].first
+    %w( channels messages shm_pages shm_free_pages gc_runs gc_collected_channels expired_channels evicted_channels evicted_messages arena_pages arena_free_pages arena_free_runs arena_largest_free_run arena_requested_bytes arena_allocated_bytes large_message_pages large_message_free_pages gc_pause_last_usec gc_pause_max_usec gc_pause_total_usec ).each do |k|
+      assert_kind_of Integer, part[k], "#{k} missing from stats"
+    end
+    assert stats["partitions"].map { |p| p["channels"] }.sum >= 1
+    assert_equal 405, Typhoeus.post(url("stats"), body: "x").code
+  end
+  
+  def test_expired_channels_reclaimed
+    require 'json'
+    expired = lambda { JSON.parse(Typhoeus.get(url("stats")).body)["partitions"].map { |p| p["expired_channels"] }.sum }
+    before = expired.call
+    chans = 10.times.map { SecureRandom.hex }
+    chans.each { |chan| Publisher.new(url("pub/2_sec_message_timeout/#{chan}")).post "bye" }
+    sleep 4
+    assert expired.call - before >= chans.length, "channels weren't reclaimed once their messages expired"
+  end
+  
+  def test_large_message_memory
+    require 'json'
+    in_use = lambda { JSON.parse(Typhoeus.get(url("stats")).body)["partitions"].map { |p| p["large_message_pages"] - p["large_message_free_pages"] }.sum }
+    before = in_use.call
+    pub = Publisher.new url("pub/#{SecureRandom.hex}")
+    pub.post "q" * 600 * 1024
+    assert in_use.call > before, "large message body wasn't kept in large message memory"
+  end
+  
+  def eventsource_get(chan, events, headers={})
+    body = ""
+    req = Typhoeus::Request.new url("sub/eventsource/#{chan}"), timeout: 5, headers: headers
+    req.on_body do |chunk|
+      body << chunk
+      :abort if body.scan(/^\n/).length >= events
+    end
+    req.run
+    [req.response, body]
+  end
+  
+  def test_eventsource
+    chan = SecureRandom.hex
+    pub = Publisher.new url("pub/#{chan}")
+    pub.post ["hello", "multi\nline"]
+    resp, body = eventsource_get chan, 2
+    assert_match /text\/event-stream/, resp.headers["Content-Type"]
+    assert_match /^data: hello\n\n/, body
+    assert_match /^data: multi\ndata: line\n\n/, body
+    first_id = body[/^id: (.*)\n/, 1]
+    refute_nil first_id
+    #resume past the first event
+    resp, body = eventsource_get chan, 1, "Last-Event-ID" => first_id
+    refute_match /^data: hello$/, body
+    assert_match /^data: multi\ndata: line\n\n/, body
+  end
+  
+  def websocket_connect(chan)
+    require 'socket'
+    require 'base64'
+    key = Base64.strict_encode64 SecureRandom.random_bytes(16)
+    sock = TCPSocket.new SERVER, PORT
+    sock.write "GET /sub/websocket/#{chan} HTTP/1.1\r\nHost: #{SERVER}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: #{key}\r\nSec-WebSocket-Version: 13\r\n\r\n"
+    head = ""
+    head << sock.read(1) until head.end_with? "\r\n\r\n"
+    [sock, head, key]
+  end
+  
+  #next data frame, skipping pings
+  def websocket_read(sock)
+    loop do
+      b0, b1 = sock.read(2).unpack "CC"
+      len = b1 & 0x7f
+      len = sock.read(2).unpack("n").first if len == 126
+      len = sock.read(8).unpack("Q>").first if len == 127
+      data = sock.read len
+      return [b0 & 0x0f, data] unless b0 & 0x0f == 9
+    end
+  end
+  
+  def test_websocket
+    require 'digest/sha1'
+    chan = SecureRandom.hex
+    pub = Publisher.new url("pub/#{chan}")
+    pub.post "hello"
+    sock, head, key = websocket_connect chan
+    assert_match /\AHTTP\/1.1 101/, head
+    assert_includes head, Base64.strict_encode64(Digest::SHA1.digest(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"))
+    assert_equal [1, "hello"], websocket_read(sock)
+    pub.post ["q" * 300, "w" * 70000]
+    assert_equal [1, "q" * 300], websocket_read(sock)
+    assert_equal [1, "w" * 70000], websocket_read(sock)
+    #masked close, no payload
+    sock.write [0x88, 0x80, 1, 2, 3, 4].pack("C*")
+    assert_equal 8, websocket_read(sock).first
+    sock.close
+    assert_equal 400, Typhoeus.get(url("sub/websocket/#{chan}")).code
+  end
+  
+  def test_batch_catch_up
+    chan = SecureRandom.hex
+    pub = Publisher.new url("pub/#{chan}")
+    pub.post ["one", "two", "three"]
+    resp = Typhoeus.get url("sub/batch/#{chan}"), timeout: 5
+    assert_equal 200, resp.code
+    boundary = resp.headers["Content-Type"][/\Amultipart\/mixed; boundary=(.+)\z/, 1]
+    refute_nil boundary, "expected a multipart response"
+    parts = resp.body.split(/\r\n--#{boundary}(?:--)?\r\n|\A--#{boundary}\r\n/).reject(&:empty?)
+    assert_equal %w( one two three ), parts.map { |part| part.split("\r\n\r\n", 2).last }
+    assert_match /^Etag: #{Regexp.escape resp.headers["Etag"]}\r$/, parts.last
+    #one message behind is a plain response
+    pub.post "four"
+    resp = Typhoeus.get url("sub/batch/#{chan}"), timeout: 5, headers: { "If-Modified-Since" => resp.headers["Last-Modified"], "If-None-Match" => resp.headers["Etag"] }
+    assert_equal "four", resp.body
+  end
+  
+  def test_delivery_delay
+    chan = SecureRandom.hex
+    pub = Publisher.new url("pub/delayed/#{chan}")
+    pub.post "zero"
+    first = Typhoeus.get url("sub/batch/#{chan}"), timeout: 5
+    sub = Typhoeus::Request.new url("sub/batch/#{chan}"), timeout: 5, headers: { "If-Modified-Since" => first.headers["Last-Modified"], "If-None-Match" => first.headers["Etag"] }
+    hydra = Typhoeus::Hydra.new
+    hydra.queue sub
+    Thread.new { hydra.run }
+    sleep 0.2
+    started = Time.now
+    pub.post %w( one two three )
+    sleep 0.1 until sub.response
+    assert Time.now - started >= 0.3, "delivered before the delivery delay was up"
+    assert_match /\Amultipart\/mixed/, sub.response.headers["Content-Type"]
+    %w( one two three ).each { |msg| assert_includes sub.response.body, "\r\n\r\n#{msg}\r\n" }
+    refute_includes sub.response.body, "zero"
+  end
+  
+  def test_latest_value
+    chan = SecureRandom.hex
+    pub = Publisher.new url("pub/latest/#{chan}")
+    pub.post "first"
+    first = Typhoeus.get url("sub/broadcast/#{chan}"), timeout: 5
+    assert_equal "first", first.body
+    pub.post %w( second third fourth )
+    #a subscriber that fell behind skips straight to the latest value
+    behind = Typhoeus.get url("sub/broadcast/#{chan}"), timeout: 5, headers: { "If-Modified-Since" => first.headers["Last-Modified"], "If-None-Match" => first.headers["Etag"] }
+    assert_equal "fourth", behind.body
+    #and so does a new one
+    assert_equal "fourth", Typhoeus.get(url("sub/broadcast/#{chan}"), timeout: 5).body
+  end
+  
+  def test_multi_channel_publish
+    chans = 3.times.map { SecureRandom.hex }
+    hydra = Typhoeus::Hydra.new
+    subs = chans.first(2).map do |chan|
+      sub = Typhoeus::Request.new url("sub/broadcast/#{chan}"), timeout: 5
+      hydra.queue sub
+      sub
+    end
+    Thread.new { hydra.run }
+    sleep 0.2
+    pub = Typhoeus.post url("pub/multi/#{chans.join ","}"), body: "one for all", headers: { "Content-Type" => "text/plain" }
+    assert_equal 201, pub.code
+    sleep 0.1 until subs.all? &:response
+    subs.each { |sub| assert_equal "one for all", sub.response.body }
+    #the channel nobody was waiting on has it queued
+    assert_equal "one for all", Typhoeus.get(url("sub/broadcast/#{chans.last}"), timeout: 5).body
+  end
+  
+  def test_multi_channel_subscribe
+    require 'time'
+    chans = 3.times.map { SecureRandom.hex }
+    Typhoeus.post url("pub/#{chans.first}"), body: "already seen", headers: { "Content-Type" => "text/plain" }
+    seen = Typhoeus.get url("sub/broadcast/#{chans.first}"), timeout: 5
+    position = "#{Time.httpdate(seen.headers["Last-Modified"]).to_i}:#{seen.headers["Etag"]}"
+    sub = Typhoeus::Request.new url("sub/multi/#{chans.join ","}"), timeout: 5, headers: { "X-Channel-Positions" => position }
+    hydra = Typhoeus::Hydra.new
+    hydra.queue sub
+    Thread.new { hydra.run }
+    sleep 0.2
+    assert_nil sub.response, "multi-channel subscriber didn't wait"
+    Typhoeus.post url("pub/#{chans.last}"), body: "news", headers: { "Content-Type" => "text/plain" }
+    sleep 0.1 until sub.response
+    assert_equal 200, sub.response.code
+    assert_match %r{^multipart/mixed}, sub.response.headers["Content-Type"]
+    assert_match "X-Channel-Id: #{chans.last}\r\n", sub.response.body
+    assert_match "\r\n\r\nnews\r\n--", sub.response.body
+    refute_match "already seen", sub.response.body
+  end
+  
+  def test_bulk_publish
+    require 'json'
+    chans = 3.times.map { SecureRandom.hex }
+    sub = Typhoeus::Request.new url("sub/broadcast/#{chans.first}"), timeout: 5
+    hydra = Typhoeus::Hydra.new
+    hydra.queue sub
+    Thread.new { hydra.run }
+    sleep 0.2
+    bodies = ["first", "second\nwith a newline", ""]
+    records = chans.zip(bodies).map { |chan, body| "#{chan} text/plain #{body.bytesize}\n#{body}\n" }
+    pub = Typhoeus.post url("pub/bulk"), body: records.join + "#{chans.first} - 100\ntoo short\n"
+    assert_equal 200, pub.code
+    assert_equal [201, 202, 202, 400], JSON.parse(pub.body)
+    sleep 0.1 until sub.response
+    assert_equal "first", sub.response.body
+    second = Typhoeus.get url("sub/broadcast/#{chans[1]}"), timeout: 5
+    assert_equal "second\nwith a newline", second.body
+    assert_equal "text/plain", second.headers["Content-Type"]
+  end
+  
+  def test_bulk_fan_out(channels=6000)
+    #enough waiting channels per worker (20 of them) to fill each one's mailbox ring while the publish defers wakeups
+    chans = channels.times.map { SecureRandom.hex }
+    hydra = Typhoeus::Hydra.new max_concurrency: channels
+    subs = chans.map do |chan|
+      sub = Typhoeus::Request.new url("sub/broadcast/#{chan}"), timeout: 20
+      hydra.queue sub
+      sub
+    end
+    Thread.new { hydra.run }
+    sleep 3
+    pub = Typhoeus.post url("pub/bulk"), body: chans.map { |chan| "#{chan} text/plain #{chan.bytesize}\n#{chan}\n" }.join
+    assert_equal 200, pub.code
+    sleep 0.1 until subs.all? &:response
+    subs.zip(chans).each do |sub, chan|
+      assert_equal 200, sub.response.code
+      assert_equal chan, sub.response.body
+    end
+  end
+  
+  def test_prefix_subscribe
+    prefix = SecureRandom.hex
+    sub = Typhoeus::Request.new url("sub/prefix/#{prefix}*"), timeout: 5
+    hydra = Typhoeus::Hydra.new
+    hydra.queue sub
+    Thread.new { hydra.run }
+    sleep 0.2
+    Typhoeus.post url("pub/#{SecureRandom.hex}"), body: "elsewhere", headers: { "Content-Type" => "text/plain" }
+    Typhoeus.post url("pub/#{prefix}suffix"), body: "matched", headers: { "Content-Type" => "text/plain" }
+    sleep 0.1 until sub.response
+    assert_equal 200, sub.response.code
+    assert_equal "matched", sub.response.body
+  end
+  
+  def test_prefix_channel_keeps_no_copies
+    prefix = SecureRandom.hex
+    first = Typhoeus::Request.new url("sub/prefix/#{prefix}*"), timeout: 5
+    hydra = Typhoeus::Hydra.new
+    hydra.queue first
+    Thread.new { hydra.run }
+    sleep 0.2
+    Typhoeus.post url("pub/#{prefix}a"), body: "before", headers: { "Content-Type" => "text/plain" }
+    sleep 0.1 until first.response
+    assert_equal "before", first.response.body
+    #nobody's waiting now, so the prefix channel isn't given this one
+    Typhoeus.post url("pub/#{prefix}b"), body: "missed", headers: { "Content-Type" => "text/plain" }
+    sub = Typhoeus::Request.new url("sub/prefix/#{prefix}*"), timeout: 5
+    hydra = Typhoeus::Hydra.new
+    hydra.queue sub
+    Thread.new { hydra.run }
+    sleep 0.2
+    Typhoeus.post url("pub/#{prefix}c"), body: "after", headers: { "Content-Type" => "text/plain" }
+    sleep 0.1 until sub.response
+    assert_equal 200, sub.response.code
+    assert_equal "after", sub.response.body
+  end
+  
+  def test_precompressed_message
+    require 'zlib'
+    chan = SecureRandom.hex
+    body = "the same text, over and over. " * 100
+    Publisher.new(url("pub/gzip/#{chan}")).post body
+    gz = Typhoeus.get url("sub/broadcast/#{chan}"), timeout: 5, headers: { "Accept-Encoding" => "gzip" }
+    assert_equal "gzip", gz.headers["Content-Encoding"]
+    assert gz.body.bytesize < body.bytesize, "precompressed body isn't any smaller"
+    assert_equal body, Zlib::GzipReader.new(StringIO.new(gz.body)).read
+    plain = Typhoeus.get url("sub/broadcast/#{chan}"), timeout: 5
+    assert_nil plain.headers["Content-Encoding"]
+    assert_equal body, plain.body
+  end
+  
   def test_gzip
     #bug: turning on gzip cleared the response etag
     pub, sub = pubsub 1, sub: "/sub/gzip/", gzip: true, retry_delay: 0.3